@@ -0,0 +1,428 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <esp_attr.h>
+#include <esp_debug_helpers.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <soc/cpu.h>
+
+#include "utils.h"
+#include "alloc_trace.h"
+
+#if CONFIG_ALLOC_TRACE
+
+#define MAX_SITES             ( 128 )
+#define RECENT_CNT            ( 64 )
+#define LIVE_MAX_FILL         ( CONFIG_ALLOC_TRACE_LIVE * 3 / 4 )   // Keeps probe runs short
+#define NO_SITE               ( 0xFF )
+
+typedef struct
+{
+  uint32_t  pcs[ALLOC_TRACE_DEPTH];   // Innermost first, all zero for an unused slot
+  uint32_t  live_bytes;
+  uint32_t  live_cnt;
+  uint32_t  peak_bytes;
+  uint32_t  total_bytes;
+  uint32_t  total_cnt;
+} site_t;
+
+// Open addressing on the block's address, linear probing with backward shift deletion
+typedef struct
+{
+  void     *ptr;                // NULL for a free slot
+  uint32_t  size;
+  uint8_t   site;
+  uint8_t   reserved;
+  uint16_t  mark;               // alloc_trace_mark() count when it was made
+} live_t;
+
+typedef struct
+{
+  uint32_t  time_ms;
+  void     *ptr;
+  uint32_t  size;
+  uint8_t   site;
+  bool      is_free;
+} recent_t;
+
+typedef struct
+{
+  uint32_t  bytes;
+  uint32_t  cnt;
+} leak_t;
+
+typedef struct
+{
+  volatile bool running;
+  uint16_t      mark;
+  uint16_t      site_cnt;
+  uint32_t      live_cnt;
+  uint32_t      live_bytes;
+  uint32_t      peak_bytes;
+  uint32_t      untracked;      // Allocations with no room in the site or live tables
+  uint32_t      recent_total;
+
+  // Reports only run on the httpd task
+  leak_t        leaks[MAX_SITES];
+  char          line[512];
+} alloc_trace_t;
+
+static site_t         s_sites[MAX_SITES];
+static live_t         s_live[CONFIG_ALLOC_TRACE_LIVE];
+static recent_t       s_recent[RECENT_CNT];
+static alloc_trace_t  s_trace;
+static portMUX_TYPE   s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void *__real_malloc( size_t size );
+void *__real_calloc( size_t cnt, size_t size );
+void *__real_realloc( void *ptr, size_t size );
+void  __real_free( void *ptr );
+
+//-----------------------------------------------------------------------------
+// The two frames above the __wrap_ function calling this.  Never inlined, so that's a fixed
+// number of frames up
+static void IRAM_ATTR __attribute__(( noinline )) _call_site( uint32_t *p_pcs )
+{
+  esp_backtrace_frame_t frame;
+  esp_backtrace_get_start( &frame.pc, &frame.sp, &frame.next_pc );
+
+  for ( int8_t depth = -1; depth < ALLOC_TRACE_DEPTH; depth++ )
+  {
+    bool valid = ( frame.next_pc != 0 ) && esp_backtrace_get_next_frame( &frame );
+    if ( depth >= 0 )
+    {
+      p_pcs[depth] = valid ? esp_cpu_process_stack_pc( frame.pc ) : 0;
+    }
+    if ( !valid )
+    {
+      frame.next_pc = 0;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t IRAM_ATTR _live_slot( const void *ptr )
+{
+  return ( ( (uint32_t)ptr >> 3 ) * 2654435761UL ) % CONFIG_ALLOC_TRACE_LIVE;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t IRAM_ATTR _next_slot( uint32_t slot )
+{
+  return ( slot + 1 == CONFIG_ALLOC_TRACE_LIVE ) ? 0 : slot + 1;
+}
+
+//-----------------------------------------------------------------------------
+// Callers hold s_lock.  Sites are never removed, the table always keeps a free slot to end a probe.
+// A backtrace that didn't get as far as the caller can't be told apart from a free slot
+static uint8_t IRAM_ATTR _find_site( const uint32_t *p_pcs )
+{
+  if ( !p_pcs[0] )
+  {
+    return NO_SITE;
+  }
+
+  uint32_t slot = ( ( p_pcs[0] ^ ( p_pcs[1] << 7 ) ) >> 2 ) % MAX_SITES;
+  while ( s_sites[slot].pcs[0] || s_sites[slot].pcs[1] )
+  {
+    if ( !memcmp( s_sites[slot].pcs, p_pcs, sizeof( s_sites[slot].pcs ) ) )
+    {
+      return slot;
+    }
+    slot = ( slot + 1 ) % MAX_SITES;
+  }
+
+  if ( s_trace.site_cnt == MAX_SITES - 1 )
+  {
+    return NO_SITE;
+  }
+
+  s_trace.site_cnt++;
+  memcpy( s_sites[slot].pcs, p_pcs, sizeof( s_sites[slot].pcs ) );
+  return slot;
+}
+
+//-----------------------------------------------------------------------------
+// Callers hold s_lock
+static void IRAM_ATTR _add_recent( void *ptr, uint32_t size, uint8_t site, bool is_free )
+{
+  s_recent[s_trace.recent_total++ % RECENT_CNT] = (recent_t){ .time_ms = esp_timer_get_time() / 1000, .ptr = ptr,
+                                                              .size = size, .site = site, .is_free = is_free };
+}
+
+//-----------------------------------------------------------------------------
+static void IRAM_ATTR _record_alloc( void *ptr, size_t size, const uint32_t *p_pcs )
+{
+  portENTER_CRITICAL( &s_lock );
+  uint8_t site = s_trace.running ? _find_site( p_pcs ) : NO_SITE;
+  if ( ( site == NO_SITE ) || ( s_trace.live_cnt >= LIVE_MAX_FILL ) )
+  {
+    s_trace.untracked += s_trace.running;
+    portEXIT_CRITICAL( &s_lock );
+    return;
+  }
+
+  uint32_t slot = _live_slot( ptr );
+  while ( s_live[slot].ptr )
+  {
+    slot = _next_slot( slot );
+  }
+  s_live[slot] = (live_t){ .ptr = ptr, .size = size, .site = site, .mark = s_trace.mark };
+  s_trace.live_cnt++;
+
+  site_t *p_site = &s_sites[site];
+  p_site->live_bytes  += size;
+  p_site->live_cnt    += 1;
+  p_site->peak_bytes   = MAX( p_site->peak_bytes, p_site->live_bytes );
+  p_site->total_bytes += size;
+  p_site->total_cnt   += 1;
+
+  s_trace.live_bytes += size;
+  s_trace.peak_bytes  = MAX( s_trace.peak_bytes, s_trace.live_bytes );
+  _add_recent( ptr, size, site, false );
+  portEXIT_CRITICAL( &s_lock );
+}
+
+//-----------------------------------------------------------------------------
+// Blocks made before the trace started aren't in the table, their frees are ignored
+static void IRAM_ATTR _record_free( void *ptr )
+{
+  portENTER_CRITICAL( &s_lock );
+  uint32_t slot = _live_slot( ptr );
+  while ( s_live[slot].ptr && ( s_live[slot].ptr != ptr ) )
+  {
+    slot = _next_slot( slot );
+  }
+
+  if ( !s_trace.running || !s_live[slot].ptr )
+  {
+    portEXIT_CRITICAL( &s_lock );
+    return;
+  }
+
+  site_t *p_site = &s_sites[s_live[slot].site];
+  p_site->live_bytes -= s_live[slot].size;
+  p_site->live_cnt   -= 1;
+  s_trace.live_bytes -= s_live[slot].size;
+  s_trace.live_cnt--;
+  _add_recent( ptr, s_live[slot].size, s_live[slot].site, true );
+
+  // Pull later entries of the run back over the hole, if their home slot allows it
+  uint32_t hole = slot;
+  for ( uint32_t next = _next_slot( hole ); s_live[next].ptr; next = _next_slot( next ) )
+  {
+    uint32_t home = _live_slot( s_live[next].ptr );
+    bool     stays = ( hole <= next ) ? ( ( hole < home ) && ( home <= next ) ) : ( ( hole < home ) || ( home <= next ) );
+    if ( !stays )
+    {
+      s_live[hole] = s_live[next];
+      hole = next;
+    }
+  }
+  s_live[hole].ptr = NULL;
+  portEXIT_CRITICAL( &s_lock );
+}
+
+//-----------------------------------------------------------------------------
+void * IRAM_ATTR __wrap_malloc( size_t size )
+{
+  void *ptr = __real_malloc( size );
+  if ( s_trace.running && ptr )
+  {
+    uint32_t pcs[ALLOC_TRACE_DEPTH];
+    _call_site( pcs );
+    _record_alloc( ptr, size, pcs );
+  }
+  return ptr;
+}
+
+//-----------------------------------------------------------------------------
+void * IRAM_ATTR __wrap_calloc( size_t cnt, size_t size )
+{
+  void *ptr = __real_calloc( cnt, size );
+  if ( s_trace.running && ptr )
+  {
+    uint32_t pcs[ALLOC_TRACE_DEPTH];
+    _call_site( pcs );
+    _record_alloc( ptr, cnt * size, pcs );
+  }
+  return ptr;
+}
+
+//-----------------------------------------------------------------------------
+// The old block can be handed out again on the other core before it's forgotten here.  The
+// older entry is always first in its probe run, so it's still the one removed
+void * IRAM_ATTR __wrap_realloc( void *ptr, size_t size )
+{
+  void *p_new = __real_realloc( ptr, size );
+  if ( s_trace.running )
+  {
+    if ( ptr && ( p_new || !size ) )
+    {
+      _record_free( ptr );
+    }
+    if ( p_new )
+    {
+      uint32_t pcs[ALLOC_TRACE_DEPTH];
+      _call_site( pcs );
+      _record_alloc( p_new, size, pcs );
+    }
+  }
+  return p_new;
+}
+
+//-----------------------------------------------------------------------------
+// Forgotten first, so the address can't be handed out again while it's still in the table
+void IRAM_ATTR __wrap_free( void *ptr )
+{
+  if ( s_trace.running && ptr )
+  {
+    _record_free( ptr );
+  }
+  __real_free( ptr );
+}
+
+//-----------------------------------------------------------------------------
+void alloc_trace_start( void )
+{
+  portENTER_CRITICAL( &s_lock );
+  memset( s_sites, 0, sizeof( s_sites ) );
+  memset( s_live, 0, sizeof( s_live ) );
+  memset( &s_trace, 0, offsetof( alloc_trace_t, leaks ) );
+  s_trace.running = true;
+  portEXIT_CRITICAL( &s_lock );
+
+  print( "Tracing allocations, room for %u live\n", LIVE_MAX_FILL );
+}
+
+//-----------------------------------------------------------------------------
+void alloc_trace_stop( void )
+{
+  s_trace.running = false;
+  print( "Allocation trace stopped, %u bytes live over %u sites\n", s_trace.live_bytes, s_trace.site_cnt );
+}
+
+//-----------------------------------------------------------------------------
+bool alloc_trace_is_running( void )
+{
+  return s_trace.running;
+}
+
+//-----------------------------------------------------------------------------
+uint16_t alloc_trace_mark( void )
+{
+  portENTER_CRITICAL( &s_lock );
+  uint16_t mark = ++s_trace.mark;
+  portEXIT_CRITICAL( &s_lock );
+
+  print( "Allocation trace mark %u\n", mark );
+  return mark;
+}
+
+//-----------------------------------------------------------------------------
+// Appends one site's frames.  The table is only ever added to, no lock needed to read them
+static uint16_t _write_pcs( char *p_line, uint8_t site )
+{
+  uint16_t len = 0;
+  for ( uint8_t depth = 0; depth < ALLOC_TRACE_DEPTH; depth++ )
+  {
+    len += sprintf( p_line + len, " 0x%08x", ( site == NO_SITE ) ? 0 : s_sites[site].pcs[depth] );
+  }
+  return len;
+}
+
+//-----------------------------------------------------------------------------
+void alloc_trace_write_report( alloc_trace_write_t write, void *p_ctx )
+{
+  // Leaks are what's still live from between the last two marks, gathered per site
+  uint16_t leak_mark = s_trace.mark - 1;
+  memset( s_trace.leaks, 0, sizeof( s_trace.leaks ) );
+  for ( uint32_t slot = 0; ( s_trace.mark >= 2 ) && ( slot < ARRAY_SIZE( s_live ) ); slot++ )
+  {
+    portENTER_CRITICAL( &s_lock );
+    live_t live = s_live[slot];
+    portEXIT_CRITICAL( &s_lock );
+
+    if ( live.ptr && ( live.mark == leak_mark ) )
+    {
+      s_trace.leaks[live.site].bytes += live.size;
+      s_trace.leaks[live.site].cnt++;
+    }
+  }
+
+  char    *p_line = s_trace.line;
+  uint16_t len    = snprintf( p_line, sizeof( s_trace.line ),
+    "# running %u\n# mark %u\n# live_bytes %u\n# peak_bytes %u\n# live_cnt %u\n# untracked %u\n"
+    "# site pc... live_bytes live_cnt peak_bytes total_bytes total_cnt\n",
+    s_trace.running, s_trace.mark, s_trace.live_bytes, s_trace.peak_bytes, s_trace.live_cnt, s_trace.untracked );
+
+  // Flushing early enough that a whole line always fits
+  const uint16_t flush_len = sizeof( s_trace.line ) - ( 64 + 11 * ALLOC_TRACE_DEPTH );
+  for ( uint8_t site = 0; site < MAX_SITES; site++ )
+  {
+    portENTER_CRITICAL( &s_lock );
+    site_t copy = s_sites[site];
+    portEXIT_CRITICAL( &s_lock );
+
+    if ( copy.total_cnt )
+    {
+      len += sprintf( p_line + len, "site" );
+      len += _write_pcs( p_line + len, site );
+      len += sprintf( p_line + len, " %u %u %u %u %u\n",
+        copy.live_bytes, copy.live_cnt, copy.peak_bytes, copy.total_bytes, copy.total_cnt );
+    }
+    if ( len > flush_len )
+    {
+      write( p_ctx, p_line, len );
+      len = 0;
+    }
+  }
+
+  len += sprintf( p_line + len, "# recent ms op ptr size pc...\n" );
+  uint32_t recent_total = s_trace.recent_total;
+  uint32_t first        = ( recent_total > RECENT_CNT ) ? recent_total - RECENT_CNT : 0;
+  for ( uint32_t n = first; n < recent_total; n++ )
+  {
+    portENTER_CRITICAL( &s_lock );
+    recent_t recent = s_recent[n % RECENT_CNT];
+    portEXIT_CRITICAL( &s_lock );
+
+    len += sprintf( p_line + len, "recent %u %s 0x%08x %u", recent.time_ms, recent.is_free ? "free" : "alloc",
+      (uint32_t)recent.ptr, recent.size );
+    len += _write_pcs( p_line + len, recent.site );
+    len += sprintf( p_line + len, "\n" );
+    if ( len > flush_len )
+    {
+      write( p_ctx, p_line, len );
+      len = 0;
+    }
+  }
+
+  if ( s_trace.mark >= 2 )
+  {
+    len += sprintf( p_line + len, "# leak pc... bytes cnt, made after mark %u and before mark %u\n", leak_mark, s_trace.mark );
+  }
+  else
+  {
+    len += sprintf( p_line + len, "# leak pc... bytes cnt, once there are two marks\n" );
+  }
+  for ( uint8_t site = 0; site < MAX_SITES; site++ )
+  {
+    if ( s_trace.leaks[site].cnt )
+    {
+      len += sprintf( p_line + len, "leak" );
+      len += _write_pcs( p_line + len, site );
+      len += sprintf( p_line + len, " %u %u\n", s_trace.leaks[site].bytes, s_trace.leaks[site].cnt );
+    }
+    if ( len > flush_len )
+    {
+      write( p_ctx, p_line, len );
+      len = 0;
+    }
+  }
+
+  write( p_ctx, p_line, len );
+}
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef _ALLOC_TRACE_H_
+#define _ALLOC_TRACE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define ALLOC_TRACE_DEPTH     ( 2 )       // The calling function and its caller
+
+typedef void (*alloc_trace_write_t)( void *p_ctx, const char *p_text, size_t len );
+
+// With CONFIG_ALLOC_TRACE the link wraps malloc(), calloc(), realloc() and free() for the whole
+// build, IDF components included.  Starting forgets everything and follows each allocation from
+// then on, attributing it to the two frames that called the allocator.  Stopping freezes it.
+// Memory from heap_caps_malloc() and friends directly isn't seen
+void alloc_trace_start( void );
+void alloc_trace_stop( void );
+bool alloc_trace_is_running( void );
+
+// Tags allocations from here on with a new mark.  Anything made between the last two marks and
+// not yet freed is reported as a leak, e.g. mark, one POST /ota, mark
+uint16_t alloc_trace_mark( void );
+
+// Text, per call site totals, recent allocations and leaks, for tools/alloc_report.py
+void alloc_trace_write_report( alloc_trace_write_t write, void *p_ctx );
+
+#endif
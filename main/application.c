@@ -1,5 +1,6 @@
 #include <freertos/freertos.h>
 #include <freertos/task.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -10,31 +11,51 @@
 #include "application.h"
 #include "hardware.h"
 #include "wifi.h"
+#include "ethernet.h"
+#include "timer_wheel.h"
+#include "event_bus.h"
+#include "timeseries.h"
 #include "esp_ota_ops.h"
 
-static void _application_task(void *Param);
+#define LED_TOGGLE_PERIOD_MS    ( 250 )
+
+typedef struct
+{
+  char    *p_buffer;
+  size_t  size;
+  size_t  len;
+} html_out_t;
 
 //-----------------------------------------------------------------------------
-static void _application_task(void *Param)
-{ 
-  const uint32_t task_delay_ms = 250;
+static void _led_timer_cb( void *p_arg )
+{
+  hardware_toggle_led();
+}
 
-  while(1)
-  {
-    delay_ms(task_delay_ms);
-    hardware_toggle_led();
-  }  
+//-----------------------------------------------------------------------------
+// Appends to the page, stopping at the end of the buffer.  len never passes size - 1, so
+// everything after a cut-off is dropped and the page stays terminated
+static void _html( html_out_t *p_out, const char *p_fmt, ... )
+{
+  va_list args;
+  va_start( args, p_fmt );
+  int len = vsnprintf( p_out->p_buffer + p_out->len, p_out->size - p_out->len, p_fmt, args );
+  va_end( args );
+
+  p_out->len = MIN( p_out->len + MAX( len, 0 ), p_out->size - 1 );
 }
 
 //-----------------------------------------------------------------------------
-char const * application_get_html( const char *p_custom_header )
+// Fills in the caller's buffer, APPLICATION_HTML_SIZE fits the whole page.  A shorter one cuts
+// it off, still terminated
+char const * application_get_html( char *buffer, size_t buffer_size, const char *p_custom_header )
 {
-  static char buffer[2048] = { 0 };
-  char *p_buffer = buffer;
-  
+  html_out_t out = { .p_buffer = buffer, .size = buffer_size };
+  buffer[0] = '\0';
+
   if ( p_custom_header )
   {
-    p_buffer += sprintf(p_buffer, "%s", p_custom_header);
+    _html( &out, "%s", p_custom_header );
   }
 
   const esp_partition_t *partition = esp_ota_get_running_partition();
@@ -56,22 +77,63 @@ char const * application_get_html( const char *p_custom_header )
       break;
    }
   
-  p_buffer += sprintf(p_buffer, "<h1>System Info</h1>");
-  p_buffer += sprintf(p_buffer, "System Time: %s<br>", get_system_time_str());
-  p_buffer += sprintf(p_buffer, "Firmware Build: %s %s, Boot Count: %i<br>", __DATE__, __TIME__, nvm_get_param_int32( NVM_PARAM_RESET_COUNTER ));
-  p_buffer += sprintf(p_buffer, "Up-time: ");
-  p_buffer += add_formatted_duration_str( p_buffer, system_uptime_s() );
-  p_buffer += sprintf(p_buffer, "<br><b>Partition: %d</b><br>", partition_ota);
-  p_buffer += sprintf(p_buffer, "<br>");
-  
+  _html( &out, "<h1>System Info</h1>");
+  _html( &out, "System Time: %s<br>", get_system_time_str());
+  _html( &out, "Firmware Build: %s %s, Boot Count: %i<br>", __DATE__, __TIME__, nvm_get_reset_counter());
+  char uptime[48];      // Longest duration string is "65535 hours, 59 minutes, 59 seconds"
+  uptime[add_formatted_duration_str( uptime, system_uptime_s() )] = '\0';
+  _html( &out, "Up-time: %s", uptime );
+  _html( &out, "<br><b>Partition: %d</b><br>", partition_ota);
+
+  debug_stats_t debug_stats;
+  debug_get_stats( &debug_stats );
+  _html( &out, "Debug Log: %u bytes in %u writes, queue depth %u (peak %u), %u bytes dropped<br>",
+    debug_stats.bytes_drained, debug_stats.drain_calls, debug_stats.queue_depth, debug_stats.queue_depth_peak, debug_stats.bytes_dropped );
+
+  nvm_stats_t nvm_stats;
+  nvm_get_stats( &nvm_stats );
+  _html( &out, "NVM: %u keys written in %u commits, %u writes avoided, loaded in %u us",
+    nvm_stats.writes, nvm_stats.commits, nvm_stats.writes_avoided, nvm_stats.load_time_us );
+  if ( nvm_stats.loaded_from_snapshot )
+  {
+    _html( &out, " from the snapshot (%u us per key)", nvm_stats.per_key_load_us );
+  }
+  _html( &out, "<br>" );
+
+  wifi_stats_t wifi_stats;
+  wifi_get_stats( &wifi_stats );
+  _html( &out, "Wi-Fi: %u connects (%u cached AP, %u cache misses, %u leases reused), %u retries, last %u ms (assoc %u ms), best %u ms<br>",
+    wifi_stats.connects, wifi_stats.fast_connects, wifi_stats.fast_connect_misses, wifi_stats.leases_reused, wifi_stats.retries,
+    wifi_stats.last_connect_ms, wifi_stats.last_assoc_ms, wifi_stats.best_connect_ms );
+  _html( &out, "Webserver: %u restarts, %u avoided across link drops, %u ms per restart, %u ms saved<br>",
+    wifi_stats.http_restarts, wifi_stats.http_restarts_avoided, wifi_stats.http_restart_ms, wifi_stats.http_time_saved_ms );
+#if CONFIG_ETHERNET_ENABLED
+  ethernet_stats_t eth_stats;
+  ethernet_get_stats( &eth_stats );
+  _html( &out, "Ethernet: %s, %u Mbps %s duplex, %u connects, %u link drops, last %u ms<br>",
+    ethernet_get_ip_addr_str(), eth_stats.speed_mbps, eth_stats.full_duplex ? "full" : "half",
+    eth_stats.connects, eth_stats.link_drops, eth_stats.last_connect_ms );
+#endif
+
+  event_bus_stats_t event_stats;
+  event_bus_get_stats( &event_stats );
+  _html( &out, "Events: %u published, %u delivered, %u dropped<br>",
+    event_stats.published, event_stats.delivered, event_stats.dropped );
+
+  // The last hour by the minute, more at /timeseries
+  _html( &out, "Free Heap, last hour:<br>");
+  out.len += timeseries_get_svg( TIMESERIES_MINUTES, TIMESERIES_HEAP_FREE, 60, buffer + out.len, out.size - out.len );
+  _html( &out, "<br>CPU Load, last hour:<br>");
+  out.len += timeseries_get_svg( TIMESERIES_MINUTES, TIMESERIES_CPU_LOAD, 60, buffer + out.len, out.size - out.len );
+  _html( &out, "<br>");
 
   return buffer;
 }
 
 //-----------------------------------------------------------------------------
-char const * application_post_html(const char *p_post_data)
+char const * application_post_html( char *p_buffer, size_t buffer_size, const char *p_post_data )
 {
-  return application_get_html( NULL );
+  return application_get_html( p_buffer, buffer_size, NULL );
 }
 
 //-----------------------------------------------------------------------------
@@ -83,7 +145,7 @@ char const * application_post_html(const char *p_post_data)
   char *p_msg = status_msg;
   status_msg_id++;
   p_msg += sprintf( p_msg, "{ \"message_id\":%i,",   status_msg_id );
-  p_msg += sprintf( p_msg, "\"uptime\":%u,",         (uint32_t)system_uptime_s() ); 
+  p_msg += sprintf( p_msg, "\"uptime\":%u,",         system_uptime_s() ); 
   p_msg += sprintf( p_msg, "\"system_time\":\"%s\"", get_system_time_str() );
   p_msg += sprintf( p_msg, "}" );
   
@@ -102,8 +164,32 @@ void application_handle_user_button_press(void)
 {
 }
 
+#if defined( CONFIG_NVM_GETTER_BENCHMARK ) || defined( CONFIG_DELAY_BENCHMARK )
+//-----------------------------------------------------------------------------
+// Both take seconds, so they run alongside everything else instead of holding up boot
+static void _benchmark_task( void *Param )
+{
+#ifdef CONFIG_NVM_GETTER_BENCHMARK
+  nvm_getter_benchmark_t nvm_benchmark;
+  nvm_benchmark_getters( &nvm_benchmark, 100000 );
+#endif
+
+#ifdef CONFIG_DELAY_BENCHMARK
+  static const uint32_t delay_benchmark_us[] = { 20, 100, 500, 2500, 9000, 25000 };
+  delay_benchmark_t delay_results[ARRAY_SIZE( delay_benchmark_us )];
+  delay_benchmark( delay_results, delay_benchmark_us, ARRAY_SIZE( delay_benchmark_us ), 50 );
+#endif
+
+  vTaskDelete( NULL );
+}
+#endif
+
 //-----------------------------------------------------------------------------
 void application_init(void)
 {
-  xTaskCreate( _application_task, "app_task", 8192, NULL, 5, NULL);
+  timer_wheel_add_periodic( LED_TOGGLE_PERIOD_MS, _led_timer_cb, NULL );
+
+#if defined( CONFIG_NVM_GETTER_BENCHMARK ) || defined( CONFIG_DELAY_BENCHMARK )
+  xTaskCreate( _benchmark_task, "benchmarks", 3072, NULL, 1, NULL );
+#endif
 }
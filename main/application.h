@@ -1,11 +1,15 @@
 #ifndef _APPLICATION_H_
 #define _APPLICATION_H_
 
+#include <stddef.h>
+
+#define APPLICATION_HTML_SIZE   ( 3072 )    // What the status page needs from the caller
+
 void application_init(void);
 void         application_handle_user_button_press(void);
 char const * application_get_mqtt_status_msg(void);
 void         application_handle_mqtt_request_msg( char *p_msg );
-char const * application_get_html( const char *p_custom_header );
-char const * application_post_html(const char *p_post_data);
+char const * application_get_html( char *p_buffer, size_t buffer_size, const char *p_custom_header );
+char const * application_post_html( char *p_buffer, size_t buffer_size, const char *p_post_data );
 
 #endif
\ No newline at end of file
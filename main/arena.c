@@ -0,0 +1,60 @@
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "utils.h"
+#include "arena.h"
+
+//-----------------------------------------------------------------------------
+void arena_init( arena_t *p_arena, void *p_memory, size_t size )
+{
+  p_arena->p_base = p_memory;
+  p_arena->size   = size;
+  p_arena->used   = 0;
+  p_arena->peak   = 0;
+}
+
+//-----------------------------------------------------------------------------
+void arena_reset( arena_t *p_arena )
+{
+  p_arena->used = 0;
+}
+
+//-----------------------------------------------------------------------------
+void *arena_alloc( arena_t *p_arena, size_t size )
+{
+  size_t start = ( p_arena->used + ARENA_ALIGN - 1 ) & ~( ARENA_ALIGN - 1 );
+  if ( ( start > p_arena->size ) || ( size > p_arena->size - start ) )
+  {
+    return NULL;
+  }
+
+  p_arena->used = start + size;
+  p_arena->peak = MAX( p_arena->peak, p_arena->used );
+  return p_arena->p_base + start;
+}
+
+//-----------------------------------------------------------------------------
+// Formats straight into the free space, then keeps only what was used.  If it didn't fit
+// nothing is kept, the arena is as it was
+char *arena_printf( arena_t *p_arena, const char *p_format, ... )
+{
+  size_t start = ( p_arena->used + ARENA_ALIGN - 1 ) & ~( ARENA_ALIGN - 1 );
+  if ( start >= p_arena->size )
+  {
+    return NULL;
+  }
+
+  char   *p_text = (char *)p_arena->p_base + start;
+  size_t  room   = p_arena->size - start;
+
+  va_list args;
+  va_start( args, p_format );
+  int len = vsnprintf( p_text, room, p_format, args );
+  va_end( args );
+
+  if ( ( len < 0 ) || ( (size_t)len >= room ) )
+  {
+    return NULL;
+  }
+  return arena_alloc( p_arena, len + 1 );
+}
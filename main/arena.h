@@ -0,0 +1,28 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ARENA_ALIGN     ( 8 )
+
+// A bump allocator over memory the caller owns.  Nothing is freed on its own, a reset hands
+// everything back at once.  Not thread safe, an arena belongs to one user at a time
+typedef struct
+{
+  uint8_t  *p_base;
+  size_t    size;
+  size_t    used;
+  size_t    peak;       // Most in use at once since init
+} arena_t;
+
+void   arena_init( arena_t *p_arena, void *p_memory, size_t size );
+void   arena_reset( arena_t *p_arena );
+
+// ARENA_ALIGN aligned, NULL if it doesn't fit
+void  *arena_alloc( arena_t *p_arena, size_t size );
+
+// Formatted into exactly as much of the arena as it needs, NULL if it doesn't fit
+char  *arena_printf( arena_t *p_arena, const char *p_format, ... ) __attribute__(( format( printf, 2, 3 ) ));
+
+#endif
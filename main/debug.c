@@ -9,11 +9,21 @@
 #include "utils.h"
 #include "debug.h"
 #include "wifi.h"
+#include "metrics.h"
+#include "task_monitor.h"
+#include "trace.h"
 
 #define VALIDITY_CHECK_EXPECTED_VALUE   ( 0xE1F512ED )
 
 #define DRAIN_CNT     ( 5 )
 
+// Largest span handed to a drain in one call.  Output is coalesced up to this size so a
+// burst of logging turns into a handful of large writes instead of hundreds of tiny ones
+#define DRAIN_CHUNK_SIZE    ( 512 )
+
+// Safety net in case a notification is missed, the task otherwise sleeps until print() wakes it
+#define IDLE_WAKE_PERIOD_MS ( 1000 )
+
 #pragma pack(1)
 struct
 {
@@ -31,6 +41,7 @@ static uint8_t * const p_debug_data = s_debug_data;
 typedef struct
 {
   volatile bool       initialized;
+  TaskHandle_t        task_handle;
   
   debug_handle_t      null_handle;
   debug_handle_t      uart_handle;
@@ -40,31 +51,31 @@ typedef struct
   
   debug_drain_func_t  drains[DRAIN_CNT];
   uint16_t            drain_idx[DRAIN_CNT];
+
+  char                io_buffer[DRAIN_CHUNK_SIZE];
+
+  debug_stats_t       stats;
 } stdio_task_context_t;
 
 static stdio_task_context_t s_task = { 0 };
+TASK_STATIC_STORAGE( s_debug_task, CONFIG_TASK_STACK_DEBUG );
 
-static void _null_drain( const char *p_msg, uint8_t bytecnt, uint8_t handle );
-static void _uart_drain( const char *p_msg, uint8_t bytecnt, uint8_t handle );
+static void _null_drain( const char *p_msg, uint16_t bytecnt, uint8_t handle );
+static void _uart_drain( const char *p_msg, uint16_t bytecnt, uint8_t handle );
 static void _debug_task( void *pvParameters );
 static uint16_t _debug_drain( debug_handle_t idx, char *buf, uint16_t bufsize );
+static uint16_t _buffer_used( debug_handle_t idx );
 
 static void _write_stdout( bool print_timestamp, const char *p_msg, va_list args );
 static inline void _buffer_fill( const char *p_data, uint16_t len );
 
 //-----------------------------------------------------------------------------
+// Everything print() needs is set up before returning, so callers can print straight away and
+// the task just picks up whatever has been buffered by the time it first runs
 void debug_init( void )
 {
-  xTaskCreate( _debug_task,  "debug_task", 2048, NULL, 0, NULL );
-  while ( !s_task.initialized ) { delay_ms( 1 ); };
-}
-
-//-----------------------------------------------------------------------------
-static void _debug_task( void *pvParameters )
-{
-  const uint32_t thread_period_ms = 10;
-
   s_task.buffer_mutex = xSemaphoreCreateRecursiveMutexStatic( &s_task.buffer_mutex_buffer );  
+  vQueueAddToRegistry( s_task.buffer_mutex, "print" );
   s_task.initialized = true;
 
   if ( ( s_buffer_ctx.header_valid_check != VALIDITY_CHECK_EXPECTED_VALUE ) ||
@@ -76,50 +87,56 @@ static void _debug_task( void *pvParameters )
   s_task.null_handle = debug_reserve( _null_drain );
   s_task.uart_handle = debug_reserve( _uart_drain );
 
-  char io_buffer[32];
+  s_task.task_handle = task_create( _debug_task, "debug_task", CONFIG_TASK_STACK_DEBUG, 0, TASK_STATIC_BUFFERS( s_debug_task ) );
+}
 
+//-----------------------------------------------------------------------------
+static void _debug_task( void *pvParameters )
+{
   bool thread_active;
   while ( 1 )
   {
     thread_active = false;   
-    if ( xSemaphoreTakeRecursive( s_task.buffer_mutex, 10 ) != pdPASS )
-    {
-      continue;
-    }
 
-    // Dump debug to all the drains
+    // Dump debug to all the drains.  Each drain gets one coalesced chunk per pass, and the
+    // buffer mutex is only held while copying out so print() isn't stalled behind the UART
     for ( debug_handle_t idx = 0; idx < ARRAY_SIZE(s_task.drains); idx++ )
     {
       // Don't drain the null drain, which keeps track of the lowest fill idx
-      if ( ( s_task.drains[idx] != NULL ) && ( idx != s_task.null_handle ) )
+      debug_drain_func_t drain_func = s_task.drains[idx];
+      if ( ( drain_func != NULL ) && ( idx != s_task.null_handle ) )
       {
-        uint8_t msg_len = _debug_drain( idx, io_buffer, sizeof( io_buffer ) - 1 );
+        uint16_t msg_len = _debug_drain( idx, s_task.io_buffer, sizeof( s_task.io_buffer ) );
         if ( msg_len )
         {
-          s_task.drains[idx]( io_buffer, msg_len, idx );
+          TRACE_BEGIN( "debug drain" );
+          drain_func( s_task.io_buffer, msg_len, idx );
+          TRACE_END( "debug drain" );
+          s_task.stats.bytes_drained += msg_len;
+          s_task.stats.drain_calls++;
           thread_active = true;
         }
       }
     }
-
-    xSemaphoreGiveRecursive( s_task.buffer_mutex );
     
     if ( !thread_active )  // Don't sleep if we're actively draining buffers
     {
-      delay_ms( thread_period_ms );
+      // Sleep until print() has something for us
+      ulTaskNotifyTake( pdTRUE, pdMS_TO_TICKS( IDLE_WAKE_PERIOD_MS ) );
+      s_task.stats.wakeups++;
     }
   }
 }
 
 //-----------------------------------------------------------------------------
-static void _null_drain( const char *p_msg, uint8_t bytecnt, uint8_t handle )
+static void _null_drain( const char *p_msg, uint16_t bytecnt, uint8_t handle )
 {
 }
 
 //-----------------------------------------------------------------------------
-static void _uart_drain( const char *p_msg, uint8_t bytecnt, uint8_t handle )
+static void _uart_drain( const char *p_msg, uint16_t bytecnt, uint8_t handle )
 {
-  printf("%.*s", bytecnt, p_msg); 
+  fwrite( p_msg, 1, bytecnt, stdout );
   fflush(stdout);
 }
 
@@ -143,6 +160,12 @@ debug_handle_t debug_reserve( debug_drain_func_t drain_func )
     }
     
     xSemaphoreGiveRecursive( s_task.buffer_mutex );
+
+    // A rewound drain likely has history waiting for it
+    if ( s_task.task_handle )
+    {
+      xTaskNotifyGive( s_task.task_handle );
+    }
   }
   
   return retv;
@@ -209,34 +232,78 @@ static void _write_stdout( bool print_timestamp, const char *p_msg, va_list args
   _buffer_fill( msg_buffer, strlen( msg_buffer ) );
 
   xSemaphoreGiveRecursive( s_task.buffer_mutex );
+
+  if ( s_task.task_handle )
+  {
+    xTaskNotifyGive( s_task.task_handle );
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Bytes waiting in the ring for the given drain.  Callers should hold the mutex
+static uint16_t _buffer_used( debug_handle_t idx )
+{
+  uint16_t fill_idx  = s_buffer_ctx.fill_idx;
+  uint16_t drain_idx = s_task.drain_idx[idx];
+
+  return ( fill_idx >= drain_idx ) ? ( fill_idx - drain_idx ) : ( s_buffer_ctx.buffer_length - drain_idx + fill_idx );
 }
 
 //-----------------------------------------------------------------------------
 // Does not provide thread safety, callers should lock the mutex themselves
 static inline void _buffer_fill( const char *p_data, uint16_t len )
 {
-  while ( len-- )
+  uint16_t buffer_length = s_buffer_ctx.buffer_length;
+
+  // The ring holds at most buffer_length - 1 bytes, anything older than that is lost anyways
+  if ( len >= buffer_length )
   {
-    // Fill the buffer
-    p_debug_data[s_buffer_ctx.fill_idx++] = *p_data++;
-    if ( s_buffer_ctx.fill_idx >= s_buffer_ctx.buffer_length )
-    {
-      s_buffer_ctx.fill_idx = 0;
-    }
+    p_data += len - ( buffer_length - 1 );
+    len     = buffer_length - 1;
+  }
 
-    // This loop is wasteful running for each char in, but there's no clean & easy alternative
-    for ( debug_handle_t drain_idx = 0; drain_idx < DRAIN_CNT; drain_idx++ )
+  // Push any drain that would be overrun forward, the same as if it had been bumped byte by byte
+  uint16_t max_used = 0;
+  for ( debug_handle_t drain_idx = 0; drain_idx < DRAIN_CNT; drain_idx++ )
+  {
+    uint16_t used = _buffer_used( drain_idx );
+    uint16_t space = buffer_length - 1 - used;
+    if ( len > space )
     {
-      if ( s_task.drain_idx[drain_idx] == s_buffer_ctx.fill_idx )
+      uint16_t dropped = len - space;
+      s_task.drain_idx[drain_idx] = ( s_task.drain_idx[drain_idx] + dropped ) % buffer_length;
+      used -= dropped;
+
+      if ( ( s_task.drains[drain_idx] != NULL ) && ( drain_idx != s_task.null_handle ) )
       {
-        s_task.drain_idx[drain_idx]++;
-        if ( s_task.drain_idx[drain_idx] >= s_buffer_ctx.buffer_length )
-        {
-          s_task.drain_idx[drain_idx] = 0;
-        }
+        s_task.stats.bytes_dropped += dropped;
+        metrics_add( METRIC_DEBUG_DROPPED, dropped );
       }
     }
+
+    if ( ( s_task.drains[drain_idx] != NULL ) && ( drain_idx != s_task.null_handle ) )
+    {
+      max_used = MAX( max_used, used + len );
+    }
   }
+
+  // Copy in at most two contiguous spans
+  while ( len )
+  {
+    uint16_t span = MIN( len, buffer_length - s_buffer_ctx.fill_idx );
+    memcpy( &p_debug_data[s_buffer_ctx.fill_idx], p_data, span );
+
+    s_buffer_ctx.fill_idx += span;
+    if ( s_buffer_ctx.fill_idx >= buffer_length )
+    {
+      s_buffer_ctx.fill_idx = 0;
+    }
+
+    p_data += span;
+    len    -= span;
+  }
+
+  s_task.stats.queue_depth_peak = MAX( s_task.stats.queue_depth_peak, max_used );
 }
 
 //-----------------------------------------------------------------------------
@@ -254,20 +321,30 @@ static uint16_t _debug_drain( debug_handle_t idx, char *buf, uint16_t bufsize )
 
   size_t bytes_drained = 0;
 
+  // Copy out up to two contiguous spans (the second one after the ring wraps)
   while ( bytes_drained < bufsize )
   {
+    uint16_t drain_idx = s_task.drain_idx[idx];
+    uint16_t fill_idx  = s_buffer_ctx.fill_idx;
+
     // Empty when equal
-    if ( s_task.drain_idx[idx] == s_buffer_ctx.fill_idx )
+    if ( drain_idx == fill_idx )
     {
       break;
     }
 
-    buf[bytes_drained++] = p_debug_data[s_task.drain_idx[idx]++];
-    if ( s_task.drain_idx[idx] >= s_buffer_ctx.buffer_length )
+    uint16_t span = ( fill_idx > drain_idx ) ? ( fill_idx - drain_idx ) : ( s_buffer_ctx.buffer_length - drain_idx );
+    span = MIN( span, bufsize - bytes_drained );
+
+    memcpy( &buf[bytes_drained], &p_debug_data[drain_idx], span );
+    bytes_drained += span;
+
+    drain_idx += span;
+    if ( drain_idx >= s_buffer_ctx.buffer_length )
     {
-      s_task.drain_idx[idx] = 0;
+      drain_idx = 0;
     }
-
+    s_task.drain_idx[idx] = drain_idx;
   }
   
   xSemaphoreGiveRecursive( s_task.buffer_mutex );
@@ -275,6 +352,34 @@ static uint16_t _debug_drain( debug_handle_t idx, char *buf, uint16_t bufsize )
   return bytes_drained;
 }
 
+//-----------------------------------------------------------------------------
+void debug_get_stats( debug_stats_t *p_stats )
+{
+  if ( !p_stats )
+  {
+    return;
+  }
+
+  if ( !s_task.initialized || ( xSemaphoreTakeRecursive( s_task.buffer_mutex, 10 ) != pdPASS ) )
+  {
+    memset( p_stats, 0, sizeof( *p_stats ) );
+    return;
+  }
+
+  *p_stats = s_task.stats;
+
+  p_stats->queue_depth = 0;
+  for ( debug_handle_t idx = 0; idx < DRAIN_CNT; idx++ )
+  {
+    if ( ( s_task.drains[idx] != NULL ) && ( idx != s_task.null_handle ) )
+    {
+      p_stats->queue_depth = MAX( p_stats->queue_depth, _buffer_used( idx ) );
+    }
+  }
+
+  xSemaphoreGiveRecursive( s_task.buffer_mutex );
+}
+
 //-----------------------------------------------------------------------------
 void debug_rewind( debug_handle_t idx )
 {
@@ -9,7 +9,17 @@ void print( const char *p_msg, ... );
 void print_no_ts( const char *p_msg, ... );     // No timestamp option
 
 typedef int8_t debug_handle_t;
-typedef void (*debug_drain_func_t)( const char *p_msg, uint8_t bytecnt, uint8_t handle );
+typedef void (*debug_drain_func_t)( const char *p_msg, uint16_t bytecnt, uint8_t handle );
+
+typedef struct
+{
+  uint32_t bytes_drained;       // Total bytes handed to drains
+  uint32_t drain_calls;         // Number of drain callbacks, bytes_drained / drain_calls is the average batch
+  uint32_t wakeups;             // Times the task went idle and was woken
+  uint32_t bytes_dropped;       // Bytes overwritten before a drain could consume them
+  uint16_t queue_depth;         // Bytes currently pending for the slowest drain
+  uint16_t queue_depth_peak;    // Highest pending byte count seen
+} debug_stats_t;
 
 debug_handle_t debug_reserve( debug_drain_func_t drain_func );
 void           debug_release( debug_handle_t idx );
@@ -17,4 +27,6 @@ void           debug_release( debug_handle_t idx );
 void           debug_rewind( debug_handle_t idx );
 void           debug_clear( void );
 
+void           debug_get_stats( debug_stats_t *p_stats );
+
 #endif /*_stdio_task_H*/
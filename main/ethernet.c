@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <esp_eth.h>
+#include <esp_event.h>
+#include <esp_netif.h>
+
+#include "debug.h"
+#include "utils.h"
+#include "event_bus.h"
+#include "ethernet.h"
+
+#if CONFIG_ETHERNET_ENABLED
+
+// Default route goes to the highest priority netif that's up.  Wi-Fi STA sits at 100
+#define PRIMARY_ROUTE_PRIO      ( 150 )
+
+typedef struct
+{
+  esp_netif_t       *p_netif;
+  esp_eth_handle_t  eth_handle;
+  uint64_t          link_up_usec;
+  ethernet_stats_t  stats;
+  char              ip_addr_str[16];
+} ethernet_context_t;
+
+static ethernet_context_t s_eth = { 0 };
+
+static void _eth_event_handler( void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data );
+static void _ip_event_handler( void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data );
+static void _release( void *p_glue, esp_eth_mac_t *p_mac, esp_eth_phy_t *p_phy );
+
+//-----------------------------------------------------------------------------
+static void _eth_event_handler( void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data )
+{
+  switch ( event_id )
+  {
+    case ETHERNET_EVENT_CONNECTED:
+    {
+      eth_speed_t  speed;
+      eth_duplex_t duplex;
+      esp_eth_ioctl( s_eth.eth_handle, ETH_CMD_G_SPEED, &speed );
+      esp_eth_ioctl( s_eth.eth_handle, ETH_CMD_G_DUPLEX_MODE, &duplex );
+      s_eth.stats.speed_mbps  = ( speed == ETH_SPEED_100M ) ? 100 : 10;
+      s_eth.stats.full_duplex = ( duplex == ETH_DUPLEX_FULL );
+      s_eth.link_up_usec      = system_uptime_usec();
+      print( "Ethernet link up, %u Mbps %s duplex\n", s_eth.stats.speed_mbps, s_eth.stats.full_duplex ? "full" : "half" );
+      break;
+    }
+
+    case ETHERNET_EVENT_DISCONNECTED:
+      print( "Ethernet link down\n" );
+      s_eth.stats.link_drops++;
+      s_eth.stats.speed_mbps = 0;
+      s_eth.ip_addr_str[0]   = '\0';
+      event_bus_publish( EVENT_ETH_DISCONNECTED, NULL );
+      break;
+
+    case ETHERNET_EVENT_START:
+    case ETHERNET_EVENT_STOP:
+      break;
+
+    default:
+      print( "Unhandled ETH_EVENT event: %i\n", event_id );
+      break;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void _ip_event_handler( void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data )
+{
+  ip_event_got_ip_t *p_got_ip = (ip_event_got_ip_t *)event_data;
+  uint32_t ip_addr = p_got_ip->ip_info.ip.addr;
+
+  sprintf( s_eth.ip_addr_str, "%i.%i.%i.%i",
+    ( ip_addr >>  0 ) & 0xFF, ( ip_addr >>  8 ) & 0xFF,
+    ( ip_addr >> 16 ) & 0xFF, ( ip_addr >> 24 ) & 0xFF );
+
+  s_eth.stats.connects++;
+  s_eth.stats.last_connect_ms = ( system_uptime_usec() - s_eth.link_up_usec ) / 1000;
+  print( "Ethernet got IP Address - %s, %u ms after link up\n", s_eth.ip_addr_str, s_eth.stats.last_connect_ms );
+
+  event_t event = { .data.ip_addr = ip_addr };
+  event_bus_publish( EVENT_ETH_GOT_IP, &event );
+}
+
+//-----------------------------------------------------------------------------
+// Undoes as much of ethernet_init() as got done, in reverse
+static void _release( void *p_glue, esp_eth_mac_t *p_mac, esp_eth_phy_t *p_phy )
+{
+  if ( p_glue )
+  {
+    esp_eth_del_netif_glue( p_glue );
+  }
+  if ( s_eth.eth_handle )
+  {
+    esp_eth_driver_uninstall( s_eth.eth_handle );
+    s_eth.eth_handle = NULL;
+  }
+  if ( p_phy )
+  {
+    p_phy->del( p_phy );
+  }
+  if ( p_mac )
+  {
+    p_mac->del( p_mac );
+  }
+  esp_netif_destroy( s_eth.p_netif );
+  s_eth.p_netif = NULL;
+}
+
+//-----------------------------------------------------------------------------
+void ethernet_init( void )
+{
+  esp_netif_config_t netif_config = ESP_NETIF_DEFAULT_ETH();
+#if CONFIG_ETHERNET_ROLE_PRIMARY
+  esp_netif_inherent_config_t inherent_config = *netif_config.base;
+  inherent_config.route_prio = PRIMARY_ROUTE_PRIO;
+  netif_config.base = &inherent_config;
+#endif
+  s_eth.p_netif = esp_netif_new( &netif_config );
+
+  eth_mac_config_t mac_config = ETH_MAC_DEFAULT_CONFIG();
+  eth_phy_config_t phy_config = ETH_PHY_DEFAULT_CONFIG();
+#if CONFIG_ETHERNET_MAC_OPENETH
+  // QEMU's OpenCores MAC, the emulated PHY is a DP83848 that comes up straight away
+  phy_config.autonego_timeout_ms = 100;
+  esp_eth_mac_t *p_mac = esp_eth_mac_new_openeth( &mac_config );
+  esp_eth_phy_t *p_phy = esp_eth_phy_new_dp83848( &phy_config );
+#else
+  phy_config.phy_addr       = CONFIG_ETHERNET_PHY_ADDR;
+  phy_config.reset_gpio_num = CONFIG_ETHERNET_PHY_RESET_GPIO;
+  esp_eth_mac_t *p_mac = esp_eth_mac_new_esp32( &mac_config );
+  esp_eth_phy_t *p_phy = esp_eth_phy_new_lan8720( &phy_config );
+#endif
+
+  esp_eth_config_t eth_config = ETH_DEFAULT_CONFIG( p_mac, p_phy );
+  if ( !p_mac || !p_phy || ( esp_eth_driver_install( &eth_config, &s_eth.eth_handle ) != ESP_OK ) )
+  {
+    print( "Ethernet driver install failed, carrying on with Wi-Fi only\n" );
+    _release( NULL, p_mac, p_phy );
+    return;
+  }
+
+  void *p_glue = esp_eth_new_netif_glue( s_eth.eth_handle );
+  if ( !p_glue || ( esp_netif_attach( s_eth.p_netif, p_glue ) != ESP_OK ) )
+  {
+    print( "Ethernet netif attach failed, carrying on with Wi-Fi only\n" );
+    _release( p_glue, p_mac, p_phy );
+    return;
+  }
+
+  esp_event_handler_register( ETH_EVENT, ESP_EVENT_ANY_ID,    &_eth_event_handler, NULL );
+  esp_event_handler_register( IP_EVENT,  IP_EVENT_ETH_GOT_IP, &_ip_event_handler,  NULL );
+
+  esp_eth_start( s_eth.eth_handle );
+}
+
+//-----------------------------------------------------------------------------
+const char *ethernet_get_ip_addr_str( void )
+{
+  return s_eth.ip_addr_str;
+}
+
+//-----------------------------------------------------------------------------
+void ethernet_get_stats( ethernet_stats_t *p_stats )
+{
+  *p_stats = s_eth.stats;
+}
+
+#endif
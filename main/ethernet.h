@@ -0,0 +1,23 @@
+#ifndef _ETHERNET_H_
+#define _ETHERNET_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct
+{
+  uint32_t connects;          // Times we got an IP address
+  uint32_t link_drops;        // Cable pulled, switch rebooted, ...
+  uint32_t last_connect_ms;   // From link up until we had an address
+  uint16_t speed_mbps;        // 0 while the link is down
+  bool     full_duplex;
+} ethernet_stats_t;
+
+// Only with CONFIG_ETHERNET_ENABLED.  Brings the interface up and returns, the services in wifi.c
+// come up on it once it has an address
+void        ethernet_init( void );
+
+const char *ethernet_get_ip_addr_str( void );
+void        ethernet_get_stats( ethernet_stats_t *p_stats );
+
+#endif
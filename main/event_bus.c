@@ -0,0 +1,188 @@
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "utils.h"
+#include "event_bus.h"
+
+// Each subscriber owns a bounded multi-producer queue (Vyukov's design).  Every cell carries a
+// sequence number that tells producers and the consumer whose turn it is, so publishing is a
+// single compare-and-swap to claim a cell plus a release store to hand it over.  No locks, and
+// nothing a publisher does can block on a slow subscriber
+#define SUBSCRIBER_CNT            ( 4 )
+#define QUEUE_DEPTH               ( 16 )      // Power of two
+
+_Static_assert( ( QUEUE_DEPTH & ( QUEUE_DEPTH - 1 ) ) == 0, "QUEUE_DEPTH must be a power of two" );
+_Static_assert( EVENT_CNT <= 32, "event_mask only has room for 32 events" );
+
+typedef struct
+{
+  uint32_t  sequence;
+  event_t   event;
+} event_cell_t;
+
+typedef struct
+{
+  TaskHandle_t    task;
+  uint32_t        event_mask;
+  uint32_t        enqueue_pos;
+  uint32_t        dequeue_pos;      // Only touched by the subscriber
+  event_cell_t    cells[QUEUE_DEPTH];
+} subscriber_t;
+
+typedef struct
+{
+  subscriber_t        subscribers[SUBSCRIBER_CNT];
+  uint32_t            subscriber_cnt;     // Subscribers are only ever added, never removed
+  event_bus_stats_t   stats;
+} event_bus_ctx_t;
+
+static event_bus_ctx_t s_bus;
+
+//-----------------------------------------------------------------------------
+static bool _enqueue( subscriber_t *p_sub, const event_t *p_event )
+{
+  uint32_t pos = __atomic_load_n( &p_sub->enqueue_pos, __ATOMIC_RELAXED );
+
+  while ( 1 )
+  {
+    event_cell_t *p_cell = &p_sub->cells[pos & ( QUEUE_DEPTH - 1 )];
+    uint32_t sequence = __atomic_load_n( &p_cell->sequence, __ATOMIC_ACQUIRE );
+    int32_t  diff = (int32_t)sequence - (int32_t)pos;
+
+    if ( diff == 0 )
+    {
+      // Cell is free for this position, try to claim it
+      if ( __atomic_compare_exchange_n( &p_sub->enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+      {
+        p_cell->event = *p_event;
+        __atomic_store_n( &p_cell->sequence, pos + 1, __ATOMIC_RELEASE );
+        return true;
+      }
+      // Lost the race, pos now holds the winner's value
+    }
+    else if ( diff < 0 )
+    {
+      return false;   // Full, the consumer hasn't freed this cell from the previous lap
+    }
+    else
+    {
+      pos = __atomic_load_n( &p_sub->enqueue_pos, __ATOMIC_RELAXED );
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+static bool _dequeue( subscriber_t *p_sub, event_t *p_event )
+{
+  uint32_t pos = p_sub->dequeue_pos;
+  event_cell_t *p_cell = &p_sub->cells[pos & ( QUEUE_DEPTH - 1 )];
+  uint32_t sequence = __atomic_load_n( &p_cell->sequence, __ATOMIC_ACQUIRE );
+
+  if ( (int32_t)sequence - (int32_t)( pos + 1 ) < 0 )
+  {
+    return false;   // Empty, or a producer has claimed the cell but not finished writing it
+  }
+
+  *p_event = p_cell->event;
+  __atomic_store_n( &p_cell->sequence, pos + QUEUE_DEPTH, __ATOMIC_RELEASE );
+  p_sub->dequeue_pos = pos + 1;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+event_subscriber_t event_bus_subscribe( uint32_t event_mask )
+{
+  uint32_t idx = __atomic_load_n( &s_bus.subscriber_cnt, __ATOMIC_RELAXED );
+  do
+  {
+    if ( idx >= SUBSCRIBER_CNT )
+    {
+      print( "Event bus is out of subscribers!\n" );
+      return -1;
+    }
+  } while ( !__atomic_compare_exchange_n( &s_bus.subscriber_cnt, &idx, idx + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) );
+
+  subscriber_t *p_sub = &s_bus.subscribers[idx];
+  p_sub->task        = xTaskGetCurrentTaskHandle();
+  p_sub->enqueue_pos = 0;
+  p_sub->dequeue_pos = 0;
+  for ( uint32_t cell = 0; cell < QUEUE_DEPTH; cell++ )
+  {
+    p_sub->cells[cell].sequence = cell;
+  }
+
+  // Publishers only look at subscribers with a mask, so setting it last publishes the rest
+  __atomic_store_n( &p_sub->event_mask, event_mask, __ATOMIC_RELEASE );
+  return idx;
+}
+
+//-----------------------------------------------------------------------------
+void event_bus_publish( event_id_t id, const event_t *p_event )
+{
+  event_t event = { 0 };
+  if ( p_event )
+  {
+    event = *p_event;
+  }
+  event.id             = id;
+  event.timestamp_usec = system_uptime_usec();
+
+  __atomic_fetch_add( &s_bus.stats.published, 1, __ATOMIC_RELAXED );
+
+  uint32_t subscriber_cnt = __atomic_load_n( &s_bus.subscriber_cnt, __ATOMIC_RELAXED );
+  for ( uint32_t idx = 0; idx < subscriber_cnt; idx++ )
+  {
+    subscriber_t *p_sub = &s_bus.subscribers[idx];
+    if ( !( __atomic_load_n( &p_sub->event_mask, __ATOMIC_ACQUIRE ) & EVENT_MASK( id ) ) )
+    {
+      continue;
+    }
+
+    if ( _enqueue( p_sub, &event ) )
+    {
+      __atomic_fetch_add( &s_bus.stats.delivered, 1, __ATOMIC_RELAXED );
+      xTaskNotifyGive( p_sub->task );
+    }
+    else
+    {
+      __atomic_fetch_add( &s_bus.stats.dropped, 1, __ATOMIC_RELAXED );
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+bool event_bus_receive( event_subscriber_t subscriber, event_t *p_event, TickType_t timeout )
+{
+  if ( ( subscriber < 0 ) || ( subscriber >= SUBSCRIBER_CNT ) )
+  {
+    return false;
+  }
+
+  subscriber_t *p_sub = &s_bus.subscribers[subscriber];
+  TickType_t start_tick = xTaskGetTickCount();
+
+  while ( 1 )
+  {
+    if ( _dequeue( p_sub, p_event ) )
+    {
+      return true;
+    }
+
+    // One notification can stand for several events, so always drain before sleeping again
+    TickType_t waited = xTaskGetTickCount() - start_tick;
+    if ( ( waited >= timeout ) || !ulTaskNotifyTake( pdTRUE, timeout - waited ) )
+    {
+      return _dequeue( p_sub, p_event );
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+void event_bus_get_stats( event_bus_stats_t *p_stats )
+{
+  p_stats->published = __atomic_load_n( &s_bus.stats.published, __ATOMIC_RELAXED );
+  p_stats->delivered = __atomic_load_n( &s_bus.stats.delivered, __ATOMIC_RELAXED );
+  p_stats->dropped   = __atomic_load_n( &s_bus.stats.dropped, __ATOMIC_RELAXED );
+}
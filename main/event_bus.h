@@ -0,0 +1,57 @@
+#ifndef _EVENT_BUS_H_
+#define _EVENT_BUS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <freertos/FreeRTOS.h>
+
+typedef enum
+{
+  EVENT_PROVISIONED,          // Wi-Fi credentials are in place, station is starting
+  EVENT_GOT_IP,               // data.ip_addr
+  EVENT_DISCONNECTED,
+  EVENT_TELNET_OUTPUT,        // Debug output is queued for the telnet sockets
+  EVENT_LINK_GRACE_EXPIRED,   // Link stayed down past CONFIG_HTTP_LINK_DOWN_GRACE_MS
+  EVENT_ETH_GOT_IP,           // data.ip_addr
+  EVENT_ETH_DISCONNECTED,
+  EVENT_RESET_PROVISIONING,   // Asked for from timer context, the flash work is left to the Wi-Fi task
+  EVENT_WIFI_CONNECT,         // Station started or the reconnect backoff ran out, the Wi-Fi task connects
+
+  EVENT_CNT
+} event_id_t;
+
+#define EVENT_MASK(id)    ( 1UL << ( id ) )
+
+typedef struct
+{
+  event_id_t  id;
+  uint64_t    timestamp_usec;     // When it was published
+  union
+  {
+    uint32_t  ip_addr;            // Network byte order, as lwip hands it over
+  } data;
+} event_t;
+
+typedef struct
+{
+  uint32_t published;
+  uint32_t delivered;             // Sum over subscribers
+  uint32_t dropped;               // Subscriber queue was full
+} event_bus_stats_t;
+
+typedef int8_t event_subscriber_t;   // -1 if there was no room for another subscriber
+
+// Subscribes the calling task, which gets woken through its task notification whenever one of
+// its events is published.  Subscribing tasks mustn't use their notification for anything else
+event_subscriber_t event_bus_subscribe( uint32_t event_mask );
+
+// Task context only.  Never blocks, a subscriber that's too far behind loses the event
+void               event_bus_publish( event_id_t id, const event_t *p_event );
+
+// Pops the next event for the subscriber, waiting up to timeout for one to arrive
+bool               event_bus_receive( event_subscriber_t subscriber, event_t *p_event, TickType_t timeout );
+
+void               event_bus_get_stats( event_bus_stats_t *p_stats );
+
+#endif
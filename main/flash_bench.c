@@ -0,0 +1,345 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "debug.h"
+#include "utils.h"
+#include "wear.h"
+#include "flash_bench.h"
+
+#if CONFIG_FLASH_BENCHMARK
+
+#define BLOCK_SIZE            ( 64 * 1024 )     // What the chip can erase in one command, besides sectors
+#define MAX_CHUNK_SIZE        ( 8 * 1024 )
+
+// Program and read cases each get their own window of the region, so every program lands on erased
+// flash and consecutive reads don't hit what the cache kept from the last one
+static const uint16_t s_chunk_sizes[]  = { 256, 1024, 4096, MAX_CHUNK_SIZE };
+static const uint8_t  s_alignments[]   = { 0, 1 };     // Page aligned, and one byte off
+
+#define CASE_CNT              ( ARRAY_SIZE( s_chunk_sizes ) * ARRAY_SIZE( s_alignments ) )
+#define REGION_SIZE           ( CONFIG_FLASH_BENCHMARK_REGION_KB * 1024 )
+#define CASE_WINDOW           ( REGION_SIZE / CASE_CNT )
+
+_Static_assert( ( REGION_SIZE % BLOCK_SIZE ) == 0, "region has to be whole erase blocks" );
+_Static_assert( CASE_WINDOW >= 4 * MAX_CHUNK_SIZE, "region too small for the largest chunk" );
+
+typedef struct
+{
+  uint32_t bytes;
+  uint32_t usec;
+  uint32_t max_op_usec;
+  uint32_t ops;
+} bench_result_t;
+
+typedef struct
+{
+  char    *p_buffer;
+  size_t  size;
+  size_t  len;
+} json_out_t;
+
+typedef enum
+{
+  FLASH_BENCH_STATE_IDLE,
+  FLASH_BENCH_STATE_RUNNING,
+  FLASH_BENCH_STATE_DONE,
+  FLASH_BENCH_STATE_FAILED,
+} flash_bench_state_t;
+
+static const char * const s_state_names[] = { "idle", "running", "done", "failed" };
+
+typedef struct
+{
+  flash_bench_state_t state;          // Everything else is owned by the benchmark task while this is RUNNING
+  const char          *p_error;
+  uint16_t            report_len;
+  char                report[FLASH_BENCH_REPORT_SIZE];
+} flash_bench_context_t;
+
+static flash_bench_context_t s_bench = { 0 };
+
+//-----------------------------------------------------------------------------
+static void _json( json_out_t *p_out, const char *p_fmt, ... )
+{
+  if ( p_out->len >= p_out->size )
+  {
+    return;
+  }
+
+  va_list args;
+  va_start( args, p_fmt );
+  p_out->len += vsnprintf( p_out->p_buffer + p_out->len, p_out->size - p_out->len, p_fmt, args );
+  va_end( args );
+}
+
+//-----------------------------------------------------------------------------
+static void _json_result( json_out_t *p_out, const bench_result_t *p_result )
+{
+  // bytes / usec is MB/s, scaled to KB/s without the 64 bit divide mattering
+  uint32_t kbps    = p_result->usec ? (uint32_t)( (uint64_t)p_result->bytes * 1000 / p_result->usec ) : 0;
+  uint32_t avg_us  = p_result->ops ? p_result->usec / p_result->ops : 0;
+  _json( p_out, "\"kbytes_per_s\":%u,\"avg_us\":%u,\"max_us\":%u,\"ops\":%u}",
+    kbps, avg_us, p_result->max_op_usec, p_result->ops );
+}
+
+//-----------------------------------------------------------------------------
+static void _account( bench_result_t *p_result, uint32_t bytes, uint64_t start_usec )
+{
+  uint32_t usec = system_uptime_usec() - start_usec;
+  p_result->bytes += bytes;
+  p_result->usec  += usec;
+  p_result->ops++;
+  p_result->max_op_usec = MAX( p_result->max_op_usec, usec );
+}
+
+//-----------------------------------------------------------------------------
+static bool _erase( const esp_partition_t *p_partition, wear_partition_t wear_partition, uint32_t op_size, bench_result_t *p_result )
+{
+  for ( uint32_t offset = 0; offset < REGION_SIZE; offset += op_size )
+  {
+    uint64_t start_usec = system_uptime_usec();
+    if ( esp_partition_erase_range( p_partition, offset, op_size ) != ESP_OK )
+    {
+      return false;
+    }
+    _account( p_result, op_size, start_usec );
+    wear_record_erase( wear_partition, op_size / SPI_FLASH_SEC_SIZE );
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static bool _program( const esp_partition_t *p_partition, wear_partition_t wear_partition, uint32_t window_offset,
+                      uint16_t chunk_size, uint8_t alignment, const uint8_t *p_data, bench_result_t *p_result )
+{
+  uint32_t end = window_offset + CASE_WINDOW;
+  for ( uint32_t offset = window_offset + alignment; offset + chunk_size <= end; offset += chunk_size )
+  {
+    uint64_t start_usec = system_uptime_usec();
+    if ( esp_partition_write( p_partition, offset, p_data, chunk_size ) != ESP_OK )
+    {
+      return false;
+    }
+    _account( p_result, chunk_size, start_usec );
+    wear_record_write( wear_partition, chunk_size );
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static bool _read( const esp_partition_t *p_partition, uint32_t window_offset, uint16_t chunk_size, uint8_t *p_data, bench_result_t *p_result )
+{
+  for ( uint32_t offset = window_offset; offset + chunk_size <= window_offset + CASE_WINDOW; offset += chunk_size )
+  {
+    uint64_t start_usec = system_uptime_usec();
+    if ( esp_partition_read( p_partition, offset, p_data, chunk_size ) != ESP_OK )
+    {
+      return false;
+    }
+    _account( p_result, chunk_size, start_usec );
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// Through the cache, the way the running app reads its own rodata
+static void _mmap_read( const uint8_t *p_mapped, uint32_t window_offset, uint16_t chunk_size, uint8_t *p_data, bench_result_t *p_result )
+{
+  for ( uint32_t offset = window_offset; offset + chunk_size <= window_offset + CASE_WINDOW; offset += chunk_size )
+  {
+    uint64_t start_usec = system_uptime_usec();
+    memcpy( p_data, p_mapped + offset, chunk_size );
+    _account( p_result, chunk_size, start_usec );
+  }
+}
+
+//-----------------------------------------------------------------------------
+// The slot still holds the previous image and otadata still points at it, so a rollback would boot
+// whatever half of it the benchmark leaves behind.  Invalidate it first, the way the IDF drops the
+// previous app.  ESP_FAIL there means otadata doesn't name an image in another slot, nothing to do
+static bool _invalidate_slot( void )
+{
+  const esp_partition_t *p_partition = esp_ota_get_next_update_partition( NULL );
+  esp_err_t err = esp_ota_erase_last_boot_app_partition();
+  if ( err == ESP_OK )
+  {
+    print( "Erased the previous image in %s\n", p_partition->label );
+    wear_record_erase( wear_partition_for( p_partition ), p_partition->size / SPI_FLASH_SEC_SIZE );
+    wear_record_erase( WEAR_PARTITION_OTADATA, 1 );
+  }
+  return ( err == ESP_OK ) || ( err == ESP_FAIL );
+}
+
+//-----------------------------------------------------------------------------
+static const char *_run( json_out_t *p_out )
+{
+  const char *p_error = NULL;
+
+  const esp_partition_t *p_partition    = esp_ota_get_next_update_partition( NULL );
+  wear_partition_t       wear_partition = wear_partition_for( p_partition );
+  uint8_t               *p_data         = malloc( MAX_CHUNK_SIZE );
+  const void            *p_mapped       = NULL;
+  spi_flash_mmap_handle_t mmap_handle;
+
+  if ( !p_data )
+  {
+    return "out of memory";
+  }
+
+  print( "Flash benchmark over %s at 0x%08x, %u KB\n", p_partition->label, p_partition->address, REGION_SIZE / 1024 );
+  for ( uint16_t i = 0; i < MAX_CHUNK_SIZE; i++ )
+  {
+    p_data[i] = i * 7;    // Mostly ones and zeros mixed, like a real image
+  }
+
+  _json( p_out, "{\"partition\":\"%s\",\"address\":%u,\"region_kb\":%u,\"flash_mode\":\"%s\",\"flash_freq\":\"%s\",",
+    p_partition->label, p_partition->address, REGION_SIZE / 1024, CONFIG_ESPTOOLPY_FLASHMODE, CONFIG_ESPTOOLPY_FLASHFREQ );
+
+  // Block erase first, then sector by sector, leaving the whole region erased for the programs
+  bench_result_t block_erase = { 0 };
+  bench_result_t sector_erase = { 0 };
+  if ( !_erase( p_partition, wear_partition, BLOCK_SIZE, &block_erase ) ||
+       !_erase( p_partition, wear_partition, SPI_FLASH_SEC_SIZE, &sector_erase ) )
+  {
+    p_error = "erase failed";
+    goto done;
+  }
+  _json( p_out, "\"erase\":{\"block_64k\":{" );
+  _json_result( p_out, &block_erase );
+  _json( p_out, ",\"sector_4k\":{" );
+  _json_result( p_out, &sector_erase );
+  _json( p_out, "},\"program\":[" );
+
+  for ( uint8_t i = 0; i < CASE_CNT; i++ )
+  {
+    uint16_t chunk_size = s_chunk_sizes[i / ARRAY_SIZE( s_alignments )];
+    uint8_t  alignment  = s_alignments[i % ARRAY_SIZE( s_alignments )];
+    bench_result_t result = { 0 };
+    if ( !_program( p_partition, wear_partition, i * CASE_WINDOW, chunk_size, alignment, p_data, &result ) )
+    {
+      p_error = "write failed";
+      goto done;
+    }
+    _json( p_out, "%s{\"chunk\":%u,\"offset\":%u,", i ? "," : "", chunk_size, alignment );
+    _json_result( p_out, &result );
+  }
+
+  _json( p_out, "],\"read\":[" );
+  for ( uint8_t i = 0; i < ARRAY_SIZE( s_chunk_sizes ); i++ )
+  {
+    bench_result_t result = { 0 };
+    if ( !_read( p_partition, i * CASE_WINDOW, s_chunk_sizes[i], p_data, &result ) )
+    {
+      p_error = "read failed";
+      goto done;
+    }
+    _json( p_out, "%s{\"chunk\":%u,", i ? "," : "", s_chunk_sizes[i] );
+    _json_result( p_out, &result );
+  }
+
+  if ( esp_partition_mmap( p_partition, 0, REGION_SIZE, SPI_FLASH_MMAP_DATA, &p_mapped, &mmap_handle ) != ESP_OK )
+  {
+    p_error = "mmap failed";
+    goto done;
+  }
+  _json( p_out, "],\"mmap_read\":[" );
+  for ( uint8_t i = 0; i < ARRAY_SIZE( s_chunk_sizes ); i++ )
+  {
+    // Windows the plain reads didn't touch, so the cache starts cold
+    bench_result_t result = { 0 };
+    _mmap_read( p_mapped, ( i + ARRAY_SIZE( s_chunk_sizes ) ) * CASE_WINDOW, s_chunk_sizes[i], p_data, &result );
+    _json( p_out, "%s{\"chunk\":%u,", i ? "," : "", s_chunk_sizes[i] );
+    _json_result( p_out, &result );
+  }
+  spi_flash_munmap( mmap_handle );
+  _json( p_out, "]}" );
+
+done:
+  free( p_data );
+  return p_error;
+}
+
+//-----------------------------------------------------------------------------
+static void _flash_bench_task( void *p_param )
+{
+  const esp_partition_t *p_partition = esp_ota_get_next_update_partition( NULL );
+  json_out_t out = { .p_buffer = s_bench.report, .size = sizeof( s_bench.report ) };
+
+  if ( !p_partition )
+  {
+    s_bench.p_error = "no inactive app slot";
+  }
+  else if ( p_partition->size < REGION_SIZE )
+  {
+    s_bench.p_error = "partition too small";
+  }
+  else if ( !_invalidate_slot() )
+  {
+    s_bench.p_error = "couldn't invalidate the previous image";
+  }
+  else
+  {
+    s_bench.p_error = _run( &out );
+  }
+
+  // Half a report isn't worth untangling, the error says what broke
+  s_bench.report_len = s_bench.p_error ? 0 : MIN( out.len, sizeof( s_bench.report ) - 1 );
+  print( "Flash benchmark %s\n", s_bench.p_error ? s_bench.p_error : "done" );
+  __atomic_store_n( &s_bench.state, s_bench.p_error ? FLASH_BENCH_STATE_FAILED : FLASH_BENCH_STATE_DONE, __ATOMIC_RELEASE );
+  vTaskDelete( NULL );
+}
+
+//-----------------------------------------------------------------------------
+bool flash_bench_start( void )
+{
+  if ( flash_bench_running() )
+  {
+    return false;
+  }
+
+  // Until the new image marks itself valid the bootloader may still fall back to the old one
+  esp_ota_img_states_t ota_state;
+  if ( ( esp_ota_get_state_partition( esp_ota_get_running_partition(), &ota_state ) == ESP_OK ) &&
+       ( ota_state == ESP_OTA_IMG_PENDING_VERIFY ) )
+  {
+    print( "Flash benchmark refused, rollback still pending\n" );
+    return false;
+  }
+
+  s_bench.p_error    = NULL;
+  s_bench.report_len = 0;
+  s_bench.state      = FLASH_BENCH_STATE_RUNNING;
+
+  // Below the httpd task, so status polls still get answered between flash operations
+  if ( xTaskCreate( _flash_bench_task, "flash_bench", 3072, NULL, 4, NULL ) != pdPASS )
+  {
+    s_bench.state = FLASH_BENCH_STATE_IDLE;
+    return false;
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+bool flash_bench_running( void )
+{
+  return __atomic_load_n( &s_bench.state, __ATOMIC_ACQUIRE ) == FLASH_BENCH_STATE_RUNNING;
+}
+
+//-----------------------------------------------------------------------------
+uint16_t flash_bench_get_json( char *p_buffer, size_t buffer_size )
+{
+  flash_bench_state_t state = __atomic_load_n( &s_bench.state, __ATOMIC_ACQUIRE );
+  int len = snprintf( p_buffer, buffer_size, "{\"state\":\"%s\",\"error\":\"%s\",\"report\":%.*s}", s_state_names[state],
+    s_bench.p_error ? s_bench.p_error : "", ( state == FLASH_BENCH_STATE_DONE ) ? s_bench.report_len : 4,
+    ( state == FLASH_BENCH_STATE_DONE ) ? s_bench.report : "null" );
+  return MIN( len, buffer_size - 1 );
+}
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef _FLASH_BENCH_H_
+#define _FLASH_BENCH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define FLASH_BENCH_REPORT_SIZE   ( 2048 )
+#define FLASH_BENCH_JSON_SIZE     ( FLASH_BENCH_REPORT_SIZE + 64 )   // What flash_bench_get_json() needs for a full report
+
+// Erases, programs and reads back the first CONFIG_FLASH_BENCHMARK_REGION_KB of the inactive app
+// slot on a task of its own, taking a few seconds.  The previous image in that slot is erased and
+// dropped from otadata first, so there's nothing to roll back to until the next OTA.  Returns false
+// if a run is in progress or the running image hasn't been marked valid yet
+bool     flash_bench_start( void );
+bool     flash_bench_running( void );   // Uploads have to wait, they'd write the same slot
+
+// State of the current or last run, with the report once it's done
+uint16_t flash_bench_get_json( char *p_buffer, size_t buffer_size );
+
+#endif
@@ -1,3 +1,4 @@
+#include <esp_app_format.h>
 #include <esp_flash_partitions.h>
 #include <esp_ota_ops.h>
 #include <esp_partition.h>
@@ -9,7 +10,9 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
 #include <freertos/task.h>
+#include <mbedtls/sha256.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "debug.h"
@@ -17,6 +20,56 @@
 #include "utils.h"
 #include "wifi.h"
 #include "application.h"
+#include "nvm.h"
+#include "wear.h"
+#include "startup.h"
+#include "netperf.h"
+#include "flash_bench.h"
+#include "ota_history.h"
+#include "metrics.h"
+#include "timeseries.h"
+#include "task_monitor.h"
+#include "profiler.h"
+#include "trace.h"
+#include "alloc_trace.h"
+#include "arena.h"
+
+// HTTPD_DEFAULT_CONFIG() only has room for 8
+#define HTTP_MAX_URI_HANDLERS     ( 24 )
+
+#define OTA_RECV_BUFFER_SIZE      ( 256 )
+
+// httpd runs every handler on its one task, so only one request at a time ever holds a slot
+#define HTTP_REQUEST_SLOTS        ( 1 )
+
+// Everything esp_ota_write() and esp_ota_end() look at before the first segment's data
+#define OTA_HEADER_SIZE           ( sizeof( esp_image_header_t ) + sizeof( esp_image_segment_header_t ) + sizeof( esp_app_desc_t ) )
+
+typedef struct
+{
+  uint32_t bytes;
+  uint32_t recv_calls;
+  uint32_t recv_timeouts;     // HTTPD_SOCK_ERR_TIMEOUT, retried
+  uint32_t recv_min_bytes;
+  uint32_t recv_max_bytes;
+  uint64_t recv_usec;         // Inside httpd_req_recv(), i.e. waiting on the network
+} ota_recv_stats_t;
+
+// What a registered handler really is, _instrumented_handler() is what httpd gets
+typedef struct
+{
+  const httpd_uri_t *p_uri;
+  metrics_http_t    *p_metrics;
+} http_route_t;
+
+// What a request being handled has to itself, taken by _instrumented_handler() for the handler's
+// duration.  Only touched from the httpd task
+typedef struct
+{
+  httpd_req_t *p_req;         // NULL while free
+  uint16_t     status;        // httpd keeps its own copy private
+  arena_t      arena;
+} http_request_t;
 
 typedef struct
 {
@@ -32,7 +85,12 @@ static basic_auth_info_t auth_info =
   .password = "andrade",
 };
 
-static char *_http_auth_basic( const char *username, const char *password );
+static http_route_t   s_routes[HTTP_MAX_URI_HANDLERS];
+static uint8_t        s_route_cnt;
+static http_request_t s_requests[HTTP_REQUEST_SLOTS];
+static uint8_t        s_arena_memory[HTTP_REQUEST_SLOTS][CONFIG_HTTP_ARENA_SIZE] __attribute__(( aligned( ARENA_ALIGN ) ));
+
+static char *_http_auth_basic( arena_t *p_arena, const char *username, const char *password );
 
 static esp_err_t _root_get_handler( httpd_req_t *req );
 static esp_err_t _root_post_handler( httpd_req_t *req );
@@ -40,36 +98,245 @@ static esp_err_t _ota_get_handler( httpd_req_t *req );
 static esp_err_t _ota_post_handler( httpd_req_t *req );
 static esp_err_t _reset_get_handler( httpd_req_t *req );
 static esp_err_t _reset_post_handler( httpd_req_t *req );
+static esp_err_t _wear_get_handler( httpd_req_t *req );
+static esp_err_t _boot_get_handler( httpd_req_t *req );
+static void _record_otadata_write( void );
+static int _ota_recv( httpd_req_t *req, char *p_buf, size_t len, ota_recv_stats_t *p_stats );
+static bool _ota_is_dry_run( httpd_req_t *req );
+static const char *_ota_check_header( const uint8_t *p_header, size_t header_len );
+static esp_err_t _ota_dry_run( httpd_req_t *req );
+static esp_err_t _ota_finish( httpd_req_t *req, ota_profile_t *p_profile, const ota_recv_stats_t *p_recv_stats,
+                              uint64_t start_usec, uint64_t write_usec, uint64_t erase_usec, uint32_t heap_drop );
+static esp_err_t _ota_history_get_handler( httpd_req_t *req );
+static esp_err_t _netperf_get_handler( httpd_req_t *req );
+static esp_err_t _netperf_post_handler( httpd_req_t *req );
+static esp_err_t _flashbench_get_handler( httpd_req_t *req );
+static esp_err_t _flashbench_post_handler( httpd_req_t *req );
+static bool _request_authenticated( httpd_req_t *req );
+static esp_err_t _send_auth_required( httpd_req_t *req );
+static esp_err_t _metrics_get_handler( httpd_req_t *req );
+static void _send_chunk( void *p_ctx, const char *p_text, size_t len );
+static esp_err_t _timeseries_get_handler( httpd_req_t *req );
+static esp_err_t _tasks_get_handler( httpd_req_t *req );
+static esp_err_t _profiler_get_handler( httpd_req_t *req );
+static esp_err_t _profiler_post_handler( httpd_req_t *req );
+static esp_err_t _trace_get_handler( httpd_req_t *req );
+static esp_err_t _trace_post_handler( httpd_req_t *req );
+static esp_err_t _alloctrace_get_handler( httpd_req_t *req );
+static esp_err_t _alloctrace_post_handler( httpd_req_t *req );
+static http_request_t *_request_find( httpd_req_t *req );
+static void *_request_alloc( httpd_req_t *req, size_t size );
+static esp_err_t _send_no_memory( httpd_req_t *req );
+static void _request_served( arena_t *p_arena );
+static void _set_status( httpd_req_t *req, const char *status );
+static esp_err_t _instrumented_handler( httpd_req_t *req );
+static void _register_uri_handler( httpd_handle_t server, const httpd_uri_t *p_uri );
 
 //-----------------------------------------------------------------------------
-static char *_http_auth_basic( const char *username, const char *password )
+// NULL if the request's arena has no room for it
+static char *_http_auth_basic( arena_t *p_arena, const char *username, const char *password )
 {
-  int out;
-  char user_info[128];
-  static char digest[512];
+  size_t out;
   size_t n = 0;
-  sprintf( user_info, "%s:%s", username, password );
+  char *user_info = arena_printf( p_arena, "%s:%s", username, password );
+  if ( !user_info )
+  {
+    return NULL;
+  }
 
   esp_crypto_base64_encode( NULL, 0, &n, ( const unsigned char * )user_info, strlen( user_info ) );
 
   // 6: The length of the "Basic " string
   // n: Number of bytes for a base64 encode format
   // 1: Number of bytes for a reserved which be used to fill zero
-  if ( sizeof( digest ) > ( 6 + n + 1 ) )
+  char *digest = arena_alloc( p_arena, 6 + n + 1 );
+  if ( digest )
   {
     strcpy( digest, "Basic " );
-    esp_crypto_base64_encode( ( unsigned char * )digest + 6, n, ( size_t * )&out, ( const unsigned char * )user_info, strlen( user_info ) );
+    esp_crypto_base64_encode( ( unsigned char * )digest + 6, n, &out, ( const unsigned char * )user_info, strlen( user_info ) );
   }
 
   return digest;
 }
 
+//-----------------------------------------------------------------------------
+// Checks the request's Basic credentials against the basic_auth_info_t in its user_ctx
+static bool _request_authenticated( httpd_req_t *req )
+{
+  basic_auth_info_t *basic_auth_info = req->user_ctx;
+  arena_t           *p_arena         = &_request_find( req )->arena;
+
+  size_t buf_len     = httpd_req_get_hdr_value_len( req, "Authorization" ) + 1;
+  char  *auth_buffer = ( buf_len > 1 ) ? arena_alloc( p_arena, buf_len ) : NULL;
+  if ( auth_buffer )
+  {
+    if ( httpd_req_get_hdr_value_str( req, "Authorization", auth_buffer, buf_len ) == ESP_OK )
+    {
+      char *auth_credentials = _http_auth_basic( p_arena, basic_auth_info->username, basic_auth_info->password );
+      if ( auth_credentials && !strncmp( auth_credentials, auth_buffer, buf_len ) )
+      {
+        print( "Authenticated!\n" );
+        return true;
+      }
+    }
+  }
+
+  print( "Not authenticated\n" );
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+static esp_err_t _send_auth_required( httpd_req_t *req )
+{
+  _set_status( req, HTTPD_401 );
+  httpd_resp_set_hdr( req, "Connection", "keep-alive" );
+  httpd_resp_set_hdr( req, "WWW-Authenticate", "Basic realm=\"Hello\"" );
+  httpd_resp_send( req, NULL, 0 );
+
+  return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+// Handlers all run on the httpd task, so there's no racing over the first one.  Borrows the
+// request's arena before the handler gets it
+static void _request_served( arena_t *p_arena )
+{
+  static bool s_served = false;
+  if ( s_served )
+  {
+    return;
+  }
+
+  s_served = true;
+  startup_ready( STARTUP_FIRST_HTTP_REQUEST );
+
+  char *timeline = arena_alloc( p_arena, 768 );
+  if ( timeline )
+  {
+    startup_get_timeline( timeline, 768, "\n" );
+
+    print( "Boot timeline:\n" );
+    for ( char *p_line = strtok( timeline, "\n" ); p_line; p_line = strtok( NULL, "\n" ) )
+    {
+      print( "  %s\n", p_line );
+    }
+  }
+  arena_reset( p_arena );
+}
+
+//-----------------------------------------------------------------------------
+// The slot _instrumented_handler() took for req
+static http_request_t *_request_find( httpd_req_t *req )
+{
+  for ( uint8_t i = 0; i < ARRAY_SIZE( s_requests ); i++ )
+  {
+    if ( s_requests[i].p_req == req )
+    {
+      return &s_requests[i];
+    }
+  }
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Memory for the handler's own use, handed back as soon as it returns.  NULL once the
+// request's CONFIG_HTTP_ARENA_SIZE bytes are used up
+static void *_request_alloc( httpd_req_t *req, size_t size )
+{
+  void *p_memory = arena_alloc( &_request_find( req )->arena, size );
+  if ( !p_memory )
+  {
+    print( "No room for %u more bytes of request memory\n", size );
+  }
+  return p_memory;
+}
+
+//-----------------------------------------------------------------------------
+static esp_err_t _send_no_memory( httpd_req_t *req )
+{
+  _set_status( req, HTTPD_500 );
+  httpd_resp_send( req, NULL, 0 );
+  return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+// Stands in for httpd_resp_set_status() so the metrics know the status of every response
+static void _set_status( httpd_req_t *req, const char *status )
+{
+  _request_find( req )->status = atoi( status );
+  httpd_resp_set_status( req, status );
+}
+
+//-----------------------------------------------------------------------------
+// What httpd calls for every URI.  Gives the request a slot with a fresh arena, times the real
+// handler and files the latency and status
+static esp_err_t _instrumented_handler( httpd_req_t *req )
+{
+  const http_route_t *p_route = req->user_ctx;
+  req->user_ctx = p_route->p_uri->user_ctx;
+
+  http_request_t *p_request = _request_find( NULL );
+  if ( !p_request )
+  {
+    httpd_resp_set_status( req, "503 Service Unavailable" );
+    httpd_resp_send( req, NULL, 0 );
+    metrics_http_observe( p_route->p_metrics, 503, 0 );
+    return ESP_OK;
+  }
+
+  if ( !p_request->arena.p_base )
+  {
+    arena_init( &p_request->arena, s_arena_memory[p_request - s_requests], sizeof( s_arena_memory[0] ) );
+  }
+  p_request->p_req  = req;
+  p_request->status = 200;    // httpd's default if the handler doesn't set one
+  arena_reset( &p_request->arena );
+
+  _request_served( &p_request->arena );
+
+  uint64_t start_usec = system_uptime_usec();
+  TRACE_BEGIN( p_route->p_uri->uri );
+  esp_err_t ret = p_route->p_uri->handler( req );
+  TRACE_END( p_route->p_uri->uri );
+  uint32_t latency_usec = MIN( system_uptime_usec() - start_usec, UINT32_MAX );
+
+  // httpd drops the connection on an error, whatever status was set
+  metrics_http_observe( p_route->p_metrics, ( ret == ESP_OK ) ? p_request->status : 500, latency_usec );
+  metrics_set( METRIC_HTTP_ARENA_PEAK, p_request->arena.peak );
+  p_request->p_req = NULL;
+  return ret;
+}
+
+//-----------------------------------------------------------------------------
+static void _register_uri_handler( httpd_handle_t server, const httpd_uri_t *p_uri )
+{
+  if ( s_route_cnt == ARRAY_SIZE( s_routes ) )
+  {
+    print( "No room for handler %s\n", p_uri->uri );
+    return;
+  }
+
+  http_route_t *p_route = &s_routes[s_route_cnt++];
+  p_route->p_uri     = p_uri;
+  p_route->p_metrics = metrics_http_register( p_uri->uri, p_uri->method );
+
+  httpd_uri_t instrumented = *p_uri;
+  instrumented.handler  = _instrumented_handler;
+  instrumented.user_ctx = p_route;
+  httpd_register_uri_handler( server, &instrumented );
+}
+
 //-----------------------------------------------------------------------------
 static esp_err_t _root_get_handler( httpd_req_t *req )
 {
-  const char *p_html_resp = application_get_html( NULL );
+  char *p_html = _request_alloc( req, APPLICATION_HTML_SIZE );
+  if ( !p_html )
+  {
+    return _send_no_memory( req );
+  }
+  const char *p_html_resp = application_get_html( p_html, APPLICATION_HTML_SIZE, NULL );
 
-  httpd_resp_set_status( req, HTTPD_200 );
+  _set_status( req, HTTPD_200 );
   httpd_resp_set_hdr( req, "Connection", "keep-alive" );
   httpd_resp_send( req, p_html_resp, strlen( p_html_resp ) );
   return ESP_OK;
@@ -78,22 +345,28 @@ static esp_err_t _root_get_handler( httpd_req_t *req )
 //-----------------------------------------------------------------------------
 static esp_err_t _root_post_handler( httpd_req_t *req )
 {
-  char post_data[256] = { 0 };
+  size_t post_len  = MIN( 255, req->content_len );
+  char  *post_data = _request_alloc( req, post_len + 1 );
+  char  *p_html    = _request_alloc( req, APPLICATION_HTML_SIZE );
+  if ( !post_data || !p_html )
+  {
+    return _send_no_memory( req );
+  }
 
   // Read the data for the request
-  httpd_req_recv(req, post_data, MIN( sizeof(post_data) - 1, req->content_len));
+  int ret = httpd_req_recv( req, post_data, post_len );
+  post_data[MAX( ret, 0 )] = '\0';
   //print( "Received: %s\n", post_data);
   
-  const char *p_html_resp = application_post_html(post_data);
+  const char *p_html_resp = application_post_html( p_html, APPLICATION_HTML_SIZE, post_data );
 
-  httpd_resp_set_status( req, HTTPD_200 );
+  _set_status( req, HTTPD_200 );
   httpd_resp_set_hdr( req, "Connection", "keep-alive" );
   httpd_resp_send( req, p_html_resp, strlen(p_html_resp) );
   return ESP_OK;
 }
 
 //-----------------------------------------------------------------------------
-static char auth_buffer[512];
 static const char ota_html_file[] = "\
 <style>\n\
 .progress {margin: 15px auto;  max-width: 500px;height: 30px;}\n\
@@ -140,30 +413,206 @@ function upload_file() {\n\
 //-----------------------------------------------------------------------------
 static esp_err_t _ota_get_handler( httpd_req_t *req )
 {
-  basic_auth_info_t *basic_auth_info = req->user_ctx;
+  if ( !_request_authenticated( req ) )
+  {
+    return _send_auth_required( req );
+  }
+
+  _set_status( req, HTTPD_200 );
+  httpd_resp_set_hdr( req, "Connection", "keep-alive" );
+  httpd_resp_send( req, ota_html_file, strlen( ota_html_file ) );
+  return ESP_OK;
+}
 
-  size_t buf_len = httpd_req_get_hdr_value_len( req, "Authorization" ) + 1;
-  if ( ( buf_len > 1 ) && ( buf_len <= sizeof( auth_buffer ) ) )
+//-----------------------------------------------------------------------------
+// httpd_req_recv() with the timeout retry, keeping track of how long we sat waiting in it
+static int _ota_recv( httpd_req_t *req, char *p_buf, size_t len, ota_recv_stats_t *p_stats )
+{
+  while ( 1 )
   {
-    if ( httpd_req_get_hdr_value_str( req, "Authorization", auth_buffer, buf_len ) == ESP_OK )
+    uint64_t start_usec = system_uptime_usec();
+    int ret = httpd_req_recv( req, p_buf, len );
+    p_stats->recv_usec += system_uptime_usec() - start_usec;
+
+    if ( ret == HTTPD_SOCK_ERR_TIMEOUT )
     {
-      char *auth_credentials = _http_auth_basic( basic_auth_info->username, basic_auth_info->password );
-      if ( !strncmp( auth_credentials, auth_buffer, buf_len ) )
-      {
-        print( "Authenticated!\n" );
-        httpd_resp_set_status( req, HTTPD_200 );
-        httpd_resp_set_hdr( req, "Connection", "keep-alive" );
-        httpd_resp_send( req, ota_html_file, strlen( ota_html_file ) );
-        return ESP_OK;
-      }
+      p_stats->recv_timeouts++;
+      continue;
     }
+
+    if ( ret > 0 )
+    {
+      p_stats->bytes += ret;
+      p_stats->recv_calls++;
+      p_stats->recv_min_bytes = MIN( p_stats->recv_min_bytes, ret );
+      p_stats->recv_max_bytes = MAX( p_stats->recv_max_bytes, ret );
+    }
+    return ret;
   }
+}
 
-  print( "Not authenticated\n" );
-  httpd_resp_set_status( req, HTTPD_401 );
-  httpd_resp_set_hdr( req, "Connection", "keep-alive" );
-  httpd_resp_set_hdr( req, "WWW-Authenticate", "Basic realm=\"Hello\"" );
-  httpd_resp_send( req, NULL, 0 );
+//-----------------------------------------------------------------------------
+static bool _ota_is_dry_run( httpd_req_t *req )
+{
+  char query[32];
+  char value[8];
+  return ( httpd_req_get_url_query_str( req, query, sizeof( query ) ) == ESP_OK ) &&
+         ( httpd_query_key_value( query, "dry_run", value, sizeof( value ) ) == ESP_OK ) &&
+         strcmp( value, "0" );
+}
+
+//-----------------------------------------------------------------------------
+// The same checks the OTA API makes on the image header, NULL if it would be accepted
+static const char *_ota_check_header( const uint8_t *p_header, size_t header_len )
+{
+  const esp_image_header_t *p_image    = (const esp_image_header_t *)p_header;
+  const esp_app_desc_t     *p_app_desc = (const esp_app_desc_t *)( p_header + sizeof( esp_image_header_t ) + sizeof( esp_image_segment_header_t ) );
+
+  if ( header_len < OTA_HEADER_SIZE )
+  {
+    return "image too short";
+  }
+  if ( p_image->magic != ESP_IMAGE_HEADER_MAGIC )
+  {
+    return "bad image magic";
+  }
+  if ( p_image->chip_id != CONFIG_IDF_FIRMWARE_CHIP_ID )
+  {
+    return "built for another chip";
+  }
+  if ( p_app_desc->magic_word != ESP_APP_DESC_MAGIC_WORD )
+  {
+    return "no app description";
+  }
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// POST /ota?dry_run=1.  Receives, hashes and checks the image exactly like an upload, but nothing
+// goes near flash, so it can be run as often as needed to tune the network side
+static esp_err_t _ota_dry_run( httpd_req_t *req )
+{
+  char    *buf = _request_alloc( req, OTA_RECV_BUFFER_SIZE );
+  uint8_t  header[OTA_HEADER_SIZE];
+  size_t   header_len = 0;
+  uint64_t hash_usec  = 0;
+  uint64_t start_usec = system_uptime_usec();
+  int      remaining  = req->content_len;
+  ota_recv_stats_t recv_stats = { .recv_min_bytes = UINT32_MAX };
+
+  if ( !buf )
+  {
+    return _send_no_memory( req );
+  }
+
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init( &sha );
+  mbedtls_sha256_starts_ret( &sha, 0 );
+
+  print( "OTA dry run, %u bytes\n", remaining );
+  while ( remaining > 0 )
+  {
+    int ret = _ota_recv( req, buf, MIN( remaining, OTA_RECV_BUFFER_SIZE ), &recv_stats );
+    if ( ret <= 0 )
+    {
+      break;
+    }
+    remaining -= ret;
+
+    size_t header_bytes = MIN( ret, sizeof( header ) - header_len );
+    memcpy( header + header_len, buf, header_bytes );
+    header_len += header_bytes;
+
+    uint64_t hash_start_usec = system_uptime_usec();
+    mbedtls_sha256_update_ret( &sha, (const unsigned char *)buf, ret );
+    hash_usec += system_uptime_usec() - hash_start_usec;
+  }
+
+  uint8_t digest[32];
+  mbedtls_sha256_finish_ret( &sha, digest );
+  mbedtls_sha256_free( &sha );
+  uint32_t total_ms = ( system_uptime_usec() - start_usec ) / 1000;
+
+  char sha_str[2 * sizeof( digest ) + 1];
+  for ( uint8_t i = 0; i < sizeof( digest ); i++ )
+  {
+    sprintf( sha_str + 2 * i, "%02x", digest[i] );
+  }
+
+  const char *p_error = remaining ? "receive failed" : _ota_check_header( header, header_len );
+  const esp_app_desc_t *p_app_desc = (const esp_app_desc_t *)( header + sizeof( esp_image_header_t ) + sizeof( esp_image_segment_header_t ) );
+
+  char *json = arena_printf( &_request_find( req )->arena,
+    "{\"dry_run\":true,\"error\":\"%s\",\"bytes\":%u,\"total_ms\":%u,\"kbytes_per_s\":%u,"
+    "\"recv\":{\"wait_ms\":%u,\"calls\":%u,\"timeouts\":%u,\"avg_bytes\":%u,\"min_bytes\":%u,\"max_bytes\":%u},"
+    "\"hash_ms\":%u,\"sha256\":\"%s\",\"project\":\"%.32s\",\"version\":\"%.32s\"}",
+    p_error ? p_error : "", recv_stats.bytes, total_ms, total_ms ? recv_stats.bytes / total_ms : 0,
+    (uint32_t)( recv_stats.recv_usec / 1000 ), recv_stats.recv_calls, recv_stats.recv_timeouts,
+    recv_stats.recv_calls ? recv_stats.bytes / recv_stats.recv_calls : 0, recv_stats.recv_calls ? recv_stats.recv_min_bytes : 0,
+    recv_stats.recv_max_bytes, (uint32_t)( hash_usec / 1000 ), sha_str,
+    p_error ? "" : p_app_desc->project_name, p_error ? "" : p_app_desc->version );
+  print( "OTA dry run done in %u ms%s%s\n", total_ms, p_error ? ", " : "", p_error ? p_error : "" );
+
+  if ( !json )
+  {
+    return _send_no_memory( req );
+  }
+
+  _set_status( req, remaining ? HTTPD_500 : HTTPD_200 );
+  httpd_resp_set_type( req, "application/json" );
+  httpd_resp_send( req, json, HTTPD_RESP_USE_STRLEN );
+  return remaining ? ESP_FAIL : ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+// heap_min is sampled between calls, so it misses what esp_ota_*() allocate and free again inside
+// them.  The allocator's all time low does catch that, but only once the upload takes it below
+// heap_floor, where it stood when the upload started
+static uint32_t _ota_heap_drop( uint32_t heap_start, uint32_t heap_min, uint32_t heap_floor )
+{
+  uint32_t heap_low = esp_get_minimum_free_heap_size();
+  return heap_start - ( ( heap_low < heap_floor ) ? MIN( heap_low, heap_min ) : heap_min );
+}
+
+//-----------------------------------------------------------------------------
+// Completes the upload's profile, files it in the history and sends it back as the response.
+// Reboots into the new image if the status set on req is 200
+static esp_err_t _ota_finish( httpd_req_t *req, ota_profile_t *p_profile, const ota_recv_stats_t *p_recv_stats,
+                              uint64_t start_usec, uint64_t write_usec, uint64_t erase_usec, uint32_t heap_drop )
+{
+  p_profile->bytes         = p_recv_stats->bytes;
+  p_profile->total_ms      = ( system_uptime_usec() - start_usec ) / 1000;
+  p_profile->recv_ms       = p_recv_stats->recv_usec / 1000;
+  p_profile->write_ms      = write_usec / 1000;
+  p_profile->erase_ms      = erase_usec / 1000;
+  p_profile->recv_calls    = p_recv_stats->recv_calls;
+  p_profile->recv_timeouts = MIN( p_recv_stats->recv_timeouts, UINT16_MAX );
+  p_profile->heap_drop     = heap_drop;
+  ota_history_add( p_profile );
+
+  metrics_add( METRIC_OTA_UPLOADS, 1 );
+  metrics_add( METRIC_OTA_BYTES, p_profile->bytes );
+  metrics_observe( METRIC_OTA_DURATION, p_profile->total_ms );
+  if ( p_profile->failed_stage != OTA_STAGE_NONE )
+  {
+    metrics_add( METRIC_OTA_FAILURES, 1 );
+  }
+
+  char *json = _request_alloc( req, 512 );
+  httpd_resp_set_type( req, "application/json" );
+  httpd_resp_send( req, json, json ? ota_profile_get_json( p_profile, json, 512 ) : 0 );
+
+  if ( p_profile->failed_stage != OTA_STAGE_NONE )
+  {
+    return ESP_FAIL;
+  }
+
+  fflush( stdout );
+  wear_persist();
+  nvm_flush();
+
+  vTaskDelay( 2000 / portTICK_RATE_MS);
+  esp_restart();
 
   return ESP_OK;
 }
@@ -171,10 +620,37 @@ static esp_err_t _ota_get_handler( httpd_req_t *req )
 //-----------------------------------------------------------------------------
 static esp_err_t _ota_post_handler( httpd_req_t *req )
 {
-  char buf[256];
-  httpd_resp_set_status( req, HTTPD_500 );    // Assume failure
+  if ( _ota_is_dry_run( req ) )
+  {
+    return _ota_dry_run( req );
+  }
+
+#if CONFIG_FLASH_BENCHMARK
+  // The benchmark is erasing and writing the slot this would go to
+  if ( flash_bench_running() )
+  {
+    _set_status( req, "409 Conflict" );
+    httpd_resp_send( req, NULL, 0 );
+    return ESP_OK;
+  }
+#endif
+
+  char *buf = _request_alloc( req, OTA_RECV_BUFFER_SIZE );
+  if ( !buf )
+  {
+    return _send_no_memory( req );
+  }
+  _set_status( req, HTTPD_500 );    // Assume failure
   
   int ret, remaining = req->content_len;
+  ota_recv_stats_t recv_stats = { .recv_min_bytes = UINT32_MAX };
+  ota_profile_t    profile    = { .failed_stage = OTA_STAGE_BEGIN };
+  uint64_t         start_usec = system_uptime_usec();
+  uint64_t         write_usec = 0;
+  uint64_t         erase_usec = 0;
+  uint32_t         heap_start = esp_get_free_heap_size();
+  uint32_t         heap_min   = heap_start;
+  uint32_t         heap_floor = esp_get_minimum_free_heap_size();
   print( "Receiving\n" );
   
   esp_ota_handle_t update_handle = 0 ;
@@ -187,10 +663,15 @@ static esp_err_t _ota_post_handler( httpd_req_t *req )
     goto return_failure;
   }
 
+  wear_partition_t wear_partition = wear_partition_for( update_partition );
+  uint32_t         bytes_written  = 0;
+
   print( "Writing partition: type %d, subtype %d, offset 0x%08x\n", update_partition-> type, update_partition->subtype, update_partition->address);
   print( "Running partition: type %d, subtype %d, offset 0x%08x\n", running->type,           running->subtype,          running->address);
   esp_err_t err = ESP_OK;
+  TRACE_BEGIN( "ota begin" );
   err = esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle);
+  TRACE_END( "ota begin" );
   if (err != ESP_OK)
   {
       print( "esp_ota_begin failed (%s)", esp_err_to_name(err));
@@ -199,43 +680,73 @@ static esp_err_t _ota_post_handler( httpd_req_t *req )
   while ( remaining > 0 )
   {
     // Read the data for the request
-    if ( ( ret = httpd_req_recv( req, buf, MIN( remaining, sizeof( buf ) ) ) ) <= 0 )
+    profile.failed_stage = OTA_STAGE_RECV;
+    TRACE_BEGIN( "ota recv" );
+    ret = _ota_recv( req, buf, MIN( remaining, OTA_RECV_BUFFER_SIZE ), &recv_stats );
+    TRACE_END( "ota recv" );
+    if ( ret <= 0 )
     {
-      if ( ret == HTTPD_SOCK_ERR_TIMEOUT )
-      {
-        // Retry receiving if timeout occurred
-        continue;
-      }
-
       goto return_failure;
     }
     
     size_t bytes_read = ret;
+    profile.chunk_hist[ota_chunk_bucket( bytes_read, OTA_RECV_BUFFER_SIZE )]++;
+    heap_min = MIN( heap_min, esp_get_free_heap_size() );
     
     remaining -= bytes_read;
+    profile.failed_stage = OTA_STAGE_WRITE;
+    uint64_t write_start_usec = system_uptime_usec();
+    TRACE_BEGIN( "ota write" );
     err = esp_ota_write( update_handle, buf, bytes_read);
+    TRACE_END( "ota write" );
+    heap_min = MIN( heap_min, esp_get_free_heap_size() );
     if (err != ESP_OK)
     {
       goto return_failure;
     }
+
+    // Sequential mode erases each sector just before the first write into it
+    uint32_t sectors_before = ( bytes_written + SPI_FLASH_SEC_SIZE - 1 ) / SPI_FLASH_SEC_SIZE;
+    bytes_written += bytes_read;
+    uint32_t sectors_erased = ( ( bytes_written + SPI_FLASH_SEC_SIZE - 1 ) / SPI_FLASH_SEC_SIZE ) - sectors_before;
+    *( sectors_erased ? &erase_usec : &write_usec ) += system_uptime_usec() - write_start_usec;
+    wear_record_write( wear_partition, bytes_read );
+    wear_record_erase( wear_partition, sectors_erased );
   }
 
-  print( "Receiving done\n" );
+  print( "Receiving done, %u ms waiting on the network over %u reads, %u timeouts\n",
+    (uint32_t)( recv_stats.recv_usec / 1000 ), recv_stats.recv_calls, recv_stats.recv_timeouts );
 
   // End response
-  if ( ( esp_ota_end(update_handle)                   == ESP_OK ) && 
-       ( esp_ota_set_boot_partition(update_partition) == ESP_OK ) )
+  profile.failed_stage = OTA_STAGE_END;
+  uint64_t end_start_usec = system_uptime_usec();
+  TRACE_BEGIN( "ota end" );
+  err = esp_ota_end( update_handle );
+  TRACE_END( "ota end" );
+  heap_min = MIN( heap_min, esp_get_free_heap_size() );
+  update_handle = 0;          // Freed by esp_ota_end() whether it passed or not
+  profile.end_ms = ( system_uptime_usec() - end_start_usec ) / 1000;
+
+  if ( err == ESP_OK )
   {
-    print( "OTA Success?!\n Rebooting\n" );
-    fflush( stdout );
+    profile.failed_stage = OTA_STAGE_SET_BOOT;
+    uint64_t set_boot_start_usec = system_uptime_usec();
+    TRACE_BEGIN( "ota set_boot" );
+    err = esp_ota_set_boot_partition( update_partition );
+    TRACE_END( "ota set_boot" );
+    heap_min = MIN( heap_min, esp_get_free_heap_size() );
+    profile.set_boot_ms = ( system_uptime_usec() - set_boot_start_usec ) / 1000;
+  }
 
-    httpd_resp_set_status( req, HTTPD_200 );
-    httpd_resp_send( req, NULL, 0 );
-    
-    vTaskDelay( 2000 / portTICK_RATE_MS);
-    esp_restart();
-    
-    return ESP_OK;
+  if ( err == ESP_OK )
+  {
+    profile.failed_stage = OTA_STAGE_NONE;
+    wear_record_commit( wear_partition );
+    _record_otadata_write();
+
+    print( "OTA Success?!\n Rebooting\n" );
+    _set_status( req, HTTPD_200 );
+    return _ota_finish( req, &profile, &recv_stats, start_usec, write_usec, erase_usec, _ota_heap_drop( heap_start, heap_min, heap_floor ) );
   }
   print( "OTA End failed (%s)!\n", esp_err_to_name(err));
 
@@ -245,8 +756,8 @@ return_failure:
     esp_ota_abort(update_handle);
   }
 
-  httpd_resp_set_status( req, HTTPD_500 );    // Assume failure
-  httpd_resp_send( req, NULL, 0 );
+  _set_status( req, HTTPD_500 );    // Assume failure
+  _ota_finish( req, &profile, &recv_stats, start_usec, write_usec, erase_usec, _ota_heap_drop( heap_start, heap_min, heap_floor ) );
   return ESP_FAIL;
 }
 
@@ -285,8 +796,10 @@ static esp_err_t _reset_post_handler( httpd_req_t *req )
 {
   print( "Rebooting\n" );
   fflush( stdout );
+  wear_persist();
+  nvm_flush();
 
-  httpd_resp_set_status( req, HTTPD_200 );
+  _set_status( req, HTTPD_200 );
   httpd_resp_send( req, NULL, 0 );
   
   vTaskDelay( 2000 / portTICK_RATE_MS);
@@ -298,31 +811,433 @@ static esp_err_t _reset_post_handler( httpd_req_t *req )
 //-----------------------------------------------------------------------------
 static esp_err_t _reset_get_handler( httpd_req_t *req )
 {
-  basic_auth_info_t *basic_auth_info = req->user_ctx;
+  if ( !_request_authenticated( req ) )
+  {
+    return _send_auth_required( req );
+  }
+
+  _set_status( req, HTTPD_200 );
+  httpd_resp_set_hdr( req, "Connection", "keep-alive" );
+  httpd_resp_send( req, reset_html_file, strlen( reset_html_file ) );
+  return ESP_OK;
+}
 
-  size_t buf_len = httpd_req_get_hdr_value_len( req, "Authorization" ) + 1;
-  if ( ( buf_len > 1 ) && ( buf_len <= sizeof( auth_buffer ) ) )
+//-----------------------------------------------------------------------------
+// Selecting a boot image or confirming one rewrites a single otadata sector
+static void _record_otadata_write( void )
+{
+  wear_record_erase( WEAR_PARTITION_OTADATA, 1 );
+  wear_record_write( WEAR_PARTITION_OTADATA, 32 );    // sizeof( esp_ota_select_entry_t )
+  wear_record_commit( WEAR_PARTITION_OTADATA );
+}
+
+//-----------------------------------------------------------------------------
+static esp_err_t _wear_get_handler( httpd_req_t *req )
+{
+  _set_status( req, HTTPD_200 );
+  httpd_resp_set_type( req, "application/json" );
+  httpd_resp_set_hdr( req, "Connection", "keep-alive" );
+  wear_write_json( _send_chunk, req );
+  httpd_resp_send_chunk( req, NULL, 0 );
+  return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+static esp_err_t _boot_get_handler( httpd_req_t *req )
+{
+  char *timeline = _request_alloc( req, 768 );
+  if ( !timeline )
   {
-    if ( httpd_req_get_hdr_value_str( req, "Authorization", auth_buffer, buf_len ) == ESP_OK )
+    return _send_no_memory( req );
+  }
+  uint16_t len = startup_get_timeline( timeline, 768, "\n" );
+
+  _set_status( req, HTTPD_200 );
+  httpd_resp_set_type( req, "text/plain" );
+  httpd_resp_set_hdr( req, "Connection", "keep-alive" );
+  httpd_resp_send( req, timeline, len );
+  return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+// Profiles of the last OTA_HISTORY_DEPTH uploads, oldest first.  Kept in NVM, so they span firmware versions
+static esp_err_t _ota_history_get_handler( httpd_req_t *req )
+{
+  char *json = _request_alloc( req, OTA_HISTORY_DEPTH * 384 );
+  if ( !json )
+  {
+    return _send_no_memory( req );
+  }
+  uint16_t len = ota_history_get_json( json, OTA_HISTORY_DEPTH * 384 );
+
+  _set_status( req, HTTPD_200 );
+  httpd_resp_set_type( req, "application/json" );
+  httpd_resp_set_hdr( req, "Connection", "keep-alive" );
+  httpd_resp_send( req, json, len );
+  return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+// Results of the current or last throughput test
+static esp_err_t _netperf_get_handler( httpd_req_t *req )
+{
+  char *json = _request_alloc( req, NETPERF_JSON_SIZE );
+  if ( !json )
+  {
+    return _send_no_memory( req );
+  }
+  uint16_t len = netperf_get_json( json, NETPERF_JSON_SIZE );
+
+  _set_status( req, HTTPD_200 );
+  httpd_resp_set_type( req, "application/json" );
+  httpd_resp_set_hdr( req, "Connection", "keep-alive" );
+  httpd_resp_send( req, json, len );
+  return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+// POST /netperf?proto=tcp|udp&dir=rx|tx&duration=<s>, direction as seen from the device.  Starts
+// listening for tools/netperf.py and answers straight away, the results come from GET /netperf
+static esp_err_t _netperf_post_handler( httpd_req_t *req )
+{
+  if ( !_request_authenticated( req ) )
+  {
+    return _send_auth_required( req );
+  }
+
+  netperf_params_t params = { .proto = NETPERF_PROTO_TCP, .dir = NETPERF_DIR_RX, .duration_s = 10 };
+  char query[64];
+  char value[8];
+  if ( httpd_req_get_url_query_str( req, query, sizeof( query ) ) == ESP_OK )
+  {
+    if ( httpd_query_key_value( query, "proto", value, sizeof( value ) ) == ESP_OK )
     {
-      char *auth_credentials = _http_auth_basic( basic_auth_info->username, basic_auth_info->password );
-      if ( !strncmp( auth_credentials, auth_buffer, buf_len ) )
-      {
-        print( "Authenticated!\n" );
-        httpd_resp_set_status( req, HTTPD_200 );
-        httpd_resp_set_hdr( req, "Connection", "keep-alive" );
-        httpd_resp_send( req, reset_html_file, strlen( reset_html_file ) );
-        return ESP_OK;
-      }
+      params.proto = strcmp( value, "udp" ) ? NETPERF_PROTO_TCP : NETPERF_PROTO_UDP;
+    }
+    if ( httpd_query_key_value( query, "dir", value, sizeof( value ) ) == ESP_OK )
+    {
+      params.dir = strcmp( value, "tx" ) ? NETPERF_DIR_RX : NETPERF_DIR_TX;
+    }
+    if ( httpd_query_key_value( query, "duration", value, sizeof( value ) ) == ESP_OK )
+    {
+      params.duration_s = CLAMP( atoi( value ), 1, NETPERF_MAX_DURATION_S );
     }
   }
 
-  print( "Not authenticated\n" );
-  httpd_resp_set_status( req, HTTPD_401 );
+  if ( !netperf_start( &params ) )
+  {
+    _set_status( req, "409 Conflict" );
+    httpd_resp_send( req, NULL, 0 );
+    return ESP_OK;
+  }
+
+  return _netperf_get_handler( req );
+}
+
+//-----------------------------------------------------------------------------
+// State of the current or last flash benchmark, with its report once it's done
+static esp_err_t _flashbench_get_handler( httpd_req_t *req )
+{
+#if CONFIG_FLASH_BENCHMARK
+  char *json = _request_alloc( req, FLASH_BENCH_JSON_SIZE );
+  if ( !json )
+  {
+    return _send_no_memory( req );
+  }
+  uint16_t len = flash_bench_get_json( json, FLASH_BENCH_JSON_SIZE );
+
+  _set_status( req, HTTPD_200 );
+  httpd_resp_set_type( req, "application/json" );
   httpd_resp_set_hdr( req, "Connection", "keep-alive" );
-  httpd_resp_set_hdr( req, "WWW-Authenticate", "Basic realm=\"Hello\"" );
+  httpd_resp_send( req, json, len );
+#else
+  _set_status( req, "501 Not Implemented" );
+  httpd_resp_send( req, NULL, 0 );
+#endif
+  return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+// Starts the benchmark and answers straight away, the report comes from GET /flashbench
+static esp_err_t _flashbench_post_handler( httpd_req_t *req )
+{
+  if ( !_request_authenticated( req ) )
+  {
+    return _send_auth_required( req );
+  }
+
+#if CONFIG_FLASH_BENCHMARK
+  if ( !flash_bench_start() )
+  {
+    _set_status( req, "409 Conflict" );
+    httpd_resp_send( req, NULL, 0 );
+    return ESP_OK;
+  }
+#endif
+  return _flashbench_get_handler( req );
+}
+
+//-----------------------------------------------------------------------------
+// For the modules that stream a response, p_ctx is the request
+static void _send_chunk( void *p_ctx, const char *p_text, size_t len )
+{
+  httpd_resp_send_chunk( p_ctx, p_text, len );
+}
+
+//-----------------------------------------------------------------------------
+// Streamed a family at a time from the registry's own buffer, a scrape allocates nothing
+static esp_err_t _metrics_get_handler( httpd_req_t *req )
+{
+  _set_status( req, HTTPD_200 );
+  httpd_resp_set_type( req, "text/plain; version=0.0.4" );
+  httpd_resp_set_hdr( req, "Connection", "keep-alive" );
+  metrics_render( _send_chunk, req );
+  httpd_resp_send_chunk( req, NULL, 0 );
+
+  return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+// ?tier=seconds|minutes, ?format=json|bin.  Streamed straight out of the rings
+static esp_err_t _timeseries_get_handler( httpd_req_t *req )
+{
+  timeseries_tier_t tier   = TIMESERIES_SECONDS;
+  bool              binary = false;
+  char query[48];
+  char value[8];
+  if ( httpd_req_get_url_query_str( req, query, sizeof( query ) ) == ESP_OK )
+  {
+    if ( httpd_query_key_value( query, "tier", value, sizeof( value ) ) == ESP_OK )
+    {
+      tier = strcmp( value, "minutes" ) ? TIMESERIES_SECONDS : TIMESERIES_MINUTES;
+    }
+    if ( httpd_query_key_value( query, "format", value, sizeof( value ) ) == ESP_OK )
+    {
+      binary = !strcmp( value, "bin" );
+    }
+  }
+
+  _set_status( req, HTTPD_200 );
+  httpd_resp_set_hdr( req, "Connection", "keep-alive" );
+  if ( binary )
+  {
+    httpd_resp_set_type( req, "application/octet-stream" );
+    httpd_resp_set_hdr( req, "Content-Disposition", "attachment; filename=\"timeseries.bin\"" );
+    timeseries_write_binary( tier, _send_chunk, req );
+  }
+  else
+  {
+    httpd_resp_set_type( req, "application/json" );
+    timeseries_write_json( tier, _send_chunk, req );
+  }
+  httpd_resp_send_chunk( req, NULL, 0 );
+
+  return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+// CPU figures cover the time since the previous GET, so poll it at the interval of interest
+static esp_err_t _tasks_get_handler( httpd_req_t *req )
+{
+  char *json = _request_alloc( req, 4096 );
+  if ( !json )
+  {
+    return _send_no_memory( req );
+  }
+  uint16_t len = task_monitor_get_json( json, 4096 );
+
+  _set_status( req, HTTPD_200 );
+  httpd_resp_set_type( req, "application/json" );
+  httpd_resp_set_hdr( req, "Connection", "keep-alive" );
+  httpd_resp_send( req, json, len );
+
+  return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+// The samples from the last run, as text for tools/profile_fold.py
+static esp_err_t _profiler_get_handler( httpd_req_t *req )
+{
+#if CONFIG_PROFILER
+  if ( profiler_is_running() )
+  {
+    _set_status( req, "409 Conflict" );
+    httpd_resp_send( req, "Stop the profiler first\n", HTTPD_RESP_USE_STRLEN );
+    return ESP_OK;
+  }
+
+  _set_status( req, HTTPD_200 );
+  httpd_resp_set_type( req, "text/plain" );
+  httpd_resp_set_hdr( req, "Connection", "keep-alive" );
+  profiler_write_samples( _send_chunk, req );
+  httpd_resp_send_chunk( req, NULL, 0 );
+#else
+  _set_status( req, "501 Not Implemented" );
+  httpd_resp_send( req, NULL, 0 );
+#endif
+  return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+// ?action=start&hz=N or ?action=stop
+static esp_err_t _profiler_post_handler( httpd_req_t *req )
+{
+  if ( !_request_authenticated( req ) )
+  {
+    return _send_auth_required( req );
+  }
+
+#if CONFIG_PROFILER
+  uint16_t hz    = 100;
+  bool     start = false;
+  char query[48];
+  char value[8];
+  if ( httpd_req_get_url_query_str( req, query, sizeof( query ) ) == ESP_OK )
+  {
+    if ( httpd_query_key_value( query, "action", value, sizeof( value ) ) == ESP_OK )
+    {
+      start = !strcmp( value, "start" );
+    }
+    if ( httpd_query_key_value( query, "hz", value, sizeof( value ) ) == ESP_OK )
+    {
+      hz = CLAMP( atoi( value ), PROFILER_MIN_HZ, PROFILER_MAX_HZ );
+    }
+  }
+
+  if ( !start )
+  {
+    profiler_stop();
+  }
+  else if ( !profiler_start( hz ) )
+  {
+    _set_status( req, "409 Conflict" );
+    httpd_resp_send( req, NULL, 0 );
+    return ESP_OK;
+  }
+
+  _set_status( req, HTTPD_200 );
+  httpd_resp_set_hdr( req, "Connection", "keep-alive" );
+  httpd_resp_send( req, NULL, 0 );
+#else
+  _set_status( req, "501 Not Implemented" );
+  httpd_resp_send( req, NULL, 0 );
+#endif
+  return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+static esp_err_t _trace_get_handler( httpd_req_t *req )
+{
+#if CONFIG_TRACE_RECORDER
+  _set_status( req, HTTPD_200 );
+  httpd_resp_set_type( req, "application/json" );
+  httpd_resp_set_hdr( req, "Connection", "keep-alive" );
+  trace_write_json( _send_chunk, req );
+  httpd_resp_send_chunk( req, NULL, 0 );
+#else
+  _set_status( req, "501 Not Implemented" );
+  httpd_resp_send( req, NULL, 0 );
+#endif
+  return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+// ?action=start clears the trace and records from now, ?action=stop freezes it
+static esp_err_t _trace_post_handler( httpd_req_t *req )
+{
+  if ( !_request_authenticated( req ) )
+  {
+    return _send_auth_required( req );
+  }
+
+#if CONFIG_TRACE_RECORDER
+  char query[32];
+  char value[8];
+  if ( ( httpd_req_get_url_query_str( req, query, sizeof( query ) ) != ESP_OK ) ||
+       ( httpd_query_key_value( query, "action", value, sizeof( value ) ) != ESP_OK ) )
+  {
+    _set_status( req, HTTPD_400 );
+    httpd_resp_send( req, NULL, 0 );
+    return ESP_OK;
+  }
+
+  if ( !strcmp( value, "start" ) )
+  {
+    trace_start();
+  }
+  else
+  {
+    trace_stop();
+  }
+
+  _set_status( req, HTTPD_200 );
+  httpd_resp_set_hdr( req, "Connection", "keep-alive" );
+  httpd_resp_send( req, NULL, 0 );
+#else
+  _set_status( req, "501 Not Implemented" );
+  httpd_resp_send( req, NULL, 0 );
+#endif
+  return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+static esp_err_t _alloctrace_get_handler( httpd_req_t *req )
+{
+#if CONFIG_ALLOC_TRACE
+  _set_status( req, HTTPD_200 );
+  httpd_resp_set_type( req, "text/plain" );
+  httpd_resp_set_hdr( req, "Connection", "keep-alive" );
+  alloc_trace_write_report( _send_chunk, req );
+  httpd_resp_send_chunk( req, NULL, 0 );
+#else
+  _set_status( req, "501 Not Implemented" );
   httpd_resp_send( req, NULL, 0 );
+#endif
+  return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+// ?action=start, ?action=stop or ?action=mark, which answers with the mark's number
+static esp_err_t _alloctrace_post_handler( httpd_req_t *req )
+{
+  if ( !_request_authenticated( req ) )
+  {
+    return _send_auth_required( req );
+  }
 
+#if CONFIG_ALLOC_TRACE
+  char query[32];
+  char value[8];
+  if ( ( httpd_req_get_url_query_str( req, query, sizeof( query ) ) != ESP_OK ) ||
+       ( httpd_query_key_value( query, "action", value, sizeof( value ) ) != ESP_OK ) )
+  {
+    _set_status( req, HTTPD_400 );
+    httpd_resp_send( req, NULL, 0 );
+    return ESP_OK;
+  }
+
+  char resp[16] = "";
+  if ( !strcmp( value, "start" ) )
+  {
+    alloc_trace_start();
+  }
+  else if ( !strcmp( value, "mark" ) )
+  {
+    snprintf( resp, sizeof( resp ), "mark %u\n", alloc_trace_mark() );
+  }
+  else
+  {
+    alloc_trace_stop();
+  }
+
+  _set_status( req, HTTPD_200 );
+  httpd_resp_set_type( req, "text/plain" );
+  httpd_resp_set_hdr( req, "Connection", "keep-alive" );
+  httpd_resp_send( req, resp, HTTPD_RESP_USE_STRLEN );
+#else
+  _set_status( req, "501 Not Implemented" );
+  httpd_resp_send( req, NULL, 0 );
+#endif
   return ESP_OK;
 }
 
@@ -331,12 +1246,15 @@ void http_start_webserver( httpd_handle_t *p_server )
 {
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
   config.lru_purge_enable = true;
+  config.max_uri_handlers = HTTP_MAX_URI_HANDLERS;
 
   // Start the httpd server
   print( "Starting server on port %d\n", config.server_port );
 
   if ( httpd_start( p_server, &config ) == ESP_OK )
   {
+    s_route_cnt = 0;
+
     static const httpd_uri_t root_post =
     {
       .uri       = "/",
@@ -344,7 +1262,7 @@ void http_start_webserver( httpd_handle_t *p_server )
       .handler   = _root_post_handler,
       .user_ctx  = NULL
     };
-    httpd_register_uri_handler( *p_server, &root_post );
+    _register_uri_handler( *p_server, &root_post );
     
     static httpd_uri_t root_get =
     {
@@ -353,7 +1271,7 @@ void http_start_webserver( httpd_handle_t *p_server )
       .handler   = _root_get_handler,
       .user_ctx  = &auth_info,
     };
-    httpd_register_uri_handler( *p_server, &root_get );
+    _register_uri_handler( *p_server, &root_get );
     
     static const httpd_uri_t ota_post =
     {
@@ -362,7 +1280,7 @@ void http_start_webserver( httpd_handle_t *p_server )
       .handler   = _ota_post_handler,
       .user_ctx  = NULL
     };
-    httpd_register_uri_handler( *p_server, &ota_post );
+    _register_uri_handler( *p_server, &ota_post );
     
     static httpd_uri_t ota_get =
     {
@@ -371,7 +1289,16 @@ void http_start_webserver( httpd_handle_t *p_server )
       .handler   = _ota_get_handler,
       .user_ctx  = &auth_info,
     };
-    httpd_register_uri_handler( *p_server, &ota_get );
+    _register_uri_handler( *p_server, &ota_get );
+
+    static const httpd_uri_t ota_history_get =
+    {
+      .uri       = "/ota/history",
+      .method    = HTTP_GET,
+      .handler   = _ota_history_get_handler,
+      .user_ctx  = NULL,
+    };
+    _register_uri_handler( *p_server, &ota_history_get );
     
     static httpd_uri_t reset_post =
     {
@@ -380,7 +1307,7 @@ void http_start_webserver( httpd_handle_t *p_server )
       .handler   = _reset_post_handler,
       .user_ctx  = NULL,
     };
-    httpd_register_uri_handler( *p_server, &reset_post );
+    _register_uri_handler( *p_server, &reset_post );
     
     static httpd_uri_t reset_get =
     {
@@ -389,7 +1316,142 @@ void http_start_webserver( httpd_handle_t *p_server )
       .handler   = _reset_get_handler,
       .user_ctx  = &auth_info,
     };
-    httpd_register_uri_handler( *p_server, &reset_get );
+    _register_uri_handler( *p_server, &reset_get );
+
+    static const httpd_uri_t wear_get =
+    {
+      .uri       = "/wear",
+      .method    = HTTP_GET,
+      .handler   = _wear_get_handler,
+      .user_ctx  = NULL,
+    };
+    _register_uri_handler( *p_server, &wear_get );
+
+    static const httpd_uri_t boot_get =
+    {
+      .uri       = "/boot",
+      .method    = HTTP_GET,
+      .handler   = _boot_get_handler,
+      .user_ctx  = NULL,
+    };
+    _register_uri_handler( *p_server, &boot_get );
+
+    static const httpd_uri_t netperf_get =
+    {
+      .uri       = "/netperf",
+      .method    = HTTP_GET,
+      .handler   = _netperf_get_handler,
+      .user_ctx  = NULL,
+    };
+    _register_uri_handler( *p_server, &netperf_get );
+
+    static httpd_uri_t netperf_post =
+    {
+      .uri       = "/netperf",
+      .method    = HTTP_POST,
+      .handler   = _netperf_post_handler,
+      .user_ctx  = &auth_info,
+    };
+    _register_uri_handler( *p_server, &netperf_post );
+
+    static const httpd_uri_t flashbench_get =
+    {
+      .uri       = "/flashbench",
+      .method    = HTTP_GET,
+      .handler   = _flashbench_get_handler,
+      .user_ctx  = NULL,
+    };
+    _register_uri_handler( *p_server, &flashbench_get );
+
+    static httpd_uri_t flashbench_post =
+    {
+      .uri       = "/flashbench",
+      .method    = HTTP_POST,
+      .handler   = _flashbench_post_handler,
+      .user_ctx  = &auth_info,
+    };
+    _register_uri_handler( *p_server, &flashbench_post );
+
+    static const httpd_uri_t metrics_get =
+    {
+      .uri       = "/metrics",
+      .method    = HTTP_GET,
+      .handler   = _metrics_get_handler,
+      .user_ctx  = NULL,
+    };
+    _register_uri_handler( *p_server, &metrics_get );
+
+    static const httpd_uri_t timeseries_get =
+    {
+      .uri       = "/timeseries",
+      .method    = HTTP_GET,
+      .handler   = _timeseries_get_handler,
+      .user_ctx  = NULL,
+    };
+    _register_uri_handler( *p_server, &timeseries_get );
+
+    static const httpd_uri_t tasks_get =
+    {
+      .uri       = "/tasks",
+      .method    = HTTP_GET,
+      .handler   = _tasks_get_handler,
+      .user_ctx  = NULL,
+    };
+    _register_uri_handler( *p_server, &tasks_get );
+
+    static const httpd_uri_t profiler_get =
+    {
+      .uri       = "/profiler",
+      .method    = HTTP_GET,
+      .handler   = _profiler_get_handler,
+      .user_ctx  = NULL,
+    };
+    _register_uri_handler( *p_server, &profiler_get );
+
+    static httpd_uri_t profiler_post =
+    {
+      .uri       = "/profiler",
+      .method    = HTTP_POST,
+      .handler   = _profiler_post_handler,
+      .user_ctx  = &auth_info,
+    };
+    _register_uri_handler( *p_server, &profiler_post );
+
+    static const httpd_uri_t trace_get =
+    {
+      .uri       = "/trace",
+      .method    = HTTP_GET,
+      .handler   = _trace_get_handler,
+      .user_ctx  = NULL,
+    };
+    _register_uri_handler( *p_server, &trace_get );
+
+    static httpd_uri_t trace_post =
+    {
+      .uri       = "/trace",
+      .method    = HTTP_POST,
+      .handler   = _trace_post_handler,
+      .user_ctx  = &auth_info,
+    };
+    _register_uri_handler( *p_server, &trace_post );
+
+    static const httpd_uri_t alloctrace_get =
+    {
+      .uri       = "/alloctrace",
+      .method    = HTTP_GET,
+      .handler   = _alloctrace_get_handler,
+      .user_ctx  = NULL,
+    };
+    _register_uri_handler( *p_server, &alloctrace_get );
+
+    static httpd_uri_t alloctrace_post =
+    {
+      .uri       = "/alloctrace",
+      .method    = HTTP_POST,
+      .handler   = _alloctrace_post_handler,
+      .user_ctx  = &auth_info,
+    };
+    _register_uri_handler( *p_server, &alloctrace_post );
   }
 }
 
@@ -411,6 +1473,7 @@ void http_init( void )
     {
       // Validate image some how, then call:
       esp_ota_mark_app_valid_cancel_rollback();
+      _record_otadata_write();
       // If needed: esp_ota_mark_app_invalid_rollback_and_reboot();
     }
   }
@@ -1,5 +1,6 @@
 #include <esp_wifi.h>
 #include <esp_event.h>
+#include <esp_netif.h>
 #include <esp_log.h>
 #include <esp_system.h>
 #include <nvs_flash.h>
@@ -22,58 +23,84 @@
 #include "main.h"
 #include "nvm.h"
 #include "wifi.h"
+#include "ethernet.h"
 #include "debug.h"
 #include "utils.h"
 #include "application.h"
 #include "hardware.h"
+#include "wear.h"
+#include "timer_wheel.h"
+#include "startup.h"
+#include "timeseries.h"
+
+#define BUTTON_SCAN_PERIOD_MS         ( 50 )
+#define BUTTON_LONG_PRESS_MS          ( 10 * 1000 )
+
+static timer_handle_t s_long_press_timer = -1;
+
+// Only real dependencies go in here, everything else comes up side by side.  Wi-Fi needs NVS up
+// before esp_wifi_init() and its AP cache loaded, and waits for wear itself before touching otadata
+static const startup_stage_desc_t s_startup_stages[] =
+{
+  { STARTUP_TIMERS,       timer_wheel_init,   0,                                                                    false },
+  { STARTUP_DEBUG,        debug_init,         0,                                                                    false },
+  { STARTUP_HARDWARE,     hardware_init,      0,                                                                    false },
+  { STARTUP_NVM,          nvm_init,           STARTUP_BIT( STARTUP_DEBUG ),                                         true  },
+  { STARTUP_WEAR,         wear_init,          STARTUP_BIT( STARTUP_NVM ),                                           false },
+  { STARTUP_WIFI,         wifi_task_init,     STARTUP_BIT( STARTUP_NVM ) | STARTUP_BIT( STARTUP_TIMERS ),           true  },
+#if CONFIG_ETHERNET_ENABLED
+  { STARTUP_ETHERNET,     ethernet_init,      0,                                                                    false },
+#endif
+  { STARTUP_TIMESERIES,   timeseries_init,    STARTUP_BIT( STARTUP_TIMERS ),                                        false },
+  { STARTUP_APPLICATION,  application_init,   STARTUP_BIT( STARTUP_TIMERS ) | STARTUP_BIT( STARTUP_NVM ) |
+                                              STARTUP_BIT( STARTUP_HARDWARE ),                                      false },
+};
+
+//-----------------------------------------------------------------------------
+static void _button_long_press_cb( void *p_arg )
+{
+  print("Resetting provisioning\n");
+  wifi_reset_provisioning();
+}
+
+//-----------------------------------------------------------------------------
+static void _button_scan_cb( void *p_arg )
+{
+  static bool button_was_pressed = false;
+
+  bool button_pressed = hardware_user_button_pressed();
+  if ( button_pressed == button_was_pressed )
+  {
+    return;
+  }
+
+  button_was_pressed = button_pressed;
+  if ( button_pressed )
+  {
+    print("Button pressed!\n");
+    timer_wheel_start( s_long_press_timer, BUTTON_LONG_PRESS_MS );
+    application_handle_user_button_press();
+  }
+  else
+  {
+    print("Button released!\n");
+    timer_wheel_stop( s_long_press_timer );
+  }
+}
 
 //-----------------------------------------------------------------------------
 void app_main( void )
 { 
   printf( "****************************\n" ); 
   esp_event_loop_create_default();
+  esp_netif_init();       // Before Wi-Fi and Ethernet start side by side, it isn't safe to race
   
   setenv("TZ", "PST8PDT,M3.2.0,M11.1.0", 1);
   tzset();
  
-  debug_init();
-  nvm_init();
-  wifi_task_init();
-  hardware_init();
-  application_init();
-  
-  const uint32_t task_delay_ms = 100;
+  startup_run( s_startup_stages, ARRAY_SIZE( s_startup_stages ) );
 
-  while(1)
-  {
-    static float button_down_time_s = 0;
-    delay_ms( task_delay_ms );
-    
-    bool button_pressed = hardware_user_button_pressed();
-    if ( button_pressed )
-    {
-      if ( button_down_time_s == 0 )
-      {
-        print("Button pressed!\n");
-        button_down_time_s = system_uptime_s();
-        application_handle_user_button_press();
-      }
-      else if ( system_uptime_s() > ( button_down_time_s + 10 ) )
-      {
-        print("Resetting provisioning\n");
-        button_down_time_s += ( 60 * 60 );
-        wifi_reset_provisioning();
-      }
-    }
-    else if ( button_down_time_s )
-    {
-      print("Button released!\n");
-      button_down_time_s = 0;
-    }
-  }  
+  // Everything from here on is timer driven, app_main's task isn't needed once it returns
+  s_long_press_timer = timer_wheel_add_oneshot( 0, _button_long_press_cb, NULL );
+  timer_wheel_add_periodic( BUTTON_SCAN_PERIOD_MS, _button_scan_cb, NULL );
 }
-
-
-
-
-
@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <esp_http_server.h>
+#include <esp_system.h>
+#include <freertos/FreeRTOS.h>
+
+#include "utils.h"
+#include "metrics.h"
+
+typedef struct
+{
+  const uint32_t  *p_bounds;
+  uint8_t         bound_cnt;
+  uint32_t        scale;
+  uint32_t        buckets[METRICS_MAX_BUCKETS + 1];   // Not cumulative, that's done when rendering.  Last is +Inf
+  uint64_t        sum;            // Under s_sum_lock, 32 bits of microseconds would wrap in about an hour
+} histogram_t;
+
+typedef struct
+{
+  const char    *p_name;
+  const char    *p_help;
+  const char    *p_type;
+  histogram_t   *p_histogram;       // NULL for counters and gauges
+} metric_desc_t;
+
+struct metrics_http_s
+{
+  const char    *p_uri;
+  int           method;
+  uint32_t      requests[5];        // By status class, 1xx to 5xx
+  histogram_t   latency;
+};
+
+static const uint32_t s_ota_duration_bounds_ms[]   = { 5000, 10000, 20000, 30000, 60000, 120000, 300000 };
+static const uint32_t s_http_latency_bounds_us[]   = { 1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 5000000 };
+
+// Counters and gauges are all one uint32_t each, histograms have their own storage
+static uint32_t s_values[METRIC_CNT];
+
+#define _METRICS_NO_STORAGE( ... )
+#define _METRICS_HISTOGRAM_STORAGE( id, name, help, bounds, divisor )                                             \
+  static histogram_t s_##name = { .p_bounds = bounds, .bound_cnt = ARRAY_SIZE( bounds ), .scale = divisor };       \
+  _Static_assert( ARRAY_SIZE( bounds ) <= METRICS_MAX_BUCKETS, "'" #name "' has too many buckets" );
+
+METRICS_LIST( _METRICS_NO_STORAGE, _METRICS_NO_STORAGE, _METRICS_HISTOGRAM_STORAGE )
+
+#define _METRICS_COUNTER_DESC( id, name, help )         [METRIC_##id] = { #name, help, "counter", NULL },
+#define _METRICS_GAUGE_DESC( id, name, help )           [METRIC_##id] = { #name, help, "gauge",   NULL },
+#define _METRICS_HISTOGRAM_DESC( id, name, help, ... )  [METRIC_##id] = { #name, help, "histogram", &s_##name },
+
+static const metric_desc_t s_metrics[METRIC_CNT] =
+{
+  METRICS_LIST( _METRICS_COUNTER_DESC, _METRICS_GAUGE_DESC, _METRICS_HISTOGRAM_DESC )
+};
+
+static metrics_http_t s_http[METRICS_MAX_HTTP_HANDLERS];
+static uint8_t        s_http_cnt;
+
+static char           s_render_buffer[1536];     // Big enough for one histogram with its labels
+
+static portMUX_TYPE   s_sum_lock = portMUX_INITIALIZER_UNLOCKED;
+
+//-----------------------------------------------------------------------------
+static void _histogram_observe( histogram_t *p_histogram, uint32_t value )
+{
+  uint8_t bucket = 0;
+  while ( ( bucket < p_histogram->bound_cnt ) && ( value > p_histogram->p_bounds[bucket] ) )
+  {
+    bucket++;
+  }
+
+  __atomic_fetch_add( &p_histogram->buckets[bucket], 1, __ATOMIC_RELAXED );
+  portENTER_CRITICAL( &s_sum_lock );
+  p_histogram->sum += value;
+  portEXIT_CRITICAL( &s_sum_lock );
+}
+
+//-----------------------------------------------------------------------------
+void metrics_add( metric_id_t id, uint32_t value )
+{
+  __atomic_fetch_add( &s_values[id], value, __ATOMIC_RELAXED );
+}
+
+//-----------------------------------------------------------------------------
+void metrics_set( metric_id_t id, int32_t value )
+{
+  __atomic_store_n( &s_values[id], (uint32_t)value, __ATOMIC_RELAXED );
+}
+
+//-----------------------------------------------------------------------------
+void metrics_observe( metric_id_t id, uint32_t value )
+{
+  if ( s_metrics[id].p_histogram )
+  {
+    _histogram_observe( s_metrics[id].p_histogram, value );
+  }
+}
+
+//-----------------------------------------------------------------------------
+uint32_t metrics_get( metric_id_t id )
+{
+  return __atomic_load_n( &s_values[id], __ATOMIC_RELAXED );
+}
+
+//-----------------------------------------------------------------------------
+uint32_t metrics_http_requests( void )
+{
+  uint32_t requests = 0;
+  uint8_t  http_cnt = __atomic_load_n( &s_http_cnt, __ATOMIC_ACQUIRE );
+
+  for ( uint8_t i = 0; i < http_cnt; i++ )
+  {
+    for ( uint8_t status_class = 0; status_class < ARRAY_SIZE( s_http[i].requests ); status_class++ )
+    {
+      requests += __atomic_load_n( &s_http[i].requests[status_class], __ATOMIC_RELAXED );
+    }
+  }
+
+  return requests;
+}
+
+//-----------------------------------------------------------------------------
+// Only the task that starts the webserver registers, so there's no racing over a new slot
+metrics_http_t *metrics_http_register( const char *p_uri, int method )
+{
+  for ( uint8_t i = 0; i < s_http_cnt; i++ )
+  {
+    if ( ( s_http[i].method == method ) && !strcmp( s_http[i].p_uri, p_uri ) )
+    {
+      return &s_http[i];
+    }
+  }
+
+  if ( s_http_cnt == ARRAY_SIZE( s_http ) )
+  {
+    return NULL;
+  }
+
+  metrics_http_t *p_http = &s_http[s_http_cnt];
+  p_http->p_uri            = p_uri;
+  p_http->method           = method;
+  p_http->latency.p_bounds  = s_http_latency_bounds_us;
+  p_http->latency.bound_cnt = ARRAY_SIZE( s_http_latency_bounds_us );
+  p_http->latency.scale     = 1000 * 1000;
+  __atomic_store_n( &s_http_cnt, s_http_cnt + 1, __ATOMIC_RELEASE );
+  return p_http;
+}
+
+//-----------------------------------------------------------------------------
+void metrics_http_observe( metrics_http_t *p_http, uint16_t status, uint32_t latency_us )
+{
+  if ( p_http )
+  {
+    uint8_t status_class = CLAMP( status / 100, 1, 5 ) - 1;
+    __atomic_fetch_add( &p_http->requests[status_class], 1, __ATOMIC_RELAXED );
+    _histogram_observe( &p_http->latency, latency_us );
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Values are integers in 1/scale units, e.g. microseconds with a scale of 1000000 for seconds
+static int _format_scaled( char *p_buffer, size_t buffer_size, uint64_t value, uint32_t scale )
+{
+  if ( scale == 1 )
+  {
+    return snprintf( p_buffer, buffer_size, "%llu", (unsigned long long)value );
+  }
+
+  uint8_t digits = 0;
+  for ( uint32_t s = scale; s > 1; s /= 10 )
+  {
+    digits++;
+  }
+  int len = snprintf( p_buffer, buffer_size, "%llu.%0*u", (unsigned long long)( value / scale ), digits, (uint32_t)( value % scale ) );
+
+  // Drop the trailing zeros, and the point too if nothing is left after it
+  while ( ( len > 0 ) && ( (size_t)len < buffer_size ) && ( p_buffer[len - 1] == '0' ) )
+  {
+    p_buffer[--len] = '\0';
+  }
+  if ( ( len > 0 ) && ( (size_t)len < buffer_size ) && ( p_buffer[len - 1] == '.' ) )
+  {
+    p_buffer[--len] = '\0';
+  }
+  return len;
+}
+
+//-----------------------------------------------------------------------------
+// Appends the _bucket, _sum and _count lines, p_labels goes inside the braces ahead of le
+static size_t _render_histogram( char *p_buffer, size_t buffer_size, const char *p_name, const char *p_labels, const histogram_t *p_histogram )
+{
+  size_t   len        = 0;
+  uint32_t cumulative = 0;
+  char     bound[24];
+
+  for ( uint8_t bucket = 0; ( bucket <= p_histogram->bound_cnt ) && ( len < buffer_size ); bucket++ )
+  {
+    cumulative += __atomic_load_n( &p_histogram->buckets[bucket], __ATOMIC_RELAXED );
+    if ( bucket < p_histogram->bound_cnt )
+    {
+      _format_scaled( bound, sizeof( bound ), p_histogram->p_bounds[bucket], p_histogram->scale );
+    }
+    len += snprintf( p_buffer + len, buffer_size - len, "%s_bucket{%s%sle=\"%s\"} %u\n", p_name, p_labels, *p_labels ? "," : "",
+      ( bucket < p_histogram->bound_cnt ) ? bound : "+Inf", cumulative );
+  }
+
+  if ( len < buffer_size )
+  {
+    portENTER_CRITICAL( &s_sum_lock );
+    uint64_t sum = p_histogram->sum;
+    portEXIT_CRITICAL( &s_sum_lock );
+
+    _format_scaled( bound, sizeof( bound ), sum, p_histogram->scale );
+    const char *p_open  = *p_labels ? "{" : "";
+    const char *p_close = *p_labels ? "}" : "";
+    len += snprintf( p_buffer + len, buffer_size - len, "%s_sum%s%s%s %s\n%s_count%s%s%s %u\n",
+      p_name, p_open, p_labels, p_close, bound, p_name, p_open, p_labels, p_close, cumulative );
+  }
+
+  return MIN( len, buffer_size - 1 );
+}
+
+//-----------------------------------------------------------------------------
+static void _render_http( metrics_write_t write, void *p_ctx )
+{
+  static const char * const status_classes[] = { "1xx", "2xx", "3xx", "4xx", "5xx" };
+  char   labels[64];
+  size_t len;
+  uint8_t http_cnt = __atomic_load_n( &s_http_cnt, __ATOMIC_ACQUIRE );
+
+  len = snprintf( s_render_buffer, sizeof( s_render_buffer ),
+    "# HELP esp_http_requests_total Requests served, by handler and status class\n# TYPE esp_http_requests_total counter\n" );
+  write( p_ctx, s_render_buffer, len );
+  for ( uint8_t i = 0; i < http_cnt; i++ )
+  {
+    len = 0;
+    for ( uint8_t status_class = 0; ( status_class < ARRAY_SIZE( status_classes ) ) && ( len < sizeof( s_render_buffer ) ); status_class++ )
+    {
+      len += snprintf( s_render_buffer + len, sizeof( s_render_buffer ) - len, "esp_http_requests_total{uri=\"%s\",method=\"%s\",status=\"%s\"} %u\n",
+        s_http[i].p_uri, http_method_str( s_http[i].method ), status_classes[status_class],
+        __atomic_load_n( &s_http[i].requests[status_class], __ATOMIC_RELAXED ) );
+    }
+    write( p_ctx, s_render_buffer, MIN( len, sizeof( s_render_buffer ) - 1 ) );
+  }
+
+  len = snprintf( s_render_buffer, sizeof( s_render_buffer ),
+    "# HELP esp_http_request_duration_seconds Handler latency\n# TYPE esp_http_request_duration_seconds histogram\n" );
+  write( p_ctx, s_render_buffer, len );
+  for ( uint8_t i = 0; i < http_cnt; i++ )
+  {
+    snprintf( labels, sizeof( labels ), "uri=\"%s\",method=\"%s\"", s_http[i].p_uri, http_method_str( s_http[i].method ) );
+    len = _render_histogram( s_render_buffer, sizeof( s_render_buffer ), "esp_http_request_duration_seconds", labels, &s_http[i].latency );
+    write( p_ctx, s_render_buffer, len );
+  }
+}
+
+//-----------------------------------------------------------------------------
+void metrics_render( metrics_write_t write, void *p_ctx )
+{
+  // Sampled rather than kept up to date, nothing would read them in between
+  metrics_set( METRIC_HEAP_FREE,     esp_get_free_heap_size() );
+  metrics_set( METRIC_HEAP_MIN_FREE, esp_get_minimum_free_heap_size() );
+  metrics_set( METRIC_UPTIME,        system_uptime_s() );
+
+  for ( metric_id_t id = 0; id < METRIC_CNT; id++ )
+  {
+    const metric_desc_t *p_metric = &s_metrics[id];
+    size_t len = snprintf( s_render_buffer, sizeof( s_render_buffer ), "# HELP %s %s\n# TYPE %s %s\n",
+      p_metric->p_name, p_metric->p_help, p_metric->p_name, p_metric->p_type );
+
+    if ( p_metric->p_histogram )
+    {
+      len += _render_histogram( s_render_buffer + len, sizeof( s_render_buffer ) - len, p_metric->p_name, "", p_metric->p_histogram );
+    }
+    else
+    {
+      uint32_t value = __atomic_load_n( &s_values[id], __ATOMIC_RELAXED );
+      bool     gauge = ( p_metric->p_type[0] == 'g' );
+      len += snprintf( s_render_buffer + len, sizeof( s_render_buffer ) - len, gauge ? "%s %d\n" : "%s %u\n", p_metric->p_name, value );
+    }
+
+    write( p_ctx, s_render_buffer, MIN( len, sizeof( s_render_buffer ) - 1 ) );
+  }
+
+  _render_http( write, p_ctx );
+}
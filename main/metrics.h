@@ -0,0 +1,63 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define METRICS_MAX_BUCKETS         ( 10 )      // Finite bounds per histogram, +Inf is implied
+#define METRICS_MAX_HTTP_HANDLERS   ( 24 )
+
+//-----------------------------------------------------------------------------
+// The fixed metrics.  Storage, the metric_id_t enum and the exposition are generated from this.
+//
+//   COUNTER(   ID, name, help )                   Only goes up, metrics_add()
+//   GAUGE(     ID, name, help )                   metrics_set()
+//   HISTOGRAM( ID, name, help, bounds, scale )    metrics_observe(), bounds is a uint32_t array in
+//                                                 the units observed, exposed divided by scale
+#define METRICS_LIST( COUNTER, GAUGE, HISTOGRAM )                                                                          \
+  COUNTER(   OTA_UPLOADS,        esp_ota_uploads_total,          "OTA uploads attempted" )                                 \
+  COUNTER(   OTA_FAILURES,       esp_ota_failures_total,         "OTA uploads that didn't end in a reboot" )               \
+  COUNTER(   OTA_BYTES,          esp_ota_bytes_total,            "Bytes received by OTA uploads" )                         \
+  HISTOGRAM( OTA_DURATION,       esp_ota_duration_seconds,       "OTA upload duration", s_ota_duration_bounds_ms, 1000 )   \
+  COUNTER(   WIFI_CONNECTS,      esp_wifi_connects_total,        "Times the station got an address" )                     \
+  COUNTER(   WIFI_RECONNECTS,    esp_wifi_reconnects_total,      "Reconnect attempts after losing the AP" )                \
+  COUNTER(   DEBUG_DROPPED,      esp_debug_dropped_bytes_total,  "Log bytes overwritten before a drain read them" )        \
+  COUNTER(   NVM_COMMITS,        esp_nvm_commits_total,          "NVS commits" )                                           \
+  GAUGE(     HEAP_FREE,          esp_heap_free_bytes,            "Free heap" )                                             \
+  GAUGE(     HEAP_MIN_FREE,      esp_heap_min_free_bytes,        "Lowest free heap since boot" )                           \
+  GAUGE(     HTTP_ARENA_PEAK,    esp_http_arena_peak_bytes,      "Most request memory one handler has used" )              \
+  GAUGE(     UPTIME,             esp_uptime_seconds,             "Seconds since boot" )
+
+#define _METRICS_ENUM_ENTRY( id, ... )    METRIC_##id,
+
+typedef enum
+{
+  METRICS_LIST( _METRICS_ENUM_ENTRY, _METRICS_ENUM_ENTRY, _METRICS_ENUM_ENTRY )
+  METRIC_CNT
+} metric_id_t;
+
+typedef struct metrics_http_s metrics_http_t;
+
+// Receives the exposition a piece at a time, so a scrape needs no buffer the size of the output
+typedef void (*metrics_write_t)( void *p_ctx, const char *p_text, size_t len );
+
+//-----------------------------------------------------------------------------
+// Safe from any task.  Counters, gauges and histogram buckets are lock-free and wrap at 32 bits,
+// Prometheus treats a counter going backwards as a reset.  A histogram's sum is 64 bits, which
+// the esp32 can't update atomically, so an observation takes a spinlock for just that add
+void metrics_add( metric_id_t id, uint32_t value );
+void metrics_set( metric_id_t id, int32_t value );
+void metrics_observe( metric_id_t id, uint32_t value );
+
+uint32_t metrics_get( metric_id_t id );       // Counters and gauges only
+uint32_t metrics_http_requests( void );       // Across every handler and status
+
+// One slot per URI and method, handing back the same slot when the server is restarted.  NULL
+// once METRICS_MAX_HTTP_HANDLERS are taken
+metrics_http_t *metrics_http_register( const char *p_uri, int method );
+void            metrics_http_observe( metrics_http_t *p_http, uint16_t status, uint32_t latency_us );
+
+// Writes everything out in the Prometheus text exposition format.  One scrape at a time
+void metrics_render( metrics_write_t write, void *p_ctx );
+
+#endif
@@ -11,6 +11,8 @@
 
 #include "utils.h"
 #include "wifi.h"
+#include "mqtt.h"
+#include "timer_wheel.h"
 #include "application.h"
 
 #define MQTT_TOPIC            "reef/template"
@@ -19,15 +21,41 @@
 #define MQTT_REQUEST_TOPIC    MQTT_TOPIC "/request"
 #define MQTT_SERVER_IP        "mqtt.local"
 
+#define STATUS_UPDATE_PERIOD_MS   ( 5 * 1000 )
+#define IP_UPDATE_PERIOD_MS       ( 60 * 1000 )
+
 //-----------------------------------------------------------------------------
 static bool s_mqtt_subscribed = false;
-static bool s_force_mqtt_updates = false;
 static esp_mqtt_client_handle_t s_mqtt_client = NULL;
+static timer_handle_t s_status_timer = -1;
+static timer_handle_t s_ip_timer = -1;
 
 //-----------------------------------------------------------------------------
-void force_mqtt_update()
+// Both run on the timer wheel, so they only enqueue and leave the sending to the mqtt task
+static void _status_timer_cb( void *p_arg )
 {
-  s_force_mqtt_updates = true;
+  esp_mqtt_client_enqueue( s_mqtt_client, MQTT_STATUS_TOPIC, application_get_mqtt_status_msg(), 0, 1, 0, true );
+}
+
+//-----------------------------------------------------------------------------
+static void _ip_timer_cb( void *p_arg )
+{
+  char ip_msg[64];
+  char *p_msg = ip_msg;
+
+  p_msg += sprintf( p_msg, "{ \"ip_addr\":\"%s\",", wifi_get_ip_addr_str() );
+  p_msg += sprintf( p_msg, "\"mdns_name\":\"%s\"", wifi_get_mdns_name_str() );
+  p_msg += sprintf( p_msg, "}" );
+
+  esp_mqtt_client_enqueue( s_mqtt_client, MQTT_IP_TOPIC, ip_msg, 0, 1, 0, true );
+}
+
+//-----------------------------------------------------------------------------
+void mqtt_force_update()
+{
+  // Fire now, the periodic cadence carries on from here
+  timer_wheel_start( s_status_timer, 0 );
+  timer_wheel_start( s_ip_timer, 0 );
 }
 
 //-----------------------------------------------------------------------------
@@ -82,44 +110,8 @@ void mqtt_init()
   s_mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
   esp_mqtt_client_register_event(s_mqtt_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
   esp_mqtt_client_start(s_mqtt_client);
-}
 
-//-----------------------------------------------------------------------------
-// Run on the wifi task
-void mqtt_do_work()
-{
-  static float last_status_update = 0;
-  static float last_ip_update = 0;
-  
-  if ( !s_mqtt_client )
-  {
-    return;
-  }
-  
-  if ( s_force_mqtt_updates )
-  {
-    last_status_update = 0;
-    last_ip_update     = 0;
-    s_force_mqtt_updates = false;
-  }
-  
-  uint32_t status_update_rate_s = 5;
-  if ( ( last_status_update == 0 ) || ( ( system_uptime_s() - last_status_update ) > status_update_rate_s ) )
-  {    
-    esp_mqtt_client_publish( s_mqtt_client, MQTT_STATUS_TOPIC, application_get_mqtt_status_msg(), 0, 1, 0);
-    last_status_update = system_uptime_s();
-  }
-  
-  if ( ( last_ip_update == 0 ) || ( ( system_uptime_s() - last_ip_update ) > 60 ) )
-  {
-    char ip_msg[64];
-    char *p_msg = ip_msg;
-    
-    p_msg += sprintf( p_msg, "{ \"ip_addr\":\"%s\",", wifi_get_ip_addr_str() );
-    p_msg += sprintf( p_msg, "\"mdns_name\":\"%s\"", wifi_get_mdns_name_str() );
-    p_msg += sprintf( p_msg, "}" );
-    
-    esp_mqtt_client_publish( s_mqtt_client, MQTT_IP_TOPIC, ip_msg, 0, 1, 0);
-    last_ip_update = system_uptime_s();
-  }
+  s_status_timer = timer_wheel_add_periodic( STATUS_UPDATE_PERIOD_MS, _status_timer_cb, NULL );
+  s_ip_timer     = timer_wheel_add_periodic( IP_UPDATE_PERIOD_MS, _ip_timer_cb, NULL );
+  mqtt_force_update();
 }
@@ -4,7 +4,6 @@
 #include <stdbool.h>
 
 void mqtt_init( void );
-void mqtt_do_work( void );
 void mqtt_force_update( void );
 
 #endif
\ No newline at end of file
@@ -0,0 +1,303 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#if CONFIG_LWIP_STATS
+#include <lwip/stats.h>
+#endif
+
+#include "debug.h"
+#include "utils.h"
+#include "netperf.h"
+
+#define NETPERF_CONNECT_TIMEOUT_S   ( 10 )
+#define NETPERF_IO_TIMEOUT_MS       ( 1000 )        // Longest a socket call may hold up the deadline check
+#define NETPERF_TCP_CHUNK           ( 2 * 1460 )    // Two full segments per send
+#define NETPERF_UDP_PAYLOAD         ( 1472 )        // Largest that fits a 1500 byte MTU unfragmented
+#define NETPERF_UDP_SEQ_FIN         ( 0xFFFFFFFF )  // Sequence number of the datagrams that end a UDP tx test
+#define NETPERF_UDP_FIN_CNT         ( 5 )
+
+#define USEC_PER_SEC                ( 1000 * 1000 )
+
+typedef enum
+{
+  NETPERF_STATE_IDLE,
+  NETPERF_STATE_WAITING,      // For the client to connect
+  NETPERF_STATE_RUNNING,
+  NETPERF_STATE_DONE,
+  NETPERF_STATE_FAILED,
+} netperf_state_t;
+
+static const char * const s_state_names[] = { "idle", "waiting", "running", "done", "failed" };
+
+typedef struct
+{
+  netperf_state_t   state;            // Everything else is owned by the test task until this leaves RUNNING
+  netperf_params_t  params;
+  const char        *p_error;
+
+  uint64_t          bytes;
+  uint32_t          elapsed_ms;
+  uint32_t          datagrams;
+  uint32_t          lost;             // UDP rx only, from gaps in the sequence numbers
+  int32_t           retransmits;      // TCP tx only, -1 when lwIP isn't keeping count
+  uint8_t           sample_cnt;
+  uint32_t          samples_kbps[NETPERF_MAX_DURATION_S];
+
+  uint8_t           buffer[MAX( NETPERF_TCP_CHUNK, NETPERF_UDP_PAYLOAD )];
+} netperf_context_t;
+
+static netperf_context_t s_netperf = { 0 };
+
+static int  _open_tcp( void );
+static int  _open_udp( void );
+static void _run( int sock );
+static void _netperf_task( void *p_param );
+
+//-----------------------------------------------------------------------------
+static void _set_io_timeout( int sock )
+{
+  struct timeval timeout = { .tv_sec = NETPERF_IO_TIMEOUT_MS / 1000, .tv_usec = ( NETPERF_IO_TIMEOUT_MS % 1000 ) * 1000 };
+  setsockopt( sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+  setsockopt( sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof( timeout ) );
+}
+
+//-----------------------------------------------------------------------------
+static bool _wait_readable( int sock, uint32_t timeout_s )
+{
+  fd_set read_fds;
+  FD_ZERO( &read_fds );
+  FD_SET( sock, &read_fds );
+  struct timeval timeout = { .tv_sec = timeout_s };
+  return select( sock + 1, &read_fds, NULL, NULL, &timeout ) > 0;
+}
+
+//-----------------------------------------------------------------------------
+// Returns the connected socket, or -1 with p_error set
+static int _open_tcp( void )
+{
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons( CONFIG_NETPERF_PORT ), .sin_addr.s_addr = htonl( INADDR_ANY ) };
+  int listen_sock = socket( AF_INET, SOCK_STREAM, IPPROTO_IP );
+  int reuse = 1;
+  setsockopt( listen_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
+  if ( ( listen_sock < 0 ) || bind( listen_sock, (struct sockaddr *)&addr, sizeof( addr ) ) || listen( listen_sock, 1 ) )
+  {
+    s_netperf.p_error = "couldn't listen";
+    close( listen_sock );
+    return -1;
+  }
+
+  int sock = -1;
+  if ( _wait_readable( listen_sock, NETPERF_CONNECT_TIMEOUT_S ) )
+  {
+    sock = accept( listen_sock, NULL, NULL );
+  }
+  close( listen_sock );
+
+  if ( sock < 0 )
+  {
+    s_netperf.p_error = "no client connected";
+  }
+  return sock;
+}
+
+//-----------------------------------------------------------------------------
+// UDP has no accept, the client announces itself with a datagram which tells us where to send
+static int _open_udp( void )
+{
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons( CONFIG_NETPERF_PORT ), .sin_addr.s_addr = htonl( INADDR_ANY ) };
+  int sock = socket( AF_INET, SOCK_DGRAM, IPPROTO_IP );
+  if ( ( sock < 0 ) || bind( sock, (struct sockaddr *)&addr, sizeof( addr ) ) )
+  {
+    s_netperf.p_error = "couldn't bind";
+    close( sock );
+    return -1;
+  }
+
+  struct sockaddr_in peer;
+  socklen_t peer_len = sizeof( peer );
+  if ( !_wait_readable( sock, NETPERF_CONNECT_TIMEOUT_S ) ||
+       ( recvfrom( sock, s_netperf.buffer, sizeof( s_netperf.buffer ), MSG_PEEK, (struct sockaddr *)&peer, &peer_len ) < 0 ) )
+  {
+    s_netperf.p_error = "no client connected";
+    close( sock );
+    return -1;
+  }
+
+  if ( s_netperf.params.dir == NETPERF_DIR_TX )
+  {
+    recv( sock, s_netperf.buffer, sizeof( s_netperf.buffer ), 0 );    // Just the hello, nothing to count
+    connect( sock, (struct sockaddr *)&peer, peer_len );
+  }
+  return sock;
+}
+
+//-----------------------------------------------------------------------------
+static int _transfer( int sock )
+{
+  bool udp = ( s_netperf.params.proto == NETPERF_PROTO_UDP );
+
+  if ( s_netperf.params.dir == NETPERF_DIR_RX )
+  {
+    uint32_t seq;
+    int len = recv( sock, s_netperf.buffer, sizeof( s_netperf.buffer ), 0 );
+    if ( udp && ( len >= (int)sizeof( seq ) ) )
+    {
+      memcpy( &seq, s_netperf.buffer, sizeof( seq ) );
+      seq = ntohl( seq );
+      s_netperf.lost += ( seq > s_netperf.datagrams + s_netperf.lost ) ? seq - ( s_netperf.datagrams + s_netperf.lost ) : 0;
+      s_netperf.datagrams++;
+    }
+    return len;
+  }
+
+  if ( udp )
+  {
+    uint32_t seq = htonl( s_netperf.datagrams );
+    memcpy( s_netperf.buffer, &seq, sizeof( seq ) );
+    int len = send( sock, s_netperf.buffer, NETPERF_UDP_PAYLOAD, 0 );
+    if ( ( len < 0 ) && ( errno == ENOMEM ) )
+    {
+      // lwIP's out of pbufs, the link's as full as it gets.  Let it drain
+      vTaskDelay( 1 );
+      errno = EAGAIN;
+    }
+    s_netperf.datagrams += ( len > 0 ) ? 1 : 0;
+    return len;
+  }
+
+  return send( sock, s_netperf.buffer, NETPERF_TCP_CHUNK, 0 );
+}
+
+//-----------------------------------------------------------------------------
+static void _run( int sock )
+{
+  _set_io_timeout( sock );
+
+#if CONFIG_LWIP_STATS && MIB2_STATS
+  uint32_t retransmits_before = lwip_stats.mib2.tcpretranssegs;
+#endif
+
+  uint64_t start_usec  = system_uptime_usec();
+  uint64_t end_usec    = start_usec + (uint64_t)s_netperf.params.duration_s * USEC_PER_SEC;
+  uint64_t sample_usec = start_usec + USEC_PER_SEC;
+  uint32_t sample_bytes = 0;
+  uint64_t now_usec    = start_usec;
+
+  while ( now_usec < end_usec )
+  {
+    int len = _transfer( sock );
+    now_usec = system_uptime_usec();
+
+    if ( len > 0 )
+    {
+      s_netperf.bytes += len;
+      sample_bytes    += len;
+    }
+    else if ( ( len == 0 ) || ( ( errno != EAGAIN ) && ( errno != EWOULDBLOCK ) ) )
+    {
+      break;    // Client hung up early, report what we got
+    }
+
+    while ( ( now_usec >= sample_usec ) && ( sample_usec <= end_usec ) && ( s_netperf.sample_cnt < ARRAY_SIZE( s_netperf.samples_kbps ) ) )
+    {
+      s_netperf.samples_kbps[s_netperf.sample_cnt++] = sample_bytes / 125;    // bits / 1000
+      sample_bytes = 0;
+      sample_usec += USEC_PER_SEC;
+    }
+  }
+
+  s_netperf.elapsed_ms = ( MIN( now_usec, end_usec ) - start_usec ) / 1000;
+
+  if ( ( s_netperf.params.proto == NETPERF_PROTO_UDP ) && ( s_netperf.params.dir == NETPERF_DIR_TX ) )
+  {
+    uint32_t fin = htonl( NETPERF_UDP_SEQ_FIN );
+    memcpy( s_netperf.buffer, &fin, sizeof( fin ) );
+    for ( uint8_t i = 0; i < NETPERF_UDP_FIN_CNT; i++ )
+    {
+      send( sock, s_netperf.buffer, sizeof( fin ), 0 );
+    }
+  }
+
+#if CONFIG_LWIP_STATS && MIB2_STATS
+  s_netperf.retransmits = lwip_stats.mib2.tcpretranssegs - retransmits_before;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+static void _netperf_task( void *p_param )
+{
+  int sock = ( s_netperf.params.proto == NETPERF_PROTO_TCP ) ? _open_tcp() : _open_udp();
+  if ( sock >= 0 )
+  {
+    print( "Netperf client connected\n" );
+    __atomic_store_n( &s_netperf.state, NETPERF_STATE_RUNNING, __ATOMIC_RELEASE );
+    _run( sock );
+    close( sock );
+  }
+
+  print( "Netperf %s: %llu bytes in %u ms\n", s_netperf.p_error ? s_netperf.p_error : "done", s_netperf.bytes, s_netperf.elapsed_ms );
+  __atomic_store_n( &s_netperf.state, s_netperf.p_error ? NETPERF_STATE_FAILED : NETPERF_STATE_DONE, __ATOMIC_RELEASE );
+  vTaskDelete( NULL );
+}
+
+//-----------------------------------------------------------------------------
+bool netperf_start( const netperf_params_t *p_params )
+{
+  netperf_state_t state = __atomic_load_n( &s_netperf.state, __ATOMIC_ACQUIRE );
+  if ( ( state == NETPERF_STATE_WAITING ) || ( state == NETPERF_STATE_RUNNING ) )
+  {
+    return false;
+  }
+
+  memset( &s_netperf, 0, offsetof( netperf_context_t, buffer ) );
+  s_netperf.params            = *p_params;
+  s_netperf.params.duration_s = CLAMP( p_params->duration_s, 1, NETPERF_MAX_DURATION_S );
+  s_netperf.retransmits       = -1;
+  s_netperf.state             = NETPERF_STATE_WAITING;
+
+  print( "Netperf %s %s for %u s, waiting on port %u\n", ( p_params->proto == NETPERF_PROTO_TCP ) ? "tcp" : "udp",
+    ( p_params->dir == NETPERF_DIR_RX ) ? "rx" : "tx", s_netperf.params.duration_s, CONFIG_NETPERF_PORT );
+
+  // Same priority as the httpd task, so the test doesn't starve it while the client polls
+  if ( xTaskCreate( _netperf_task, "netperf_task", 3072, NULL, 5, NULL ) != pdPASS )
+  {
+    s_netperf.state = NETPERF_STATE_IDLE;
+    return false;
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+uint16_t netperf_get_json( char *p_buffer, size_t buffer_size )
+{
+  netperf_state_t state = __atomic_load_n( &s_netperf.state, __ATOMIC_ACQUIRE );
+  uint32_t kbps = s_netperf.elapsed_ms ? (uint32_t)( s_netperf.bytes * 8 / s_netperf.elapsed_ms ) : 0;
+
+  int len = snprintf( p_buffer, buffer_size,
+    "{\"state\":\"%s\",\"error\":\"%s\",\"port\":%u,\"proto\":\"%s\",\"dir\":\"%s\",\"duration_s\":%u,"
+    "\"tcp_wnd\":%u,\"tcp_snd_buf\":%u,\"bytes\":%llu,\"elapsed_ms\":%u,\"kbps\":%u,"
+    "\"datagrams\":%u,\"lost\":%u,\"retransmits\":%d,\"samples_kbps\":[",
+    s_state_names[state], s_netperf.p_error ? s_netperf.p_error : "", CONFIG_NETPERF_PORT,
+    ( s_netperf.params.proto == NETPERF_PROTO_TCP ) ? "tcp" : "udp", ( s_netperf.params.dir == NETPERF_DIR_RX ) ? "rx" : "tx",
+    s_netperf.params.duration_s, CONFIG_LWIP_TCP_WND_DEFAULT, CONFIG_LWIP_TCP_SND_BUF_DEFAULT,
+    s_netperf.bytes, s_netperf.elapsed_ms, kbps, s_netperf.datagrams, s_netperf.lost, s_netperf.retransmits );
+
+  // Samples stop short of the end of a small buffer, so the closing "]}" always fits
+  for ( uint8_t i = 0; ( i < s_netperf.sample_cnt ) && ( len + NETPERF_SAMPLE_JSON_MAX + 2 < buffer_size ); i++ )
+  {
+    len += snprintf( p_buffer + len, buffer_size - len, "%s%u", i ? "," : "", s_netperf.samples_kbps[i] );
+  }
+  if ( len < buffer_size )
+  {
+    len += snprintf( p_buffer + len, buffer_size - len, "]}" );
+  }
+
+  return MIN( len, buffer_size - 1 );
+}
@@ -0,0 +1,39 @@
+#ifndef _NETPERF_H_
+#define _NETPERF_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define NETPERF_MAX_DURATION_S    ( 60 )
+#define NETPERF_SAMPLE_JSON_MAX   ( 11 )      // ",4294967295", one per-second sample in the report
+#define NETPERF_JSON_SIZE         ( 384 + NETPERF_SAMPLE_JSON_MAX * NETPERF_MAX_DURATION_S )   // Fits the longest test's report
+
+typedef enum
+{
+  NETPERF_PROTO_TCP,
+  NETPERF_PROTO_UDP,
+} netperf_proto_t;
+
+// As seen from the device
+typedef enum
+{
+  NETPERF_DIR_RX,
+  NETPERF_DIR_TX,
+} netperf_dir_t;
+
+typedef struct
+{
+  netperf_proto_t proto;
+  netperf_dir_t   dir;
+  uint8_t         duration_s;     // Clamped to 1..NETPERF_MAX_DURATION_S
+} netperf_params_t;
+
+// Opens CONFIG_NETPERF_PORT and waits for tools/netperf.py to connect.  Returns false if a test
+// is already in progress
+bool     netperf_start( const netperf_params_t *p_params );
+
+// State of the current or last test, with the per-second samples once it's running
+uint16_t netperf_get_json( char *p_buffer, size_t buffer_size );
+
+#endif
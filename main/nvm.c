@@ -5,16 +5,26 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/semphr.h>
+#include <esp_rom_crc.h>
 
 #include "debug.h"
+#include "utils.h"
 #include "nvm.h"
+#include "wear.h"
+#include "wifi.h"
+#include "ota_history.h"
 #include "application.h"
+#include "startup.h"
+#include "metrics.h"
+#include "task_monitor.h"
+#include "trace.h"
 
 typedef enum
 {
   NVM_PARAM_TYPE_FLOAT,
   NVM_PARAM_TYPE_INT,
   NVM_PARAM_TYPE_BLOB,
+  NVM_PARAM_TYPE_STR,
 } nvm_parameter_type_t;
   
 typedef struct
@@ -30,234 +40,1455 @@ typedef struct
   union
   {
     int32_t   default_value_int;     // for 'value' ints
-    int32_t   default_value_float;   // for 'value' floats
-    size_t    blob_length;           // for 'blobs' - aka binary arrays
+    float     default_value_float;   // for 'value' floats
+    size_t    blob_length;           // for 'blobs' - aka binary arrays, and strings (including the terminator)
   };
 } nvm_parameter_t;
 
-static SemaphoreHandle_t  s_access_mutex;
+// Blobs & strings live in RAM permanently (and get snapshotted on write), keep them small
+#define NVM_BLOB_MAX_SIZE     ( 1024 )
+
+#define NVM_SCHEMA_KEY        "schema_ver"
+
+// s_migrations[n] takes the flash contents from schema version n to n + 1.  Each runs with the
+// NVS handle open and before any parameter is loaded, anything it writes is committed with the
+// new schema version
+typedef void (*nvm_migration_func_t)( nvs_handle flash_handle );
+
+static const nvm_migration_func_t s_migrations[] =
+{
+  [0] = NULL,     // Version 0 predates the schema key, the layout itself is unchanged
+};
+
+_Static_assert( ARRAY_SIZE( s_migrations ) == NVM_SCHEMA_VERSION, "Every NVM_SCHEMA_VERSION bump needs an entry in s_migrations[]" );
+
+// Upper bound on how long a continuous stream of sets can hold off the flash write
+#define MAX_WRITE_DELAY_MS    ( 10 * CONFIG_NVM_WRITE_DEBOUNCE_MS )
+
+// Optimistic read attempts before a getter falls back to the mutex.  Retries only happen when a
+// setter is mid-update, which is a handful of instructions unless that setter got preempted
+#define SEQLOCK_MAX_RETRIES   ( 4 )
+
+static SemaphoreHandle_t  s_access_mutex;     // Serializes setters and the dirty mask, getters don't take it
+static volatile uint32_t  s_seq = 0;          // Seqlock generation for the RAM copy, odd while a setter is mid-update
+static SemaphoreHandle_t  s_write_mutex;      // Serializes flash writers (_nvm_task and nvm_flush)
+static TaskHandle_t       s_task_handle;
+TASK_STATIC_STORAGE( s_nvm_task, CONFIG_TASK_STACK_NVM );
 static bool               s_initialized = false;
+static uint32_t           s_dirty_mask  = 0;  // One bit per nvm_param_t that differs from flash
+static uint32_t           s_transaction_depth = 0;  // Writes are held off while a transaction is open
+static nvm_stats_t        s_stats       = { 0 };
+
+//-----------------------------------------------------------------------------
+// Everything below is generated from NVM_PARAM_LIST in nvm.h
+
+#define _NVM_NO_STORAGE( ... )
+#define _NVM_BLOB_STORAGE( id, name, blob_type )    static blob_type s_##name##_storage;
+#define _NVM_STR_STORAGE( id, name, max_len )       static char      s_##name##_storage[( max_len ) + 1];
+
+NVM_PARAM_LIST( _NVM_NO_STORAGE, _NVM_NO_STORAGE, _NVM_BLOB_STORAGE, _NVM_STR_STORAGE )
+
+#define _NVM_INT_ENTRY( id, name, default_value )   \
+  [NVM_PARAM_##id] = { .p_name = #name, .type = NVM_PARAM_TYPE_INT,   .value_int   = ( default_value ), .default_value_int   = ( default_value ) },
+#define _NVM_FLOAT_ENTRY( id, name, default_value ) \
+  [NVM_PARAM_##id] = { .p_name = #name, .type = NVM_PARAM_TYPE_FLOAT, .value_float = ( default_value ), .default_value_float = ( default_value ) },
+#define _NVM_BLOB_ENTRY( id, name, blob_type )      \
+  [NVM_PARAM_##id] = { .p_name = #name, .type = NVM_PARAM_TYPE_BLOB,  .p_blob = &s_##name##_storage,   .blob_length = sizeof( s_##name##_storage ) },
+#define _NVM_STR_ENTRY( id, name, max_len )         \
+  [NVM_PARAM_##id] = { .p_name = #name, .type = NVM_PARAM_TYPE_STR,   .p_blob = s_##name##_storage,    .blob_length = sizeof( s_##name##_storage ) },
+
+nvm_parameter_t nvm_params[] = 
+{
+  NVM_PARAM_LIST( _NVM_INT_ENTRY, _NVM_FLOAT_ENTRY, _NVM_BLOB_ENTRY, _NVM_STR_ENTRY )
+};
+
+#define _NVM_KEY_CHECK( id, name, ... )             \
+  _Static_assert( sizeof( #name ) <= NVS_KEY_NAME_MAX_SIZE, "NVM key '" #name "' is too long for NVS" );
+#define _NVM_BLOB_CHECK( id, name, blob_type )      \
+  _NVM_KEY_CHECK( id, name )                        \
+  _Static_assert( sizeof( blob_type ) <= NVM_BLOB_MAX_SIZE, "NVM blob '" #name "' is too large" );
+#define _NVM_STR_CHECK( id, name, max_len )         \
+  _NVM_KEY_CHECK( id, name )                        \
+  _Static_assert( ( max_len ) > 0 && ( max_len ) < NVM_BLOB_MAX_SIZE, "NVM string '" #name "' has a bad max_len" );
+
+NVM_PARAM_LIST( _NVM_KEY_CHECK, _NVM_KEY_CHECK, _NVM_BLOB_CHECK, _NVM_STR_CHECK )
+
+_Static_assert( ARRAY_SIZE( nvm_params ) == NVM_PARAM_COUNT, "nvm_params[] is out of sync with nvm_param_t" );
+_Static_assert( NVM_PARAM_COUNT <= 32, "s_dirty_mask only has room for 32 parameters" );
+
+//-----------------------------------------------------------------------------
+// Large values (certificates, calibration tables, ...) don't belong in the RAM resident table.
+// They're streamed through a bounded scratch buffer and spread over NVM_LARGE_CHUNK_SIZE entries
+// in their own namespace: '<name>' holds a header with per-chunk CRCs, the chunks themselves
+// live under one of two keys each, '<name>#<n>' or '<name>~<n>'.  A changed chunk is written to
+// whichever key the header doesn't point at, so the old value stays intact until the header is
+// switched over as the very last write.  The CRCs let a rewrite skip chunks that haven't
+// changed without reading anything back
+#define NVM_LARGE_NAMESPACE     "large"
+#define NVM_LARGE_MAGIC         ( 0x3247524C )     // 'LRG2'
+#define NVM_LARGE_KEY_SEPARATORS  "#~"              // Indexed by the chunk's generation bit
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t total_len;
+  uint32_t value_crc;
+  uint32_t chunk_gen;       // One bit per chunk, which of its two keys holds it
+  uint32_t chunk_crc[NVM_LARGE_MAX_CHUNKS];
+} nvm_large_header_t;
+
+_Static_assert( NVM_LARGE_MAX_CHUNKS <= 32, "chunk_gen only has room for 32 chunks" );
+
+typedef struct
+{
+  StaticSemaphore_t   write_mutex_buffer;
+  SemaphoreHandle_t   write_mutex;          // Held by the active writer from begin until end/abort
+  TaskHandle_t        writer;               // Task that called begin, the only one allowed to carry on
+  StaticSemaphore_t   read_mutex_buffer;
+  SemaphoreHandle_t   read_mutex;           // Guards read_scratch
+
+  bool                writing;
+  char                name[NVM_LARGE_NAME_MAX + 1];
+  nvs_handle          flash_handle;
+  nvm_large_header_t  old_header;
+  nvm_large_header_t  new_header;
+  size_t              written;              // Bytes accepted from the caller so far
+  size_t              fill;                 // Bytes waiting in write_scratch
+
+  uint8_t             write_scratch[NVM_LARGE_CHUNK_SIZE];
+  uint8_t             read_scratch[NVM_LARGE_CHUNK_SIZE];
+} nvm_large_ctx_t;
+
+static nvm_large_ctx_t    s_large = { 0 };
+
+#ifdef CONFIG_NVM_PACKED_SNAPSHOT
+//-----------------------------------------------------------------------------
+// Every parameter packed back to back in one CRC protected blob, so boot is a single NVS read.
+// The per-key entries are still kept up to date and are the fallback if the snapshot is
+// missing, corrupt or was written for a different parameter list.  The snapshot itself is only
+// rewritten by nvm_flush(), in between NVM_STALE_KEY flags the parameters whose per-key entry is
+// newer than it, and those few are read per key at boot
+#define NVM_SNAPSHOT_KEY      "nvm_snapshot"
+#define NVM_SNAPSHOT_MAGIC    ( 0x534D564E )     // 'NVMS'
+#define NVM_STALE_KEY         "nvm_stale"
+
+#define _NVM_INT_SIZE( ... )                      + sizeof( int32_t )
+#define _NVM_FLOAT_SIZE( ... )                    + sizeof( float )
+#define _NVM_BLOB_SIZE( id, name, blob_type )     + sizeof( blob_type )
+#define _NVM_STR_SIZE( id, name, max_len )        + ( ( max_len ) + 1 )
+
+#define NVM_SNAPSHOT_PAYLOAD_SIZE   ( 0 NVM_PARAM_LIST( _NVM_INT_SIZE, _NVM_FLOAT_SIZE, _NVM_BLOB_SIZE, _NVM_STR_SIZE ) )
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t schema_version;
+  uint32_t layout_crc;        // Over every parameter's name, type & size, catches list edits without a schema bump
+  uint32_t payload_crc;
+  uint32_t per_key_load_us;   // What loading without the snapshot took, for comparison
+  uint8_t  payload[NVM_SNAPSHOT_PAYLOAD_SIZE];
+} nvm_snapshot_t;
+
+// Static, it outgrows the task stack as soon as a few blobs are added
+static nvm_snapshot_t     s_snapshot;
+static uint32_t           s_snapshot_stale = 0;   // Mirrors NVM_STALE_KEY, guarded by s_write_mutex
+#endif
+
+#define NVM_ALL_PARAMS        ( UINT32_MAX >> ( 32 - NVM_PARAM_COUNT ) )
+
+//-----------------------------------------------------------------------------
+static void _nvm_task(void *Param);
+static void _load_nvm();
+static bool _load_params( nvs_handle flash_handle, uint32_t param_mask );
+static bool _migrate_nvm( nvs_handle flash_handle );
+static void _discard_bad_key( nvs_handle flash_handle, const nvm_parameter_t *p_param, esp_err_t read_err );
+static void *_param_data( nvm_parameter_t *p_param, size_t *p_len );
+static void _account_write( size_t len );
+static void _account_param_write( nvm_parameter_t *p_param );
+static void _account_commit( void );
+#ifdef CONFIG_NVM_PACKED_SNAPSHOT
+static bool _load_snapshot( nvs_handle flash_handle );
+static void _store_snapshot( nvs_handle flash_handle );
+#endif
+static esp_err_t _write_dirty_params( bool store_snapshot );
+static void _mark_dirty( nvm_param_t nvm_param );
+static void _read_param( void *p_dest, const void *p_src, size_t len );
+static void _publish_begin( void );
+static void _publish_end( void );
+
+//-----------------------------------------------------------------------------
+void nvm_reset(void)
+{
+  nvs_flash_erase();
+  nvs_flash_init();
+}
+
+//-----------------------------------------------------------------------------
+// Where a parameter's value lives in RAM, and how many bytes of it get persisted
+static void *_param_data( nvm_parameter_t *p_param, size_t *p_len )
+{
+  switch ( p_param->type )
+  {
+    case NVM_PARAM_TYPE_INT:
+      *p_len = sizeof( p_param->value_int );
+      return &p_param->value_int;
+
+    case NVM_PARAM_TYPE_FLOAT:
+      *p_len = sizeof( p_param->value_float );
+      return &p_param->value_float;
+
+    case NVM_PARAM_TYPE_BLOB:
+    case NVM_PARAM_TYPE_STR:
+    default:
+      *p_len = p_param->blob_length;
+      return p_param->p_blob;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void _account_write( size_t len )
+{
+  s_stats.writes++;
+  wear_record_nvs_write( len );
+}
+
+//-----------------------------------------------------------------------------
+static void _account_param_write( nvm_parameter_t *p_param )
+{
+  size_t len;
+  _param_data( p_param, &len );
+  _account_write( len );
+}
+
+//-----------------------------------------------------------------------------
+static void _account_commit( void )
+{
+  s_stats.commits++;
+  metrics_add( METRIC_NVM_COMMITS, 1 );
+  wear_record_commit( WEAR_PARTITION_NVS );
+}
+
+//-----------------------------------------------------------------------------
+// A key that simply doesn't exist yet needs no erase, anything else (wrong type or size) does
+static void _discard_bad_key( nvs_handle flash_handle, const nvm_parameter_t *p_param, esp_err_t read_err )
+{
+  print( "Error reading NVM Param: '%s', loading default\n", p_param->p_name );
+  if ( read_err == ESP_ERR_NVS_NOT_FOUND )
+  {
+    return;
+  }
+
+  esp_err_t err = nvs_erase_key(flash_handle, p_param->p_name);
+  if ( err != ESP_OK )
+  {
+    print("Error erasing key - 0X%X\n", err );
+  }
+}
+
+#ifdef CONFIG_NVM_PACKED_SNAPSHOT
+//-----------------------------------------------------------------------------
+static uint32_t _layout_crc( void )
+{
+  uint32_t crc = 0;
+  for ( uint8_t idx = 0; idx < NVM_PARAM_COUNT; idx++ )
+  {
+    size_t   len;
+    uint32_t layout[2];
+
+    _param_data( &nvm_params[idx], &len );
+    layout[0] = nvm_params[idx].type;
+    layout[1] = len;
+
+    crc = esp_rom_crc32_le( crc, (const uint8_t *)nvm_params[idx].p_name, strlen( nvm_params[idx].p_name ) + 1 );
+    crc = esp_rom_crc32_le( crc, (const uint8_t *)layout, sizeof( layout ) );
+  }
+  return crc;
+}
+
+//-----------------------------------------------------------------------------
+// Returns false, leaving the RAM copy untouched, if the snapshot can't be trusted
+static bool _load_snapshot( nvs_handle flash_handle )
+{
+  size_t len = sizeof( s_snapshot );
+  if ( ESP_OK != nvs_get_blob( flash_handle, NVM_SNAPSHOT_KEY, &s_snapshot, &len ) )
+  {
+    print( "No NVM snapshot, loading per key\n" );
+    return false;
+  }
+
+  if ( ( len                        != sizeof( s_snapshot ) ) ||
+       ( s_snapshot.magic           != NVM_SNAPSHOT_MAGIC ) ||
+       ( s_snapshot.schema_version  != NVM_SCHEMA_VERSION ) ||
+       ( s_snapshot.layout_crc      != _layout_crc() ) ||
+       ( s_snapshot.payload_crc     != esp_rom_crc32_le( 0, s_snapshot.payload, sizeof( s_snapshot.payload ) ) ) )
+  {
+    print( "NVM snapshot is stale or corrupt, loading per key\n" );
+    return false;
+  }
+
+  s_stats.per_key_load_us = s_snapshot.per_key_load_us;
+
+  size_t offset = 0;
+  for ( uint8_t idx = 0; idx < NVM_PARAM_COUNT; idx++ )
+  {
+    nvm_parameter_t *p_param = &nvm_params[idx];
+    size_t  param_len;
+    uint8_t *p_dest = _param_data( p_param, &param_len );
+
+    memcpy( p_dest, &s_snapshot.payload[offset], param_len );
+    offset += param_len;
+
+    if ( p_param->type == NVM_PARAM_TYPE_STR )
+    {
+      p_dest[param_len - 1] = 0;
+    }
+  }
+
+  print( "Loaded %u NVM Params from snapshot\n", NVM_PARAM_COUNT );
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// Packs the current RAM copy and writes it, then clears the stale flags.  Callers hold
+// s_write_mutex (or are still loading) and commit
+static void _store_snapshot( nvs_handle flash_handle )
+{
+  s_snapshot.magic           = NVM_SNAPSHOT_MAGIC;
+  s_snapshot.schema_version  = NVM_SCHEMA_VERSION;
+  s_snapshot.layout_crc      = _layout_crc();
+  s_snapshot.per_key_load_us = s_stats.per_key_load_us;
+
+  // Hold off setters so the snapshot is consistent across parameters
+  if ( s_access_mutex )
+  {
+    xSemaphoreTake(s_access_mutex, portMAX_DELAY);
+  }
+
+  size_t offset = 0;
+  for ( uint8_t idx = 0; idx < NVM_PARAM_COUNT; idx++ )
+  {
+    size_t  param_len;
+    uint8_t *p_src = _param_data( &nvm_params[idx], &param_len );
+
+    memcpy( &s_snapshot.payload[offset], p_src, param_len );
+    offset += param_len;
+  }
+
+  if ( s_access_mutex )
+  {
+    xSemaphoreGive(s_access_mutex);
+  }
+
+  s_snapshot.payload_crc = esp_rom_crc32_le( 0, s_snapshot.payload, sizeof( s_snapshot.payload ) );
+
+  esp_err_t err = nvs_set_blob( flash_handle, NVM_SNAPSHOT_KEY, &s_snapshot, sizeof( s_snapshot ) );
+  _account_write( sizeof( s_snapshot ) );
+  if ( err != ESP_OK )
+  {
+    print("Error writing NVM snapshot - 0X%X\n", err );
+    return;
+  }
+
+  // Only once the snapshot is down, until then the stale keys still have to be read per key
+  err = nvs_set_u32( flash_handle, NVM_STALE_KEY, 0 );
+  _account_write( sizeof( uint32_t ) );
+  if ( err != ESP_OK )
+  {
+    print("Error writing NVM - 0X%X\n", err );
+    return;
+  }
+  s_snapshot_stale = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Flags parameters as newer in their per-key entry than in the snapshot.  Only costs a write the
+// first time a parameter changes after each snapshot.  s_snapshot_stale only takes the bits once
+// they're in flash, so a failed attempt is made again
+static esp_err_t _mark_snapshot_stale( nvs_handle flash_handle, uint32_t param_mask )
+{
+  if ( !( param_mask & ~s_snapshot_stale ) )
+  {
+    return ESP_OK;
+  }
+
+  esp_err_t err = nvs_set_u32( flash_handle, NVM_STALE_KEY, s_snapshot_stale | param_mask );
+  if ( err != ESP_OK )
+  {
+    print("Error writing NVM - 0X%X\n", err );
+    return err;
+  }
+  s_snapshot_stale |= param_mask;
+  _account_write( sizeof( uint32_t ) );
+  return ESP_OK;
+}
+#endif
+
+//-----------------------------------------------------------------------------
+// Brings flash written by older firmware up to NVM_SCHEMA_VERSION.  Returns true if anything
+// was written and needs committing
+static bool _migrate_nvm( nvs_handle flash_handle )
+{
+  uint32_t stored_version = 0;
+  if ( ESP_OK != nvs_get_u32( flash_handle, NVM_SCHEMA_KEY, &stored_version ) )
+  {
+    stored_version = 0;
+  }
+
+  if ( stored_version == NVM_SCHEMA_VERSION )
+  {
+    return false;
+  }
+
+  if ( stored_version > NVM_SCHEMA_VERSION )
+  {
+    // Downgraded firmware, leave newer data alone and hope it's compatible
+    print( "NVM schema %u is newer than ours (%u), not migrating\n", stored_version, NVM_SCHEMA_VERSION );
+    return false;
+  }
+
+  for ( uint32_t version = stored_version; version < NVM_SCHEMA_VERSION; version++ )
+  {
+    print( "Migrating NVM schema %u -> %u\n", version, version + 1 );
+    if ( s_migrations[version] )
+    {
+      s_migrations[version]( flash_handle );
+    }
+  }
+
+  esp_err_t err = nvs_set_u32( flash_handle, NVM_SCHEMA_KEY, NVM_SCHEMA_VERSION );
+  if ( err != ESP_OK )
+  {
+    print("Error writing NVM - 0X%X\n", err );
+  }
+  _account_write( sizeof( uint32_t ) );
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// Pulls every parameter out of flash, writing defaults for anything missing
+static void _load_nvm()
+{
+  uint64_t start_us = system_uptime_usec();
+
+  nvs_handle flash_handle;
+  esp_err_t err = nvs_open( "storage", NVS_READWRITE, &flash_handle );
+  if (err != ESP_OK)
+  {
+      print( "Error (%d) opening NVS handle!\n", err);
+      return;
+  }
+
+#ifdef CONFIG_NVM_PACKED_SNAPSHOT
+  // The snapshot carries its own schema version, so a good one skips the migration check too
+  if ( _load_snapshot( flash_handle ) )
+  {
+    // Whatever changed since the snapshot was taken is newer in its per-key entry
+    if ( ESP_OK != nvs_get_u32( flash_handle, NVM_STALE_KEY, &s_snapshot_stale ) )
+    {
+      s_snapshot_stale = 0;
+    }
+    s_snapshot_stale &= NVM_ALL_PARAMS;
+
+    if ( _load_params( flash_handle, s_snapshot_stale ) )
+    {
+      if ( ESP_OK != nvs_commit(flash_handle) )
+      {
+        print("Error committing NVM\n" );
+      }
+      _account_commit();
+    }
+    nvs_close(flash_handle);
+
+    s_stats.load_time_us         = system_uptime_usec() - start_us;
+    s_stats.loaded_from_snapshot = true;
+    print( "NVM loaded in %u us from the snapshot, %u us per key\n", s_stats.load_time_us, s_stats.per_key_load_us );
+    return;
+  }
+#endif
+
+  bool table_dirty = _migrate_nvm( flash_handle );
+  table_dirty |= _load_params( flash_handle, NVM_ALL_PARAMS );
+  s_stats.per_key_load_us = system_uptime_usec() - start_us;
+
+#ifdef CONFIG_NVM_PACKED_SNAPSHOT
+  // Either missing or stale, next boot gets the fast path
+  _store_snapshot( flash_handle );
+  table_dirty = true;
+#endif
+  
+  if ( table_dirty )
+  {
+    if ( ESP_OK != nvs_commit(flash_handle) )
+    {
+      print("Error committing NVM\n" );
+    }
+    _account_commit();
+  }
+
+  nvs_close(flash_handle);
+
+  s_stats.load_time_us = system_uptime_usec() - start_us;
+  print( "NVM loaded in %u us\n", s_stats.load_time_us );
+}
+
+//-----------------------------------------------------------------------------
+// Reads the parameters in param_mask per key, writing defaults for anything missing.  Returns
+// true if anything was written and needs committing
+static bool _load_params( nvs_handle flash_handle, uint32_t param_mask )
+{
+  bool      table_dirty = false;
+  esp_err_t err;
+
+  for ( uint8_t idx = 0; idx < NVM_PARAM_COUNT; idx++ )
+  {
+    if ( !( param_mask & ( 1UL << idx ) ) )
+    {
+      continue;
+    }
+
+    nvm_parameter_t *p_param = &nvm_params[idx];
+    size_t  param_len;
+    void    *p_dest = _param_data( p_param, &param_len );
+
+    switch ( p_param->type )
+    {
+      case NVM_PARAM_TYPE_INT:
+        err = nvs_get_i32( flash_handle, p_param->p_name, &p_param->value_int );
+        break;
+
+      // Treat Floats as blobs as they're not formally supported
+      case NVM_PARAM_TYPE_FLOAT:
+      case NVM_PARAM_TYPE_BLOB:
+        err = nvs_get_blob( flash_handle, p_param->p_name, p_dest, &param_len );
+        break;
+
+      case NVM_PARAM_TYPE_STR:
+        err = nvs_get_str( flash_handle, p_param->p_name, p_dest, &param_len );
+        break;
+    }
+
+    if ( err == ESP_OK )
+    {
+      if ( p_param->type == NVM_PARAM_TYPE_INT )
+        print( "Loaded NVM Param '%s': %i\n", p_param->p_name, p_param->value_int );
+      else if ( p_param->type == NVM_PARAM_TYPE_FLOAT )
+        print( "Loaded NVM Param '%s': %f\n", p_param->p_name, p_param->value_float );
+      else if ( p_param->type == NVM_PARAM_TYPE_STR )
+        print( "Loaded NVM Param '%s': '%s'\n", p_param->p_name, (char *)p_param->p_blob );
+      else
+        print( "Loaded NVM Param '%s'\n", p_param->p_name );
+      continue;
+    }
+
+    _discard_bad_key( flash_handle, p_param, err );
+
+    switch ( p_param->type )
+    {
+      case NVM_PARAM_TYPE_INT:
+        p_param->value_int = p_param->default_value_int;
+        err = nvs_set_i32( flash_handle, p_param->p_name, p_param->value_int );
+        break;
+
+      case NVM_PARAM_TYPE_FLOAT:
+        p_param->value_float = p_param->default_value_float;
+        err = nvs_set_blob( flash_handle, p_param->p_name, &p_param->value_float, sizeof( float ) );
+        break;
+
+      case NVM_PARAM_TYPE_BLOB:
+        memset( p_param->p_blob, 0, p_param->blob_length );
+        err = nvs_set_blob( flash_handle, p_param->p_name, p_param->p_blob, p_param->blob_length );
+        break;
+
+      case NVM_PARAM_TYPE_STR:
+        memset( p_param->p_blob, 0, p_param->blob_length );
+        err = nvs_set_str( flash_handle, p_param->p_name, p_param->p_blob );
+        break;
+    }
+
+    if ( err != ESP_OK )
+    {
+      print("Error writing NVM - 0X%X\n", err );
+    }
+
+    _account_param_write( p_param );
+    table_dirty = true;
+  }
+
+  return table_dirty;
+}
+
+//-----------------------------------------------------------------------------
+// Writes only the parameters whose dirty bit is set, then commits once.  The access mutex
+// is only held while snapshotting values, so getters never wait on flash I/O for ints & floats.
+// store_snapshot also brings the packed snapshot up to date if anything changed since the last.
+// The bits are cleared up front so sets made meanwhile mark their parameter again, and the bits
+// of anything that didn't make it to flash go back, to ride along with the next write
+static esp_err_t _write_dirty_params( bool store_snapshot )
+{
+  xSemaphoreTake(s_write_mutex, portMAX_DELAY);
+
+  xSemaphoreTake(s_access_mutex, portMAX_DELAY);
+  if ( s_transaction_depth )
+  {
+    // nvm_transaction_end() kicks the task once the whole batch is in
+    xSemaphoreGive(s_access_mutex);
+    xSemaphoreGive(s_write_mutex);
+    return ESP_ERR_INVALID_STATE;
+  }
+  uint32_t dirty_mask = s_dirty_mask;
+  s_dirty_mask = 0;
+  nvm_parameter_t snapshot[NVM_PARAM_COUNT];
+  memcpy( snapshot, nvm_params, sizeof( snapshot ) );
+  xSemaphoreGive(s_access_mutex);
+
+#ifdef CONFIG_NVM_PACKED_SNAPSHOT
+  store_snapshot = store_snapshot && ( dirty_mask || s_snapshot_stale );
+#else
+  store_snapshot = false;
+#endif
+
+  if ( !dirty_mask && !store_snapshot )
+  {
+    xSemaphoreGive(s_write_mutex);
+    return ESP_OK;
+  }
+
+  nvs_handle flash_handle;
+  esp_err_t err = nvs_open( "storage", NVS_READWRITE, &flash_handle );
+  if (err != ESP_OK)
+  {
+    print( "Error (%d) opening NVS handle!\n", err);
+
+    // Put the bits back so the next attempt picks them up
+    xSemaphoreTake(s_access_mutex, portMAX_DELAY);
+    s_dirty_mask |= dirty_mask;
+    xSemaphoreGive(s_access_mutex);
+    xSemaphoreGive(s_write_mutex);
+    return err;
+  }
+
+  uint32_t  failed_mask = 0;
+  esp_err_t first_err   = ESP_OK;
+
+#ifdef CONFIG_NVM_PACKED_SNAPSHOT
+  // Before the keys themselves, so a power cut part way through can't leave the snapshot
+  // looking current.  Without the mark boot would prefer the snapshot, so the keys wait too
+  first_err   = _mark_snapshot_stale( flash_handle, dirty_mask );
+  failed_mask = ( first_err == ESP_OK ) ? 0 : dirty_mask;
+#endif
+
+  for ( uint8_t idx = 0; idx < NVM_PARAM_COUNT; idx++ )
+  {
+    if ( !( dirty_mask & ~failed_mask & ( 1UL << idx ) ) )
+    {
+      continue;
+    }
+
+    nvm_parameter_t *p_param = &snapshot[idx];
+    switch ( p_param->type )
+    {
+      case NVM_PARAM_TYPE_INT:
+        print( "Updating NVM Param '%s' to %i\n", p_param->p_name, p_param->value_int );
+        err = nvs_set_i32( flash_handle, p_param->p_name, p_param->value_int );
+        break;
+
+      case NVM_PARAM_TYPE_FLOAT:
+        print( "Updating NVM Param '%s' to %f\n", p_param->p_name, p_param->value_float );
+        err = nvs_set_blob( flash_handle, p_param->p_name, &p_param->value_float, sizeof( float ) );
+        break;
+
+      case NVM_PARAM_TYPE_BLOB:
+        // Blob contents aren't part of the snapshot, hold off setters while they're copied out
+        print( "Updating NVM Param '%s'\n", p_param->p_name );
+        xSemaphoreTake(s_access_mutex, portMAX_DELAY);
+        err = nvs_set_blob( flash_handle, p_param->p_name, p_param->p_blob, p_param->blob_length );
+        xSemaphoreGive(s_access_mutex);
+        break;
+
+      case NVM_PARAM_TYPE_STR:
+        xSemaphoreTake(s_access_mutex, portMAX_DELAY);
+        print( "Updating NVM Param '%s' to '%s'\n", p_param->p_name, (char *)p_param->p_blob );
+        err = nvs_set_str( flash_handle, p_param->p_name, p_param->p_blob );
+        xSemaphoreGive(s_access_mutex);
+        break;
+    }
+
+    if ( err != ESP_OK )
+    {
+      print("Error writing NVM - 0X%X\n", err );
+      failed_mask |= ( 1UL << idx );
+      first_err    = ( first_err == ESP_OK ) ? err : first_err;
+      continue;
+    }
+    _account_param_write( p_param );
+  }
+
+#ifdef CONFIG_NVM_PACKED_SNAPSHOT
+  // The snapshot may never get ahead of the keys, a failed one stays marked stale
+  if ( store_snapshot && !failed_mask )
+  {
+    _store_snapshot( flash_handle );
+  }
+#endif
+
+  esp_err_t commit_err = nvs_commit(flash_handle);
+  if ( commit_err != ESP_OK )
+  {
+    print("Error committing NVM\n" );
+    failed_mask = dirty_mask;
+  }
+  _account_commit();
+
+  nvs_close(flash_handle);
+
+  if ( failed_mask )
+  {
+    xSemaphoreTake(s_access_mutex, portMAX_DELAY);
+    s_dirty_mask |= failed_mask;
+    xSemaphoreGive(s_access_mutex);
+  }
+  xSemaphoreGive(s_write_mutex);
+  return ( commit_err != ESP_OK ) ? commit_err : first_err;
+}
+
+//-----------------------------------------------------------------------------
+// Callers should hold s_access_mutex
+static void _mark_dirty( nvm_param_t nvm_param )
+{
+  if ( s_dirty_mask & ( 1UL << nvm_param ) )
+  {
+    // Already waiting on a write, this set rides along with it
+    s_stats.writes_avoided++;
+  }
+
+  s_dirty_mask |= ( 1UL << nvm_param );
+
+  if ( s_task_handle && !s_transaction_depth )
+  {
+    xTaskNotifyGive( s_task_handle );
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Callers should hold s_access_mutex.  Bracket every store to nvm_params[] with these
+static void _publish_begin( void )
+{
+  __atomic_store_n( &s_seq, s_seq + 1, __ATOMIC_RELAXED );
+  __atomic_thread_fence( __ATOMIC_RELEASE );
+}
+
+//-----------------------------------------------------------------------------
+static void _publish_end( void )
+{
+  __atomic_store_n( &s_seq, s_seq + 1, __ATOMIC_RELEASE );
+}
+
+//-----------------------------------------------------------------------------
+// Seqlock read of the RAM copy.  Never blocks on flash I/O, and only touches the mutex if a
+// setter was preempted between _publish_begin() and _publish_end()
+static void _read_param( void *p_dest, const void *p_src, size_t len )
+{
+  for ( uint8_t attempt = 0; attempt < SEQLOCK_MAX_RETRIES; attempt++ )
+  {
+    uint32_t seq = __atomic_load_n( &s_seq, __ATOMIC_ACQUIRE );
+    if ( !( seq & 1 ) )
+    {
+      memcpy( p_dest, p_src, len );
+      __atomic_thread_fence( __ATOMIC_ACQUIRE );
+      if ( __atomic_load_n( &s_seq, __ATOMIC_RELAXED ) == seq )
+      {
+        return;
+      }
+    }
+  }
+
+  // Taking the mutex lets priority inheritance push the stalled setter through
+  xSemaphoreTake(s_access_mutex, portMAX_DELAY);
+  memcpy( p_dest, p_src, len );
+  xSemaphoreGive(s_access_mutex);
+}
+
+//-----------------------------------------------------------------------------
+int32_t nvm_get_param_int32( nvm_param_t nvm_param )
+{
+  int32_t retv;
+  _read_param( &retv, &nvm_params[nvm_param].value_int, sizeof( retv ) );
+  return retv;
+}
+
+//-----------------------------------------------------------------------------
+float nvm_get_param_float( nvm_param_t nvm_param )
+{
+  float retv;
+  _read_param( &retv, &nvm_params[nvm_param].value_float, sizeof( retv ) );
+  return retv;
+}
+
+//-----------------------------------------------------------------------------
+void nvm_get_param_blob( nvm_param_t nvm_param, void *p_dest, size_t dest_size )
+{
+  _read_param( p_dest, nvm_params[nvm_param].p_blob, MIN( dest_size, nvm_params[nvm_param].blob_length ) );
+}
+
+//-----------------------------------------------------------------------------
+void nvm_get_param_str( nvm_param_t nvm_param, char *p_dest, size_t dest_size )
+{
+  if ( !dest_size )
+  {
+    return;
+  }
+
+  _read_param( p_dest, nvm_params[nvm_param].p_blob, MIN( dest_size, nvm_params[nvm_param].blob_length ) );
+  p_dest[dest_size - 1] = 0;
+}
+
+//-----------------------------------------------------------------------------
+void nvm_set_param_int32( nvm_param_t nvm_param, int32_t new_val  )
+{
+  xSemaphoreTake(s_access_mutex, portMAX_DELAY);
+  if ( nvm_params[nvm_param].value_int != new_val )
+  {
+    _publish_begin();
+    nvm_params[nvm_param].value_int = new_val;
+    _publish_end();
+    _mark_dirty( nvm_param );
+  }
+  else
+  {
+    s_stats.writes_avoided++;
+  }
+  xSemaphoreGive(s_access_mutex);
+}
+
+//-----------------------------------------------------------------------------
+void nvm_set_param_float( nvm_param_t nvm_param, float new_val )
+{
+  xSemaphoreTake(s_access_mutex, portMAX_DELAY);
+  // Compare bit patterns so NaN & -0.0 behave the same as they would in flash
+  if ( memcmp( &nvm_params[nvm_param].value_float, &new_val, sizeof( float ) ) != 0 )
+  {
+    _publish_begin();
+    nvm_params[nvm_param].value_float = new_val;
+    _publish_end();
+    _mark_dirty( nvm_param );
+  }
+  else
+  {
+    s_stats.writes_avoided++;
+  }
+  xSemaphoreGive(s_access_mutex);
+}
+
+//-----------------------------------------------------------------------------
+void nvm_set_param_blob( nvm_param_t nvm_param, const void *p_new_val, size_t len )
+{
+  nvm_parameter_t *p_param = &nvm_params[nvm_param];
+  len = MIN( len, p_param->blob_length );
+
+  xSemaphoreTake(s_access_mutex, portMAX_DELAY);
+  if ( memcmp( p_param->p_blob, p_new_val, len ) != 0 )
+  {
+    _publish_begin();
+    memcpy( p_param->p_blob, p_new_val, len );
+    _publish_end();
+    _mark_dirty( nvm_param );
+  }
+  else
+  {
+    s_stats.writes_avoided++;
+  }
+  xSemaphoreGive(s_access_mutex);
+}
+
+//-----------------------------------------------------------------------------
+bool nvm_set_param_str( nvm_param_t nvm_param, const char *p_new_val )
+{
+  nvm_parameter_t *p_param = &nvm_params[nvm_param];
+  size_t len = strnlen( p_new_val, p_param->blob_length );
+  bool truncated = ( len >= p_param->blob_length );
+  if ( truncated )
+  {
+    len = p_param->blob_length - 1;
+    print( "NVM Param '%s' truncated to %u chars\n", p_param->p_name, len );
+  }
+
+  xSemaphoreTake(s_access_mutex, portMAX_DELAY);
+  char *p_current = p_param->p_blob;
+  if ( ( strncmp( p_current, p_new_val, len ) != 0 ) || ( p_current[len] != 0 ) )
+  {
+    _publish_begin();
+    memcpy( p_current, p_new_val, len );
+    p_current[len] = 0;
+    _publish_end();
+    _mark_dirty( nvm_param );
+  }
+  else
+  {
+    s_stats.writes_avoided++;
+  }
+  xSemaphoreGive(s_access_mutex);
+
+  return !truncated;
+}
+
+//-----------------------------------------------------------------------------
+void nvm_transaction_begin( void )
+{
+  xSemaphoreTake(s_access_mutex, portMAX_DELAY);
+  s_transaction_depth++;
+  xSemaphoreGive(s_access_mutex);
+}
 
 //-----------------------------------------------------------------------------
-nvm_parameter_t nvm_params[] = 
+void nvm_transaction_end( void )
 {
-  [NVM_PARAM_RESET_COUNTER]     = { .p_name = "reset_counter", .type = NVM_PARAM_TYPE_INT, .value_int = -1, .default_value_int = 0 },
-};
+  xSemaphoreTake(s_access_mutex, portMAX_DELAY);
+  if ( s_transaction_depth )
+  {
+    s_transaction_depth--;
+  }
 
-bool nvm_params_updated = false;
+  if ( !s_transaction_depth && s_dirty_mask && s_task_handle )
+  {
+    xTaskNotifyGive( s_task_handle );
+  }
+  xSemaphoreGive(s_access_mutex);
+}
 
 //-----------------------------------------------------------------------------
-static void _nvm_task(void *Param);
-static void _update_nvm();
+esp_err_t nvm_flush( void )
+{
+  if ( !s_initialized )
+  {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  TRACE_BEGIN( "nvm flush" );
+  esp_err_t err = _write_dirty_params( true );
+  TRACE_END( "nvm flush" );
+
+  if ( err == ESP_ERR_INVALID_STATE )
+  {
+    print( "NVM flush inside a transaction, nothing written\n" );
+  }
+  return err;
+}
 
 //-----------------------------------------------------------------------------
-void nvm_reset(void)
+void nvm_get_stats( nvm_stats_t *p_stats )
 {
-  nvs_flash_erase();
-  nvs_flash_init();
+  xSemaphoreTake(s_access_mutex, portMAX_DELAY);
+  *p_stats = s_stats;
+  xSemaphoreGive(s_access_mutex);
 }
 
 //-----------------------------------------------------------------------------
-static void _update_nvm()
+static size_t _large_chunk_len( uint32_t total_len, uint32_t chunk_idx )
 {
-  // Initialize NVS
-  static bool first_pass = true;
-  esp_err_t err;
-  if ( first_pass )
+  return MIN( NVM_LARGE_CHUNK_SIZE, total_len - ( chunk_idx * NVM_LARGE_CHUNK_SIZE ) );
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t _large_chunk_cnt( uint32_t total_len )
+{
+  return ( total_len + NVM_LARGE_CHUNK_SIZE - 1 ) / NVM_LARGE_CHUNK_SIZE;
+}
+
+//-----------------------------------------------------------------------------
+static void _large_chunk_key( char *p_key, const char *p_name, uint32_t chunk_idx, uint32_t gen )
+{
+  snprintf( p_key, NVS_KEY_NAME_MAX_SIZE, "%s%c%u", p_name, NVM_LARGE_KEY_SEPARATORS[gen & 1], chunk_idx );
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t _large_chunk_gen( const nvm_large_header_t *p_header, uint32_t chunk_idx )
+{
+  return ( p_header->chunk_gen >> chunk_idx ) & 1;
+}
+
+//-----------------------------------------------------------------------------
+// Erases every chunk key p_header doesn't point at, including leftovers from a write that was
+// aborted or cut short by a reset.  Erasing a key that doesn't exist costs no flash write
+static void _large_sweep_chunks( nvs_handle flash_handle, const char *p_name, const nvm_large_header_t *p_header )
+{
+  uint32_t chunk_cnt = p_header ? _large_chunk_cnt( p_header->total_len ) : 0;
+
+  for ( uint32_t chunk_idx = 0; chunk_idx < NVM_LARGE_MAX_CHUNKS; chunk_idx++ )
   {
-    err = nvs_flash_init();
-    if (err == ESP_ERR_NVS_NO_FREE_PAGES)
+    for ( uint32_t gen = 0; gen < 2; gen++ )
     {
-        nvs_flash_erase();
-        nvs_flash_init();
+      if ( ( chunk_idx < chunk_cnt ) && ( gen == _large_chunk_gen( p_header, chunk_idx ) ) )
+      {
+        continue;
+      }
+
+      char key[NVS_KEY_NAME_MAX_SIZE];
+      _large_chunk_key( key, p_name, chunk_idx, gen );
+      nvs_erase_key( flash_handle, key );
     }
   }
+}
 
-  nvs_handle flash_handle;
-  err = nvs_open( "storage", NVS_READWRITE, &flash_handle );
-  if (err != ESP_OK)
+//-----------------------------------------------------------------------------
+// begin() took write_mutex on the calling task, and only that task can give it back
+static bool _large_is_writer( void )
+{
+  return s_large.writing && ( s_large.writer == xTaskGetCurrentTaskHandle() );
+}
+
+//-----------------------------------------------------------------------------
+static esp_err_t _large_read_header( nvs_handle flash_handle, const char *p_name, nvm_large_header_t *p_header )
+{
+  size_t len = sizeof( *p_header );
+  esp_err_t err = nvs_get_blob( flash_handle, p_name, p_header, &len );
+  if ( err != ESP_OK )
   {
-      print( "Error (%d) opening NVS handle!\n", err);
+    return err;
+  }
+
+  if ( ( len != sizeof( *p_header ) ) || ( p_header->magic != NVM_LARGE_MAGIC ) ||
+       ( p_header->total_len > NVM_LARGE_MAX_SIZE ) )
+  {
+    return ESP_ERR_INVALID_CRC;
+  }
+
+  return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+// Writes the chunk sitting in write_scratch to the key the old header doesn't use, unless
+// flash already holds the same bytes
+static esp_err_t _large_flush_chunk( void )
+{
+  uint32_t chunk_idx = ( s_large.written - s_large.fill ) / NVM_LARGE_CHUNK_SIZE;
+  uint32_t crc       = esp_rom_crc32_le( 0, s_large.write_scratch, s_large.fill );
+
+  s_large.new_header.chunk_crc[chunk_idx] = crc;
+  s_large.new_header.value_crc = esp_rom_crc32_le( s_large.new_header.value_crc, s_large.write_scratch, s_large.fill );
+
+  bool unchanged = ( s_large.old_header.magic == NVM_LARGE_MAGIC ) &&
+                   ( chunk_idx < _large_chunk_cnt( s_large.old_header.total_len ) ) &&
+                   ( _large_chunk_len( s_large.old_header.total_len, chunk_idx ) == s_large.fill ) &&
+                   ( s_large.old_header.chunk_crc[chunk_idx] == crc );
+
+  // Chunks the old value doesn't reach have no live key, either one will do
+  uint32_t old_gen = ( s_large.old_header.magic == NVM_LARGE_MAGIC ) ? _large_chunk_gen( &s_large.old_header, chunk_idx ) : 1;
+  uint32_t new_gen = unchanged ? old_gen : !old_gen;
+  s_large.new_header.chunk_gen |= ( new_gen << chunk_idx );
+
+  esp_err_t err = ESP_OK;
+  if ( unchanged )
+  {
+    s_stats.writes_avoided++;
   }
   else
   {
-    bool table_dirty = false;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    _large_chunk_key( key, s_large.name, chunk_idx, new_gen );
+    err = nvs_set_blob( s_large.flash_handle, key, s_large.write_scratch, s_large.fill );
+    _account_write( s_large.fill );
+  }
+
+  s_large.fill = 0;
+  return err;
+}
+
+//-----------------------------------------------------------------------------
+esp_err_t nvm_large_write_begin( const char *p_name, size_t total_len )
+{
+  if ( !s_initialized )
+  {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  if ( !p_name || !strlen( p_name ) || ( strlen( p_name ) > NVM_LARGE_NAME_MAX ) ||
+       strpbrk( p_name, NVM_LARGE_KEY_SEPARATORS ) || ( total_len > NVM_LARGE_MAX_SIZE ) )
+  {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  xSemaphoreTake( s_large.write_mutex, portMAX_DELAY );
+
+  esp_err_t err = nvs_open( NVM_LARGE_NAMESPACE, NVS_READWRITE, &s_large.flash_handle );
+  if ( err != ESP_OK )
+  {
+    print( "Error (%d) opening NVS handle!\n", err);
+    xSemaphoreGive( s_large.write_mutex );
+    return err;
+  }
+
+  strcpy( s_large.name, p_name );
+  if ( _large_read_header( s_large.flash_handle, p_name, &s_large.old_header ) != ESP_OK )
+  {
+    memset( &s_large.old_header, 0, sizeof( s_large.old_header ) );
+  }
+
+  memset( &s_large.new_header, 0, sizeof( s_large.new_header ) );
+  s_large.new_header.magic     = NVM_LARGE_MAGIC;
+  s_large.new_header.total_len = total_len;
+
+  s_large.written = 0;
+  s_large.fill    = 0;
+  s_large.writer  = xTaskGetCurrentTaskHandle();
+  s_large.writing = true;
+
+  return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+// Any error ends the session like an abort, write_mutex must not stay held for a caller that
+// gives up without calling abort
+esp_err_t nvm_large_write( const void *p_data, size_t len )
+{
+  if ( !_large_is_writer() )
+  {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  if ( ( s_large.written + len ) > s_large.new_header.total_len )
+  {
+    nvm_large_write_abort();
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  const uint8_t *p_src = p_data;
+  while ( len )
+  {
+    size_t bytes_to_copy = MIN( len, NVM_LARGE_CHUNK_SIZE - s_large.fill );
+    memcpy( &s_large.write_scratch[s_large.fill], p_src, bytes_to_copy );
+
+    s_large.fill    += bytes_to_copy;
+    s_large.written += bytes_to_copy;
+    p_src           += bytes_to_copy;
+    len             -= bytes_to_copy;
 
-    for ( uint8_t idx = 0; idx < NVM_PARAM_COUNT; idx++ )
+    if ( s_large.fill == NVM_LARGE_CHUNK_SIZE )
     {
-      nvm_parameter_t *p_param = &nvm_params[idx];
-      
-      bool write_value = false;
-      // Treat Floats as blobs as they're not formally supported
-      if (( p_param->type == NVM_PARAM_TYPE_BLOB ) || ( p_param->type == NVM_PARAM_TYPE_FLOAT ))
-      {
-        uint8_t *p_dest   = (( p_param->type == NVM_PARAM_TYPE_FLOAT ) ? &p_param->value_float : p_param->p_blob );
-        size_t  param_len = (( p_param->type == NVM_PARAM_TYPE_FLOAT ) ? sizeof( float )       : p_param->blob_length );
-        
-        uint8_t temp_blob[param_len];
-        if ( ESP_OK == nvs_get_blob(flash_handle, p_param->p_name, temp_blob, &param_len) )
-        {
-          if ( first_pass )
-          {
-            memcpy( p_dest, temp_blob, param_len );
-            if ( p_param->type == NVM_PARAM_TYPE_FLOAT )
-              print( "Loaded NVM Param '%s': %f\n", p_param->p_name, p_param->value_float );
-            else
-              print( "Loaded NVM Param '%s'\n", p_param->p_name );
-          }
-          else if ( memcmp( p_dest, temp_blob, param_len ) != 0 )
-          {
-            write_value = true;
-            if ( p_param->type == NVM_PARAM_TYPE_FLOAT )
-              print( "Updating NVM Param '%s' from %f to %f\n", p_param->p_name, *(float*)temp_blob, p_param->value_float );
-            else
-              print( "Updating NVM Param '%s'\n", p_param->p_name );
-              
-            memcpy( temp_blob, p_dest, param_len );
-          }
-          else
-          {
-            print( "NOT Updating NVM Param '%s'\n", p_param->p_name );
-          }
-        }
-        else
-        {
-          print( "Error reading NVM Param: '%s', loading default\n", p_param->p_name );
-          err = nvs_erase_key(flash_handle, p_param->p_name);
-          if ( err != ESP_OK )
-          {
-            print("Error erasing key - 0X%X\n", err );
-          }
-          
-          if ( p_param->type == NVM_PARAM_TYPE_FLOAT )
-            p_param->value_float = p_param->default_value_float;
-          if ( p_param->type == NVM_PARAM_TYPE_BLOB )
-            memset( temp_blob, 0, param_len );
-
-          write_value = true;
-        }
-
-        if (write_value)
-        {
-          err = nvs_set_blob(flash_handle, p_param->p_name, temp_blob, param_len );
-          if ( err != ESP_OK )
-          {
-            print("Error writing NVM - 0X%X\n", err );
-          }
-
-          table_dirty = true;
-        }
-      }
-      else if ( p_param->type == NVM_PARAM_TYPE_INT )
+      esp_err_t err = _large_flush_chunk();
+      if ( err != ESP_OK )
       {
-        int32_t temp_read_val;
-        if ( ESP_OK == nvs_get_i32(flash_handle, p_param->p_name, &temp_read_val) )
-        {
-          if ( first_pass )
-          {
-            p_param->value_int = temp_read_val;
-            print( "Loaded NVM Param '%s': %i\n", p_param->p_name, p_param->value_int );
-          }
-          else if ( p_param->value_int != temp_read_val )
-          {
-            print( "Updating NVM Param '%s' from %i to %i\n", p_param->p_name, temp_read_val, p_param->value_int );
-            write_value = true;
-          }
-        }
-        else
-        {
-          print( "Error reading NVM Param: '%s', loading default\n", p_param->p_name );
-          err = nvs_erase_key(flash_handle, p_param->p_name);
-          if ( err != ESP_OK )
-          {
-            print("Error erasing key - 0X%X\n", err );
-          }
-
-          p_param->value_int = p_param->default_value_int;
-          write_value = true;
-        }
-        if (write_value)
-        {
-          err = nvs_set_i32(flash_handle, p_param->p_name, p_param->value_int );
-          if ( err != ESP_OK )
-          {
-            print("Error writing NVM - 0X%X\n", err );
-          }
-          table_dirty = true;
-        }
+        print( "Error writing NVM - 0X%X\n", err );
+        nvm_large_write_abort();
+        return err;
       }
     }
-    
-    if ( table_dirty )
+  }
+
+  return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+void nvm_large_write_abort( void )
+{
+  if ( !_large_is_writer() )
+  {
+    return;
+  }
+
+  // The header still points at the old chunks, so the old value reads back as it was.  The
+  // new chunks written so far sit under the other keys until the next write sweeps them up
+  nvs_close( s_large.flash_handle );
+  s_large.writing = false;
+  xSemaphoreGive( s_large.write_mutex );
+}
+
+//-----------------------------------------------------------------------------
+esp_err_t nvm_large_write_end( void )
+{
+  if ( !_large_is_writer() )
+  {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  if ( s_large.written != s_large.new_header.total_len )
+  {
+    nvm_large_write_abort();
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  esp_err_t err = ESP_OK;
+  if ( s_large.fill )
+  {
+    err = _large_flush_chunk();
+  }
+
+  if ( err == ESP_OK )
+  {
+    if ( memcmp( &s_large.old_header, &s_large.new_header, sizeof( s_large.new_header ) ) != 0 )
     {
-      if ( ESP_OK != nvs_commit(flash_handle) )
+      // The switch over, up to here a reset leaves the old value readable
+      err = nvs_set_blob( s_large.flash_handle, s_large.name, &s_large.new_header, sizeof( s_large.new_header ) );
+      _account_write( sizeof( s_large.new_header ) );
+
+      if ( err == ESP_OK )
       {
-        print("Error committing NVM\n" );
+        // Only now is the old generation unreferenced
+        _large_sweep_chunks( s_large.flash_handle, s_large.name, &s_large.new_header );
+        err = nvs_commit( s_large.flash_handle );
+        _account_commit();
       }
     }
+    else
+    {
+      s_stats.writes_avoided++;
+    }
+  }
 
-    nvs_close(flash_handle);
+  if ( err != ESP_OK )
+  {
+    print( "Error writing NVM value '%s' - 0X%X\n", s_large.name, err );
   }
-  first_pass = false;
+
+  nvs_close( s_large.flash_handle );
+  s_large.writing = false;
+  xSemaphoreGive( s_large.write_mutex );
+
+  return err;
 }
 
 //-----------------------------------------------------------------------------
-int32_t nvm_get_param_int32( nvm_param_t nvm_param )
+// Reads len bytes starting at offset.  Whole chunks go straight to p_dest, only partial ones
+// bounce through the scratch buffer.  Every chunk is checked against its CRC
+esp_err_t nvm_large_read( const char *p_name, size_t offset, void *p_dest, size_t len, size_t *p_read )
 {
-  xSemaphoreTake(s_access_mutex, portMAX_DELAY);
-  int32_t retv = nvm_params[nvm_param].value_int;
-  xSemaphoreGive(s_access_mutex);
-  return retv;
+  if ( p_read )
+  {
+    *p_read = 0;
+  }
+
+  if ( !s_initialized )
+  {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  if ( !p_name || ( strlen( p_name ) > NVM_LARGE_NAME_MAX ) )
+  {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  nvs_handle flash_handle;
+  esp_err_t err = nvs_open( NVM_LARGE_NAMESPACE, NVS_READONLY, &flash_handle );
+  if ( err != ESP_OK )
+  {
+    return err;
+  }
+
+  nvm_large_header_t header;
+  err = _large_read_header( flash_handle, p_name, &header );
+  if ( ( err == ESP_OK ) && ( offset > header.total_len ) )
+  {
+    err = ESP_ERR_INVALID_SIZE;
+  }
+
+  uint8_t *p_out    = p_dest;
+  size_t  remaining = ( err == ESP_OK ) ? MIN( len, header.total_len - offset ) : 0;
+
+  while ( remaining )
+  {
+    uint32_t chunk_idx    = offset / NVM_LARGE_CHUNK_SIZE;
+    size_t   chunk_offset = offset % NVM_LARGE_CHUNK_SIZE;
+    size_t   chunk_len    = _large_chunk_len( header.total_len, chunk_idx );
+    size_t   bytes_wanted = MIN( remaining, chunk_len - chunk_offset );
+    bool     direct       = ( chunk_offset == 0 ) && ( bytes_wanted == chunk_len );
+
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    _large_chunk_key( key, p_name, chunk_idx, _large_chunk_gen( &header, chunk_idx ) );
+
+    uint8_t *p_chunk = p_out;
+    if ( !direct )
+    {
+      xSemaphoreTake( s_large.read_mutex, portMAX_DELAY );
+      p_chunk = s_large.read_scratch;
+    }
+
+    size_t read_len = chunk_len;
+    err = nvs_get_blob( flash_handle, key, p_chunk, &read_len );
+    if ( ( err == ESP_OK ) &&
+         ( ( read_len != chunk_len ) || ( esp_rom_crc32_le( 0, p_chunk, chunk_len ) != header.chunk_crc[chunk_idx] ) ) )
+    {
+      err = ESP_ERR_INVALID_CRC;
+    }
+
+    if ( !direct )
+    {
+      if ( err == ESP_OK )
+      {
+        memcpy( p_out, &p_chunk[chunk_offset], bytes_wanted );
+      }
+      xSemaphoreGive( s_large.read_mutex );
+    }
+
+    if ( err != ESP_OK )
+    {
+      print( "Error reading NVM value '%s' chunk %u - 0X%X\n", p_name, chunk_idx, err );
+      break;
+    }
+
+    p_out     += bytes_wanted;
+    offset    += bytes_wanted;
+    remaining -= bytes_wanted;
+    if ( p_read )
+    {
+      *p_read += bytes_wanted;
+    }
+  }
+
+  nvs_close( flash_handle );
+  return err;
 }
 
 //-----------------------------------------------------------------------------
-float nvm_get_param_float( nvm_param_t nvm_param )
+esp_err_t nvm_large_get_info( const char *p_name, size_t *p_len, uint32_t *p_crc )
 {
-  xSemaphoreTake(s_access_mutex, portMAX_DELAY);
-  float retv = nvm_params[nvm_param].value_float;
-  xSemaphoreGive(s_access_mutex);
-  return retv;
+  if ( !s_initialized )
+  {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  if ( !p_name || ( strlen( p_name ) > NVM_LARGE_NAME_MAX ) )
+  {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  nvs_handle flash_handle;
+  esp_err_t err = nvs_open( NVM_LARGE_NAMESPACE, NVS_READONLY, &flash_handle );
+  if ( err != ESP_OK )
+  {
+    return err;
+  }
+
+  nvm_large_header_t header;
+  err = _large_read_header( flash_handle, p_name, &header );
+  if ( err == ESP_OK )
+  {
+    if ( p_len ) *p_len = header.total_len;
+    if ( p_crc ) *p_crc = header.value_crc;
+  }
+
+  nvs_close( flash_handle );
+  return err;
 }
 
 //-----------------------------------------------------------------------------
-void nvm_get_param_blob( nvm_param_t nvm_param, void *p_dest )
+esp_err_t nvm_large_erase( const char *p_name )
 {
-  xSemaphoreTake(s_access_mutex, portMAX_DELAY);
-  memcpy( p_dest, nvm_params[nvm_param].p_blob, nvm_params[nvm_param].blob_length );  
-  xSemaphoreGive(s_access_mutex);
+  if ( !s_initialized )
+  {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  if ( !p_name || ( strlen( p_name ) > NVM_LARGE_NAME_MAX ) )
+  {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  xSemaphoreTake( s_large.write_mutex, portMAX_DELAY );
+
+  nvs_handle flash_handle;
+  esp_err_t err = nvs_open( NVM_LARGE_NAMESPACE, NVS_READWRITE, &flash_handle );
+  if ( err == ESP_OK )
+  {
+    nvm_large_header_t header;
+    err = _large_read_header( flash_handle, p_name, &header );
+    if ( err == ESP_OK )
+    {
+      // Header first, a reset part way through then leaves orphaned chunks rather than a value
+      // with holes in it
+      nvs_erase_key( flash_handle, p_name );
+      _large_sweep_chunks( flash_handle, p_name, NULL );
+      err = nvs_commit( flash_handle );
+      _account_commit();
+    }
+
+    nvs_close( flash_handle );
+  }
+
+  xSemaphoreGive( s_large.write_mutex );
+  return err;
 }
 
+#ifdef CONFIG_NVM_GETTER_BENCHMARK
 //-----------------------------------------------------------------------------
-void nvm_set_param_int32( nvm_param_t nvm_param, int32_t new_val  )
-{
-  xSemaphoreTake(s_access_mutex, portMAX_DELAY);
-  nvm_params[nvm_param].value_int = new_val;
-  nvm_params_updated = true;
-  xSemaphoreGive(s_access_mutex);
-}
+static volatile bool s_benchmark_running;
 
 //-----------------------------------------------------------------------------
-void nvm_set_param_float( nvm_param_t nvm_param, float new_val )
+// Keeps flash commits going back to back for the duration of the benchmark
+static void _benchmark_writer_task( void *Param )
 {
-  xSemaphoreTake(s_access_mutex, portMAX_DELAY);
-  nvm_params[nvm_param].value_float = new_val;
-  nvm_params_updated = true;
-  xSemaphoreGive(s_access_mutex);
+  int32_t original = nvm_get_reset_counter();
+  int32_t toggle   = 0;
+
+  // Commits like the NVM task would, nvm_flush() would rewrite the snapshot every time
+  while ( s_benchmark_running )
+  {
+    nvm_set_reset_counter( original + ( toggle ^= 1 ) );
+    _write_dirty_params( false );
+  }
+
+  nvm_set_reset_counter( original );
+  _write_dirty_params( false );
+
+  s_benchmark_running = true;   // Hand-shake back to nvm_benchmark_getters()
+  vTaskDelete( NULL );
 }
 
 //-----------------------------------------------------------------------------
-void nvm_set_param_blob( nvm_param_t nvm_param, void *p_new_val )
+// Measures getter latency from the calling task while another task is continuously committing
+void nvm_benchmark_getters( nvm_getter_benchmark_t *p_result, uint32_t iterations )
 {
-  xSemaphoreTake(s_access_mutex, portMAX_DELAY);
-  memcpy( nvm_params[nvm_param].p_blob, p_new_val, nvm_params[nvm_param].blob_length );  
-  nvm_params_updated = true;
-  xSemaphoreGive(s_access_mutex);
+  memset( p_result, 0, sizeof( *p_result ) );
+  p_result->min_us = UINT32_MAX;
+
+  nvm_stats_t stats_before;
+  nvm_get_stats( &stats_before );
+
+  s_benchmark_running = true;
+  xTaskCreate( _benchmark_writer_task, "nvm_bench", 3072, NULL, uxTaskPriorityGet( NULL ), NULL );
+
+  uint64_t total_us = 0;
+  for ( uint32_t idx = 0; idx < iterations; idx++ )
+  {
+    uint64_t start_us = system_uptime_usec();
+    volatile int32_t value = nvm_get_reset_counter();
+    uint32_t elapsed_us = system_uptime_usec() - start_us;
+    (void)value;
+
+    total_us += elapsed_us;
+    p_result->min_us = MIN( p_result->min_us, elapsed_us );
+    p_result->max_us = MAX( p_result->max_us, elapsed_us );
+
+    // Give the writer a chance to run on single core parts
+    if ( ( idx % 1000 ) == 0 )
+    {
+      vTaskDelay( 1 );
+    }
+  }
+
+  s_benchmark_running = false;
+  while ( !s_benchmark_running )
+  {
+    vTaskDelay( 10 / portTICK_RATE_MS );
+  }
+  s_benchmark_running = false;
+
+  nvm_stats_t stats_after;
+  nvm_get_stats( &stats_after );
+
+  p_result->iterations = iterations;
+  p_result->avg_ns     = ( total_us * 1000 ) / MAX( 1, iterations );
+  p_result->commits    = stats_after.commits - stats_before.commits;
+
+  print( "NVM getter benchmark: %u reads during %u commits, min %u us, avg %u ns, max %u us\n",
+    p_result->iterations, p_result->commits, p_result->min_us, p_result->avg_ns, p_result->max_us );
 }
+#endif
 
 //-----------------------------------------------------------------------------
 static void _nvm_task(void *Param)
 {  
-  s_access_mutex = xSemaphoreCreateMutex();
+  // Also set by xTaskCreate(), but we may get going on the other core before that returns
+  s_task_handle = xTaskGetCurrentTaskHandle();
 
   // Initialize NVS
   esp_err_t error = nvs_flash_init();
@@ -268,37 +1499,42 @@ static void _nvm_task(void *Param)
     nvs_flash_init();
   }
   
-  _update_nvm();
-  
-  const uint32_t task_delay_ms = 1000;
+  _load_nvm();
   
   s_initialized = true;
+  startup_ready( STARTUP_NVM );
   
-  nvm_set_param_int32( NVM_PARAM_RESET_COUNTER, nvm_get_param_int32( NVM_PARAM_RESET_COUNTER ) + 1 );
+  nvm_set_reset_counter( nvm_get_reset_counter() + 1 );
   
   while(1)
   {
-    // TODO: Refactor to use eventbits
-    vTaskDelay( task_delay_ms / portTICK_RATE_MS);    
-    if ( nvm_params_updated )
+    // Sleep until a setter marks something dirty
+    ulTaskNotifyTake( pdTRUE, portMAX_DELAY );
+
+    // Fold a burst of sets into a single commit by waiting for things to go quiet
+    TickType_t start_tick = xTaskGetTickCount();
+    while ( ulTaskNotifyTake( pdTRUE, pdMS_TO_TICKS( CONFIG_NVM_WRITE_DEBOUNCE_MS ) ) &&
+            ( ( xTaskGetTickCount() - start_tick ) < pdMS_TO_TICKS( MAX_WRITE_DELAY_MS ) ) )
     {
-      xSemaphoreTake(s_access_mutex, portMAX_DELAY);
-      print("NVM Params updated, writing to flash\n");
-      nvm_params_updated = false;
-      _update_nvm();
-      xSemaphoreGive(s_access_mutex);
     }
+
+    TRACE_BEGIN( "nvm write" );
+    _write_dirty_params( false );
+    TRACE_END( "nvm write" );
   }
 }
 
 //-----------------------------------------------------------------------------
+// Returns straight away, loading happens on the task.  STARTUP_NVM is signalled once the
+// parameters are in RAM, anything that reads them at boot should depend on it
 void nvm_init( void )
 { 
-  xTaskCreate( _nvm_task, "_nvm_task", 4096, NULL, 0, NULL );
-  
-  // Lots of things rely on NVM, block until the task is up and ready
-  while ( !s_initialized )
-  {
-    vTaskDelay( 10 / portTICK_RATE_MS);
-  }
+  s_access_mutex = xSemaphoreCreateMutex();
+  s_write_mutex  = xSemaphoreCreateMutex();
+  vQueueAddToRegistry( s_access_mutex, "nvm_access" );
+  vQueueAddToRegistry( s_write_mutex,  "nvm_write" );
+  s_large.write_mutex = xSemaphoreCreateMutexStatic( &s_large.write_mutex_buffer );
+  s_large.read_mutex  = xSemaphoreCreateMutexStatic( &s_large.read_mutex_buffer );
+
+  s_task_handle = task_create( _nvm_task, "_nvm_task", CONFIG_TASK_STACK_NVM, 0, TASK_STATIC_BUFFERS( s_nvm_task ) );
 }
\ No newline at end of file
@@ -2,26 +2,134 @@
 #define _NVM_H_
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <esp_err.h>
+
+// Blob parameters only need their struct declared here, nvm.c includes the full definitions
+struct wear_record_s;
+struct wifi_cache_s;
+struct ota_history_s;
+
+//-----------------------------------------------------------------------------
+// Bump whenever a parameter is renamed, retyped or reinterpreted, and add the matching
+// entry to s_migrations[] in nvm.c.  Adding a new parameter doesn't need a bump, missing
+// keys are filled in with their defaults at boot
+#define NVM_SCHEMA_VERSION    ( 1 )
 
 //-----------------------------------------------------------------------------
+// The one place parameters are defined.  Everything else (the nvm_param_t enum, the table in
+// nvm.c, RAM storage and the typed nvm_get_<name>() / nvm_set_<name>() accessors) is generated.
+// The lower case name doubles as the NVS key, so it's limited to 15 characters.
+//
+//   INT(   ID, name, default )
+//   FLOAT( ID, name, default )
+//   BLOB(  ID, name, type )        Stored as sizeof(type) bytes, defaults to all zeros.  May be an
+//                                  incomplete struct here, only nvm.c needs the definition
+//   STR(   ID, name, max_len )     max_len excludes the terminator, defaults to ""
+#define NVM_PARAM_LIST( INT, FLOAT, BLOB, STR )                                        \
+  INT(  RESET_COUNTER, reset_counter, 0 )                                               \
+  BLOB( FLASH_WEAR,    flash_wear,    struct wear_record_s )                            \
+  BLOB( WIFI_CACHE,    wifi_cache,    struct wifi_cache_s )                             \
+  BLOB( OTA_HISTORY,   ota_history,   struct ota_history_s )
+
+//-----------------------------------------------------------------------------
+#define _NVM_ENUM_ENTRY( id, ... )    NVM_PARAM_##id,
+
 typedef enum
 {
-  NVM_PARAM_RESET_COUNTER,
+  NVM_PARAM_LIST( _NVM_ENUM_ENTRY, _NVM_ENUM_ENTRY, _NVM_ENUM_ENTRY, _NVM_ENUM_ENTRY )
   NVM_PARAM_COUNT,
 } nvm_param_t;
 
-#define NUM_FEED_SCHEDULES    (NVM_PARAM_FEED_SCHED_5 - NVM_PARAM_FEED_SCHED_0 + 1)
+typedef struct
+{
+  uint32_t writes;            // Keys written to flash
+  uint32_t writes_avoided;    // Sets that didn't cost a flash write (unchanged, or folded into a pending write)
+  uint32_t commits;           // nvs_commit calls
+  uint32_t load_time_us;      // Time spent pulling parameters out of flash at boot
+  uint32_t per_key_load_us;   // What the last load without the snapshot took, to compare against
+  bool     loaded_from_snapshot;
+} nvm_stats_t;
+
+typedef struct
+{
+  uint32_t iterations;
+  uint32_t commits;           // Flash commits that completed while the getters were running
+  uint32_t min_us;
+  uint32_t avg_ns;
+  uint32_t max_us;
+} nvm_getter_benchmark_t;
 
 //-----------------------------------------------------------------------------
 void nvm_init( void );
+esp_err_t nvm_flush( void );  // Writes pending changes and the snapshot now, call before rebooting
+void nvm_get_stats( nvm_stats_t *p_stats );
+
+// Sets made between these land in flash together, in one commit.  Nestable, and nvm_flush()
+// fails with ESP_ERR_INVALID_STATE while one is open, so keep them short
+void nvm_transaction_begin( void );
+void nvm_transaction_end( void );
 
 void    nvm_reset(void);
+
+// Untyped access by index, prefer the generated nvm_get_<name>() / nvm_set_<name>() below
 int32_t nvm_get_param_int32(nvm_param_t nvm_param);
 float   nvm_get_param_float(nvm_param_t nvm_param);
-void    nvm_get_param_blob(nvm_param_t nvm_param, void *p_dest);  // No bounds safety, use at your own risk
+void    nvm_get_param_blob(nvm_param_t nvm_param, void *p_dest, size_t dest_size);
+void    nvm_get_param_str(nvm_param_t nvm_param, char *p_dest, size_t dest_size);
 
 void    nvm_set_param_int32(nvm_param_t nvm_param, int32_t new_val);
 void    nvm_set_param_float(nvm_param_t nvm_param, float new_val);
-void    nvm_set_param_blob(nvm_param_t nvm_param, void *p_new_val);
+void    nvm_set_param_blob(nvm_param_t nvm_param, const void *p_new_val, size_t len);
+bool    nvm_set_param_str(nvm_param_t nvm_param, const char *p_new_val);      // Returns false if truncated
+
+//-----------------------------------------------------------------------------
+// Streaming storage for values too big for the parameter table (certificates, calibration
+// tables).  Values are identified by name, written in one begin/write.../end session and read
+// back in arbitrary ranges.  Only one write session runs at a time, others block in begin, and
+// the session belongs to the task that began it: write, end and abort from any other task fail.
+// An error from the writer's write or end ends the session as an abort would.  Until end
+// returns, an abort or a reset leaves the previous value intact.  Rewriting a value with mostly
+// unchanged content only touches the chunks that differ
+#define NVM_LARGE_NAME_MAX      ( 11 )      // Leaves room for the '#nn' chunk suffix in a 15 char NVS key, no '#' or '~'
+#define NVM_LARGE_CHUNK_SIZE    ( 1024 )    // Also the size of the scratch buffers
+#define NVM_LARGE_MAX_CHUNKS    ( 32 )
+#define NVM_LARGE_MAX_SIZE      ( NVM_LARGE_MAX_CHUNKS * NVM_LARGE_CHUNK_SIZE )
+
+esp_err_t nvm_large_write_begin( const char *p_name, size_t total_len );
+esp_err_t nvm_large_write( const void *p_data, size_t len );
+esp_err_t nvm_large_write_end( void );      // Commits, fails if fewer than total_len bytes were written
+void      nvm_large_write_abort( void );
+
+esp_err_t nvm_large_read( const char *p_name, size_t offset, void *p_dest, size_t len, size_t *p_read );
+esp_err_t nvm_large_get_info( const char *p_name, size_t *p_len, uint32_t *p_crc );
+esp_err_t nvm_large_erase( const char *p_name );
+
+#ifdef CONFIG_NVM_GETTER_BENCHMARK
+void    nvm_benchmark_getters( nvm_getter_benchmark_t *p_result, uint32_t iterations );
+#endif
+
+//-----------------------------------------------------------------------------
+// Typed accessors.  The index is a constant, so these compile down to a direct table access
+#define _NVM_INT_ACCESSORS( id, name, default_value )                                                             \
+  static inline int32_t nvm_get_##name( void )            { return nvm_get_param_int32( NVM_PARAM_##id ); }         \
+  static inline void    nvm_set_##name( int32_t new_val ) { nvm_set_param_int32( NVM_PARAM_##id, new_val ); }
+
+#define _NVM_FLOAT_ACCESSORS( id, name, default_value )                                                           \
+  static inline float   nvm_get_##name( void )            { return nvm_get_param_float( NVM_PARAM_##id ); }         \
+  static inline void    nvm_set_##name( float new_val )   { nvm_set_param_float( NVM_PARAM_##id, new_val ); }
+
+// Blob lengths are clamped to the parameter's own size, so these can get by without sizeof
+#define _NVM_BLOB_ACCESSORS( id, name, blob_type )                                                                 \
+  static inline void    nvm_get_##name( blob_type *p_dest )          { nvm_get_param_blob( NVM_PARAM_##id, p_dest, SIZE_MAX ); }     \
+  static inline void    nvm_set_##name( const blob_type *p_new_val ) { nvm_set_param_blob( NVM_PARAM_##id, p_new_val, SIZE_MAX ); }
+
+#define _NVM_STR_ACCESSORS( id, name, max_len )                                                                    \
+  enum { NVM_##id##_MAX_LEN = ( max_len ) };                                                                       \
+  static inline void    nvm_get_##name( char *p_dest, size_t dest_size ) { nvm_get_param_str( NVM_PARAM_##id, p_dest, dest_size ); } \
+  static inline bool    nvm_set_##name( const char *p_new_val )          { return nvm_set_param_str( NVM_PARAM_##id, p_new_val ); }
+
+NVM_PARAM_LIST( _NVM_INT_ACCESSORS, _NVM_FLOAT_ACCESSORS, _NVM_BLOB_ACCESSORS, _NVM_STR_ACCESSORS )
 
 #endif
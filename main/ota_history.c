@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <esp_ota_ops.h>
+
+#include "utils.h"
+#include "nvm.h"
+#include "ota_history.h"
+
+#define UNIX_TIME_2020    ( 1577836800 )      // Anything earlier and the clock was never set
+
+static const char * const s_stage_names[] = { "", "begin", "recv", "write", "end", "set_boot" };
+
+//-----------------------------------------------------------------------------
+uint8_t ota_chunk_bucket( uint32_t bytes, uint32_t buffer_size )
+{
+  uint8_t bucket = 0;
+  for ( uint32_t limit = buffer_size >> ( OTA_CHUNK_BUCKET_CNT - 2 ); ( bytes >= limit ) && ( bucket < OTA_CHUNK_BUCKET_CNT - 1 ); limit <<= 1 )
+  {
+    bucket++;
+  }
+  return bucket;
+}
+
+//-----------------------------------------------------------------------------
+void ota_history_add( ota_profile_t *p_profile )
+{
+  const esp_app_desc_t *p_app_desc = esp_ota_get_app_description();
+  snprintf( p_profile->fw_version, sizeof( p_profile->fw_version ), "%s", p_app_desc->version );
+
+  time_t now = time( NULL );
+  p_profile->unix_time = ( now > UNIX_TIME_2020 ) ? now : 0;
+
+  // Only the httpd task adds, so read, modify, write is safe
+  ota_history_t history;
+  nvm_get_ota_history( &history );
+  history.profiles[history.next % OTA_HISTORY_DEPTH] = *p_profile;
+  history.next = ( history.next + 1 ) % OTA_HISTORY_DEPTH;
+  history.cnt  = MIN( history.cnt + 1, OTA_HISTORY_DEPTH );
+  nvm_set_ota_history( &history );
+}
+
+//-----------------------------------------------------------------------------
+uint16_t ota_profile_get_json( const ota_profile_t *p_profile, char *p_buffer, size_t buffer_size )
+{
+  uint32_t kbps = p_profile->total_ms ? p_profile->bytes / p_profile->total_ms : 0;
+  int len = snprintf( p_buffer, buffer_size,
+    "{\"fw_version\":\"%.16s\",\"unix_time\":%u,\"error\":\"%s\",\"bytes\":%u,\"total_ms\":%u,\"kbytes_per_s\":%u,"
+    "\"recv_ms\":%u,\"write_ms\":%u,\"erase_ms\":%u,\"end_ms\":%u,\"set_boot_ms\":%u,"
+    "\"recv_calls\":%u,\"recv_timeouts\":%u,\"chunks\":{\"<1/8\":%u,\"<1/4\":%u,\"<1/2\":%u,\"<full\":%u,\"full\":%u},"
+    "\"heap_drop\":%u}",
+    p_profile->fw_version, p_profile->unix_time, s_stage_names[MIN( p_profile->failed_stage, ARRAY_SIZE( s_stage_names ) - 1 )],
+    p_profile->bytes, p_profile->total_ms, kbps, p_profile->recv_ms, p_profile->write_ms, p_profile->erase_ms,
+    p_profile->end_ms, p_profile->set_boot_ms, p_profile->recv_calls, p_profile->recv_timeouts,
+    p_profile->chunk_hist[0], p_profile->chunk_hist[1], p_profile->chunk_hist[2], p_profile->chunk_hist[3], p_profile->chunk_hist[4],
+    p_profile->heap_drop );
+
+  return MIN( len, buffer_size - 1 );
+}
+
+//-----------------------------------------------------------------------------
+uint16_t ota_history_get_json( char *p_buffer, size_t buffer_size )
+{
+  ota_history_t history;
+  nvm_get_ota_history( &history );
+
+  // The closing bracket always gets its byte, profiles that don't fit whole are left out
+  size_t room = buffer_size - 1;
+  size_t len  = snprintf( p_buffer, room, "[" );
+  for ( uint8_t i = 0; i < MIN( history.cnt, OTA_HISTORY_DEPTH ); i++ )
+  {
+    uint8_t idx   = ( history.next + OTA_HISTORY_DEPTH - history.cnt + i ) % OTA_HISTORY_DEPTH;
+    size_t  start = len;
+    len += snprintf( p_buffer + len, room - len, i ? "," : "" );
+    len += ( len + 1 < room ) ? ota_profile_get_json( &history.profiles[idx], p_buffer + len, room - len ) : 0;
+    if ( len + 1 >= room )
+    {
+      len = start;
+      break;
+    }
+  }
+  p_buffer[len++] = ']';
+  p_buffer[len]   = '\0';
+
+  return len;
+}
@@ -0,0 +1,56 @@
+#ifndef _OTA_HISTORY_H_
+#define _OTA_HISTORY_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define OTA_HISTORY_DEPTH         ( 8 )
+#define OTA_CHUNK_BUCKET_CNT      ( 5 )       // Receive sizes < 1/8, < 1/4, < 1/2 and < all of the buffer, and full buffers
+
+typedef enum
+{
+  OTA_STAGE_NONE,             // Succeeded
+  OTA_STAGE_BEGIN,
+  OTA_STAGE_RECV,
+  OTA_STAGE_WRITE,
+  OTA_STAGE_END,              // Image didn't validate
+  OTA_STAGE_SET_BOOT,
+} ota_stage_t;
+
+// One upload, as seen by _ota_post_handler().  Kept small, the whole history is an NVM blob
+typedef struct
+{
+  char     fw_version[16];    // Firmware that received the upload, so regressions line up with releases
+  uint32_t unix_time;         // 0 if NTP hadn't synced yet
+  uint32_t bytes;
+  uint32_t total_ms;
+  uint32_t recv_ms;           // Waiting in httpd_req_recv()
+  uint32_t write_ms;          // esp_ota_write() calls that only programmed
+  uint32_t erase_ms;          // esp_ota_write() calls that erased a sector first, program time included
+  uint32_t end_ms;            // esp_ota_end(), which reads the image back and checks it
+  uint32_t set_boot_ms;       // esp_ota_set_boot_partition()
+  uint32_t recv_calls;
+  uint16_t recv_timeouts;
+  uint16_t chunk_hist[OTA_CHUNK_BUCKET_CNT];
+  uint32_t heap_drop;         // Free heap at the start less the lowest it got during the upload, esp_ota_*() included
+  uint8_t  failed_stage;      // ota_stage_t
+  uint8_t  reserved[3];
+} ota_profile_t;
+
+typedef struct ota_history_s
+{
+  uint8_t        next;        // Slot the next profile goes into
+  uint8_t        cnt;
+  uint8_t        reserved[2];
+  ota_profile_t  profiles[OTA_HISTORY_DEPTH];
+} ota_history_t;
+
+uint8_t  ota_chunk_bucket( uint32_t bytes, uint32_t buffer_size );   // For a receive of bytes into a buffer_size buffer
+
+// Stamps the firmware version and time, and stores it in the NVM backed history
+void     ota_history_add( ota_profile_t *p_profile );
+
+uint16_t ota_profile_get_json( const ota_profile_t *p_profile, char *p_buffer, size_t buffer_size );
+uint16_t ota_history_get_json( char *p_buffer, size_t buffer_size );     // Oldest first
+
+#endif
@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <driver/timer.h>
+#include <esp_attr.h>
+#include <esp_debug_helpers.h>
+#include <esp_heap_caps.h>
+#include <esp_ipc.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/xtensa_context.h>
+#include <soc/cpu.h>
+
+#include "utils.h"
+#include "profiler.h"
+
+#if CONFIG_PROFILER
+
+#define TIMER_DIVIDER         ( 80 )          // 1 MHz off the 80 MHz APB clock
+#define TIMER_HZ              ( 80 * mHz / TIMER_DIVIDER )
+#define MAX_TASK_NAMES        ( 32 )
+
+// Core 0 gets group 0 and core 1 group 1, so each core's interrupt is allocated on that core
+#if portNUM_PROCESSORS > 1
+static const timer_group_t s_timer_groups[2] = { TIMER_GROUP_0, TIMER_GROUP_1 };
+#else
+static const timer_group_t s_timer_groups[1] = { TIMER_GROUP_0 };
+#endif
+
+typedef struct
+{
+  uint32_t  task;                   // The interrupted TCB, with the core in bit 0
+  uint32_t  pcs[PROFILER_DEPTH];    // Innermost first, 0 past the end of the backtrace
+} sample_t;
+
+typedef struct
+{
+  uint32_t  task;
+  char      name[configMAX_TASK_NAME_LEN];
+} task_name_t;
+
+// The bulk of it, allocated by the first start and kept after a stop for GET /profiler.  Internal
+// RAM, the interrupt writes samples while the flash cache may be off
+typedef struct
+{
+  task_name_t task_names[MAX_TASK_NAMES];     // Tasks alive when it stopped
+  uint8_t     task_name_cnt;
+  char        line[512];
+  sample_t    samples[CONFIG_PROFILER_SAMPLES];
+} profile_t;
+
+typedef struct
+{
+  bool        running;
+  uint16_t    hz;
+  uint32_t    sample_cnt;           // Taken, including those that didn't fit
+  uint64_t    start_usec;
+  uint32_t    duration_ms;
+  profile_t   *p_profile;           // NULL until the first start
+} profiler_t;
+
+static profiler_t  s_profiler;
+
+//-----------------------------------------------------------------------------
+// Level 1, so it never nests inside another interrupt and the port has saved the interrupted
+// task's exception frame, windows spilled, where its TCB's pxTopOfStack points.  Time spent with
+// interrupts masked shows up where they were unmasked.  IRAM so it still samples while the flash
+// cache is off, i.e. during OTA writes
+static bool IRAM_ATTR _sample_isr( void *p_arg )
+{
+  uint32_t     core = xPortGetCoreID();
+  TaskHandle_t task = xTaskGetCurrentTaskHandleForCPU( core );
+  if ( !task )
+  {
+    return false;
+  }
+
+  uint32_t idx = __atomic_fetch_add( &s_profiler.sample_cnt, 1, __ATOMIC_RELAXED );
+  if ( idx >= CONFIG_PROFILER_SAMPLES )
+  {
+    return false;
+  }
+
+  const XtExcFrame *p_frame = *(const XtExcFrame **)task;
+  sample_t         *p_sample = &s_profiler.p_profile->samples[idx];
+
+  p_sample->task   = (uint32_t)task | core;
+  p_sample->pcs[0] = p_frame->pc;
+
+  esp_backtrace_frame_t frame = { .pc = p_frame->pc, .sp = p_frame->a1, .next_pc = p_frame->a0 };
+  for ( uint8_t depth = 1; depth < PROFILER_DEPTH; depth++ )
+  {
+    bool valid = ( frame.next_pc != 0 ) && esp_backtrace_get_next_frame( &frame );
+    p_sample->pcs[depth] = valid ? esp_cpu_process_stack_pc( frame.pc ) : 0;
+    if ( !valid )
+    {
+      frame.next_pc = 0;
+    }
+  }
+
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+// Through esp_ipc so the interrupt is allocated on, and later freed from, the core it samples
+static void _start_on_core( void *p_arg )
+{
+  uint32_t      core   = (uint32_t)p_arg;
+  timer_group_t group  = s_timer_groups[core];
+  uint32_t      period = TIMER_HZ / s_profiler.hz;
+
+  timer_config_t config =
+  {
+    .divider     = TIMER_DIVIDER,
+    .counter_dir = TIMER_COUNT_UP,
+    .counter_en  = TIMER_PAUSE,
+    .alarm_en    = TIMER_ALARM_EN,
+    .auto_reload = TIMER_AUTORELOAD_EN,
+  };
+  timer_init( group, TIMER_0, &config );
+
+  // Half a period apart, so the cores aren't both interrupted at once
+  timer_set_counter_value( group, TIMER_0, core * period / 2 );
+  timer_set_alarm_value( group, TIMER_0, period );
+  timer_enable_intr( group, TIMER_0 );
+  timer_isr_callback_add( group, TIMER_0, _sample_isr, NULL, ESP_INTR_FLAG_LEVEL1 | ESP_INTR_FLAG_IRAM );
+  timer_start( group, TIMER_0 );
+}
+
+//-----------------------------------------------------------------------------
+static void _stop_on_core( void *p_arg )
+{
+  timer_group_t group = s_timer_groups[(uint32_t)p_arg];
+
+  timer_pause( group, TIMER_0 );
+  timer_isr_callback_remove( group, TIMER_0 );
+  timer_deinit( group, TIMER_0 );
+}
+
+//-----------------------------------------------------------------------------
+bool profiler_start( uint16_t hz )
+{
+  if ( s_profiler.running )
+  {
+    return false;
+  }
+
+  if ( !s_profiler.p_profile )
+  {
+    s_profiler.p_profile = heap_caps_malloc( sizeof( profile_t ), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT );
+    if ( !s_profiler.p_profile )
+    {
+      print( "Profiler needs %u bytes, not enough free\n", sizeof( profile_t ) );
+      return false;
+    }
+  }
+  s_profiler.p_profile->task_name_cnt = 0;
+
+  s_profiler.running     = true;
+  s_profiler.hz          = CLAMP( hz, PROFILER_MIN_HZ, PROFILER_MAX_HZ );
+  s_profiler.sample_cnt  = 0;
+  s_profiler.start_usec  = system_uptime_usec();
+  s_profiler.duration_ms = 0;
+
+  print( "Profiling at %u Hz a core, room for %u samples\n", s_profiler.hz, CONFIG_PROFILER_SAMPLES );
+  for ( uint32_t core = 0; core < portNUM_PROCESSORS; core++ )
+  {
+    esp_ipc_call_blocking( core, _start_on_core, (void *)core );
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+void profiler_stop( void )
+{
+  if ( !s_profiler.running )
+  {
+    return;
+  }
+
+  for ( uint32_t core = 0; core < portNUM_PROCESSORS; core++ )
+  {
+    esp_ipc_call_blocking( core, _stop_on_core, (void *)core );
+  }
+  s_profiler.running     = false;
+  s_profiler.duration_ms = ( system_uptime_usec() - s_profiler.start_usec ) / 1000;
+
+  // Names now, a task that has since gone just shows as its TCB address
+  profile_t    *p_profile = s_profiler.p_profile;
+  TaskStatus_t *p_status  = malloc( MAX_TASK_NAMES * sizeof( TaskStatus_t ) );
+  p_profile->task_name_cnt = p_status ? uxTaskGetSystemState( p_status, MAX_TASK_NAMES, NULL ) : 0;
+  for ( uint8_t i = 0; i < p_profile->task_name_cnt; i++ )
+  {
+    p_profile->task_names[i].task = (uint32_t)p_status[i].xHandle;
+    snprintf( p_profile->task_names[i].name, sizeof( p_profile->task_names[i].name ), "%s", p_status[i].pcTaskName );
+  }
+  free( p_status );
+
+  print( "Profiler stopped after %u ms, %u samples\n", s_profiler.duration_ms, s_profiler.sample_cnt );
+}
+
+//-----------------------------------------------------------------------------
+bool profiler_is_running( void )
+{
+  return s_profiler.running;
+}
+
+//-----------------------------------------------------------------------------
+static const char *_task_name( uint32_t task )
+{
+  static char address[12];
+  const profile_t *p_profile = s_profiler.p_profile;
+  for ( uint8_t i = 0; i < p_profile->task_name_cnt; i++ )
+  {
+    if ( p_profile->task_names[i].task == task )
+    {
+      return p_profile->task_names[i].name;
+    }
+  }
+
+  snprintf( address, sizeof( address ), "0x%08x", task );
+  return address;
+}
+
+//-----------------------------------------------------------------------------
+void profiler_write_samples( profiler_write_t write, void *p_ctx )
+{
+  profile_t *p_profile = s_profiler.p_profile;
+  if ( !p_profile )
+  {
+    static const char never_run[] = "# samples 0\n";
+    write( p_ctx, never_run, sizeof( never_run ) - 1 );
+    return;
+  }
+
+  char     *p_line = p_profile->line;
+  uint32_t kept    = MIN( s_profiler.sample_cnt, CONFIG_PROFILER_SAMPLES );
+  uint16_t len     = snprintf( p_line, sizeof( p_profile->line ),
+    "# hz %u\n# duration_ms %u\n# samples %u\n# dropped %u\n# core task pc...\n",
+    s_profiler.hz, s_profiler.duration_ms, kept, s_profiler.sample_cnt - kept );
+
+  for ( uint32_t idx = 0; idx < kept; idx++ )
+  {
+    // Task names can't have spaces in them here, the rest of the line is split on them
+    const sample_t *p_sample = &p_profile->samples[idx];
+    char            name[configMAX_TASK_NAME_LEN];
+    snprintf( name, sizeof( name ), "%s", _task_name( p_sample->task & ~1UL ) );
+    for ( char *p_char = name; *p_char; p_char++ )
+    {
+      *p_char = ( *p_char == ' ' ) ? '_' : *p_char;
+    }
+
+    // Flush early enough that a whole line always fits
+    if ( len > sizeof( p_profile->line ) - ( 4 + configMAX_TASK_NAME_LEN + 11 * PROFILER_DEPTH ) )
+    {
+      write( p_ctx, p_line, len );
+      len = 0;
+    }
+
+    len += sprintf( p_line + len, "%u %s", p_sample->task & 1, name );
+    for ( uint8_t depth = 0; ( depth < PROFILER_DEPTH ) && p_sample->pcs[depth]; depth++ )
+    {
+      len += sprintf( p_line + len, " 0x%08x", p_sample->pcs[depth] );
+    }
+    len += sprintf( p_line + len, "\n" );
+  }
+
+  write( p_ctx, p_line, len );
+}
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef _PROFILER_H_
+#define _PROFILER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define PROFILER_DEPTH      ( 4 )       // The interrupted PC and three callers
+#define PROFILER_MIN_HZ     ( 10 )
+#define PROFILER_MAX_HZ     ( 2000 )    // Per core
+
+typedef void (*profiler_write_t)( void *p_ctx, const char *p_text, size_t len );
+
+// Takes a timer interrupt on each core at hz, clamped to PROFILER_MIN_HZ..PROFILER_MAX_HZ, and
+// keeps the first CONFIG_PROFILER_SAMPLES.  Nothing runs while stopped.  The first start allocates
+// the sample buffer, which then stays for the samples to be read.  False if already running or the
+// buffer couldn't be allocated
+bool profiler_start( uint16_t hz );
+void profiler_stop( void );
+bool profiler_is_running( void );
+
+// One sample a line, "core task pc caller...", for tools/profile_fold.py.  Only once stopped
+void profiler_write_samples( profiler_write_t write, void *p_ctx );
+
+#endif
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+
+#include "utils.h"
+#include "startup.h"
+
+// Event groups keep the top byte for themselves
+_Static_assert( STARTUP_STAGE_CNT <= 24, "Too many startup stages for one event group" );
+
+#define ALL_STAGE_BITS    ( STARTUP_BIT( STARTUP_STAGE_CNT ) - 1 )
+
+typedef struct
+{
+  uint64_t  start_usec;     // Since boot, 0 for milestones
+  uint64_t  ready_usec;     // 0 until ready
+} stage_timing_t;
+
+typedef struct
+{
+  StaticEventGroup_t  event_group_buffer;
+  EventGroupHandle_t  event_group;
+  stage_timing_t      timing[STARTUP_STAGE_CNT];
+} startup_ctx_t;
+
+static startup_ctx_t s_startup;
+
+static const char * const s_stage_names[STARTUP_STAGE_CNT] =
+{
+  [STARTUP_TIMERS]              = "timers",
+  [STARTUP_DEBUG]               = "debug",
+  [STARTUP_NVM]                 = "nvm",
+  [STARTUP_WEAR]                = "wear",
+  [STARTUP_HARDWARE]            = "hardware",
+  [STARTUP_WIFI]                = "wifi",
+  [STARTUP_ETHERNET]            = "ethernet",
+  [STARTUP_TIMESERIES]          = "timeseries",
+  [STARTUP_APPLICATION]         = "application",
+  [STARTUP_NETWORK]             = "network up",
+  [STARTUP_FIRST_HTTP_REQUEST]  = "first http request",
+};
+
+//-----------------------------------------------------------------------------
+void startup_run( const startup_stage_desc_t *p_stages, uint8_t stage_cnt )
+{
+  EventGroupHandle_t event_group = xEventGroupCreateStatic( &s_startup.event_group_buffer );
+  s_startup.event_group = event_group;
+
+  uint32_t scheduled_bits = 0;
+  uint32_t started_bits   = 0;
+
+  for ( uint8_t idx = 0; idx < stage_cnt; idx++ )
+  {
+    scheduled_bits |= STARTUP_BIT( p_stages[idx].stage );
+  }
+
+  while ( started_bits != scheduled_bits )
+  {
+    uint32_t ready_bits = xEventGroupGetBits( event_group );
+    bool started_any = false;
+
+    for ( uint8_t idx = 0; idx < stage_cnt; idx++ )
+    {
+      const startup_stage_desc_t *p_stage = &p_stages[idx];
+      uint32_t stage_bit = STARTUP_BIT( p_stage->stage );
+
+      if ( ( started_bits & stage_bit ) || ( ( ready_bits & p_stage->depends_on ) != p_stage->depends_on ) )
+      {
+        continue;
+      }
+
+      started_bits |= stage_bit;
+      started_any   = true;
+      s_startup.timing[p_stage->stage].start_usec = system_uptime_usec();
+      p_stage->init_func();
+
+      if ( !p_stage->signals_ready )
+      {
+        startup_ready( p_stage->stage );
+      }
+    }
+
+    if ( !started_any )
+    {
+      // Sleep until anything else becomes ready, then see what that unblocked
+      xEventGroupWaitBits( event_group, ALL_STAGE_BITS & ~ready_bits, pdFALSE, pdFALSE, portMAX_DELAY );
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+void startup_ready( startup_stage_t stage )
+{
+  uint64_t zero = 0;
+  __atomic_compare_exchange_n( &s_startup.timing[stage].ready_usec, &zero, system_uptime_usec(), false, __ATOMIC_RELAXED, __ATOMIC_RELAXED );
+  xEventGroupSetBits( s_startup.event_group, STARTUP_BIT( stage ) );
+}
+
+//-----------------------------------------------------------------------------
+void startup_wait( uint32_t stage_bits )
+{
+  xEventGroupWaitBits( s_startup.event_group, stage_bits, pdFALSE, pdTRUE, portMAX_DELAY );
+}
+
+//-----------------------------------------------------------------------------
+uint16_t startup_get_timeline( char *p_buffer, uint16_t buffer_size, const char *p_line_end )
+{
+  uint16_t len = 0;
+
+  for ( uint8_t stage = 0; ( stage < STARTUP_STAGE_CNT ) && ( len < buffer_size ); stage++ )
+  {
+    const stage_timing_t *p_timing = &s_startup.timing[stage];
+    uint32_t start_us = p_timing->start_usec;
+    uint32_t ready_us = p_timing->ready_usec;
+
+    if ( !start_us && !ready_us && ( stage < STARTUP_NETWORK ) )
+    {
+      continue;     // Not started yet, or not in this build's stage table at all
+    }
+    else if ( !ready_us )
+    {
+      len += snprintf( p_buffer + len, buffer_size - len, "%-20s pending%s", s_stage_names[stage], p_line_end );
+    }
+    else if ( !start_us )
+    {
+      len += snprintf( p_buffer + len, buffer_size - len, "%-20s reached %4u.%03u ms%s",
+        s_stage_names[stage], ready_us / 1000, ready_us % 1000, p_line_end );
+    }
+    else
+    {
+      len += snprintf( p_buffer + len, buffer_size - len, "%-20s start %4u.%03u ms, ready %4u.%03u ms%s",
+        s_stage_names[stage], start_us / 1000, start_us % 1000, ready_us / 1000, ready_us % 1000, p_line_end );
+    }
+  }
+
+  return MIN( len, buffer_size - 1 );
+}
@@ -0,0 +1,46 @@
+#ifndef _STARTUP_H_
+#define _STARTUP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum
+{
+  STARTUP_TIMERS,
+  STARTUP_DEBUG,
+  STARTUP_NVM,
+  STARTUP_WEAR,
+  STARTUP_HARDWARE,
+  STARTUP_WIFI,
+  STARTUP_ETHERNET,
+  STARTUP_TIMESERIES,
+  STARTUP_APPLICATION,
+
+  // Milestones.  Nothing starts these, they're signalled when they happen
+  STARTUP_NETWORK,
+  STARTUP_FIRST_HTTP_REQUEST,
+
+  STARTUP_STAGE_CNT
+} startup_stage_t;
+
+#define STARTUP_BIT(stage)    ( 1UL << ( stage ) )
+
+typedef struct
+{
+  startup_stage_t stage;
+  void            (*init_func)( void );
+  uint32_t        depends_on;         // STARTUP_BITs that must be ready before init_func is called
+  bool            signals_ready;      // Calls startup_ready() itself, otherwise ready when init_func returns
+} startup_stage_desc_t;
+
+// Calls every stage's init_func as soon as its dependencies are ready.  Init functions should kick
+// off their work and return, so independent stages overlap.  Returns once everything has started
+void     startup_run( const startup_stage_desc_t *p_stages, uint8_t stage_cnt );
+
+void     startup_ready( startup_stage_t stage );
+void     startup_wait( uint32_t stage_bits );     // Blocks until every stage in stage_bits is ready
+
+// One line per stage, each ended with p_line_end
+uint16_t startup_get_timeline( char *p_buffer, uint16_t buffer_size, const char *p_line_end );
+
+#endif
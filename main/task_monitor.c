@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "utils.h"
+#include "task_monitor.h"
+
+#define MAX_CREATED_TASKS     ( 8 )       // Through task_create()
+#define MAX_TASKS             ( 32 )      // Everything, IDF's own tasks included
+#define STACK_MARGIN          ( 512 )     // Suggested on top of the deepest a stack has been
+#define STACK_GRANULE         ( 256 )
+
+typedef struct
+{
+  TaskHandle_t  handle;
+  uint32_t      stack_size;
+  bool          is_static;
+} created_task_t;
+
+typedef struct
+{
+  TaskHandle_t  handle;
+  uint32_t      run_time;
+} run_time_t;
+
+static created_task_t s_created[MAX_CREATED_TASKS];
+static uint8_t        s_created_cnt;
+static portMUX_TYPE   s_lock = portMUX_INITIALIZER_UNLOCKED;    // Startup creates tasks from more than one task
+
+// Reports only run on the httpd task
+static TaskStatus_t   s_status[MAX_TASKS];
+static run_time_t     s_last_run_times[MAX_TASKS];
+static uint8_t        s_last_run_time_cnt;
+static uint32_t       s_last_total_run_time;
+static uint64_t       s_last_report_usec;
+
+static const char * const s_state_names[] = { "running", "ready", "blocked", "suspended", "deleted", "invalid" };
+
+//-----------------------------------------------------------------------------
+TaskHandle_t task_create( TaskFunction_t task_func, const char *p_name, uint32_t stack_size, UBaseType_t priority,
+                          StackType_t *p_stack, StaticTask_t *p_tcb )
+{
+  TaskHandle_t handle = NULL;
+  if ( p_stack && p_tcb )
+  {
+    handle = xTaskCreateStatic( task_func, p_name, stack_size, NULL, priority, p_stack, p_tcb );
+  }
+  else if ( xTaskCreate( task_func, p_name, stack_size, NULL, priority, &handle ) != pdPASS )
+  {
+    handle = NULL;
+  }
+
+  if ( !handle )
+  {
+    print( "Couldn't create %s with a %u byte stack\n", p_name, stack_size );
+    return NULL;
+  }
+
+  portENTER_CRITICAL( &s_lock );
+  if ( s_created_cnt < ARRAY_SIZE( s_created ) )
+  {
+    s_created[s_created_cnt++] = (created_task_t){ .handle = handle, .stack_size = stack_size, .is_static = ( p_stack != NULL ) };
+  }
+  portEXIT_CRITICAL( &s_lock );
+
+  return handle;
+}
+
+//-----------------------------------------------------------------------------
+static const created_task_t *_find_created( TaskHandle_t handle )
+{
+  for ( uint8_t i = 0; i < s_created_cnt; i++ )
+  {
+    if ( s_created[i].handle == handle )
+    {
+      return &s_created[i];
+    }
+  }
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Run time as of the last report, 0 for a task that's new since
+static uint32_t _last_run_time( TaskHandle_t handle )
+{
+  for ( uint8_t i = 0; i < s_last_run_time_cnt; i++ )
+  {
+    if ( s_last_run_times[i].handle == handle )
+    {
+      return s_last_run_times[i].run_time;
+    }
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Tenths of a percent of one core
+static uint16_t _permille( uint32_t run_time, uint32_t window )
+{
+  return window ? MIN( (uint64_t)run_time * 1000 / window, 1000 ) : 0;
+}
+
+//-----------------------------------------------------------------------------
+uint16_t task_monitor_get_json( char *p_buffer, size_t buffer_size )
+{
+  uint32_t total_run_time;
+  uint8_t  task_cnt = uxTaskGetSystemState( s_status, ARRAY_SIZE( s_status ), &total_run_time );
+  if ( !task_cnt )
+  {
+    return snprintf( p_buffer, buffer_size, "{\"error\":\"more than %u tasks\"}", MAX_TASKS );
+  }
+
+  // The run time counters are 32 bits of microseconds, a window longer than that has wrapped
+  uint64_t now_usec     = system_uptime_usec();
+  bool     window_valid = ( now_usec - s_last_report_usec ) <= UINT32_MAX;
+  uint32_t window       = total_run_time - s_last_total_run_time;
+  s_last_report_usec    = now_usec;
+  s_last_total_run_time = total_run_time;
+
+  size_t len = snprintf( p_buffer, buffer_size, "{\"window_ms\":%u,\"core_load_pct\":[", window_valid ? window / 1000 : 0 );
+  for ( uint8_t cpu = 0; ( cpu < portNUM_PROCESSORS ) && ( len < buffer_size ); cpu++ )
+  {
+    TaskHandle_t idle = xTaskGetIdleTaskHandleForCPU( cpu );
+    for ( uint8_t i = 0; i < task_cnt; i++ )
+    {
+      if ( s_status[i].xHandle == idle )
+      {
+        uint16_t idle_permille = _permille( s_status[i].ulRunTimeCounter - _last_run_time( idle ), window );
+        len += snprintf( p_buffer + len, buffer_size - len, "%s%d", cpu ? "," : "",
+          window_valid ? ( 1000 - idle_permille ) / 10 : -1 );
+      }
+    }
+  }
+
+  uint32_t reclaimable = 0;
+  len += snprintf( p_buffer + len, buffer_size - len, "],\"tasks\":[" );
+  for ( uint8_t i = 0; ( i < task_cnt ) && ( len < buffer_size ); i++ )
+  {
+    const TaskStatus_t *p_status  = &s_status[i];
+    uint16_t            permille  = _permille( p_status->ulRunTimeCounter - _last_run_time( p_status->xHandle ), window );
+    BaseType_t          core      = xTaskGetAffinity( p_status->xHandle );    // xCoreID needs the stats formatting options
+
+    len += snprintf( p_buffer + len, buffer_size - len,
+      "%s{\"name\":\"%s\",\"core\":%d,\"prio\":%u,\"state\":\"%s\",\"cpu\":%d.%u,\"stack_free_min\":%u",
+      i ? "," : "", p_status->pcTaskName, ( core == tskNO_AFFINITY ) ? -1 : (int)core,
+      p_status->uxCurrentPriority, s_state_names[MIN( p_status->eCurrentState, ARRAY_SIZE( s_state_names ) - 1 )],
+      window_valid ? permille / 10 : -1, window_valid ? permille % 10 : 0, p_status->usStackHighWaterMark );
+
+    const created_task_t *p_created = _find_created( p_status->xHandle );
+    if ( p_created && ( len < buffer_size ) )
+    {
+      uint32_t used      = p_created->stack_size - p_status->usStackHighWaterMark;
+      uint32_t suggested = ( ( used + STACK_MARGIN + STACK_GRANULE - 1 ) / STACK_GRANULE ) * STACK_GRANULE;
+      reclaimable += ( p_created->stack_size > suggested ) ? p_created->stack_size - suggested : 0;
+
+      len += snprintf( p_buffer + len, buffer_size - len, ",\"stack\":%u,\"stack_used\":%u,\"stack_suggested\":%u,\"static\":%s",
+        p_created->stack_size, used, suggested, p_created->is_static ? "true" : "false" );
+    }
+
+    if ( len < buffer_size )
+    {
+      len += snprintf( p_buffer + len, buffer_size - len, "}" );
+    }
+  }
+
+  // Snapshot for the next report's window
+  for ( uint8_t i = 0; i < task_cnt; i++ )
+  {
+    s_last_run_times[i] = (run_time_t){ .handle = s_status[i].xHandle, .run_time = s_status[i].ulRunTimeCounter };
+  }
+  s_last_run_time_cnt = task_cnt;
+
+  // What malloc() draws from.  A largest block well short of the free total means fragmentation
+  multi_heap_info_t heap;
+  heap_caps_get_info( &heap, MALLOC_CAP_8BIT );
+  uint16_t fragmentation = heap.total_free_bytes ? 100 - (uint64_t)heap.largest_free_block * 100 / heap.total_free_bytes : 0;
+
+  if ( len < buffer_size )
+  {
+    len += snprintf( p_buffer + len, buffer_size - len,
+      "],\"stack_reclaimable\":%u,\"heap\":{\"free\":%u,\"min_free\":%u,\"largest_block\":%u,\"fragmentation_pct\":%u,"
+      "\"allocated_blocks\":%u,\"free_blocks\":%u}}",
+      reclaimable, heap.total_free_bytes, heap.minimum_free_bytes, heap.largest_free_block, fragmentation,
+      heap.allocated_blocks, heap.free_blocks );
+  }
+
+  // Better no report than half of one
+  if ( len >= buffer_size )
+  {
+    return snprintf( p_buffer, buffer_size, "{\"error\":\"report doesn't fit in %u bytes\"}", buffer_size );
+  }
+  return len;
+}
@@ -0,0 +1,27 @@
+#ifndef _TASK_MONITOR_H_
+#define _TASK_MONITOR_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+// The stack and TCB a task_create() call needs, which only take up RAM with CONFIG_TASK_STATIC_ALLOCATION
+#if CONFIG_TASK_STATIC_ALLOCATION
+  #define TASK_STATIC_STORAGE( name, stack_size )   static StackType_t name##_stack[stack_size]; static StaticTask_t name##_tcb
+  #define TASK_STATIC_BUFFERS( name )               name##_stack, &name##_tcb
+#else
+  #define TASK_STATIC_STORAGE( name, stack_size )   _Static_assert( ( stack_size ) > 0, #name " has no stack" )
+  #define TASK_STATIC_BUFFERS( name )               NULL, NULL
+#endif
+
+// xTaskCreateStatic() into the buffers if given, otherwise xTaskCreate().  The stack size is
+// remembered for the report.  NULL if the task couldn't be created
+TaskHandle_t task_create( TaskFunction_t task_func, const char *p_name, uint32_t stack_size, UBaseType_t priority,
+                          StackType_t *p_stack, StaticTask_t *p_tcb );
+
+// Every task's stack high-water mark and CPU use since the last report, the load on each core
+// and how fragmented the heap is.  Stack sizes and suggestions only for task_create()'d tasks
+uint16_t task_monitor_get_json( char *p_buffer, size_t buffer_size );
+
+#endif
@@ -0,0 +1,455 @@
+#include <string.h>
+
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include "utils.h"
+#include "timer_wheel.h"
+
+// Hierarchical timing wheel.  Level 0 holds timers due within the next 64 ticks, one slot per
+// tick.  Level 1 slots cover 64 ticks each and level 2 slots 4096 ticks; their contents get
+// cascaded down a level when the wheel reaches the start of their slot.  Timers further out
+// than level 2 reaches are parked in its last slot and re-filed on every cascade.
+//
+// A single one-shot esp_timer is armed for the next tick that has anything to do (an expiry
+// or a cascade), so an idle wheel costs no wakeups at all
+#define TICK_US               ( 1000 )
+#define SLOT_BITS             ( 6 )
+#define SLOTS                 ( 1 << SLOT_BITS )
+#define SLOT_MASK             ( SLOTS - 1 )
+#define LEVELS                ( 3 )
+#define LEVEL_SHIFT(level)    ( ( level ) * SLOT_BITS )
+#define LEVEL_SPAN(level)     ( 1ULL << LEVEL_SHIFT( ( level ) + 1 ) )    // Ticks reachable from level
+
+#define TIMER_CNT             ( 16 )
+#define NO_TIMER              ( -1 )
+
+typedef struct
+{
+  timer_callback_t  callback;
+  void              *p_arg;
+  uint64_t          expiry_tick;
+  uint32_t          period_ticks;   // 0 for one-shots
+  int8_t            next;
+  int8_t            prev;
+  uint8_t           level;
+  uint8_t           slot;
+  bool              in_use;
+  bool              armed;
+  bool              fired;          // Already queued to run in the current advance
+} timer_entry_t;
+
+typedef struct
+{
+  StaticSemaphore_t   mutex_buffer;
+  SemaphoreHandle_t   mutex;
+  esp_timer_handle_t  esp_timer;
+
+  uint64_t            current_tick;         // Everything due at or before this has been handled
+  uint64_t            armed_tick;           // What esp_timer is set for, UINT64_MAX if idle
+  uint64_t            occupied[LEVELS];     // One bit per non-empty slot
+  int8_t              heads[LEVELS][SLOTS];
+
+  timer_entry_t       timers[TIMER_CNT];
+} timer_wheel_ctx_t;
+
+static timer_wheel_ctx_t s_wheel;
+
+static void     _on_esp_timer( void *p_arg );
+static void     _insert( timer_handle_t idx );
+static void     _unlink( timer_handle_t idx );
+static uint64_t _next_event_tick( void );
+static void     _rearm( void );
+
+//-----------------------------------------------------------------------------
+static uint64_t _now_tick( void )
+{
+  return system_uptime_usec() / TICK_US;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t _ms_to_ticks( uint32_t ms )
+{
+  return MAX( 1, ( (uint64_t)ms * 1000 ) / TICK_US );
+}
+
+//-----------------------------------------------------------------------------
+// Files a timer by how far out it is.  Callers hold the mutex
+static void _insert( timer_handle_t idx )
+{
+  timer_entry_t *p_timer = &s_wheel.timers[idx];
+
+  // Only reachable while cascading, where _advance() has set current_tick to the tick about to
+  // run.  Everyone else schedules past current_tick
+  if ( p_timer->expiry_tick < s_wheel.current_tick )
+  {
+    p_timer->expiry_tick = s_wheel.current_tick;
+  }
+
+  uint64_t delta = p_timer->expiry_tick - s_wheel.current_tick;
+  uint64_t file_tick = p_timer->expiry_tick;
+  uint8_t  level = 0;
+  while ( ( level < LEVELS - 1 ) && ( delta >= LEVEL_SPAN( level ) ) )
+  {
+    level++;
+  }
+
+  if ( delta >= LEVEL_SPAN( level ) )
+  {
+    // Beyond the top level, park it as far out as we can reach and re-file it on cascade
+    file_tick = s_wheel.current_tick + LEVEL_SPAN( level ) - 1;
+  }
+
+  uint8_t slot = ( file_tick >> LEVEL_SHIFT( level ) ) & SLOT_MASK;
+
+  p_timer->level = level;
+  p_timer->slot  = slot;
+  p_timer->prev  = NO_TIMER;
+  p_timer->next  = s_wheel.heads[level][slot];
+  if ( p_timer->next != NO_TIMER )
+  {
+    s_wheel.timers[p_timer->next].prev = idx;
+  }
+  s_wheel.heads[level][slot] = idx;
+  s_wheel.occupied[level] |= ( 1ULL << slot );
+  p_timer->armed = true;
+}
+
+//-----------------------------------------------------------------------------
+static void _unlink( timer_handle_t idx )
+{
+  timer_entry_t *p_timer = &s_wheel.timers[idx];
+  if ( !p_timer->armed )
+  {
+    return;
+  }
+
+  if ( p_timer->prev != NO_TIMER )
+  {
+    s_wheel.timers[p_timer->prev].next = p_timer->next;
+  }
+  else
+  {
+    s_wheel.heads[p_timer->level][p_timer->slot] = p_timer->next;
+  }
+
+  if ( p_timer->next != NO_TIMER )
+  {
+    s_wheel.timers[p_timer->next].prev = p_timer->prev;
+  }
+
+  if ( s_wheel.heads[p_timer->level][p_timer->slot] == NO_TIMER )
+  {
+    s_wheel.occupied[p_timer->level] &= ~( 1ULL << p_timer->slot );
+  }
+
+  p_timer->armed = false;
+}
+
+//-----------------------------------------------------------------------------
+// The next tick after current_tick with work on it: a level 0 expiry, or the start of an
+// occupied higher level slot that needs cascading.  UINT64_MAX if the wheel is empty
+static uint64_t _next_event_tick( void )
+{
+  uint64_t next_tick = UINT64_MAX;
+
+  for ( uint8_t level = 0; level < LEVELS; level++ )
+  {
+    if ( !s_wheel.occupied[level] )
+    {
+      continue;
+    }
+
+    uint8_t  shift = LEVEL_SHIFT( level );
+    uint64_t base  = s_wheel.current_tick >> shift;
+    for ( uint32_t step = 1; step <= SLOTS; step++ )
+    {
+      uint64_t tick = ( base + step ) << shift;
+      if ( tick >= next_tick )
+      {
+        break;
+      }
+
+      if ( s_wheel.occupied[level] & ( 1ULL << ( ( base + step ) & SLOT_MASK ) ) )
+      {
+        next_tick = tick;
+        break;
+      }
+    }
+  }
+
+  return next_tick;
+}
+
+//-----------------------------------------------------------------------------
+// Moves a higher level slot's timers down to where they now belong
+static void _cascade( uint8_t level, uint8_t slot )
+{
+  timer_handle_t idx = s_wheel.heads[level][slot];
+  s_wheel.heads[level][slot] = NO_TIMER;
+  s_wheel.occupied[level] &= ~( 1ULL << slot );
+
+  while ( idx != NO_TIMER )
+  {
+    timer_handle_t next = s_wheel.timers[idx].next;
+    s_wheel.timers[idx].armed = false;
+    _insert( idx );
+    idx = next;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Runs the wheel forward to target_tick, collecting due callbacks into p_fired.  Callers hold the mutex
+static uint8_t _advance( uint64_t target_tick, timer_handle_t *p_fired )
+{
+  uint8_t fired_cnt = 0;
+
+  while ( 1 )
+  {
+    uint64_t tick = _next_event_tick();
+    if ( tick > target_tick )
+    {
+      break;
+    }
+
+    s_wheel.current_tick = tick;
+
+    // Top down, so a timer cascading from level 2 into level 1's current slot gets cascaded again
+    for ( int8_t level = LEVELS - 1; level > 0; level-- )
+    {
+      if ( ( tick & ( ( 1ULL << LEVEL_SHIFT( level ) ) - 1 ) ) == 0 )
+      {
+        _cascade( level, ( tick >> LEVEL_SHIFT( level ) ) & SLOT_MASK );
+      }
+    }
+
+    uint8_t slot = tick & SLOT_MASK;
+    timer_handle_t idx = s_wheel.heads[0][slot];
+    while ( idx != NO_TIMER )
+    {
+      timer_entry_t *p_timer = &s_wheel.timers[idx];
+      timer_handle_t next = p_timer->next;
+
+      _unlink( idx );
+      if ( !p_timer->fired )
+      {
+        p_timer->fired = true;
+        p_fired[fired_cnt++] = idx;
+      }
+
+      if ( p_timer->period_ticks )
+      {
+        // Keep the cadence anchored to the original schedule rather than to when we got here
+        p_timer->expiry_tick += p_timer->period_ticks;
+        if ( p_timer->expiry_tick <= tick )
+        {
+          p_timer->expiry_tick = tick + p_timer->period_ticks;
+        }
+        _insert( idx );
+      }
+
+      idx = next;
+    }
+  }
+
+  s_wheel.current_tick = MAX( s_wheel.current_tick, target_tick );
+  return fired_cnt;
+}
+
+//-----------------------------------------------------------------------------
+// Points esp_timer at the next event, if it isn't already.  Callers hold the mutex
+static void _rearm( void )
+{
+  uint64_t next_tick = _next_event_tick();
+  if ( next_tick == s_wheel.armed_tick )
+  {
+    return;
+  }
+
+  esp_timer_stop( s_wheel.esp_timer );
+  s_wheel.armed_tick = next_tick;
+
+  if ( next_tick != UINT64_MAX )
+  {
+    uint64_t now_usec  = system_uptime_usec();
+    uint64_t fire_usec = next_tick * TICK_US;
+    esp_timer_start_once( s_wheel.esp_timer, ( fire_usec > now_usec ) ? ( fire_usec - now_usec ) : 0 );
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void _on_esp_timer( void *p_arg )
+{
+  timer_handle_t fired[TIMER_CNT];
+
+  xSemaphoreTake( s_wheel.mutex, portMAX_DELAY );
+  s_wheel.armed_tick = UINT64_MAX;
+  uint8_t fired_cnt = _advance( _now_tick(), fired );
+  xSemaphoreGive( s_wheel.mutex );
+
+  // Run callbacks unlocked so they're free to add, start or stop timers
+  for ( uint8_t idx = 0; idx < fired_cnt; idx++ )
+  {
+    timer_entry_t *p_timer = &s_wheel.timers[fired[idx]];
+    timer_callback_t callback = p_timer->callback;
+    void *p_cb_arg = p_timer->p_arg;
+
+    p_timer->fired = false;
+    if ( callback )
+    {
+      callback( p_cb_arg );
+    }
+  }
+
+  xSemaphoreTake( s_wheel.mutex, portMAX_DELAY );
+  _rearm();
+  xSemaphoreGive( s_wheel.mutex );
+}
+
+//-----------------------------------------------------------------------------
+// Arms a timer delay_ticks from now.  Callers hold the mutex
+static void _schedule( timer_handle_t idx, uint32_t delay_ticks )
+{
+  uint64_t now_tick = _now_tick();
+
+  // An idle wheel only advances when something wakes it, catch it up so the timer gets filed
+  // relative to now rather than to whenever it last ran.  With timers pending the wheel has to
+  // walk there itself or it would skip their slots
+  bool idle = true;
+  for ( uint8_t level = 0; level < LEVELS; level++ )
+  {
+    idle &= !s_wheel.occupied[level];
+  }
+
+  if ( idle )
+  {
+    s_wheel.current_tick = MAX( s_wheel.current_tick, now_tick );
+  }
+
+  // Round up so a timer never fires early, and current_tick's level 0 slot has already run
+  s_wheel.timers[idx].expiry_tick = MAX( now_tick + 1 + delay_ticks, s_wheel.current_tick + 1 );
+  _insert( idx );
+  _rearm();
+}
+
+//-----------------------------------------------------------------------------
+static timer_handle_t _add( uint32_t delay_ms, uint32_t period_ms, timer_callback_t callback, void *p_arg )
+{
+  if ( !s_wheel.mutex || !callback )
+  {
+    return NO_TIMER;
+  }
+
+  timer_handle_t handle = NO_TIMER;
+
+  xSemaphoreTake( s_wheel.mutex, portMAX_DELAY );
+  for ( timer_handle_t idx = 0; idx < TIMER_CNT; idx++ )
+  {
+    if ( !s_wheel.timers[idx].in_use )
+    {
+      handle = idx;
+      break;
+    }
+  }
+
+  if ( handle != NO_TIMER )
+  {
+    timer_entry_t *p_timer = &s_wheel.timers[handle];
+    memset( p_timer, 0, sizeof( *p_timer ) );
+    p_timer->in_use       = true;
+    p_timer->callback     = callback;
+    p_timer->p_arg        = p_arg;
+    p_timer->period_ticks = period_ms ? _ms_to_ticks( period_ms ) : 0;
+
+    if ( delay_ms )
+    {
+      _schedule( handle, _ms_to_ticks( delay_ms ) );
+    }
+  }
+  else
+  {
+    print( "Out of wheel timers!\n" );
+  }
+  xSemaphoreGive( s_wheel.mutex );
+
+  return handle;
+}
+
+//-----------------------------------------------------------------------------
+timer_handle_t timer_wheel_add_periodic( uint32_t period_ms, timer_callback_t callback, void *p_arg )
+{
+  return _add( period_ms, period_ms, callback, p_arg );
+}
+
+//-----------------------------------------------------------------------------
+timer_handle_t timer_wheel_add_oneshot( uint32_t delay_ms, timer_callback_t callback, void *p_arg )
+{
+  return _add( delay_ms, 0, callback, p_arg );
+}
+
+//-----------------------------------------------------------------------------
+void timer_wheel_start( timer_handle_t handle, uint32_t delay_ms )
+{
+  if ( ( handle < 0 ) || ( handle >= TIMER_CNT ) )
+  {
+    return;
+  }
+
+  xSemaphoreTake( s_wheel.mutex, portMAX_DELAY );
+  timer_entry_t *p_timer = &s_wheel.timers[handle];
+  if ( p_timer->in_use )
+  {
+    _unlink( handle );
+    _schedule( handle, delay_ms ? _ms_to_ticks( delay_ms ) : 0 );
+  }
+  xSemaphoreGive( s_wheel.mutex );
+}
+
+//-----------------------------------------------------------------------------
+void timer_wheel_stop( timer_handle_t handle )
+{
+  if ( ( handle < 0 ) || ( handle >= TIMER_CNT ) )
+  {
+    return;
+  }
+
+  xSemaphoreTake( s_wheel.mutex, portMAX_DELAY );
+  _unlink( handle );
+  _rearm();
+  xSemaphoreGive( s_wheel.mutex );
+}
+
+//-----------------------------------------------------------------------------
+void timer_wheel_remove( timer_handle_t handle )
+{
+  if ( ( handle < 0 ) || ( handle >= TIMER_CNT ) )
+  {
+    return;
+  }
+
+  xSemaphoreTake( s_wheel.mutex, portMAX_DELAY );
+  _unlink( handle );
+  s_wheel.timers[handle].in_use   = false;
+  s_wheel.timers[handle].callback = NULL;
+  _rearm();
+  xSemaphoreGive( s_wheel.mutex );
+}
+
+//-----------------------------------------------------------------------------
+void timer_wheel_init( void )
+{
+  memset( s_wheel.heads, NO_TIMER, sizeof( s_wheel.heads ) );
+  s_wheel.current_tick = _now_tick();
+  s_wheel.armed_tick   = UINT64_MAX;
+  s_wheel.mutex        = xSemaphoreCreateMutexStatic( &s_wheel.mutex_buffer );
+
+  const esp_timer_create_args_t timer_args =
+  {
+    .callback        = _on_esp_timer,
+    .arg             = NULL,
+    .dispatch_method = ESP_TIMER_TASK,
+    .name            = "timer_wheel",
+  };
+  esp_timer_create( &timer_args, &s_wheel.esp_timer );
+}
@@ -0,0 +1,22 @@
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <stdint.h>
+
+// Callbacks run on the esp_timer task.  Keep them short and non-blocking, anything slow
+// delays every other timer in the system
+typedef void (*timer_callback_t)( void *p_arg );
+typedef int8_t timer_handle_t;      // -1 when a timer couldn't be allocated
+
+void           timer_wheel_init( void );
+
+timer_handle_t timer_wheel_add_periodic( uint32_t period_ms, timer_callback_t callback, void *p_arg );
+timer_handle_t timer_wheel_add_oneshot( uint32_t delay_ms, timer_callback_t callback, void *p_arg );    // Created stopped if delay_ms is 0
+
+// One-shots stay allocated after firing so they can be started again, remove them when done
+
+void           timer_wheel_start( timer_handle_t handle, uint32_t delay_ms );   // (Re)arms, periodic timers keep their period afterwards
+void           timer_wheel_stop( timer_handle_t handle );
+void           timer_wheel_remove( timer_handle_t handle );
+
+#endif
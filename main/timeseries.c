@@ -0,0 +1,443 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <esp_system.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "utils.h"
+#include "timeseries.h"
+#include "timer_wheel.h"
+#include "metrics.h"
+#include "wifi.h"
+
+#define SAMPLE_PERIOD_MS        ( 1000 )
+#define SECONDS_PER_MINUTE      ( 60 )
+#define MAX_SAMPLE_SIZE         ( TIMESERIES_CHANNEL_CNT * 5 )    // A 32-bit varint is at most 5 bytes
+#define SVG_MAX_POINTS          ( 120 )
+
+#define SECOND_BLOCK_CNT        ( CONFIG_TIMESERIES_SECONDS_KB * 1024 / TIMESERIES_BLOCK_SIZE )
+#define MINUTE_BLOCK_CNT        ( CONFIG_TIMESERIES_MINUTES_KB * 1024 / TIMESERIES_BLOCK_SIZE )
+
+// A ring of blocks.  Block seq lives at index seq % block_cnt, so a reader that falls behind
+// the writer can tell which blocks it lost
+typedef struct
+{
+  timeseries_block_hdr_t  *p_hdrs;
+  uint8_t                 (*p_data)[TIMESERIES_BLOCK_SIZE];
+  uint8_t                 block_cnt;
+  uint8_t                 used;                               // Blocks holding samples
+  uint16_t                interval_s;
+  uint32_t                next_seq;                           // Blocks ever started
+  int32_t                 last[TIMESERIES_CHANNEL_CNT];       // What the next sample is a change from
+} tier_t;
+
+typedef struct
+{
+  // The minute so far
+  uint8_t   seconds;
+  int32_t   heap_min;
+  int32_t   cpu_sum;
+  int32_t   rssi_sum;
+  uint8_t   rssi_cnt;
+  int32_t   http_sum;
+  int32_t   ota_sum;
+
+  // Counters as of the last sample, the rates are the change since
+  uint32_t  http_requests;
+  uint32_t  ota_bytes;
+  uint32_t  idle_run_time[portNUM_PROCESSORS];
+  uint64_t  sample_usec;
+} sampler_t;
+
+typedef void (*sample_cb_t)( void *p_ctx, uint32_t time_s, const int32_t *p_values );
+
+typedef struct
+{
+  timeseries_write_t  write;
+  void                *p_ctx;
+  char                buffer[512];      // Samples are batched up so a download isn't a send per sample
+  uint16_t            len;
+  bool                first;
+} json_writer_t;
+
+typedef struct
+{
+  timeseries_channel_t  channel;
+  uint8_t               max_points;
+  uint8_t               cnt;
+  uint8_t               next;
+  int32_t               points[SVG_MAX_POINTS];    // Ring, the newest max_points seen
+} svg_collector_t;
+
+static timeseries_block_hdr_t s_second_hdrs[SECOND_BLOCK_CNT];
+static uint8_t                s_second_data[SECOND_BLOCK_CNT][TIMESERIES_BLOCK_SIZE];
+static timeseries_block_hdr_t s_minute_hdrs[MINUTE_BLOCK_CNT];
+static uint8_t                s_minute_data[MINUTE_BLOCK_CNT][TIMESERIES_BLOCK_SIZE];
+
+static tier_t s_tiers[TIMESERIES_TIER_CNT] =
+{
+  [TIMESERIES_SECONDS] = { .p_hdrs = s_second_hdrs, .p_data = s_second_data, .block_cnt = SECOND_BLOCK_CNT, .interval_s = 1 },
+  [TIMESERIES_MINUTES] = { .p_hdrs = s_minute_hdrs, .p_data = s_minute_data, .block_cnt = MINUTE_BLOCK_CNT, .interval_s = SECONDS_PER_MINUTE },
+};
+
+static const char * const s_channel_names[TIMESERIES_CHANNEL_CNT] =
+{
+  [TIMESERIES_HEAP_FREE]      = "heap_free",
+  [TIMESERIES_CPU_LOAD]       = "cpu_load",
+  [TIMESERIES_RSSI]           = "rssi",
+  [TIMESERIES_HTTP_REQUESTS]  = "http_requests",
+  [TIMESERIES_OTA_BYTES]      = "ota_bytes",
+};
+
+_Static_assert( SECOND_BLOCK_CNT <= UINT8_MAX && MINUTE_BLOCK_CNT <= UINT8_MAX, "Too many blocks for tier_t" );
+
+static sampler_t      s_sampler;
+static portMUX_TYPE   s_lock = portMUX_INITIALIZER_UNLOCKED;   // Only held to append to or copy out one block
+
+// Readers all run on the httpd task
+static json_writer_t    s_json_writer;
+static svg_collector_t  s_svg_collector;
+
+//-----------------------------------------------------------------------------
+static uint8_t _put_varint( uint8_t *p_data, int32_t value )
+{
+  uint32_t zigzag = ( (uint32_t)value << 1 ) ^ (uint32_t)( value >> 31 );
+  uint8_t  len    = 0;
+
+  while ( zigzag >= 0x80 )
+  {
+    p_data[len++] = ( zigzag & 0x7F ) | 0x80;
+    zigzag >>= 7;
+  }
+  p_data[len++] = zigzag;
+
+  return len;
+}
+
+//-----------------------------------------------------------------------------
+// Returns the bytes used, 0 if the varint runs past available
+static uint8_t _get_varint( const uint8_t *p_data, uint8_t available, int32_t *p_value )
+{
+  uint32_t zigzag = 0;
+
+  for ( uint8_t len = 0; ( len < available ) && ( len < 5 ); len++ )
+  {
+    zigzag |= (uint32_t)( p_data[len] & 0x7F ) << ( 7 * len );
+    if ( !( p_data[len] & 0x80 ) )
+    {
+      *p_value = (int32_t)( zigzag >> 1 ) ^ -(int32_t)( zigzag & 1 );
+      return len + 1;
+    }
+  }
+
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+static uint8_t _encode( uint8_t *p_sample, const int32_t *p_values, const int32_t *p_base )
+{
+  uint8_t len = 0;
+  for ( uint8_t channel = 0; channel < TIMESERIES_CHANNEL_CNT; channel++ )
+  {
+    len += _put_varint( p_sample + len, p_values[channel] - ( p_base ? p_base[channel] : 0 ) );
+  }
+  return len;
+}
+
+//-----------------------------------------------------------------------------
+// Only ever called from the sampling timer, so nothing else changes the tier's write state
+static void _append( tier_t *p_tier, const int32_t *p_values, uint32_t time_s )
+{
+  uint8_t sample[MAX_SAMPLE_SIZE];
+  uint8_t len = _encode( sample, p_values, p_tier->last );
+
+  timeseries_block_hdr_t *p_hdr = p_tier->used ? &p_tier->p_hdrs[( p_tier->next_seq - 1 ) % p_tier->block_cnt] : NULL;
+  bool new_block = !p_hdr || ( p_hdr->len + len > TIMESERIES_BLOCK_SIZE );
+  if ( new_block )
+  {
+    len = _encode( sample, p_values, NULL );
+  }
+
+  portENTER_CRITICAL( &s_lock );
+  if ( new_block )
+  {
+    uint8_t idx = p_tier->next_seq++ % p_tier->block_cnt;
+    p_tier->used = MIN( p_tier->used + 1, p_tier->block_cnt );
+    p_hdr = &p_tier->p_hdrs[idx];
+    *p_hdr = (timeseries_block_hdr_t){ .start_s = time_s };
+  }
+  memcpy( p_tier->p_data[( p_tier->next_seq - 1 ) % p_tier->block_cnt] + p_hdr->len, sample, len );
+  p_hdr->len += len;
+  p_hdr->sample_cnt++;
+  portEXIT_CRITICAL( &s_lock );
+
+  memcpy( p_tier->last, p_values, sizeof( p_tier->last ) );
+}
+
+//-----------------------------------------------------------------------------
+// Copies out block seq, or the oldest still there if the writer has recycled it meanwhile.
+// Returns false once past the newest
+static bool _copy_block( const tier_t *p_tier, uint32_t *p_seq, timeseries_block_hdr_t *p_hdr, uint8_t *p_data )
+{
+  bool copied = false;
+
+  portENTER_CRITICAL( &s_lock );
+  *p_seq = MAX( *p_seq, p_tier->next_seq - p_tier->used );
+  if ( *p_seq < p_tier->next_seq )
+  {
+    uint8_t idx = *p_seq % p_tier->block_cnt;
+    *p_hdr = p_tier->p_hdrs[idx];
+    memcpy( p_data, p_tier->p_data[idx], p_hdr->len );
+    copied = true;
+  }
+  portEXIT_CRITICAL( &s_lock );
+
+  return copied;
+}
+
+//-----------------------------------------------------------------------------
+static void _for_each_sample( const tier_t *p_tier, sample_cb_t sample_cb, void *p_ctx )
+{
+  timeseries_block_hdr_t hdr;
+  uint8_t                data[TIMESERIES_BLOCK_SIZE];
+
+  for ( uint32_t seq = 0; _copy_block( p_tier, &seq, &hdr, data ); seq++ )
+  {
+    int32_t values[TIMESERIES_CHANNEL_CNT] = { 0 };
+    uint8_t pos = 0;
+
+    for ( uint8_t sample = 0; sample < hdr.sample_cnt; sample++ )
+    {
+      for ( uint8_t channel = 0; channel < TIMESERIES_CHANNEL_CNT; channel++ )
+      {
+        int32_t delta;
+        uint8_t len = _get_varint( data + pos, hdr.len - pos, &delta );
+        if ( !len )
+        {
+          return;
+        }
+
+        pos += len;
+        values[channel] += delta;
+      }
+
+      sample_cb( p_ctx, hdr.start_s + sample * p_tier->interval_s, values );
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Percent of both cores not spent in their idle tasks since the last call
+static int32_t _cpu_load( uint64_t now_usec )
+{
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+  uint32_t idle_usec = 0;
+  for ( uint8_t cpu = 0; cpu < portNUM_PROCESSORS; cpu++ )
+  {
+    TaskStatus_t status;
+    vTaskGetInfo( xTaskGetIdleTaskHandleForCPU( cpu ), &status, pdFALSE, eReady );
+    idle_usec += status.ulRunTimeCounter - s_sampler.idle_run_time[cpu];
+    s_sampler.idle_run_time[cpu] = status.ulRunTimeCounter;
+  }
+
+  uint64_t elapsed_usec = ( now_usec - s_sampler.sample_usec ) * portNUM_PROCESSORS;
+  s_sampler.sample_usec = now_usec;
+  return elapsed_usec ? 100 - MIN( idle_usec * 100 / elapsed_usec, 100 ) : 0;
+#else
+  return 0;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+static void _sample_timer_cb( void *p_arg )
+{
+  int32_t values[TIMESERIES_CHANNEL_CNT];
+
+  uint32_t http_requests = metrics_http_requests();
+  uint32_t ota_bytes     = metrics_get( METRIC_OTA_BYTES );
+
+  values[TIMESERIES_HEAP_FREE]     = esp_get_free_heap_size();
+  values[TIMESERIES_CPU_LOAD]      = _cpu_load( system_uptime_usec() );
+  values[TIMESERIES_RSSI]          = wifi_get_rssi();
+  values[TIMESERIES_HTTP_REQUESTS] = http_requests - s_sampler.http_requests;
+  values[TIMESERIES_OTA_BYTES]     = ota_bytes - s_sampler.ota_bytes;
+  s_sampler.http_requests = http_requests;
+  s_sampler.ota_bytes     = ota_bytes;
+
+  uint32_t now_s = system_uptime_s();
+  _append( &s_tiers[TIMESERIES_SECONDS], values, now_s );
+
+  s_sampler.heap_min  = s_sampler.seconds ? MIN( s_sampler.heap_min, values[TIMESERIES_HEAP_FREE] ) : values[TIMESERIES_HEAP_FREE];
+  s_sampler.cpu_sum  += values[TIMESERIES_CPU_LOAD];
+  s_sampler.rssi_sum += values[TIMESERIES_RSSI];
+  s_sampler.rssi_cnt += values[TIMESERIES_RSSI] ? 1 : 0;
+  s_sampler.http_sum += values[TIMESERIES_HTTP_REQUESTS];
+  s_sampler.ota_sum  += values[TIMESERIES_OTA_BYTES];
+
+  if ( ++s_sampler.seconds == SECONDS_PER_MINUTE )
+  {
+    values[TIMESERIES_HEAP_FREE]     = s_sampler.heap_min;
+    values[TIMESERIES_CPU_LOAD]      = s_sampler.cpu_sum / SECONDS_PER_MINUTE;
+    values[TIMESERIES_RSSI]          = s_sampler.rssi_cnt ? s_sampler.rssi_sum / s_sampler.rssi_cnt : 0;
+    values[TIMESERIES_HTTP_REQUESTS] = s_sampler.http_sum;
+    values[TIMESERIES_OTA_BYTES]     = s_sampler.ota_sum;
+    _append( &s_tiers[TIMESERIES_MINUTES], values, now_s - ( SECONDS_PER_MINUTE - 1 ) );
+
+    s_sampler.seconds  = 0;
+    s_sampler.cpu_sum  = 0;
+    s_sampler.rssi_sum = 0;
+    s_sampler.rssi_cnt = 0;
+    s_sampler.http_sum = 0;
+    s_sampler.ota_sum  = 0;
+  }
+}
+
+//-----------------------------------------------------------------------------
+void timeseries_init( void )
+{
+  // So the first sample's rates and load are over its own second, not since boot
+  s_sampler.http_requests = metrics_http_requests();
+  s_sampler.ota_bytes     = metrics_get( METRIC_OTA_BYTES );
+  _cpu_load( system_uptime_usec() );
+
+  timer_wheel_add_periodic( SAMPLE_PERIOD_MS, _sample_timer_cb, NULL );
+}
+
+//-----------------------------------------------------------------------------
+static void _json_flush( json_writer_t *p_writer )
+{
+  p_writer->write( p_writer->p_ctx, p_writer->buffer, p_writer->len );
+  p_writer->len = 0;
+}
+
+//-----------------------------------------------------------------------------
+static void _json_sample_cb( void *p_ctx, uint32_t time_s, const int32_t *p_values )
+{
+  json_writer_t *p_writer = p_ctx;
+
+  // Room for the worst case sample, 11 characters a number
+  if ( p_writer->len > sizeof( p_writer->buffer ) - ( TIMESERIES_CHANNEL_CNT + 1 ) * 12 - 4 )
+  {
+    _json_flush( p_writer );
+  }
+
+  char *p_buffer = p_writer->buffer + p_writer->len;
+  p_buffer += sprintf( p_buffer, "%s[%u", p_writer->first ? "" : ",", time_s );
+  for ( uint8_t channel = 0; channel < TIMESERIES_CHANNEL_CNT; channel++ )
+  {
+    p_buffer += sprintf( p_buffer, ",%d", p_values[channel] );
+  }
+  p_buffer += sprintf( p_buffer, "]" );
+
+  p_writer->len   = p_buffer - p_writer->buffer;
+  p_writer->first = false;
+}
+
+//-----------------------------------------------------------------------------
+void timeseries_write_json( timeseries_tier_t tier, timeseries_write_t write, void *p_ctx )
+{
+  json_writer_t *p_writer = &s_json_writer;
+  p_writer->write = write;
+  p_writer->p_ctx = p_ctx;
+  p_writer->first = true;
+
+  char *p_buffer = p_writer->buffer;
+  p_buffer += sprintf( p_buffer, "{\"interval_s\":%u,\"uptime_s\":%u,\"channels\":[", s_tiers[tier].interval_s, system_uptime_s() );
+  for ( uint8_t channel = 0; channel < TIMESERIES_CHANNEL_CNT; channel++ )
+  {
+    p_buffer += sprintf( p_buffer, "%s\"%s\"", channel ? "," : "", s_channel_names[channel] );
+  }
+  p_buffer += sprintf( p_buffer, "],\"samples\":[" );
+  p_writer->len = p_buffer - p_writer->buffer;
+
+  _for_each_sample( &s_tiers[tier], _json_sample_cb, p_writer );
+
+  p_writer->len += sprintf( p_writer->buffer + p_writer->len, "]}" );
+  _json_flush( p_writer );
+}
+
+//-----------------------------------------------------------------------------
+// Blocks go out as they're stored, for tools/timeseries.py to decode
+void timeseries_write_binary( timeseries_tier_t tier, timeseries_write_t write, void *p_ctx )
+{
+  const tier_t *p_tier = &s_tiers[tier];
+
+  timeseries_file_hdr_t file_hdr =
+  {
+    .magic       = { 'T', 'S', 'R', '1' },
+    .interval_s  = p_tier->interval_s,
+    .channel_cnt = TIMESERIES_CHANNEL_CNT,
+    .block_cnt   = p_tier->used,      // Could be one more or less by the time they're copied, the reader walks to the end
+    .uptime_s    = system_uptime_s(),
+  };
+  write( p_ctx, (const char *)&file_hdr, sizeof( file_hdr ) );
+
+  timeseries_block_hdr_t hdr;
+  uint8_t                data[TIMESERIES_BLOCK_SIZE];
+  for ( uint32_t seq = 0; _copy_block( p_tier, &seq, &hdr, data ); seq++ )
+  {
+    write( p_ctx, (const char *)&hdr, sizeof( hdr ) );
+    write( p_ctx, (const char *)data, hdr.len );
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void _svg_sample_cb( void *p_ctx, uint32_t time_s, const int32_t *p_values )
+{
+  svg_collector_t *p_collector = p_ctx;
+
+  p_collector->points[p_collector->next] = p_values[p_collector->channel];
+  p_collector->next = ( p_collector->next + 1 ) % p_collector->max_points;
+  p_collector->cnt  = MIN( p_collector->cnt + 1, p_collector->max_points );
+}
+
+//-----------------------------------------------------------------------------
+uint16_t timeseries_get_svg( timeseries_tier_t tier, timeseries_channel_t channel, uint8_t max_points, char *p_buffer, size_t buffer_size )
+{
+  svg_collector_t *p_collector = &s_svg_collector;
+  p_collector->channel    = channel;
+  p_collector->max_points = CLAMP( max_points, 2, SVG_MAX_POINTS );
+  p_collector->cnt        = 0;
+  p_collector->next       = 0;
+
+  _for_each_sample( &s_tiers[tier], _svg_sample_cb, p_collector );
+  if ( p_collector->cnt < 2 )
+  {
+    return 0;
+  }
+
+  uint8_t oldest = ( p_collector->next + p_collector->max_points - p_collector->cnt ) % p_collector->max_points;
+  int32_t min    = INT32_MAX;
+  int32_t max    = INT32_MIN;
+  for ( uint8_t i = 0; i < p_collector->cnt; i++ )
+  {
+    int32_t value = p_collector->points[( oldest + i ) % p_collector->max_points];
+    min = MIN( min, value );
+    max = MAX( max, value );
+  }
+
+  // Stretched to fit whatever the range is, flat lines sit in the middle
+  int64_t range = (int64_t)max - min;
+  size_t  len   = snprintf( p_buffer, buffer_size,
+    "<svg width=\"240\" height=\"40\" viewBox=\"0 0 %u 100\" preserveAspectRatio=\"none\">"
+    "<polyline fill=\"none\" stroke=\"#36c\" vector-effect=\"non-scaling-stroke\" points=\"", p_collector->cnt - 1 );
+  for ( uint8_t i = 0; ( i < p_collector->cnt ) && ( len < buffer_size ); i++ )
+  {
+    int32_t value = p_collector->points[( oldest + i ) % p_collector->max_points];
+    uint8_t y     = range ? 100 - ( ( value - min ) * 100 / range ) : 50;
+    len += snprintf( p_buffer + len, buffer_size - len, "%u,%u ", i, y );
+  }
+  if ( len < buffer_size )
+  {
+    len += snprintf( p_buffer + len, buffer_size - len, "\"/></svg>" );
+  }
+
+  // Half a chart is worse than none
+  if ( len >= buffer_size )
+  {
+    p_buffer[0] = '\0';
+    return 0;
+  }
+  return len;
+}
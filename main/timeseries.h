@@ -0,0 +1,58 @@
+#ifndef _TIMESERIES_H_
+#define _TIMESERIES_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TIMESERIES_BLOCK_SIZE     ( 128 )     // The unit the rings recycle in, each starts with absolute values
+
+typedef enum
+{
+  TIMESERIES_HEAP_FREE,           // Bytes, the lowest seen over a minute sample
+  TIMESERIES_CPU_LOAD,            // Percent across both cores
+  TIMESERIES_RSSI,                // dBm, 0 while not associated
+  TIMESERIES_HTTP_REQUESTS,       // Handled during the sample
+  TIMESERIES_OTA_BYTES,           // Received during the sample
+  TIMESERIES_CHANNEL_CNT
+} timeseries_channel_t;
+
+typedef enum
+{
+  TIMESERIES_SECONDS,
+  TIMESERIES_MINUTES,
+  TIMESERIES_TIER_CNT
+} timeseries_tier_t;
+
+// Binary download, little endian.  The file header is followed by the blocks oldest first, each
+// a timeseries_block_hdr_t and len bytes of samples.  A sample is one zigzag varint per channel,
+// the first in a block the value itself and the rest the change from the sample before.  Sample
+// n of a block was taken at start_s + n * interval_s
+typedef struct
+{
+  char     magic[4];              // "TSR1"
+  uint16_t interval_s;
+  uint8_t  channel_cnt;
+  uint8_t  block_cnt;
+  uint32_t uptime_s;              // When the download was taken
+} timeseries_file_hdr_t;
+
+typedef struct
+{
+  uint32_t start_s;               // Uptime
+  uint8_t  len;
+  uint8_t  sample_cnt;
+  uint8_t  reserved[2];
+} timeseries_block_hdr_t;
+
+typedef void (*timeseries_write_t)( void *p_ctx, const char *p_data, size_t len );
+
+// Samples once a second off the timer wheel, no task of its own
+void     timeseries_init( void );
+
+void     timeseries_write_json( timeseries_tier_t tier, timeseries_write_t write, void *p_ctx );
+void     timeseries_write_binary( timeseries_tier_t tier, timeseries_write_t write, void *p_ctx );
+
+// An inline <svg> of the newest max_points samples of one channel, for the status page
+uint16_t timeseries_get_svg( timeseries_tier_t tier, timeseries_channel_t channel, uint8_t max_points, char *p_buffer, size_t buffer_size );
+
+#endif
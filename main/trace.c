@@ -0,0 +1,410 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <esp_attr.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+
+#include "utils.h"
+#include "trace.h"
+
+#if CONFIG_TRACE_RECORDER
+
+#define MAX_WAITS             ( 16 )      // Tasks blocked on a queue or mutex at once
+#define MAX_TASKS             ( 32 )
+#define TASKS_PID             ( portNUM_PROCESSORS )    // Per core rows come first
+
+typedef enum
+{
+  EVENT_SWITCH,               // task was switched in on core
+  EVENT_BEGIN,                // id is the span name
+  EVENT_END,
+  EVENT_WAIT,                 // id is the queue, task blocked on it
+  EVENT_WAKE,                 // task got what it was waiting on
+  EVENT_TIMEOUT,              // or gave up
+} event_type_t;
+
+typedef struct
+{
+  uint32_t  time_usec;        // Low 32 bits of esp_timer
+  uint32_t  task;
+  uint32_t  id;
+  uint8_t   type;
+  uint8_t   core;
+  uint8_t   queue_type;       // ucQueueType, for waits
+  uint8_t   reserved;
+} event_t;
+
+typedef struct
+{
+  void * volatile  task;
+  void * volatile  queue;
+} wait_t;
+
+// The export's view of one task, i.e. one row
+typedef struct
+{
+  uint32_t  task;
+  uint8_t   depth;            // Open spans, an end with none open began before the oldest event
+  uint32_t  wait_queue;
+  uint8_t   wait_type;
+  int64_t   wait_start;
+} task_track_t;
+
+typedef struct
+{
+  volatile bool running;
+  uint32_t      next;         // Slot the next event goes in
+  uint32_t      total;        // Recorded since the last start, including those overwritten
+  uint32_t      waits_dropped;  // Blocks left out because the wait table was full
+
+  // Export, only on the httpd task
+  TaskStatus_t  status[MAX_TASKS];
+  uint8_t       status_cnt;
+  task_track_t  tracks[MAX_TASKS];
+  uint8_t       track_cnt;
+  char          line[512];
+  uint16_t      len;
+  bool          first;
+  trace_write_t write;
+  void         *p_ctx;
+} trace_t;
+
+static event_t  s_events[CONFIG_TRACE_EVENTS];
+static wait_t   s_waits[MAX_WAITS];
+static trace_t  s_trace = { .running = true };
+
+// By ucQueueType
+static const char * const s_queue_types[] = { "queue", "mutex", "semaphore", "semaphore", "mutex" };
+
+//-----------------------------------------------------------------------------
+// Called from the scheduler and from inside queue critical sections, on either core, with the
+// flash cache possibly off.  Interrupts are masked so an event is never left half written
+static void IRAM_ATTR _record( event_type_t type, void *p_task, const void *p_id, uint8_t queue_type )
+{
+  uint32_t irq_state = portSET_INTERRUPT_MASK_FROM_ISR();
+  uint32_t time_usec = esp_timer_get_time();
+
+  uint32_t idx = __atomic_load_n( &s_trace.next, __ATOMIC_RELAXED );
+  uint32_t next;
+  do
+  {
+    next = ( idx + 1 == CONFIG_TRACE_EVENTS ) ? 0 : idx + 1;
+  } while ( !__atomic_compare_exchange_n( &s_trace.next, &idx, next, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) );
+  __atomic_fetch_add( &s_trace.total, 1, __ATOMIC_RELAXED );
+
+  event_t *p_event    = &s_events[idx];
+  p_event->time_usec  = time_usec;
+  p_event->task       = (uint32_t)p_task;
+  p_event->id         = (uint32_t)p_id;
+  p_event->type       = type;
+  p_event->core       = xPortGetCoreID();
+  p_event->queue_type = queue_type;
+
+  portCLEAR_INTERRUPT_MASK_FROM_ISR( irq_state );
+}
+
+//-----------------------------------------------------------------------------
+void IRAM_ATTR trace_task_switched_in( void *p_task )
+{
+  if ( s_trace.running )
+  {
+    _record( EVENT_SWITCH, p_task, NULL, 0 );
+  }
+}
+
+//-----------------------------------------------------------------------------
+// A blocked receive or send loops back through here each time it's woken without success, only
+// the first one counts.  With the table full the wake couldn't be matched up, so the wait is
+// left out altogether rather than recorded again on every pass
+void IRAM_ATTR trace_queue_wait( void *p_queue, unsigned queue_type )
+{
+  if ( !s_trace.running )
+  {
+    return;
+  }
+
+  void *p_task = xTaskGetCurrentTaskHandle();
+  for ( uint8_t i = 0; i < MAX_WAITS; i++ )
+  {
+    if ( s_waits[i].task == p_task )
+    {
+      return;
+    }
+  }
+
+  for ( uint8_t i = 0; i < MAX_WAITS; i++ )
+  {
+    void *p_free = NULL;
+    if ( __atomic_compare_exchange_n( &s_waits[i].task, &p_free, p_task, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) )
+    {
+      s_waits[i].queue = p_queue;
+      _record( EVENT_WAIT, p_task, p_queue, queue_type );
+      return;
+    }
+  }
+  __atomic_fetch_add( &s_trace.waits_dropped, 1, __ATOMIC_RELAXED );
+}
+
+//-----------------------------------------------------------------------------
+// Every send and receive comes through here, blocked or not.  Only a task that's in the wait
+// table gets an event, and only that task ever takes itself out of it, paused or not, so a wait
+// that ends during an export isn't left behind
+void IRAM_ATTR trace_queue_done( void *p_queue, int timed_out )
+{
+  void *p_task = xTaskGetCurrentTaskHandle();
+  for ( uint8_t i = 0; i < MAX_WAITS; i++ )
+  {
+    if ( ( s_waits[i].task == p_task ) && ( s_waits[i].queue == p_queue ) )
+    {
+      s_waits[i].queue = NULL;
+      __atomic_store_n( &s_waits[i].task, NULL, __ATOMIC_RELEASE );
+      if ( s_trace.running )
+      {
+        _record( timed_out ? EVENT_TIMEOUT : EVENT_WAKE, p_task, p_queue, 0 );
+      }
+      return;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+void trace_begin( const char *p_name )
+{
+  if ( s_trace.running )
+  {
+    _record( EVENT_BEGIN, xTaskGetCurrentTaskHandle(), p_name, 0 );
+  }
+}
+
+//-----------------------------------------------------------------------------
+void trace_end( const char *p_name )
+{
+  if ( s_trace.running )
+  {
+    _record( EVENT_END, xTaskGetCurrentTaskHandle(), p_name, 0 );
+  }
+}
+
+//-----------------------------------------------------------------------------
+void trace_start( void )
+{
+  s_trace.running = false;
+  vTaskDelay( 1 );      // Lets an event being written on the other core finish
+
+  memset( s_waits, 0, sizeof( s_waits ) );
+  s_trace.next          = 0;
+  s_trace.total         = 0;
+  s_trace.waits_dropped = 0;
+  s_trace.running = true;
+  print( "Tracing, room for %u events\n", CONFIG_TRACE_EVENTS );
+}
+
+//-----------------------------------------------------------------------------
+void trace_stop( void )
+{
+  s_trace.running = false;
+  print( "Trace stopped, %u events\n", s_trace.total );
+}
+
+//-----------------------------------------------------------------------------
+bool trace_is_running( void )
+{
+  return s_trace.running;
+}
+
+//-----------------------------------------------------------------------------
+static const char *_task_name( uint32_t task )
+{
+  static char address[12];
+  for ( uint8_t i = 0; i < s_trace.status_cnt; i++ )
+  {
+    if ( (uint32_t)s_trace.status[i].xHandle == task )
+    {
+      return s_trace.status[i].pcTaskName;
+    }
+  }
+
+  snprintf( address, sizeof( address ), "0x%08x", task );
+  return address;
+}
+
+//-----------------------------------------------------------------------------
+// Named through vQueueAddToRegistry(), given CONFIG_FREERTOS_QUEUE_REGISTRY_SIZE
+static const char *_queue_name( uint32_t queue )
+{
+  static char address[12];
+#if configQUEUE_REGISTRY_SIZE > 0
+  const char *p_name = pcQueueGetName( (QueueHandle_t)queue );
+  if ( p_name )
+  {
+    return p_name;
+  }
+#endif
+
+  snprintf( address, sizeof( address ), "0x%08x", queue );
+  return address;
+}
+
+//-----------------------------------------------------------------------------
+static task_track_t *_track( uint32_t task )
+{
+  for ( uint8_t i = 0; i < s_trace.track_cnt; i++ )
+  {
+    if ( s_trace.tracks[i].task == task )
+    {
+      return &s_trace.tracks[i];
+    }
+  }
+
+  if ( s_trace.track_cnt == ARRAY_SIZE( s_trace.tracks ) )
+  {
+    return NULL;
+  }
+
+  task_track_t *p_track = &s_trace.tracks[s_trace.track_cnt++];
+  *p_track = (task_track_t){ .task = task };
+  return p_track;
+}
+
+//-----------------------------------------------------------------------------
+// One event object, flushing early enough that the longest one always fits
+static void _emit( const char *p_format, ... )
+{
+  if ( s_trace.len > sizeof( s_trace.line ) - 192 )
+  {
+    s_trace.write( s_trace.p_ctx, s_trace.line, s_trace.len );
+    s_trace.len = 0;
+  }
+
+  if ( !s_trace.first )
+  {
+    s_trace.len += sprintf( s_trace.line + s_trace.len, ",\n" );
+  }
+  s_trace.first = false;
+
+  va_list args;
+  va_start( args, p_format );
+  s_trace.len += vsnprintf( s_trace.line + s_trace.len, sizeof( s_trace.line ) - s_trace.len, p_format, args );
+  va_end( args );
+}
+
+//-----------------------------------------------------------------------------
+void trace_write_json( trace_write_t write, void *p_ctx )
+{
+  bool was_running = s_trace.running;
+  s_trace.running = false;
+  vTaskDelay( 1 );
+
+  uint32_t kept   = MIN( s_trace.total, CONFIG_TRACE_EVENTS );
+  uint32_t oldest = ( s_trace.total > CONFIG_TRACE_EVENTS ) ? s_trace.next : 0;
+
+  s_trace.status_cnt = uxTaskGetSystemState( s_trace.status, ARRAY_SIZE( s_trace.status ), NULL );
+  s_trace.track_cnt  = 0;
+  s_trace.write      = write;
+  s_trace.p_ctx      = p_ctx;
+  s_trace.first      = true;
+  s_trace.len        = snprintf( s_trace.line, sizeof( s_trace.line ),
+    "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"recorded\":%u,\"kept\":%u,\"waits_dropped\":%u},\"traceEvents\":[\n",
+    s_trace.total, kept, s_trace.waits_dropped );
+
+  // A row per core of what was running on it, and one per task of what it was doing
+  for ( uint8_t core = 0; core < portNUM_PROCESSORS; core++ )
+  {
+    _emit( "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%u,\"args\":{\"name\":\"CPU %u\"}}", core, core );
+    _emit( "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%u,\"tid\":0,\"args\":{\"name\":\"running\"}}", core );
+  }
+  _emit( "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%u,\"args\":{\"name\":\"Tasks\"}}", TASKS_PID );
+  for ( uint8_t i = 0; i < s_trace.status_cnt; i++ )
+  {
+    _emit( "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+      TASKS_PID, (uint32_t)s_trace.status[i].xHandle, s_trace.status[i].pcTaskName );
+  }
+
+  // Microseconds from the oldest event, built up from the differences between neighbours so the
+  // 32 bit times can wrap.  The two cores' events can be a little out of order, hence signed
+  int64_t  now = 0;
+  uint32_t last_usec = kept ? s_events[oldest].time_usec : 0;
+  uint32_t running[portNUM_PROCESSORS] = { 0 };
+  int64_t  running_since[portNUM_PROCESSORS] = { 0 };
+
+  for ( uint32_t n = 0; n < kept; n++ )
+  {
+    const event_t *p_event = &s_events[( oldest + n ) % CONFIG_TRACE_EVENTS];
+    now      += (int32_t)( p_event->time_usec - last_usec );
+    last_usec = p_event->time_usec;
+
+    task_track_t *p_track = _track( p_event->task );
+    switch ( p_event->type )
+    {
+      case EVENT_SWITCH:
+        if ( running[p_event->core] )
+        {
+          _emit( "{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%u,\"tid\":0,\"ts\":%lld,\"dur\":%lld}",
+            _task_name( running[p_event->core] ), p_event->core, running_since[p_event->core], now - running_since[p_event->core] );
+        }
+        running[p_event->core]       = p_event->task;
+        running_since[p_event->core] = now;
+        break;
+
+      case EVENT_BEGIN:
+        if ( p_track )
+        {
+          p_track->depth++;
+          _emit( "{\"ph\":\"B\",\"name\":\"%s\",\"pid\":%u,\"tid\":%u,\"ts\":%lld}",
+            (const char *)p_event->id, TASKS_PID, p_event->task, now );
+        }
+        break;
+
+      case EVENT_END:
+        if ( p_track && p_track->depth )
+        {
+          p_track->depth--;
+          _emit( "{\"ph\":\"E\",\"pid\":%u,\"tid\":%u,\"ts\":%lld}", TASKS_PID, p_event->task, now );
+        }
+        break;
+
+      case EVENT_WAIT:
+        if ( p_track )
+        {
+          p_track->wait_queue = p_event->id;
+          p_track->wait_type  = p_event->queue_type;
+          p_track->wait_start = now;
+        }
+        break;
+
+      case EVENT_WAKE:
+      case EVENT_TIMEOUT:
+        if ( p_track && ( p_track->wait_queue == p_event->id ) )
+        {
+          const char *p_type = s_queue_types[MIN( p_track->wait_type, ARRAY_SIZE( s_queue_types ) - 1 )];
+          _emit( "{\"ph\":\"X\",\"name\":\"wait %s %s\",\"cat\":\"%s\",\"pid\":%u,\"tid\":%u,\"ts\":%lld,\"dur\":%lld,"
+            "\"args\":{\"timed_out\":%s}}",
+            p_type, _queue_name( p_event->id ), p_type, TASKS_PID, p_event->task, p_track->wait_start,
+            now - p_track->wait_start, ( p_event->type == EVENT_TIMEOUT ) ? "true" : "false" );
+          p_track->wait_queue = 0;
+        }
+        break;
+    }
+  }
+
+  // Whatever was running when it stopped, up to the last event
+  for ( uint8_t core = 0; core < portNUM_PROCESSORS; core++ )
+  {
+    if ( running[core] )
+    {
+      _emit( "{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%u,\"tid\":0,\"ts\":%lld,\"dur\":%lld}",
+        _task_name( running[core] ), core, running_since[core], now - running_since[core] );
+    }
+  }
+
+  s_trace.len += snprintf( s_trace.line + s_trace.len, sizeof( s_trace.line ) - s_trace.len, "\n]}\n" );
+  write( p_ctx, s_trace.line, s_trace.len );
+
+  s_trace.running = was_running;
+}
+
+#endif
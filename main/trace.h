@@ -0,0 +1,33 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "sdkconfig.h"
+
+typedef void (*trace_write_t)( void *p_ctx, const char *p_text, size_t len );
+
+// Spans show up on the calling task's row.  The name is kept by pointer, use a string literal
+#if CONFIG_TRACE_RECORDER
+#define TRACE_BEGIN( name )     trace_begin( name )
+#define TRACE_END( name )       trace_end( name )
+#else
+#define TRACE_BEGIN( name )     do { } while ( 0 )
+#define TRACE_END( name )       do { } while ( 0 )
+#endif
+
+// Records from boot into a ring of the last CONFIG_TRACE_EVENTS task switches, blocking queue
+// and mutex operations, and spans.  Starting clears it, stopping freezes it for a look
+void trace_start( void );
+void trace_stop( void );
+bool trace_is_running( void );
+
+void trace_begin( const char *p_name );
+void trace_end( const char *p_name );
+
+// Chrome trace event JSON, for chrome://tracing or ui.perfetto.dev.  Pauses recording meanwhile
+void trace_write_json( trace_write_t write, void *p_ctx );
+
+#endif
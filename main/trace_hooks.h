@@ -0,0 +1,40 @@
+#ifndef _TRACE_HOOKS_H_
+#define _TRACE_HOOKS_H_
+
+// Force-included ahead of every file in the build by the top level CMakeLists.txt, so FreeRTOS
+// sees these before FreeRTOS.h defines its empty defaults.  Only the kernel expands them, they
+// can use tasks.c's and queue.c's internals.  Nothing in here may pull in other headers
+
+#ifndef __ASSEMBLER__
+
+#include "sdkconfig.h"
+
+#if CONFIG_TRACE_RECORDER
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void trace_task_switched_in( void *p_task );
+void trace_queue_wait( void *p_queue, unsigned queue_type );
+void trace_queue_done( void *p_queue, int timed_out );
+
+#ifdef __cplusplus
+}
+#endif
+
+#define traceTASK_SWITCHED_IN()                   trace_task_switched_in( pxCurrentTCB[xPortGetCoreID()] )
+
+// Mutex takes are receives.  Only operations that had to block end up in the trace
+#define traceBLOCKING_ON_QUEUE_RECEIVE( pxQueue ) trace_queue_wait( ( pxQueue ), ( pxQueue )->ucQueueType )
+#define traceBLOCKING_ON_QUEUE_SEND( pxQueue )    trace_queue_wait( ( pxQueue ), ( pxQueue )->ucQueueType )
+#define traceQUEUE_RECEIVE( pxQueue )             trace_queue_done( ( pxQueue ), 0 )
+#define traceQUEUE_RECEIVE_FAILED( pxQueue )      trace_queue_done( ( pxQueue ), 1 )
+#define traceQUEUE_SEND( pxQueue )                trace_queue_done( ( pxQueue ), 0 )
+#define traceQUEUE_SEND_FAILED( pxQueue )         trace_queue_done( ( pxQueue ), 1 )
+
+#endif
+
+#endif
+
+#endif
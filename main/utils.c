@@ -2,11 +2,28 @@
 #include <string.h>
 #include <time.h>
 
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <freertos/semphr.h>
 
 #include "utils.h"
 
+#define TICK_PERIOD_US          ( 1000000 / configTICK_RATE_HZ )
+#define DELAY_TIMER_CNT         ( 4 )       // Tasks that can be in a sub-tick sleep at once
+#define DELAY_WAKE_LATENCY_US   ( 30 )      // esp_timer task dispatch plus a context switch, roughly
+#define DELAY_SPIN_US           ( 50 )      // Below this it's cheaper to spin than to sleep
+
+typedef struct
+{
+  esp_timer_handle_t  timer;
+  SemaphoreHandle_t   done;
+  StaticSemaphore_t   done_buffer;
+  bool                in_use;
+} delay_timer_t;
+
+static delay_timer_t s_delay_timers[DELAY_TIMER_CNT];
+
 //-----------------------------------------------------------------------------
 void throttle_task( void )
 {
@@ -122,39 +139,114 @@ uint64_t system_uptime_usec( void )
 }
 
 //-----------------------------------------------------------------------------
-float system_uptime_s( void )
+uint64_t system_uptime_ms( void )
 {
-  // esp_timer_get_time returns time in uSec
-  return (float)(((double)system_uptime_usec()) / 1000000);
+  return system_uptime_usec() / 1000;
 }
 
 //-----------------------------------------------------------------------------
-static void _delay_us( uint32_t usec, bool blocking, bool tight_timing )
+uint32_t system_uptime_s( void )
 {
-  uint64_t now_time_usec = system_uptime_usec();
-  uint64_t stop_time_usec = now_time_usec + usec;
+  return system_uptime_usec() / 1000000;
+}
 
-  // 'do' loop ensures we have at least one taskYIELD for cases where usec = 0
-  while ( now_time_usec < stop_time_usec )
+//-----------------------------------------------------------------------------
+static void _delay_timer_cb( void *p_arg )
+{
+  delay_timer_t *p_delay_timer = (delay_timer_t *)p_arg;
+  xSemaphoreGive( p_delay_timer->done );
+}
+
+//-----------------------------------------------------------------------------
+static delay_timer_t * _claim_delay_timer( void )
+{
+  for ( uint8_t idx = 0; idx < DELAY_TIMER_CNT; idx++ )
   {
-    if ( !blocking )
+    delay_timer_t *p_delay_timer = &s_delay_timers[idx];
+    bool expected = false;
+    if ( !__atomic_compare_exchange_n( &p_delay_timer->in_use, &expected, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) )
+    {
+      continue;
+    }
+
+    // Created on first use by whoever claims the slot, so nobody else can be touching it
+    if ( !p_delay_timer->timer )
     {
-      // Use vTaskDelay for large delays so that the task doesn't hog the CPU (even if it's yielding)
-      uint64_t delay_tics = pdMS_TO_TICKS( ( stop_time_usec - now_time_usec ) / 1000 );
-      if ( !tight_timing )
+      p_delay_timer->done = xSemaphoreCreateBinaryStatic( &p_delay_timer->done_buffer );
+
+      const esp_timer_create_args_t timer_args =
       {
-        delay_tics = MAX( 1, delay_tics );
+        .callback        = _delay_timer_cb,
+        .arg             = p_delay_timer,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name            = "delay",
+      };
+      if ( esp_timer_create( &timer_args, &p_delay_timer->timer ) != ESP_OK )
+      {
+        p_delay_timer->timer = NULL;
+        __atomic_store_n( &p_delay_timer->in_use, false, __ATOMIC_RELEASE );
+        return NULL;
       }
+    }
+    return p_delay_timer;
+  }
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Sleeps for usec on a one-shot esp_timer.  Returns false if no timer was free, in which case
+// the caller has to find some other way to pass the time
+static bool _sleep_on_timer( uint32_t usec )
+{
+  delay_timer_t *p_delay_timer = _claim_delay_timer();
+  if ( !p_delay_timer )
+  {
+    return false;
+  }
+
+  esp_timer_start_once( p_delay_timer->timer, usec );
+
+  // The timeout is only a backstop, the timer always fires well within it
+  if ( xSemaphoreTake( p_delay_timer->done, pdMS_TO_TICKS( usec / 1000 ) + 2 ) != pdTRUE )
+  {
+    esp_timer_stop( p_delay_timer->timer );
+    xSemaphoreTake( p_delay_timer->done, 0 );
+  }
+
+  __atomic_store_n( &p_delay_timer->in_use, false, __ATOMIC_RELEASE );
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// Whole OS ticks are slept with vTaskDelay, the sub-tick remainder on a one-shot esp_timer, and
+// only the last few microseconds, less than it takes to get woken back up, are spun.  Blocking
+// delays spin the whole way, for callers that mustn't give up the CPU
+static void _delay_us( uint32_t usec, bool blocking )
+{
+  uint64_t now_time_usec = system_uptime_usec();
+  uint64_t stop_time_usec = now_time_usec + usec;
+  bool can_sleep = !blocking && ( xTaskGetSchedulerState() == taskSCHEDULER_RUNNING );
 
-      if ( delay_tics )
+  while ( now_time_usec < stop_time_usec )
+  {
+    uint32_t remaining_usec = stop_time_usec - now_time_usec;
+
+    if ( can_sleep )
+    {
+      // vTaskDelay( n ) returns anywhere in the nth tick, so only whole ticks beyond the current
+      // one can be slept safely.  The partial tick that's left goes to the timer
+      uint32_t delay_tics = remaining_usec / TICK_PERIOD_US;
+      if ( delay_tics > 1 )
       {
-        vTaskDelay( delay_tics );
+        vTaskDelay( delay_tics - 1 );
       }
-      else
+      else if ( remaining_usec > DELAY_SPIN_US )
       {
-        // FreeRTOS doesn't provide a way to delay the task more fine than 1 rtos tic
-        // Throttle the task's priority to give other tasks a chance at running at least once
-        throttle_task();
+        if ( !_sleep_on_timer( remaining_usec - DELAY_WAKE_LATENCY_US ) )
+        {
+          // Every timer is taken, fall back to giving other tasks a turn at our priority
+          throttle_task();
+        }
       }
     }
     now_time_usec = system_uptime_usec();
@@ -166,35 +258,132 @@ static void _delay_us( uint32_t usec, bool blocking, bool tight_timing )
 // the true delayed time might be significantly longer as a result of yielding to other pending tasks
 void delay_us( uint32_t usec )
 {
-  _delay_us( usec, false, true );
+  _delay_us( usec, false );
 }
 
 //-----------------------------------------------------------------------------
 void delay_ms( uint32_t msec )
 {
-  _delay_us( msec * 1000, false, false );
+  _delay_us( msec * 1000, false );
 }
 
 //-----------------------------------------------------------------------------
 void delay_s( uint32_t sec )
 {
-  _delay_us( sec * 1000 * 1000, false, false );
+  _delay_us( sec * 1000 * 1000, false );
 }
 
 //-----------------------------------------------------------------------------
 void delay_blocking_us( uint32_t usec )
 {
-  _delay_us( usec, true, true );
+  _delay_us( usec, true );
 }
 
 //-----------------------------------------------------------------------------
 void delay_blocking_ms( uint32_t msec )
 {
-  _delay_us( msec * 1000, true, false );
+  _delay_us( msec * 1000, true );
 }
 
 //-----------------------------------------------------------------------------
 void delay_blocking_s( uint32_t sec )
 {
-  _delay_us( sec * 100 * 100, true, false );
+  _delay_us( sec * 1000 * 1000, true );
+}
+
+#ifdef CONFIG_DELAY_BENCHMARK
+static volatile bool     s_benchmark_running;
+static volatile uint32_t s_benchmark_spins;
+
+//-----------------------------------------------------------------------------
+// Stands in for other work at the caller's priority.  Whatever it counts is CPU the delay gave up
+static void _benchmark_spinner_task( void *Param )
+{
+  while ( s_benchmark_running )
+  {
+    s_benchmark_spins++;
+    taskYIELD();
+  }
+
+  s_benchmark_running = true;   // Hand-shake back to delay_benchmark()
+  vTaskDelete( NULL );
+}
+
+//-----------------------------------------------------------------------------
+// What _delay_us() used to do for anything under a tick
+static void _legacy_delay_us( uint32_t usec )
+{
+  uint64_t stop_time_usec = system_uptime_usec() + usec;
+  while ( system_uptime_usec() < stop_time_usec )
+  {
+    throttle_task();
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void _benchmark_one( void (*delay_func)( uint32_t ), uint32_t requested_us, uint16_t iterations, float spins_per_us,
+                            uint32_t *p_avg_us, uint32_t *p_max_us, uint8_t *p_cpu_free_pct )
+{
+  uint64_t total_overshoot_us = 0;
+  uint64_t total_elapsed_us   = 0;
+  uint32_t max_overshoot_us   = 0;
+  uint32_t spins_before       = s_benchmark_spins;
+
+  for ( uint16_t idx = 0; idx < iterations; idx++ )
+  {
+    uint64_t start_us = system_uptime_usec();
+    delay_func( requested_us );
+    uint32_t elapsed_us = system_uptime_usec() - start_us;
+
+    uint32_t overshoot_us = ( elapsed_us > requested_us ) ? ( elapsed_us - requested_us ) : 0;
+    total_overshoot_us += overshoot_us;
+    total_elapsed_us   += elapsed_us;
+    max_overshoot_us    = MAX( max_overshoot_us, overshoot_us );
+  }
+
+  float spins_expected = spins_per_us * total_elapsed_us;
+  *p_avg_us       = total_overshoot_us / MAX( 1, iterations );
+  *p_max_us       = max_overshoot_us;
+  *p_cpu_free_pct = CLAMP( ( 100 * ( s_benchmark_spins - spins_before ) ) / MAX( 1, spins_expected ), 0, 100 );
+}
+
+//-----------------------------------------------------------------------------
+// Times each requested delay against the old spin, with a task at the caller's priority pinned to
+// the same core soaking up whatever CPU the delay leaves free
+void delay_benchmark( delay_benchmark_t *p_results, const uint32_t *p_requested_us, uint8_t result_cnt, uint16_t iterations )
+{
+  memset( p_results, 0, sizeof( *p_results ) * result_cnt );
+
+  s_benchmark_running = true;
+  s_benchmark_spins   = 0;
+  xTaskCreatePinnedToCore( _benchmark_spinner_task, "delay_bench", 2048, NULL, uxTaskPriorityGet( NULL ), NULL, xPortGetCoreID() );
+
+  // Calibrate against the spinner having the core to itself
+  uint32_t spins_before = s_benchmark_spins;
+  uint64_t start_us     = system_uptime_usec();
+  vTaskDelay( pdMS_TO_TICKS( 200 ) );
+  float spins_per_us = (float)( s_benchmark_spins - spins_before ) / ( system_uptime_usec() - start_us );
+
+  for ( uint8_t idx = 0; idx < result_cnt; idx++ )
+  {
+    delay_benchmark_t *p_result = &p_results[idx];
+    p_result->requested_us = p_requested_us[idx];
+
+    _benchmark_one( delay_us, p_result->requested_us, iterations, spins_per_us,
+      &p_result->overshoot_avg_us, &p_result->overshoot_max_us, &p_result->cpu_free_pct );
+    _benchmark_one( _legacy_delay_us, p_result->requested_us, iterations, spins_per_us,
+      &p_result->legacy_overshoot_avg_us, &p_result->legacy_overshoot_max_us, &p_result->legacy_cpu_free_pct );
+
+    print( "Delay benchmark %u us: overshoot avg %u max %u us, %u%% CPU free (was avg %u max %u us, %u%% free)\n",
+      p_result->requested_us, p_result->overshoot_avg_us, p_result->overshoot_max_us, p_result->cpu_free_pct,
+      p_result->legacy_overshoot_avg_us, p_result->legacy_overshoot_max_us, p_result->legacy_cpu_free_pct );
+  }
+
+  s_benchmark_running = false;
+  while ( !s_benchmark_running )
+  {
+    vTaskDelay( 10 / portTICK_RATE_MS );
+  }
+  s_benchmark_running = false;
 }
+#endif
@@ -35,8 +35,9 @@
 #endif
 
 
-uint64_t      system_uptime_usec( void );
-float         system_uptime_s( void );
+uint64_t      system_uptime_usec( void );         // Monotonic since boot, the reference for all deadlines
+uint64_t      system_uptime_ms( void );
+uint32_t      system_uptime_s( void );
 const char *  get_system_time_str();
 int           str_replace_inplace(char *str, const char* pattern, const char* replacement, size_t mlen);
 uint16_t      add_formatted_duration_str( char *p_buffer, uint32_t duration_s );
@@ -50,12 +51,28 @@ extern void print_no_ts(const char *p_msg, ...);                  // Implemented
 void print_buff( void *p_buffer, uint16_t buffer_size );
 void print_buff_custom_format( void *p_buffer, uint16_t buffer_size, uint8_t bytes_per_line, uint32_t base_header_line_cnt, uint32_t base_header_address_offset );
 
+// Sleep rather than spin, down to tens of microseconds.  Sub-tick remainders are timed by esp_timer
 void delay_us( uint32_t usec );        // Provides tight timing delays, attempts not to overshoot
-void delay_ms( uint32_t msec );        // Provides loose timing delays.  May overshoot by as much as 1 OS tic
+void delay_ms( uint32_t msec );
 void delay_s( uint32_t sec );
 
 void delay_blocking_us( uint32_t usec );
 void delay_blocking_ms( uint32_t msec );
 void delay_blocking_s( uint32_t sec );
 
+#ifdef CONFIG_DELAY_BENCHMARK
+typedef struct
+{
+  uint32_t requested_us;
+  uint32_t overshoot_avg_us;
+  uint32_t overshoot_max_us;
+  uint8_t  cpu_free_pct;          // How much of the delay another task at our priority got to use
+  uint32_t legacy_overshoot_avg_us;
+  uint32_t legacy_overshoot_max_us;
+  uint8_t  legacy_cpu_free_pct;   // Same, for the old throttle_task() spin
+} delay_benchmark_t;
+
+void delay_benchmark( delay_benchmark_t *p_results, const uint32_t *p_requested_us, uint8_t result_cnt, uint16_t iterations );
+#endif
+
 #endif /* SRC_UTILS_H_ */
@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <esp_partition.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "utils.h"
+#include "nvm.h"
+#include "wear.h"
+
+#define WEAR_RECORD_VERSION       ( 1 )
+
+// NVS writes whole 32 byte entries, and a 4 KB page holds 126 of them.  Pages are filled in
+// order and erased once garbage collected, so every 126 entries written costs one sector erase
+#define NVS_ENTRY_SIZE            ( 32 )
+#define NVS_PAGE_ENTRY_BYTES      ( 126 * NVS_ENTRY_SIZE )
+
+// Persisting the counters is an NVS write itself, only bother once this much has piled up
+#define PERSIST_THRESHOLD_BYTES   ( 4096 )
+
+#define SECONDS_PER_DAY           ( 24 * 60 * 60 )
+
+typedef struct
+{
+  const char              *p_name;
+  esp_partition_type_t    type;
+  esp_partition_subtype_t subtype;
+} wear_partition_info_t;
+
+static const wear_partition_info_t s_partition_info[WEAR_PARTITION_COUNT] =
+{
+  [WEAR_PARTITION_NVS]     = { .p_name = "nvs",     .type = ESP_PARTITION_TYPE_DATA, .subtype = ESP_PARTITION_SUBTYPE_DATA_NVS },
+  [WEAR_PARTITION_OTADATA] = { .p_name = "otadata", .type = ESP_PARTITION_TYPE_DATA, .subtype = ESP_PARTITION_SUBTYPE_DATA_OTA },
+  [WEAR_PARTITION_OTA_0]   = { .p_name = "ota_0",   .type = ESP_PARTITION_TYPE_APP,  .subtype = ESP_PARTITION_SUBTYPE_APP_OTA_0 },
+  [WEAR_PARTITION_OTA_1]   = { .p_name = "ota_1",   .type = ESP_PARTITION_TYPE_APP,  .subtype = ESP_PARTITION_SUBTYPE_APP_OTA_1 },
+};
+
+typedef struct
+{
+  portMUX_TYPE    lock;
+  bool            initialized;
+
+  wear_record_t   record;                 // Lifetime totals, including this boot
+  uint32_t        nvs_page_fill;          // Entry bytes written into the current NVS page
+  uint32_t        unpersisted_bytes;
+  uint64_t        last_uptime_usec;       // When record.uptime_s was last brought up to date
+
+  uint32_t        sector_cnt[WEAR_PARTITION_COUNT];
+} wear_ctx_t;
+
+static wear_ctx_t s_wear = { .lock = portMUX_INITIALIZER_UNLOCKED };
+
+static void _maybe_persist( void );
+static void _update_uptime( void );
+
+//-----------------------------------------------------------------------------
+wear_partition_t wear_partition_for( const esp_partition_t *p_partition )
+{
+  if ( p_partition )
+  {
+    for ( wear_partition_t idx = 0; idx < WEAR_PARTITION_COUNT; idx++ )
+    {
+      if ( ( p_partition->type    == s_partition_info[idx].type ) &&
+           ( p_partition->subtype == s_partition_info[idx].subtype ) )
+      {
+        return idx;
+      }
+    }
+  }
+
+  return WEAR_PARTITION_COUNT;
+}
+
+//-----------------------------------------------------------------------------
+void wear_record_write( wear_partition_t partition, uint32_t bytes )
+{
+  if ( partition >= WEAR_PARTITION_COUNT )
+  {
+    return;
+  }
+
+  portENTER_CRITICAL( &s_wear.lock );
+  s_wear.record.partitions[partition].bytes_written += bytes;
+  s_wear.unpersisted_bytes += bytes;
+  portEXIT_CRITICAL( &s_wear.lock );
+
+  _maybe_persist();
+}
+
+//-----------------------------------------------------------------------------
+void wear_record_erase( wear_partition_t partition, uint32_t sectors )
+{
+  if ( ( partition >= WEAR_PARTITION_COUNT ) || !sectors )
+  {
+    return;
+  }
+
+  portENTER_CRITICAL( &s_wear.lock );
+  s_wear.record.partitions[partition].sectors_erased += sectors;
+  s_wear.unpersisted_bytes += sectors * SPI_FLASH_SEC_SIZE;
+  portEXIT_CRITICAL( &s_wear.lock );
+
+  _maybe_persist();
+}
+
+//-----------------------------------------------------------------------------
+void wear_record_commit( wear_partition_t partition )
+{
+  if ( partition >= WEAR_PARTITION_COUNT )
+  {
+    return;
+  }
+
+  portENTER_CRITICAL( &s_wear.lock );
+  s_wear.record.partitions[partition].commits++;
+  portEXIT_CRITICAL( &s_wear.lock );
+}
+
+//-----------------------------------------------------------------------------
+// NVS doesn't report what it actually wrote, so estimate it from the value size: one header
+// entry, plus data entries for anything that doesn't fit in the header's 8 bytes
+void wear_record_nvs_write( size_t value_len )
+{
+  uint32_t entries = 1 + ( ( value_len > sizeof( uint64_t ) ) ? ( ( value_len + NVS_ENTRY_SIZE - 1 ) / NVS_ENTRY_SIZE ) : 0 );
+  uint32_t bytes   = entries * NVS_ENTRY_SIZE;
+  uint32_t sectors = 0;
+
+  portENTER_CRITICAL( &s_wear.lock );
+  s_wear.nvs_page_fill += bytes;
+  while ( s_wear.nvs_page_fill >= NVS_PAGE_ENTRY_BYTES )
+  {
+    s_wear.nvs_page_fill -= NVS_PAGE_ENTRY_BYTES;
+    sectors++;
+  }
+  portEXIT_CRITICAL( &s_wear.lock );
+
+  wear_record_write( WEAR_PARTITION_NVS, bytes );
+  wear_record_erase( WEAR_PARTITION_NVS, sectors );
+}
+
+//-----------------------------------------------------------------------------
+static void _update_uptime( void )
+{
+  uint64_t now_usec = system_uptime_usec();
+
+  portENTER_CRITICAL( &s_wear.lock );
+  uint32_t elapsed_s = ( now_usec - s_wear.last_uptime_usec ) / 1000000;
+  s_wear.record.uptime_s   += elapsed_s;
+  s_wear.last_uptime_usec  += (uint64_t)elapsed_s * 1000000;
+  portEXIT_CRITICAL( &s_wear.lock );
+}
+
+//-----------------------------------------------------------------------------
+void wear_persist( void )
+{
+  if ( !s_wear.initialized )
+  {
+    return;
+  }
+
+  _update_uptime();
+
+  wear_record_t record;
+  portENTER_CRITICAL( &s_wear.lock );
+  record = s_wear.record;
+  s_wear.unpersisted_bytes = 0;
+  portEXIT_CRITICAL( &s_wear.lock );
+
+  // Goes through the NVM writer's debounce, so this is cheap to call often
+  nvm_set_flash_wear( &record );
+}
+
+//-----------------------------------------------------------------------------
+static void _maybe_persist( void )
+{
+  if ( s_wear.initialized && ( s_wear.unpersisted_bytes >= PERSIST_THRESHOLD_BYTES ) )
+  {
+    wear_persist();
+  }
+}
+
+//-----------------------------------------------------------------------------
+// One partition at a time through a line buffer, so nothing is ever cut short
+void wear_write_json( wear_write_t write, void *p_ctx )
+{
+  _update_uptime();
+
+  wear_record_t record;
+  portENTER_CRITICAL( &s_wear.lock );
+  record = s_wear.record;
+  portEXIT_CRITICAL( &s_wear.lock );
+
+  char   line[256];
+  size_t len = snprintf( line, sizeof( line ), "{\"uptime_s\":%u,\"endurance_cycles\":%u,\"partitions\":[",
+    record.uptime_s, CONFIG_FLASH_WEAR_ENDURANCE_CYCLES );
+  write( p_ctx, line, len );
+
+  for ( wear_partition_t idx = 0; idx < WEAR_PARTITION_COUNT; idx++ )
+  {
+    const wear_counters_t *p_counters = &record.partitions[idx];
+
+    // Assumes erases are spread evenly over the partition.  True for NVS pages, and near enough
+    // for app slots since every update rewrites the image from the start
+    double capacity  = (double)s_wear.sector_cnt[idx] * CONFIG_FLASH_WEAR_ENDURANCE_CYCLES;
+    double wear_pct  = capacity ? ( 100.0 * p_counters->sectors_erased / capacity ) : 0;
+    double remaining = capacity - p_counters->sectors_erased;
+
+    len = snprintf( line, sizeof( line ),
+      "%s{\"name\":\"%s\",\"sectors\":%u,\"bytes_written\":%llu,\"sectors_erased\":%u,\"commits\":%u,\"wear_pct\":%.4f,\"days_remaining\":",
+      idx ? "," : "", s_partition_info[idx].p_name, s_wear.sector_cnt[idx],
+      p_counters->bytes_written, p_counters->sectors_erased, p_counters->commits, wear_pct );
+    write( p_ctx, line, len );
+
+    if ( p_counters->sectors_erased && record.uptime_s )
+    {
+      double erases_per_day = (double)p_counters->sectors_erased * SECONDS_PER_DAY / record.uptime_s;
+      len = snprintf( line, sizeof( line ), "%.0f}", MAX( 0, remaining ) / erases_per_day );
+    }
+    else
+    {
+      len = snprintf( line, sizeof( line ), "null}" );
+    }
+    write( p_ctx, line, len );
+  }
+
+  write( p_ctx, "]}", 2 );
+}
+
+//-----------------------------------------------------------------------------
+void wear_init( void )
+{
+  for ( wear_partition_t idx = 0; idx < WEAR_PARTITION_COUNT; idx++ )
+  {
+    const esp_partition_t *p_partition = esp_partition_find_first( s_partition_info[idx].type, s_partition_info[idx].subtype, NULL );
+    s_wear.sector_cnt[idx] = p_partition ? ( p_partition->size / SPI_FLASH_SEC_SIZE ) : 0;
+  }
+
+  wear_record_t stored;
+  nvm_get_flash_wear( &stored );
+
+  // Anything recorded so far this boot (e.g. the NVM load) stacks on top of the stored totals
+  portENTER_CRITICAL( &s_wear.lock );
+  if ( stored.version == WEAR_RECORD_VERSION )
+  {
+    s_wear.record.uptime_s += stored.uptime_s;
+    for ( wear_partition_t idx = 0; idx < WEAR_PARTITION_COUNT; idx++ )
+    {
+      s_wear.record.partitions[idx].bytes_written  += stored.partitions[idx].bytes_written;
+      s_wear.record.partitions[idx].sectors_erased += stored.partitions[idx].sectors_erased;
+      s_wear.record.partitions[idx].commits        += stored.partitions[idx].commits;
+    }
+  }
+  s_wear.record.version = WEAR_RECORD_VERSION;
+  s_wear.initialized    = true;
+  portEXIT_CRITICAL( &s_wear.lock );
+}
@@ -0,0 +1,48 @@
+#ifndef _WEAR_H_
+#define _WEAR_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <esp_partition.h>
+
+//-----------------------------------------------------------------------------
+typedef enum
+{
+  WEAR_PARTITION_NVS,
+  WEAR_PARTITION_OTADATA,
+  WEAR_PARTITION_OTA_0,
+  WEAR_PARTITION_OTA_1,
+  WEAR_PARTITION_COUNT,
+} wear_partition_t;
+
+typedef struct
+{
+  uint64_t bytes_written;
+  uint32_t sectors_erased;
+  uint32_t commits;           // nvs_commit calls for nvs, completed images for the app slots
+} wear_counters_t;
+
+typedef void (*wear_write_t)( void *p_ctx, const char *p_text, size_t len );
+
+// Persisted as an NVM parameter, see NVM_PARAM_LIST
+typedef struct wear_record_s
+{
+  uint32_t        version;
+  uint32_t        uptime_s;   // Accumulated across boots, used to project wear rates
+  wear_counters_t partitions[WEAR_PARTITION_COUNT];
+} wear_record_t;
+
+//-----------------------------------------------------------------------------
+void             wear_init( void );     // Call after nvm_init()
+void             wear_persist( void );  // Call before rebooting, then nvm_flush()
+
+wear_partition_t wear_partition_for( const esp_partition_t *p_partition );  // WEAR_PARTITION_COUNT if untracked
+
+void             wear_record_write( wear_partition_t partition, uint32_t bytes );
+void             wear_record_erase( wear_partition_t partition, uint32_t sectors );
+void             wear_record_commit( wear_partition_t partition );
+void             wear_record_nvs_write( size_t value_len );
+
+void             wear_write_json( wear_write_t write, void *p_ctx );
+
+#endif
@@ -25,15 +25,42 @@
 #include "wifi.h"
 #include "http.h"
 #include "mqtt.h"
+#include "event_bus.h"
+#include "startup.h"
+#include "timer_wheel.h"
+#include "nvm.h"
+#include "metrics.h"
+#include "task_monitor.h"
 
 #define INVALID_SOCKET (-1)
 
 #define TCP_SERVER_PORT            "23"
 #define DEBUG_MSG_QUEUE_DEPTH      10
+#define SOCKET_POLL_PERIOD_MS      100      // Accepting telnet clients is the only thing still polled
+
+#define RECONNECT_BACKOFF_MIN_MS   100      // First retry, quick enough to ride out an AP blip
+#define RECONNECT_BACKOFF_MAX_MS   ( 30 * 1000 )
+
+#define WIFI_TASK_EVENTS           ( EVENT_MASK( EVENT_PROVISIONED ) | EVENT_MASK( EVENT_GOT_IP ) | \
+                                     EVENT_MASK( EVENT_DISCONNECTED ) | EVENT_MASK( EVENT_TELNET_OUTPUT ) | \
+                                     EVENT_MASK( EVENT_LINK_GRACE_EXPIRED ) | EVENT_MASK( EVENT_ETH_GOT_IP ) | \
+                                     EVENT_MASK( EVENT_ETH_DISCONNECTED ) | EVENT_MASK( EVENT_RESET_PROVISIONING ) | \
+                                     EVENT_MASK( EVENT_WIFI_CONNECT ) )
+
+// The services here (webserver, telnet, mDNS) listen on every interface, so they don't care
+// which link a client comes in on.  Only the webserver's lifetime follows the links
+typedef enum
+{
+  LINK_WIFI,
+  LINK_ETHERNET,
+  LINK_CNT
+} link_t;
+
+static const char * const s_link_names[LINK_CNT] = { "Wi-Fi", "Ethernet" };
 
 typedef struct
 {
-  uint8_t msg[48];
+  uint8_t msg[128];
   uint8_t msg_len;
   int     socket_dest;
 } debug_msg_t;
@@ -50,29 +77,53 @@ typedef struct
   debug_msg_t         debug_msg_queue_buffer[ DEBUG_MSG_QUEUE_DEPTH ];
   QueueHandle_t       debug_msg_queue;
   
+  event_subscriber_t  events;
+
+  timer_handle_t      reconnect_timer;
+  uint8_t             reconnect_attempts;
+  bool                connecting;               // Between losing (or never having) a link and getting an address
+  bool                fast_connect_attempt;     // Current attempt is directed at the cached AP
+  bool                skip_cache;               // Cached AP didn't answer, scan until we're back up
+  uint64_t            connect_start_usec;
+  wifi_stats_t        stats;
+  bool                telnet_output_pending;    // Set from the debug task, one wakeup covers any amount of output
   char                ip_addr_str[16];
-  bool                provisioning_in_progress;
-  bool                handle_event_got_ip_address;
-  bool                handle_event_disconnected;
   
   int                 listen_socket;
   int                 sockets[MAX_OPEN_SOCKETS];
   int                 socket_flags;
   debug_handle_t      debug_handles[MAX_OPEN_SOCKETS];
   
+  uint32_t            link_ip_addr[LINK_CNT];   // 0 while that link is down
+
   httpd_handle_t      http_server;
+  link_t              http_server_link;         // Link and address the server is being kept up for
+  uint32_t            http_server_ip_addr;
+  timer_handle_t      link_grace_timer;
+  bool                link_grace_pending;       // Link is down but the server is being kept up
+  uint32_t            http_start_ms;            // Last measured cost of each half of a restart
+  uint32_t            http_stop_ms;
   
   bool                ntp_time_set;
-  
-  bool                provisioned;
 } stdio_task_context_t;
 
 static stdio_task_context_t s_task = { 0 };
+TASK_STATIC_STORAGE( s_wifi_task, CONFIG_TASK_STACK_WIFI );
 
-static void _prepare_provisioning();
+static bool _prepare_provisioning();
 static void _prepare_stdout_sockets();
 static void _handle_stdout_sockets();
-static void _handle_wifi_connection_changes();
+static void _handle_got_ip( uint32_t ip_addr );
+static void _handle_disconnected( void );
+static void _handle_link_up( link_t link, uint32_t ip_addr );
+static void _handle_link_down( link_t link );
+static void _handle_link_grace_expired( void );
+static void _start_webserver( link_t link, uint32_t ip_addr );
+static void _stop_webserver( void );
+static void _connect( void );
+static void _reset_provisioning( void );
+static uint32_t _reconnect_backoff_ms( void );
+static void _update_wifi_cache( uint32_t ip_addr );
 //static void _write_stdout_msg_to_sockets( const char * p_msg );
 static int _write_to_socket(const int socket, const uint8_t * data, const size_t len);
 
@@ -130,8 +181,7 @@ static void _provisioning_event_handler(void* arg, esp_event_base_t event_base,
     case WIFI_PROV_END:
       // De-initialize manager once provisioning is finished
       wifi_prov_mgr_deinit();
-      s_task.provisioning_in_progress = false;
-      s_task.provisioned = true;
+      event_bus_publish( EVENT_PROVISIONED, NULL );
       break;
         
     default:
@@ -142,24 +192,110 @@ static void _provisioning_event_handler(void* arg, esp_event_base_t event_base,
   fflush(stdout);
 }
 
+//-----------------------------------------------------------------------------
+// Aims straight at the AP we last had a lease from, skipping the scan, unless that's already
+// failed.  Wi-Fi task only, it's asked for through EVENT_WIFI_CONNECT
+static void _connect( void )
+{
+  if ( !s_task.connecting )
+  {
+    s_task.connecting         = true;
+    s_task.connect_start_usec = system_uptime_usec();
+  }
+
+  wifi_cache_t cache;
+  nvm_get_wifi_cache( &cache );
+  s_task.fast_connect_attempt = ( cache.channel != 0 ) && !s_task.skip_cache;
+
+  wifi_config_t config;
+  esp_wifi_get_config( WIFI_IF_STA, &config );
+
+  uint8_t channel   = s_task.fast_connect_attempt ? cache.channel : 0;
+  bool    bssid_set = s_task.fast_connect_attempt;
+  if ( ( config.sta.channel != channel ) || ( config.sta.bssid_set != bssid_set ) ||
+       ( bssid_set && memcmp( config.sta.bssid, cache.bssid, sizeof( cache.bssid ) ) ) )
+  {
+    // Storage is RAM once provisioned, so this is cheap, but the driver still redoes its setup
+    config.sta.channel   = channel;
+    config.sta.bssid_set = bssid_set;
+    memcpy( config.sta.bssid, cache.bssid, sizeof( cache.bssid ) );
+    esp_wifi_set_config( WIFI_IF_STA, &config );
+  }
+
+  esp_wifi_connect();
+}
+
+//-----------------------------------------------------------------------------
+// Runs on the esp_timer task with every other timer, the connect itself is left to the Wi-Fi task
+static void _reconnect_timer_cb( void *p_arg )
+{
+  s_task.stats.retries++;
+  metrics_add( METRIC_WIFI_RECONNECTS, 1 );
+  event_bus_publish( EVENT_WIFI_CONNECT, NULL );
+}
+
+//-----------------------------------------------------------------------------
+static void _reset_provisioning( void )
+{
+  // The reset clears the credentials from flash, which RAM storage would leave alone
+  esp_wifi_set_storage( WIFI_STORAGE_FLASH );
+  wifi_prov_mgr_reset_provisioning();
+}
+
+//-----------------------------------------------------------------------------
+// Exponential from RECONNECT_BACKOFF_MIN_MS, with full jitter so a room full of devices losing the
+// same AP don't all come back at the same moment
+static uint32_t _reconnect_backoff_ms( void )
+{
+  uint32_t ceiling_ms = RECONNECT_BACKOFF_MIN_MS << MIN( s_task.reconnect_attempts, 16 );
+  ceiling_ms = MIN( ceiling_ms, RECONNECT_BACKOFF_MAX_MS );
+  s_task.reconnect_attempts++;
+
+  return ( ceiling_ms / 2 ) + ( esp_random() % ( ceiling_ms / 2 + 1 ) );
+}
+
+//-----------------------------------------------------------------------------
+static void _link_grace_timer_cb( void *p_arg )
+{
+  event_bus_publish( EVENT_LINK_GRACE_EXPIRED, NULL );
+}
+
 //-----------------------------------------------------------------------------
 static void _wifi_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
   switch ( event_id )
   {
     case WIFI_EVENT_STA_START:
-      esp_wifi_connect();
+      event_bus_publish( EVENT_WIFI_CONNECT, NULL );
       break;
 
     case WIFI_EVENT_STA_CONNECTED:
-      print( "Connected to the AP\n");
+      s_task.stats.last_assoc_ms = ( system_uptime_usec() - s_task.connect_start_usec ) / 1000;
+      print( "Connected to the AP in %u ms%s\n", s_task.stats.last_assoc_ms, s_task.fast_connect_attempt ? " (cached)" : "" );
       break;
 
     case WIFI_EVENT_STA_DISCONNECTED:
-      print( "Disconnected. Connecting to the AP again...\n");
-      esp_wifi_connect();
-      s_task.handle_event_disconnected = true;
+    {
+      wifi_event_sta_disconnected_t *p_disconnected = (wifi_event_sta_disconnected_t *)event_data;
+      if ( !s_task.connecting )
+      {
+        // Downtime counts from losing the link, not from the first retry
+        s_task.connecting         = true;
+        s_task.connect_start_usec = system_uptime_usec();
+      }
+      else if ( s_task.fast_connect_attempt )
+      {
+        // Whatever went wrong, the cached AP isn't a safe bet any more
+        s_task.skip_cache = true;
+        s_task.stats.fast_connect_misses++;
+      }
+
+      uint32_t backoff_ms = _reconnect_backoff_ms();
+      print( "Disconnected (reason %u), reconnecting in %u ms\n", p_disconnected->reason, backoff_ms );
+      timer_wheel_start( s_task.reconnect_timer, backoff_ms );
+      event_bus_publish( EVENT_DISCONNECTED, NULL );
       break;
+    }
 
     default:
         print("Unhandled WIFI_EVENT event: %i\n", event_id );
@@ -175,11 +311,15 @@ static void _ip_event_handler( void *arg, esp_event_base_t event_base, int32_t e
   switch ( event_id )
   {
     case IP_EVENT_STA_GOT_IP:
+    {
       // Note, I had to disable an ARP check on LWIP:
       // menuconfig -> Component config -> LWIP -> DISABLE 'DHCP: Perform ARP check on any offered address'
       // https://www.esp32.com/viewtopic.php?t=12859
-      s_task.handle_event_got_ip_address = true;
+      ip_event_got_ip_t *p_got_ip = (ip_event_got_ip_t *)event_data;
+      event_t event = { .data.ip_addr = p_got_ip->ip_info.ip.addr };
+      event_bus_publish( EVENT_GOT_IP, &event );
       break;
+    }
 
     default:
         print("Unhandled IP_EVENT event: %i\n", event_id );
@@ -197,82 +337,289 @@ static void _wifi_task( void *Param )
                                               (uint8_t*)s_task.debug_msg_queue_buffer,
                                               &s_task.debug_msg_queue_ctx );
   
+  s_task.events = event_bus_subscribe( WIFI_TASK_EVENTS );
+  s_task.reconnect_timer = timer_wheel_add_oneshot( 0, _reconnect_timer_cb, NULL );
+  s_task.link_grace_timer = timer_wheel_add_oneshot( 0, _link_grace_timer_cb, NULL );
   s_task.initialized = true;
 
-  esp_netif_init();
-  
-  // Register our event handler for Wi-Fi, IP and Provisioning related events
+  // Register our event handler for Wi-Fi, IP and Provisioning related events.  Ethernet's IP
+  // events are handled in ethernet.c
   esp_event_handler_register(WIFI_PROV_EVENT, ESP_EVENT_ANY_ID, &_provisioning_event_handler, NULL);
   esp_event_handler_register(WIFI_EVENT,      ESP_EVENT_ANY_ID, &_wifi_event_handler, NULL );
-  esp_event_handler_register(IP_EVENT,        ESP_EVENT_ANY_ID, &_ip_event_handler, NULL );
-
-  const uint32_t task_delay_ms = 10;
- 
-  _prepare_provisioning();  
-  while ( !s_task.provisioned )
+  esp_event_handler_register(IP_EVENT,        IP_EVENT_STA_GOT_IP, &_ip_event_handler, NULL );
+
+  // Events published while we're still provisioning queue up and get handled once we're done
+  bool provisioned = _prepare_provisioning();
+  startup_ready( STARTUP_WIFI );
+  bool got_ip = false;
+  uint32_t ip_addr = 0;
+  uint32_t eth_ip_addr = 0;
+  while ( !provisioned )
   {
-    delay_ms( task_delay_ms );
+    event_t event;
+    if ( event_bus_receive( s_task.events, &event, portMAX_DELAY ) )
+    {
+      provisioned |= ( event.id == EVENT_PROVISIONED );
+      if ( event.id == EVENT_PROVISIONED )
+      {
+        // The credentials are in flash by now, anything _connect() changes from here on needn't be
+        esp_wifi_set_storage( WIFI_STORAGE_RAM );
+      }
+      else if ( event.id == EVENT_WIFI_CONNECT )
+      {
+        _connect();
+      }
+      else if ( event.id == EVENT_GOT_IP )
+      {
+        got_ip  = true;
+        ip_addr = event.data.ip_addr;
+      }
+      else if ( event.id == EVENT_DISCONNECTED )
+      {
+        got_ip = false;
+      }
+      else if ( event.id == EVENT_ETH_GOT_IP )
+      {
+        eth_ip_addr = event.data.ip_addr;
+      }
+      else if ( event.id == EVENT_ETH_DISCONNECTED )
+      {
+        eth_ip_addr = 0;
+      }
+      else if ( event.id == EVENT_RESET_PROVISIONING )
+      {
+        _reset_provisioning();
+      }
+    }
+
+#if CONFIG_ETHERNET_ROLE_PRIMARY
+    if ( !provisioned && eth_ip_addr )
+    {
+      // Wired and Wi-Fi was never set up, so don't wait for it.  The provisioning softAP's
+      // server sits on port 80 too, it has to go before ours can start
+      print( "On Ethernet, stopping Wi-Fi provisioning\n" );
+      wifi_prov_mgr_stop_provisioning();
+      break;
+    }
+#endif
   }
   _prepare_stdout_sockets(); 
   _ntp_init();
+  startup_wait( STARTUP_BIT( STARTUP_WEAR ) );    // http_init() may record an otadata write
   http_init();
   //mqtt_init();
   
   mdns_init();
   mdns_hostname_set(s_mdns_host_name);
+
+  if ( eth_ip_addr )
+  {
+    _handle_link_up( LINK_ETHERNET, eth_ip_addr );
+  }
+  if ( got_ip )
+  {
+    _handle_got_ip( ip_addr );
+  }
  
   while(1)
   {
-    _handle_stdout_sockets();    
-    _handle_wifi_connection_changes();
-    //mqtt_do_work();
-    
+    event_t event;
+    if ( event_bus_receive( s_task.events, &event, pdMS_TO_TICKS( SOCKET_POLL_PERIOD_MS ) ) )
+    {
+      switch ( event.id )
+      {
+        case EVENT_GOT_IP:              _handle_got_ip( event.data.ip_addr ); break;
+        case EVENT_DISCONNECTED:        _handle_disconnected();               break;
+        case EVENT_LINK_GRACE_EXPIRED:  _handle_link_grace_expired();         break;
+        case EVENT_ETH_GOT_IP:          _handle_link_up( LINK_ETHERNET, event.data.ip_addr ); break;
+        case EVENT_ETH_DISCONNECTED:    _handle_link_down( LINK_ETHERNET );   break;
+        case EVENT_RESET_PROVISIONING:  _reset_provisioning();                break;
+        case EVENT_WIFI_CONNECT:        _connect();                           break;
+        default:                                                              break;
+      }
+    }
+
+    // EVENT_TELNET_OUTPUT only needs to get us here.  Clear pending first so output queued while
+    // we're draining raises a fresh event
+    __atomic_store_n( &s_task.telnet_output_pending, false, __ATOMIC_RELEASE );
     debug_msg_t debug_msg;
     while ( xQueueReceive( s_task.debug_msg_queue, &debug_msg, 0 ) == pdTRUE )
     {
       _write_to_socket( debug_msg.socket_dest, debug_msg.msg, debug_msg.msg_len );
     }
-  
-    delay_ms( task_delay_ms );
+
+    _handle_stdout_sockets();
   }
 }
 
 //-----------------------------------------------------------------------------
-static void _handle_wifi_connection_changes( void )
+static void _handle_got_ip( uint32_t ip_addr )
+{
+  sprintf( s_task.ip_addr_str, "%i.%i.%i.%i", 
+    ( ip_addr >>  0 ) & 0xFF, ( ip_addr >>  8 ) & 0xFF,
+    ( ip_addr >> 16 ) & 0xFF, ( ip_addr >> 24 ) & 0xFF );
+
+  uint32_t connect_ms = ( system_uptime_usec() - s_task.connect_start_usec ) / 1000;
+  s_task.connecting         = false;
+  s_task.skip_cache         = false;
+  s_task.reconnect_attempts = 0;
+  s_task.stats.connects++;
+  metrics_add( METRIC_WIFI_CONNECTS, 1 );
+  s_task.stats.fast_connects  += s_task.fast_connect_attempt ? 1 : 0;
+  s_task.stats.last_connect_ms = connect_ms;
+  s_task.stats.best_connect_ms = ( s_task.stats.connects == 1 ) ? connect_ms : MIN( s_task.stats.best_connect_ms, connect_ms );
+
+  print("Got IP Address - %s, %u ms after starting to connect\n", s_task.ip_addr_str, connect_ms );
+  _update_wifi_cache( ip_addr );
+  _handle_link_up( LINK_WIFI, ip_addr );
+}
+
+//-----------------------------------------------------------------------------
+static void _handle_link_up( link_t link, uint32_t ip_addr )
 {
-  if ( !s_task.provisioning_in_progress && s_task.handle_event_got_ip_address )
+  s_task.link_ip_addr[link] = ip_addr;
+  startup_ready( STARTUP_NETWORK );
+
+  if ( s_task.http_server == NULL )
   {
-    s_task.handle_event_got_ip_address = false;
-    tcpip_adapter_ip_info_t ipInfo; 
-    tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_STA, &ipInfo);
-    
-    sprintf( s_task.ip_addr_str, "%i.%i.%i.%i", 
-      ( ipInfo.ip.addr >>  0 ) & 0xFF, ( ipInfo.ip.addr >>  8 ) & 0xFF,
-      ( ipInfo.ip.addr >> 16 ) & 0xFF, ( ipInfo.ip.addr >> 24 ) & 0xFF );
+    _start_webserver( link, ip_addr );
+    return;
+  }
 
-    print("Got IP Address - %s\n", s_task.ip_addr_str );
-    if ( s_task.http_server == NULL )
+  if ( link != s_task.http_server_link )
+  {
+    if ( s_task.link_grace_pending )
     {
-      print( "Starting webserver\n" );
-      http_start_webserver( &s_task.http_server );
+      // The server's own link is still down, but this one can carry it
+      timer_wheel_stop( s_task.link_grace_timer );
+      s_task.link_grace_pending    = false;
+      s_task.http_server_link      = link;
+      s_task.http_server_ip_addr   = ip_addr;
+      s_task.stats.http_restarts_avoided++;
+      s_task.stats.http_time_saved_ms += s_task.stats.http_restart_ms;
+      print( "%s is up, kept the webserver\n", s_link_names[link] );
     }
+    return;
   }
-  
-  if ( s_task.handle_event_disconnected )
+
+  if ( s_task.link_grace_pending )
   {
-    s_task.handle_event_disconnected = false;
+    timer_wheel_stop( s_task.link_grace_timer );
+    s_task.link_grace_pending = false;
 
-    if ( s_task.http_server )
+    if ( ip_addr == s_task.http_server_ip_addr )
     {
-      print( "Stopping webserver\n" );
-      http_stop_webserver( &s_task.http_server );
-      s_task.http_server = NULL;
+      // Same address, so every socket the server has open is still good.  Any upload that was in
+      // flight just sees TCP retransmits and carries on
+      s_task.stats.http_restarts_avoided++;
+      s_task.stats.http_time_saved_ms += s_task.stats.http_restart_ms;
+      print( "%s back on the same address, kept the webserver\n", s_link_names[link] );
+      return;
     }
   }
+
+  if ( ip_addr != s_task.http_server_ip_addr )
+  {
+    // The listener is on INADDR_ANY and would carry on, but every connection it accepted is
+    // tied to the old address and can never make progress again.  A restart drops them now
+    // instead of leaving them to hold the server's few sockets until they time out
+    _stop_webserver();
+    s_task.stats.http_restarts++;
+    _start_webserver( link, ip_addr );
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void _start_webserver( link_t link, uint32_t ip_addr )
+{
+  print( "Starting webserver on %s\n", s_link_names[link] );
+  uint64_t start_usec = system_uptime_usec();
+  http_start_webserver( &s_task.http_server );
+  s_task.http_start_ms       = ( system_uptime_usec() - start_usec ) / 1000;
+  s_task.http_server_link    = link;
+  s_task.http_server_ip_addr = ip_addr;
+  s_task.stats.http_restart_ms = s_task.http_stop_ms + s_task.http_start_ms;
 }
 
 //-----------------------------------------------------------------------------
-static void _prepare_provisioning( void )
+static void _stop_webserver( void )
+{
+  print( "Stopping webserver\n" );
+  uint64_t start_usec = system_uptime_usec();
+  http_stop_webserver( &s_task.http_server );
+  s_task.http_server = NULL;
+  s_task.http_stop_ms = ( system_uptime_usec() - start_usec ) / 1000;
+  s_task.stats.http_restart_ms = s_task.http_stop_ms + s_task.http_start_ms;
+}
+
+//-----------------------------------------------------------------------------
+static void _update_wifi_cache( uint32_t ip_addr )
+{
+  wifi_ap_record_t ap_info;
+  if ( esp_wifi_sta_get_ap_info( &ap_info ) != ESP_OK )
+  {
+    return;
+  }
+
+  wifi_cache_t cache;
+  nvm_get_wifi_cache( &cache );
+  s_task.stats.leases_reused += ( cache.ip_addr == ip_addr ) ? 1 : 0;
+
+  wifi_cache_t new_cache = { .channel = ap_info.primary, .ip_addr = ip_addr };
+  memcpy( new_cache.bssid, ap_info.bssid, sizeof( new_cache.bssid ) );
+
+  // NVM skips the write when nothing changed, which is the usual case
+  nvm_set_wifi_cache( &new_cache );
+}
+
+//-----------------------------------------------------------------------------
+static void _handle_disconnected( void )
+{
+  _handle_link_down( LINK_WIFI );
+}
+
+//-----------------------------------------------------------------------------
+// Keep the server up for a while, most drops are a roam or an AP hiccup and we'll be back on the
+// same address before anyone notices.  Retries publish a disconnect each, only the first counts
+static void _handle_link_down( link_t link )
+{
+  s_task.link_ip_addr[link] = 0;
+  if ( !s_task.http_server || ( link != s_task.http_server_link ) || s_task.link_grace_pending )
+  {
+    return;
+  }
+
+  for ( link_t other = 0; other < LINK_CNT; other++ )
+  {
+    if ( s_task.link_ip_addr[other] )
+    {
+      // Still reachable over the other link, hand the server over to it
+      s_task.http_server_link    = other;
+      s_task.http_server_ip_addr = s_task.link_ip_addr[other];
+      print( "%s down, webserver carries on over %s\n", s_link_names[link], s_link_names[other] );
+      return;
+    }
+  }
+
+  s_task.link_grace_pending = true;
+  timer_wheel_start( s_task.link_grace_timer, CONFIG_HTTP_LINK_DOWN_GRACE_MS );
+}
+
+//-----------------------------------------------------------------------------
+static void _handle_link_grace_expired( void )
+{
+  if ( s_task.link_grace_pending )
+  {
+    s_task.link_grace_pending = false;
+    print( "Link down for %u ms, giving up on the webserver\n", CONFIG_HTTP_LINK_DOWN_GRACE_MS );
+    _stop_webserver();
+    s_task.stats.http_restarts++;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Returns whether we were already provisioned, otherwise EVENT_PROVISIONED follows once we are
+static bool _prepare_provisioning( void )
 {
   // Initialize Wi-Fi including netif with default config
   esp_netif_create_default_wifi_sta();
@@ -290,13 +637,12 @@ static void _prepare_provisioning( void )
   // Initialize provisioning manager with the configuration parameters set above
   wifi_prov_mgr_init(config);
 
-  s_task.provisioned = false;
-  wifi_prov_mgr_is_provisioned(&s_task.provisioned);
+  bool provisioned = false;
+  wifi_prov_mgr_is_provisioned(&provisioned);
   
-  if ( !s_task.provisioned )
+  if ( !provisioned )
   {
     print( "Starting provisioning\n");
-    s_task.provisioning_in_progress = true;
 
     char    service_name[12];    // Wifi SSID when scheme is wifi_prov_scheme_softap   
     uint8_t eth_mac[6];
@@ -322,10 +668,16 @@ static void _prepare_provisioning( void )
     // We don't need the manager as device is already provisioned, so let's release it's resources
     wifi_prov_mgr_deinit();
 
+    // The credentials are already in flash.  Keeps the cached AP target _connect() sets, and
+    // changes on every fallback to a full scan, from being written there too
+    esp_wifi_set_storage( WIFI_STORAGE_RAM );
+
     // Start Wi-Fi station
     esp_wifi_set_mode(WIFI_MODE_STA);
     esp_wifi_start();
   }
+
+  return provisioned;
 }
 
 //-----------------------------------------------------------------------------
@@ -383,7 +735,7 @@ static void _prepare_stdout_sockets()
 }
 
 //-----------------------------------------------------------------------------
-static void _debug_drain( const char *p_msg, uint8_t bytecnt, uint8_t handle )
+static void _debug_drain( const char *p_msg, uint16_t bytecnt, uint8_t handle )
 {
   // TODO: Thread safety
   // Find the matching socket
@@ -400,9 +752,10 @@ static void _debug_drain( const char *p_msg, uint8_t bytecnt, uint8_t handle )
         memcpy( debug_msg.msg, p_msg, bytes_to_copy );
         debug_msg.msg_len = bytes_to_copy;
 
-        if ( s_task.initialized )
+        if ( s_task.initialized && ( xQueueSendToBack( s_task.debug_msg_queue, &debug_msg, 10 ) == pdTRUE ) &&
+             !__atomic_exchange_n( &s_task.telnet_output_pending, true, __ATOMIC_ACQ_REL ) )
         {
-          xQueueSendToBack( s_task.debug_msg_queue, &debug_msg, 10 );
+          event_bus_publish( EVENT_TELNET_OUTPUT, NULL );
         }
         
         p_msg   += bytes_to_copy;
@@ -517,13 +870,15 @@ void _ntp_time_sync_notification_cb(struct timeval *tv)
 //-----------------------------------------------------------------------------
 void wifi_task_init(void)
 {
-  xTaskCreate( _wifi_task,  "wifi_task", 4096, NULL, 0, NULL );
+  task_create( _wifi_task, "wifi_task", CONFIG_TASK_STACK_WIFI, 0, TASK_STATIC_BUFFERS( s_wifi_task ) );
 }
 
 //-----------------------------------------------------------------------------
+// Erasing the credentials is NVS work, so it's handed to the Wi-Fi task rather than done on
+// whatever task asked, often the timer wheel's
 void wifi_reset_provisioning(void)
 {
-  wifi_prov_mgr_reset_provisioning();
+  event_bus_publish( EVENT_RESET_PROVISIONING, NULL );
 }
 
 //-----------------------------------------------------------------------------
@@ -535,6 +890,19 @@ void wifi_reset_provisioning(void)
 //  }
 //}
 
+//-----------------------------------------------------------------------------
+void wifi_get_stats( wifi_stats_t *p_stats )
+{
+  *p_stats = s_task.stats;
+}
+
+//-----------------------------------------------------------------------------
+int8_t wifi_get_rssi( void )
+{
+  wifi_ap_record_t ap_info;
+  return ( esp_wifi_sta_get_ap_info( &ap_info ) == ESP_OK ) ? ap_info.rssi : 0;
+}
+
 //-----------------------------------------------------------------------------
 bool wifi_ntp_time_is_set()
 {
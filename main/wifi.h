@@ -1,10 +1,41 @@
 #ifndef _WIFI_H_
 #define _WIFI_H_
 
+#include <stdint.h>
+#include <stdbool.h>
+
+// Last AP we got an address from, kept in NVM so the next boot can skip the scan
+typedef struct wifi_cache_s
+{
+  uint8_t  bssid[6];
+  uint8_t  channel;       // 0 when nothing is cached
+  uint8_t  reserved;
+  uint32_t ip_addr;       // Last lease, network byte order
+} wifi_cache_t;
+
+typedef struct
+{
+  uint32_t connects;              // Times we got an IP address
+  uint32_t fast_connects;         // ... of which went straight to the cached AP
+  uint32_t fast_connect_misses;   // Cached AP wasn't there, fell back to a full scan
+  uint32_t leases_reused;         // DHCP handed back the cached address
+  uint32_t retries;
+  uint32_t last_assoc_ms;         // From starting to connect until associated
+  uint32_t last_connect_ms;       // From starting to connect until we had an address
+  uint32_t best_connect_ms;
+
+  uint32_t http_restarts;           // Webserver stopped and started again
+  uint32_t http_restarts_avoided;   // Link came back with the same address inside the grace period
+  uint32_t http_restart_ms;         // What the last stop plus start cost
+  uint32_t http_time_saved_ms;      // http_restart_ms for every restart avoided
+} wifi_stats_t;
+
 void wifi_task_init();
-void wifi_reset_provisioning(void);
+void wifi_reset_provisioning(void);    // Returns straight away, the Wi-Fi task does the reset
 bool wifi_ntp_time_is_set();
 const char *wifi_get_ip_addr_str();
 const char *wifi_get_mdns_name_str();
+void wifi_get_stats( wifi_stats_t *p_stats );
+int8_t wifi_get_rssi( void );       // Of the AP we're associated with, 0 when we aren't
 
 #endif
@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+"""Symbolizes the firmware's heap allocation trace (GET /alloctrace) into per call site tables.
+
+Needs CONFIG_ALLOC_TRACE.  To find what one OTA leaves behind:
+
+    curl -u "$ESP_HTTP_USER:$ESP_HTTP_PASSWORD" -X POST "http://192.168.1.50/alloctrace?action=start"
+    curl -u "$ESP_HTTP_USER:$ESP_HTTP_PASSWORD" -X POST "http://192.168.1.50/alloctrace?action=mark"
+    ... one POST /ota ...
+    curl -u "$ESP_HTTP_USER:$ESP_HTTP_PASSWORD" -X POST "http://192.168.1.50/alloctrace?action=mark"
+    alloc_report.py --host 192.168.1.50 build/template_project.elf
+
+Each site is the function that called the allocator and its caller, "inner <- outer".
+The ELF must be the one the device is running.
+"""
+
+import argparse
+import sys
+import urllib.request
+
+from profile_fold import symbolize
+
+DEPTH = 2
+
+
+def read_report(text):
+    header = {}
+    sites, recent, leaks = [], [], []
+    for line in text.splitlines():
+        fields = line.split()
+        if not fields:
+            continue
+        if fields[0] == "#":
+            if len(fields) == 3 and fields[2].isdigit():
+                header[fields[1]] = int(fields[2])
+        elif fields[0] == "site":
+            pcs = tuple(int(pc, 16) for pc in fields[1:1 + DEPTH])
+            sites.append((pcs, [int(v) for v in fields[1 + DEPTH:]]))
+        elif fields[0] == "recent":
+            time_ms, op, ptr, size = int(fields[1]), fields[2], fields[3], int(fields[4])
+            recent.append((time_ms, op, ptr, size, tuple(int(pc, 16) for pc in fields[5:5 + DEPTH])))
+        elif fields[0] == "leak":
+            pcs = tuple(int(pc, 16) for pc in fields[1:1 + DEPTH])
+            leaks.append((pcs, int(fields[1 + DEPTH]), int(fields[2 + DEPTH])))
+    return header, sites, recent, leaks
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("elf")
+    parser.add_argument("file", nargs="?", help="saved GET /alloctrace output, otherwise --host")
+    parser.add_argument("--host")
+    parser.add_argument("--http-port", type=int, default=80)
+    parser.add_argument("--addr2line", default="xtensa-esp32-elf-addr2line")
+    parser.add_argument("--sort", choices=("live", "peak", "total", "count"), default="live")
+    args = parser.parse_args()
+
+    if args.file:
+        with open(args.file) as f:
+            text = f.read()
+    elif args.host:
+        with urllib.request.urlopen("http://%s:%u/alloctrace" % (args.host, args.http_port), timeout=30) as resp:
+            text = resp.read().decode()
+    else:
+        parser.error("give a file or --host")
+
+    header, sites, recent, leaks = read_report(text)
+    pcs = {pc for site, _ in sites for pc in site} | {pc for *_, site in recent for pc in site} | \
+          {pc for site, _, _ in leaks for pc in site}
+    names = symbolize(args.addr2line, args.elf, sorted(pcs - {0}))
+
+    def site_name(site):
+        return " <- ".join(names.get(pc, "0x%08x" % pc) for pc in site if pc) or "?"
+
+    print("%u bytes live in %u allocations, peak %u, %u not tracked"
+          % (header.get("live_bytes", 0), header.get("live_cnt", 0), header.get("peak_bytes", 0),
+             header.get("untracked", 0)))
+    if not header.get("running"):
+        print("(stopped)")
+
+    column = {"live": 0, "peak": 2, "total": 3, "count": 4}[args.sort]
+    print("\n%10s %8s %10s %12s %8s  site" % ("live", "blocks", "peak", "total", "count"))
+    for site, (live, live_cnt, peak, total, count) in sorted(sites, key=lambda s: -s[1][column]):
+        print("%10u %8u %10u %12u %8u  %s" % (live, live_cnt, peak, total, count, site_name(site)))
+
+    if header.get("mark", 0) >= 2:
+        print("\nStill live from between marks %u and %u:" % (header["mark"] - 1, header["mark"]))
+        for site, size, count in sorted(leaks, key=lambda l: -l[1]):
+            print("%10u bytes in %4u  %s" % (size, count, site_name(site)))
+        if not leaks:
+            print("  nothing")
+
+    print("\nRecent:")
+    for time_ms, op, ptr, size, site in recent:
+        print("%10u ms %-5s %s %6u  %s" % (time_ms, op, ptr, size, site_name(site)))
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,213 @@
+#!/usr/bin/env python3
+"""Client for the firmware's built-in throughput self-test (POST /netperf).
+
+Starts a test over HTTP, runs the traffic, then prints the device's report next
+to what this end saw.  Direction is as seen from the device: rx is host -> device
+(the OTA direction), tx is device -> host.
+
+    netperf.py 192.168.1.50 --proto tcp --dir rx -t 10
+
+The device's Basic auth credentials come from --user/--password, or from
+ESP_HTTP_USER and ESP_HTTP_PASSWORD in the environment.
+
+Against QEMU with the OpenCores MAC (CONFIG_ETHERNET_MAC_OPENETH), forward the
+ports through user mode networking and point this at localhost:
+
+    qemu-system-xtensa ... -nic user,model=open_eth,hostfwd=tcp::8080-:80,\\
+        hostfwd=tcp::5001-:5001,hostfwd=udp::5001-:5001
+    netperf.py localhost --http-port 8080
+"""
+
+import argparse
+import base64
+import json
+import os
+import socket
+import struct
+import sys
+import time
+import urllib.error
+import urllib.request
+
+TCP_CHUNK = 2 * 1460
+UDP_PAYLOAD = 1472
+UDP_SEQ_FIN = 0xFFFFFFFF
+CONNECT_RETRY_S = 3.0
+
+
+def http(args, method, query=""):
+    url = "http://%s:%u/netperf%s" % (args.host, args.http_port, query)
+    req = urllib.request.Request(url, method=method, data=b"" if method == "POST" else None)
+    token = base64.b64encode(("%s:%s" % (args.user, args.password)).encode()).decode()
+    req.add_header("Authorization", "Basic " + token)
+    with urllib.request.urlopen(req, timeout=10) as resp:
+        return json.loads(resp.read())
+
+
+def tcp_connect(args):
+    deadline = time.monotonic() + CONNECT_RETRY_S
+    while True:
+        try:
+            return socket.create_connection((args.host, args.port), timeout=5)
+        except OSError:
+            # The device opens the port a moment after answering the POST
+            if time.monotonic() > deadline:
+                raise
+            time.sleep(0.1)
+
+
+def tcp_retransmits(sock):
+    # tcpi_total_retrans, Linux only
+    try:
+        info = sock.getsockopt(socket.IPPROTO_TCP, socket.TCP_INFO, 104)
+        return struct.unpack_from("I", info, 100)[0]
+    except (AttributeError, OSError, struct.error):
+        return None
+
+
+class Samples:
+    def __init__(self):
+        self.start = time.monotonic()
+        self.next = self.start + 1
+        self.bytes = 0
+        self.total = 0
+        self.kbps = []
+
+    def add(self, count):
+        now = time.monotonic()
+        while now >= self.next:
+            self.kbps.append(self.bytes * 8 // 1000)
+            self.bytes = 0
+            self.next += 1
+        self.bytes += count
+        self.total += count
+
+    def elapsed(self):
+        return time.monotonic() - self.start
+
+
+def run_tcp(args, report):
+    sock = tcp_connect(args)
+    samples = Samples()
+    if args.dir == "rx":
+        payload = bytes(TCP_CHUNK)
+        deadline = samples.start + args.duration
+        try:
+            while time.monotonic() < deadline:
+                samples.add(sock.send(payload))
+        except OSError:
+            pass    # Device closes its end once its duration is up
+        report["retransmits"] = tcp_retransmits(sock)
+    else:
+        sock.settimeout(args.duration + 5)
+        while True:
+            data = sock.recv(65536)
+            if not data:
+                break
+            samples.add(len(data))
+    report["elapsed_s"] = samples.elapsed()
+    sock.close()
+    return samples
+
+
+def run_udp(args, report):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    addr = (args.host, args.port)
+    time.sleep(0.2)     # Let the device bind before the first datagram
+    samples = Samples()
+    if args.dir == "rx":
+        interval = UDP_PAYLOAD * 8 / (args.bandwidth * 1e6)
+        deadline = time.monotonic() + args.duration
+        seq = 0
+        next_send = time.monotonic()
+        while time.monotonic() < deadline:
+            sock.sendto(struct.pack("!I", seq) + bytes(UDP_PAYLOAD - 4), addr)
+            samples.add(UDP_PAYLOAD)
+            seq += 1
+            next_send += interval
+            delay = next_send - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+        report["datagrams"] = seq
+    else:
+        received = lost = 0
+        sock.settimeout(0.5)
+        hello = struct.pack("!I", 0)
+        sock.sendto(hello, addr)
+        deadline = time.monotonic() + args.duration + 5
+        while time.monotonic() < deadline:
+            try:
+                data = sock.recv(65536)
+            except socket.timeout:
+                if not received:
+                    sock.sendto(hello, addr)
+                continue
+            seq = struct.unpack_from("!I", data)[0]
+            if seq == UDP_SEQ_FIN:
+                break
+            if not received:
+                samples = Samples()
+            lost += max(0, seq - (received + lost))
+            received += 1
+            samples.add(len(data))
+        report["datagrams"] = received
+        report["lost"] = lost
+    report["elapsed_s"] = samples.elapsed()
+    sock.close()
+    return samples
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("host")
+    parser.add_argument("--proto", choices=("tcp", "udp"), default="tcp")
+    parser.add_argument("--dir", choices=("rx", "tx"), default="rx", help="as seen from the device")
+    parser.add_argument("-t", "--duration", type=int, default=10, help="seconds, at most 60")
+    parser.add_argument("-b", "--bandwidth", type=float, default=10.0, help="UDP rx send rate, Mbit/s")
+    parser.add_argument("--port", type=int, default=5001, help="CONFIG_NETPERF_PORT")
+    parser.add_argument("--http-port", type=int, default=80)
+    parser.add_argument("--user", default=os.environ.get("ESP_HTTP_USER"), help="or ESP_HTTP_USER")
+    parser.add_argument("--password", default=os.environ.get("ESP_HTTP_PASSWORD"), help="or ESP_HTTP_PASSWORD")
+    args = parser.parse_args()
+    if args.user is None or args.password is None:
+        parser.error("give the device's credentials with --user/--password or ESP_HTTP_USER/ESP_HTTP_PASSWORD")
+
+    try:
+        started = http(args, "POST", "?proto=%s&dir=%s&duration=%u" % (args.proto, args.dir, args.duration))
+    except urllib.error.HTTPError as err:
+        sys.exit("Device refused the test: %s" % err)
+    args.duration = started["duration_s"]
+    args.port = started["port"]
+
+    host = {}
+    samples = run_tcp(args, host) if args.proto == "tcp" else run_udp(args, host)
+
+    device = started
+    deadline = time.monotonic() + 15
+    while device["state"] in ("waiting", "running") and time.monotonic() < deadline:
+        time.sleep(0.5)
+        device = http(args, "GET")
+
+    print("%s %s, %u s, lwIP window %u, send buffer %u" % (args.proto, args.dir, args.duration,
+                                                          device["tcp_wnd"], device["tcp_snd_buf"]))
+    if device["state"] != "done":
+        print("device: %s %s" % (device["state"], device["error"]))
+    else:
+        print("device: %u bytes in %u ms, %u kbit/s" % (device["bytes"], device["elapsed_ms"], device["kbps"]))
+        print("        per second: %s" % " ".join(str(kbps) for kbps in device["samples_kbps"]))
+    kbps = samples.total * 8 / 1000 / host["elapsed_s"] if host.get("elapsed_s") else 0
+    print("host:   %u bytes in %u ms, %u kbit/s" % (samples.total, host.get("elapsed_s", 0) * 1000, kbps))
+    print("        per second: %s" % " ".join(str(kbps) for kbps in samples.kbps))
+
+    if args.proto == "tcp":
+        retransmits = host.get("retransmits") if args.dir == "rx" else device["retransmits"]
+        print("retransmits: %s" % ("unknown" if retransmits in (None, -1) else retransmits))
+    elif args.dir == "rx":
+        sent = host["datagrams"]
+        print("datagrams: %u sent, %u received, %u lost" % (sent, device["datagrams"], sent - device["datagrams"]))
+    else:
+        print("datagrams: %u sent, %u received, %u lost" % (device["datagrams"], host["datagrams"], host["lost"]))
+
+
+if __name__ == "__main__":
+    main()
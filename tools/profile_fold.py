@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+"""Symbolizes the firmware's profiler samples (GET /profiler) into folded stacks.
+
+Each output line is "task;outermost;...;innermost count", the input flamegraph.pl and
+speedscope take.  Start and stop the profiler around whatever is of interest first:
+
+    curl -u "$ESP_HTTP_USER:$ESP_HTTP_PASSWORD" -X POST "http://192.168.1.50/profiler?action=start&hz=500"
+    ... run the OTA, log storm, etc ...
+    curl -u "$ESP_HTTP_USER:$ESP_HTTP_PASSWORD" -X POST "http://192.168.1.50/profiler?action=stop"
+    profile_fold.py --host 192.168.1.50 build/template_project.elf | flamegraph.pl > cpu.svg
+
+The ELF must be the one the device is running.  Backtraces are at most four frames deep,
+so stacks are cut off above that rather than all rooted at the task's entry point.
+"""
+
+import argparse
+import collections
+import subprocess
+import sys
+import urllib.request
+
+
+def read_samples(text):
+    header = {}
+    samples = []
+    for line in text.splitlines():
+        if line.startswith("#"):
+            fields = line[1:].split()
+            if len(fields) == 2 and fields[1].isdigit():
+                header[fields[0]] = int(fields[1])
+        elif line.strip():
+            fields = line.split()
+            samples.append((int(fields[0]), fields[1], [int(pc, 16) for pc in fields[2:]]))
+    return header, samples
+
+
+def symbolize(addr2line, elf, addresses):
+    # One batch, with -a so every answer is tagged with the address it's for
+    query = "\n".join("0x%08x" % a for a in addresses) + "\n"
+    out = subprocess.run([addr2line, "-a", "-f", "-C", "-e", elf], input=query,
+                         capture_output=True, text=True, check=True).stdout.splitlines()
+    names = {}
+    for i in range(0, len(out) - 2, 3):
+        address, function = int(out[i], 16), out[i + 1]
+        names[address] = function if function != "??" else "0x%08x" % address
+    return names
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("elf")
+    parser.add_argument("file", nargs="?", help="saved GET /profiler output, otherwise --host")
+    parser.add_argument("--host")
+    parser.add_argument("--http-port", type=int, default=80)
+    parser.add_argument("--addr2line", default="xtensa-esp32-elf-addr2line")
+    parser.add_argument("--per-core", action="store_true", help="root stacks at the core as well as the task")
+    parser.add_argument("--no-task", action="store_true", help="don't root stacks at the task")
+    args = parser.parse_args()
+
+    if args.file:
+        with open(args.file) as f:
+            text = f.read()
+    elif args.host:
+        with urllib.request.urlopen("http://%s:%u/profiler" % (args.host, args.http_port), timeout=30) as resp:
+            text = resp.read().decode()
+    else:
+        parser.error("give a file or --host")
+
+    header, samples = read_samples(text)
+    if header.get("dropped"):
+        print("%u samples didn't fit on the device, only the first %u are here"
+              % (header["dropped"], header.get("samples", len(samples))), file=sys.stderr)
+
+    names = symbolize(args.addr2line, args.elf, sorted({pc for _, _, pcs in samples for pc in pcs}))
+
+    stacks = collections.Counter()
+    for core, task, pcs in samples:
+        frames = [names.get(pc, "0x%08x" % pc) for pc in reversed(pcs)]
+        root = [] if args.no_task else [task]
+        if args.per_core:
+            root.insert(0, "core%u" % core)
+        stacks[";".join(root + frames)] += 1
+
+    for stack, count in sorted(stacks.items()):
+        print("%s %u" % (stack, count))
+
+
+if __name__ == "__main__":
+    sys.exit(main())
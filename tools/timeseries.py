@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+"""Decodes the firmware's binary time-series download (GET /timeseries?format=bin) to CSV.
+
+Reads a saved file, or fetches one straight from the device:
+
+    curl -o ts.bin "http://192.168.1.50/timeseries?tier=seconds&format=bin"
+    timeseries.py ts.bin > ts.csv
+    timeseries.py --host 192.168.1.50 --tier minutes
+
+Times are seconds of uptime, plus seconds before the download in the second column.
+The layout is described next to timeseries_file_hdr_t in main/timeseries.h.
+"""
+
+import argparse
+import struct
+import sys
+import urllib.request
+
+FILE_HDR = struct.Struct("<4sHBBI")
+BLOCK_HDR = struct.Struct("<IBB2x")
+CHANNELS = ("heap_free", "cpu_load", "rssi", "http_requests", "ota_bytes")
+
+
+def varints(data):
+    pos = 0
+    while pos < len(data):
+        zigzag = shift = 0
+        while True:
+            byte = data[pos]
+            pos += 1
+            zigzag |= (byte & 0x7F) << shift
+            shift += 7
+            if not byte & 0x80:
+                break
+        yield (zigzag >> 1) ^ -(zigzag & 1)
+
+
+def decode(data):
+    magic, interval_s, channel_cnt, _, uptime_s = FILE_HDR.unpack_from(data)
+    if magic != b"TSR1":
+        raise ValueError("not a time-series download")
+
+    samples = []
+    pos = FILE_HDR.size
+    while pos + BLOCK_HDR.size <= len(data):
+        start_s, length, sample_cnt = BLOCK_HDR.unpack_from(data, pos)
+        pos += BLOCK_HDR.size
+        deltas = varints(data[pos:pos + length])
+        pos += length
+
+        values = [0] * channel_cnt
+        for n in range(sample_cnt):
+            values = [v + next(deltas) for v in values]
+            samples.append((start_s + n * interval_s, values))
+
+    return uptime_s, channel_cnt, samples
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("file", nargs="?", help="saved download, otherwise --host")
+    parser.add_argument("--host")
+    parser.add_argument("--http-port", type=int, default=80)
+    parser.add_argument("--tier", choices=("seconds", "minutes"), default="seconds")
+    args = parser.parse_args()
+
+    if args.file:
+        with open(args.file, "rb") as f:
+            data = f.read()
+    elif args.host:
+        url = "http://%s:%u/timeseries?tier=%s&format=bin" % (args.host, args.http_port, args.tier)
+        with urllib.request.urlopen(url, timeout=10) as resp:
+            data = resp.read()
+    else:
+        parser.error("give a file or --host")
+
+    uptime_s, channel_cnt, samples = decode(data)
+    names = CHANNELS[:channel_cnt] + tuple("channel%u" % i for i in range(len(CHANNELS), channel_cnt))
+    print(",".join(("uptime_s", "age_s") + names))
+    for time_s, values in samples:
+        print(",".join(str(v) for v in [time_s, uptime_s - time_s] + values))
+
+
+if __name__ == "__main__":
+    sys.exit(main())